@@ -0,0 +1,2097 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* RUSAGE_THREAD */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "can.h"
+#include "capture.h"
+#include "config.h"
+#include "elmo.h"
+#include "emulator.h"
+#include "histogram.h"
+#include "monitor.h"
+#include "motion.h"
+#include "recorder.h"
+#include "realtime.h"
+#include "rtio.h"
+#include "runtime.h"
+#include "sdo.h"
+#include "spsc.h"
+#include "sync.h"
+#include "telemetry.h"
+#include "telemetrylog.h"
+#include "trajectory.h"
+#include "transport.h"
+
+/**
+ * Default CAN device interface name. A virtual CAN interface echoes the frames to the
+ * other sockets of the host, so no bus or drive is needed:
+ *   ip link add dev vcan0 type vcan && ip link set vcan0 up
+ */
+#define BENCH_INTERFACE "vcan0"
+
+/**
+ * Default number of frames per test.
+ */
+#define BENCH_FRAMES 100000
+
+/**
+ * Node ids of the sending and receiving TCans.
+ */
+#define BENCH_TX_ID 1
+#define BENCH_RX_ID 2
+
+/**
+ * Maximum number of client threads per bus in the multi-bus test.
+ */
+#define BENCH_MAX_CLIENTS 16
+
+/**
+ * Maximum number of nodes in the round-trip tests.
+ */
+#define BENCH_MAX_NODES 127
+
+/**
+ * Heartbeat timeout of the monitor test, in microseconds.
+ */
+#define BENCH_HEARTBEAT_TIMEOUT 20000
+
+/**
+ * Returns the monotonic time in seconds.
+ */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Fills the frames with PDO2 replies of the receiving node so that its filters let them
+ * through.
+ */
+static void fill(struct can_frame *frame, int count)
+{
+	unsigned char data[8] = { 0x50, 0x58, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* PX */
+	int i;
+
+	for (i = 0; i < count; i++) {
+		setDataInt(data, i);
+		createFrame(&frame[i], COBID_RPDO2(BENCH_RX_ID), 8, data);
+	}
+}
+
+static void report(const char *test, int frames, double seconds)
+{
+	printf("%-24s %10d frames %10.0f frames/s\n", test, frames, frames / seconds);
+}
+
+/**
+ * Transmit only: one write() per frame against one sendmmsg() per CAN_BATCH frames.
+ */
+static void bench_tx(TCan *tx, int frames)
+{
+	struct can_frame frame[CAN_BATCH];
+	double t;
+	int i;
+
+	fill(frame, CAN_BATCH);
+
+	t = now();
+	for (i = 0; i < frames; i++) {
+		sendFrame(tx, &frame[i % CAN_BATCH]);
+	}
+	report("tx write", frames, now() - t);
+
+	t = now();
+	for (i = 0; i < frames; i += CAN_BATCH) {
+		sendFrames(tx, frame, CAN_BATCH);
+	}
+	report("tx sendmmsg", i, now() - t);
+}
+
+/**
+ * Transmit and receive a burst of CAN_BATCH frames at a time: write() and read() per
+ * frame against one sendmmsg() and one recvmmsg() per burst.
+ */
+static void bench_rxtx(TCan *tx, TCan *rx, int frames)
+{
+	struct can_frame frame[CAN_BATCH];
+	struct can_frame in;
+	double t;
+	int i, j;
+
+	fill(frame, CAN_BATCH);
+
+	t = now();
+	for (i = 0; i < frames; i += CAN_BATCH) {
+		for (j = 0; j < CAN_BATCH; j++) {
+			sendFrame(tx, &frame[j]);
+		}
+		for (j = 0; j < CAN_BATCH; j++) {
+			if (read(rx->socket, &in, sizeof(in)) != sizeof(in)) {
+				perror("read");
+				return;
+			}
+		}
+	}
+	report("burst write/read", i, now() - t);
+
+	t = now();
+	for (i = 0; i < frames; i += CAN_BATCH) {
+		sendFrames(tx, frame, CAN_BATCH);
+		for (j = 0; j < CAN_BATCH; j++) {
+			if (receiveFrame(rx, &in) < 0) {
+				return;
+			}
+		}
+	}
+	report("burst sendmmsg/recvmmsg", i, now() - t);
+}
+
+/**
+ * Runs the SYNC producer for the given time and prints its jitter statistics.
+ */
+static void bench_sync(TCan *can, int frequency, int seconds, int priority, int cpu)
+{
+	TSync sync;
+
+	initSync(&sync, can, frequency);
+	sync.priority = priority;
+	sync.cpu = cpu;
+	if (runSync(&sync, (unsigned long)frequency * seconds) < 0) {
+		printf("SYNC producer failed\n");
+		return;
+	}
+	printSyncStats(&sync, stdout);
+}
+
+/**
+ * Starts emulated drives 1..nodes replying after latency microseconds on the interface,
+ * "loopback" for drives connected in-process by socketpairs, and opens a TCan on each
+ * (none if can is NULL). Returns the running emulator, NULL on errors.
+ */
+static TEmulator *startDrives(const char *iface, int nodes, TCan **can, long latency)
+{
+	TEmulator *emu;
+	int loopback = !strcmp(iface, "loopback");
+	int i, n;
+
+	if (!(emu = TEmulatorConstruct())) {
+		return NULL;
+	}
+	if (!loopback && emulatorOpen(emu, iface) < 0) {
+		TEmulatorDestruct(emu);
+		return NULL;
+	}
+	emulatorSetLatency(emu, latency, 0);
+
+	for (n = 0; n < nodes; n++) {
+		if (!can) {
+			if (emulatorAddDrive(emu, n + 1) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (!(can[n] = TCanConstruct(iface))) {
+			break;
+		}
+		if ((loopback ? emulatorConnect(emu, can[n], n + 1) :
+		     emulatorAddDrive(emu, n + 1) < 0 ? -1 : TCanOpen(can[n], n + 1)) < 0) {
+			TCanDestruct(can[n]);
+			break;
+		}
+	}
+
+	if (n < nodes || emulatorStart(emu) < 0) {
+		for (i = 0; can && i < n; i++) {
+			TCanClose(can[i]);
+			TCanDestruct(can[i]);
+		}
+		TEmulatorDestruct(emu);
+		return NULL;
+	}
+	return emu;
+}
+
+static void stopDrives(TEmulator *emu, int nodes, TCan **can)
+{
+	int i;
+
+	emulatorStop(emu);
+	for (i = 0; can && i < nodes; i++) {
+		TCanClose(can[i]);
+		TCanDestruct(can[i]);
+	}
+	TEmulatorDestruct(emu);
+}
+
+/**
+ * A client thread of the multi-bus test: sends PX to its node as fast as the replies come.
+ */
+typedef struct {
+	TCanRuntime *rt;
+	int bus;
+	int id;
+	double end;
+	unsigned long commands;
+	unsigned long failures;
+	pthread_t thread;
+} TClient;
+
+static void *client(void *arg)
+{
+	TClient *c = (TClient *)arg;
+	unsigned char data[8] = { 0x50, 0x58, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* PX */
+
+	while (now() < c->end) {
+		if (TCanRuntimeTransact(c->rt, c->bus, c->id, 4, data, NULL) < 0) {
+			c->failures++;
+		} else {
+			c->commands++;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Runs the clients of the given number of buses for the given time and returns the total
+ * number of commands per second.
+ */
+static double bench_buses(int buses, int nodes, double seconds)
+{
+	char iface[RUNTIME_MAX_BUSES][IFNAMSIZ];
+	TEmulator *emu[RUNTIME_MAX_BUSES];
+	TClient c[RUNTIME_MAX_BUSES][BENCH_MAX_CLIENTS];
+	TCanRuntime *rt = TCanRuntimeConstruct();
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long commands = 0, failures = 0;
+	double t;
+	int i, j;
+
+	for (i = 0; i < buses; i++) {
+		snprintf(iface[i], IFNAMSIZ, "vcan%d", i);
+		if (!(emu[i] = startDrives(iface[i], nodes, NULL, 0)) ||
+		    TCanRuntimeAddBus(rt, iface[i], i % cpus) != i) {
+			printf("Could not open %s\n", iface[i]);
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; j < nodes; j++) {
+			if (TCanRuntimeAddNode(rt, i, j + 1) < 0) {
+				printf("Could not open node %d on %s\n", j + 1, iface[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	t = now();
+	for (i = 0; i < buses; i++) {
+		for (j = 0; j < nodes; j++) {
+			memset(&c[i][j], 0, sizeof(c[i][j]));
+			c[i][j].rt = rt;
+			c[i][j].bus = i;
+			c[i][j].id = j + 1;
+			c[i][j].end = t + seconds;
+			pthread_create(&c[i][j].thread, NULL, client, &c[i][j]);
+		}
+	}
+
+	for (i = 0; i < buses; i++) {
+		for (j = 0; j < nodes; j++) {
+			pthread_join(c[i][j].thread, NULL);
+			commands += c[i][j].commands;
+			failures += c[i][j].failures;
+		}
+	}
+	t = now() - t;
+
+	TCanRuntimeClose(rt);
+	TCanRuntimeDestruct(rt);
+	for (i = 0; i < buses; i++) {
+		stopDrives(emu[i], 0, NULL);
+	}
+
+	printf("%d buses %3d nodes %10lu commands %8lu failures %10.0f commands/s\n",
+	       buses, buses * nodes, commands, failures, commands / t);
+	return commands / t;
+}
+
+/**
+ * State of one round-trip benchmark run.
+ */
+typedef struct {
+	THistogram latency;       /** latency of each command in microseconds */
+	unsigned long commands;   /** completed commands */
+	unsigned long errors;     /** failed commands */
+	int iteration;            /** number of the current pass over the nodes */
+} TRun;
+
+/**
+ * A round-trip benchmark: run() makes one pass over all the nodes.
+ */
+typedef struct {
+	const char *name;
+	int (*setup)(TCan **can, int nodes);
+	void (*run)(TCan **can, int nodes, TRun *run);
+	void (*teardown)(TCan **can, int nodes);
+} TRoundTrip;
+
+static TTelemetry telemetry[BENCH_MAX_NODES];
+
+static void record(TRun *run, int rval, long long start)
+{
+	if (rval < 0) {
+		run->errors++;
+		return;
+	}
+	histogramAdd(&run->latency, (long)((timeNow() - start) / 1000));
+	run->commands++;
+}
+
+static void rtt_position(TCan **can, int nodes, TRun *run)
+{
+	long long t;
+	int pos;
+	int i;
+
+	for (i = 0; i < nodes; i++) {
+		t = timeNow();
+		record(run, getPosition(can[i], &pos), t);
+	}
+}
+
+/*
+ * PX to all the nodes before waiting for any reply. The latency of a node is until its
+ * reply has been handed to the caller.
+ */
+static void rtt_position_async(TCan **can, int nodes, TRun *run)
+{
+	TElmoRequest req[BENCH_MAX_NODES];
+	int sent[BENCH_MAX_NODES];
+	int i;
+
+	for (i = 0; i < nodes; i++) {
+		sent[i] = getPositionAsync(can[i], &req[i]);
+	}
+	for (i = 0; i < nodes; i++) {
+		if (sent[i] < 0) {
+			run->errors++;
+			continue;
+		}
+		record(run, waitRequest(can[i], &req[i]), req[i].sent);
+	}
+}
+
+static void rtt_absolute(TCan **can, int nodes, TRun *run)
+{
+	long long t;
+	int i;
+
+	for (i = 0; i < nodes; i++) {
+		t = timeNow();
+		record(run, setAbsolutePosition(can[i], run->iteration), t);
+	}
+}
+
+/* The limits are cached, the cache is cleared so that every call goes to the drive. */
+static void rtt_limits(TCan **can, int nodes, TRun *run)
+{
+	long long t;
+	int i;
+
+	for (i = 0; i < nodes; i++) {
+		invalidateCache(can[i]);
+		t = timeNow();
+		record(run, setLimits(can[i], -320000, 320000, -320000, 320000), t);
+	}
+}
+
+static void rtt_mode(TCan **can, int nodes, TRun *run)
+{
+	long long t;
+	int i;
+
+	for (i = 0; i < nodes; i++) {
+		t = timeNow();
+		record(run, setUnitMode(can[i], run->iteration & 1 ? MODE_TORQUE : MODE_POS), t);
+	}
+}
+
+static int telemetry_setup(TCan **can, int nodes)
+{
+	int i;
+	for (i = 0; i < nodes; i++) {
+		if (configureTelemetry(can[i], 1, 0) < 0 ||
+		    subscribeTelemetry(can[i], &telemetry[i], NULL, NULL) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void telemetry_teardown(TCan **can, int nodes)
+{
+	int i;
+	for (i = 0; i < nodes; i++) {
+		unsubscribeTelemetry(can[i]);
+		disableTelemetry(can[i]);
+	}
+}
+
+/* One SYNC, then the sample of every node. The latency is from the SYNC to the sample. */
+static void rtt_telemetry(TCan **can, int nodes, TRun *run)
+{
+	TTelemetrySample sample;
+	struct can_frame frame;
+	unsigned char data[8] = { 0 };
+	long long t = timeNow();
+	int i;
+
+	createFrame(&frame, COBID_SYNC, 0, data);
+	if (sendFrame(can[0], &frame) < 0) {
+		run->errors += nodes;
+		return;
+	}
+
+	for (i = 0; i < nodes; i++) {
+		if (readTelemetry(can[i], &telemetry[i], &sample) < 0) {
+			run->errors++;
+			continue;
+		}
+		histogramAdd(&run->latency, (long)((sample.time - t) / 1000));
+		run->commands++;
+	}
+}
+
+static const TRoundTrip roundtrips[] = {
+	{ "getPosition", NULL, rtt_position, NULL },
+	{ "getPositionAsync", NULL, rtt_position_async, NULL },
+	{ "setAbsolutePosition", NULL, rtt_absolute, NULL },
+	{ "setLimits", NULL, rtt_limits, NULL },
+	{ "setUnitMode", NULL, rtt_mode, NULL },
+	{ "telemetry", telemetry_setup, rtt_telemetry, telemetry_teardown },
+};
+
+/**
+ * Runs one round-trip benchmark for the given time and prints the result as one JSON
+ * object per line.
+ */
+static void bench_roundtrip(const char *transport, const TRoundTrip *test, TCan **can,
+			    int nodes, double seconds)
+{
+	static TRun run;
+	double t, elapsed;
+
+	memset(&run, 0, sizeof(run));
+	if (test->setup && test->setup(can, nodes) < 0) {
+		printf("{\"transport\": \"%s\", \"test\": \"%s\", \"nodes\": %d, \"error\": \"setup\"}\n",
+		       transport, test->name, nodes);
+		return;
+	}
+
+	t = now();
+	do {
+		test->run(can, nodes, &run);
+		run.iteration++;
+	} while ((elapsed = now() - t) < seconds);
+
+	if (test->teardown) {
+		test->teardown(can, nodes);
+	}
+
+	printf("{\"transport\": \"%s\", \"test\": \"%s\", \"nodes\": %d, \"commands\": %lu, "
+	       "\"errors\": %lu, \"seconds\": %.3f, \"rate\": %.0f, \"p50_us\": %ld, "
+	       "\"p99_us\": %ld, \"p999_us\": %ld, \"max_us\": %ld}\n",
+	       transport, test->name, nodes, run.commands, run.errors, elapsed,
+	       run.commands / elapsed, histogramPercentile(&run.latency, 50),
+	       histogramPercentile(&run.latency, 99), histogramPercentile(&run.latency, 99.9),
+	       run.latency.max);
+	fflush(stdout);
+}
+
+static int test_io(const char *iface, int frames)
+{
+	TCan *tx, *rx;
+
+	tx = TCanConstruct(iface);
+	rx = TCanConstruct(iface);
+	if (!tx || !rx) {
+		printf("Could not construct can\n");
+		return EXIT_FAILURE;
+	}
+
+	if (TCanOpen(tx, BENCH_TX_ID) < 0) {
+		printf("CanOpen failed\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_tx(tx, frames);
+
+	if (TCanOpen(rx, BENCH_RX_ID) < 0) {
+		printf("CanOpen failed\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_rxtx(tx, rx, frames);
+
+	TCanClose(rx);
+	TCanClose(tx);
+	TCanDestruct(rx);
+	TCanDestruct(tx);
+	return EXIT_SUCCESS;
+}
+
+static int test_sync(const char *iface, int frequency, int seconds, int priority, int cpu)
+{
+	TCan *can = TCanConstruct(iface);
+
+	if (!can || TCanOpen(can, BENCH_TX_ID) < 0) {
+		printf("CanOpen failed\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_sync(can, frequency, seconds, priority, cpu);
+
+	TCanClose(can);
+	TCanDestruct(can);
+	return EXIT_SUCCESS;
+}
+
+static int test_rtt(const char *iface, int maxnodes, double seconds)
+{
+	TEmulator *emu;
+	TCan *can[BENCH_MAX_NODES];
+	int nodes;
+	unsigned int i;
+
+	if (maxnodes < 1 || maxnodes > BENCH_MAX_NODES) {
+		printf("1-%d nodes\n", BENCH_MAX_NODES);
+		return EXIT_FAILURE;
+	}
+
+	/* 1, 2, 4, ... nodes and finally maxnodes. */
+	for (nodes = 1; ; nodes *= 2) {
+		if (nodes > maxnodes) {
+			nodes = maxnodes;
+		}
+		if (!(emu = startDrives(iface, nodes, can, 0))) {
+			printf("Could not open %d nodes on %s\n", nodes, iface);
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < sizeof(roundtrips) / sizeof(roundtrips[0]); i++) {
+			bench_roundtrip(iface, &roundtrips[i], can, nodes, seconds);
+		}
+		stopDrives(emu, nodes, can);
+		if (nodes == maxnodes) {
+			break;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+static int test_buses(int buses, int nodes, int seconds)
+{
+	double base = 0, rate;
+	int i;
+
+	if (buses < 1 || buses > RUNTIME_MAX_BUSES || nodes < 1 || nodes > BENCH_MAX_CLIENTS) {
+		printf("1-%d buses and 1-%d nodes per bus\n", RUNTIME_MAX_BUSES, BENCH_MAX_CLIENTS);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; i <= buses; i++) {
+		rate = bench_buses(i, nodes, seconds);
+		if (i == 1) {
+			base = rate;
+		} else if (base > 0) {
+			printf("  scaling %.2fx of 1 bus\n", rate / base);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Starts the axes of a motion group with each trigger and prints the start skew measured
+ * by the group and the one seen by the emulated drives, in nanoseconds.
+ */
+static void bench_motion(const char *transport, TEmulator *emu, TCan **can, int axes, int starts)
+{
+	static TMotionGroup group;
+	static THistogram drive;
+	int target[MOTION_MAX_AXES];
+	long long first, last;
+	int trigger, n, i;
+
+	for (trigger = MOTION_SEQUENTIAL; trigger <= MOTION_GROUP; trigger++) {
+		initMotionGroup(&group, trigger, MOTION_BROADCAST);
+		histogramReset(&drive);
+		for (i = 0; i < axes; i++) {
+			addMotionAxis(&group, can[i]);
+		}
+
+		if (enableMotionGroup(&group, MODE_POS) < 0) {
+			printf("{\"transport\": \"%s\", \"test\": \"motion\", \"trigger\": %d, "
+			       "\"error\": \"enable\"}\n", transport, trigger);
+			continue;
+		}
+
+		for (n = 0; n < starts; n++) {
+			for (i = 0; i < axes; i++) {
+				target[i] = (n % 2) ? 0 : 1000 * (i + 1);
+			}
+			if (stageMotionGroup(&group, target) < 0 || startMotionGroup(&group) < 0) {
+				break;
+			}
+
+			first = last = emu->drive[can[0]->id]->started;
+			for (i = 1; i < axes; i++) {
+				if (emu->drive[can[i]->id]->started < first) {
+					first = emu->drive[can[i]->id]->started;
+				}
+				if (emu->drive[can[i]->id]->started > last) {
+					last = emu->drive[can[i]->id]->started;
+				}
+			}
+			histogramAdd(&drive, (long)(last - first));
+		}
+
+		printf("{\"transport\": \"%s\", \"test\": \"motion\", \"trigger\": %d, "
+		       "\"axes\": %d, \"starts\": %lu, \"unknown\": %lu, \"late\": %lu, "
+		       "\"frame_ns\": %ld, \"skew_p50_ns\": %ld, \"skew_max_ns\": %ld, "
+		       "\"drive_skew_p50_ns\": %ld, \"drive_skew_max_ns\": %ld}\n",
+		       transport, trigger, axes, group.starts, group.unknown, group.late,
+		       motionFrameTime(&group), histogramPercentile(&group.skews, 50), group.skews.max,
+		       histogramPercentile(&drive, 50), drive.max);
+		fflush(stdout);
+
+		for (i = 0; i < axes; i++) {
+			stopMotor(can[i]);
+		}
+	}
+}
+
+static int test_motion(const char *iface, int axes, int starts)
+{
+	TEmulator *emu;
+	TCan *can[MOTION_MAX_AXES];
+	int i;
+
+	if (axes < 1 || axes > MOTION_MAX_AXES) {
+		printf("1-%d axes\n", MOTION_MAX_AXES);
+		return EXIT_FAILURE;
+	}
+
+	if (!(emu = startDrives(iface, axes, can, 0))) {
+		printf("Could not open %d axes on %s\n", axes, iface);
+		return EXIT_FAILURE;
+	}
+
+	/* The transmit timestamps measure the skew of the batched starts. */
+	for (i = 0; strcmp(iface, "loopback") && i < axes; i++) {
+		if (setTimestamping(can[i], CAN_TIMESTAMP_SOFTWARE) < 0) {
+			stopDrives(emu, axes, can);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bench_motion(iface, emu, can, axes, starts);
+	stopDrives(emu, axes, can);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Streams a PT trajectory of the given number of points to an emulated drive running its
+ * table every period + drift ms, while the host assumes period. With stall, the host stops
+ * servicing the trajectory for that many ms half way. Returns the final status of
+ * serviceTrajectory().
+ */
+static int runTrajectory(TCan *can, TTrajectory *traj, int points, int period, int drift,
+			 int checkperiod, long stall)
+{
+	TTrajectoryPoint point;
+	int pushed = 0;
+	int stalled = 0;
+	int rval;
+
+	initTrajectory(traj, can, TRAJECTORY_PT, period);
+	traj->checkperiod = checkperiod;
+	if (configureTrajectory(traj) < 0 ||
+	    (drift && elmoSetInt(can, ELMO_CMD(MP4), period + drift) < 0)) {
+		return -1;
+	}
+
+	memset(&point, 0, sizeof(point));
+	do {
+		for (; pushed < points; pushed++) {
+			point.position = pushed * 100;
+			if (pushTrajectory(traj, &point, 1) < 1) {
+				break;
+			}
+		}
+		if (pushed == points) {
+			finishTrajectory(traj);
+		}
+
+		if (!traj->start) {
+			if ((rval = startTrajectory(traj)) < 0) {
+				break;
+			}
+		} else if (stall && !stalled && (int)traj->sent > points / 2) {
+			usleep(stall * 1000);
+			stalled = 1;
+		}
+		usleep(1000);
+	} while ((rval = serviceTrajectory(traj)) == 0);
+
+	stopMotor(can);
+	return rval;
+}
+
+/**
+ * Streams trajectories to an emulated drive whose clock runs slow, on time and fast,
+ * open loop and with the buffer status read back, and once with the host stalled long
+ * enough for the drive to run out of points. Returns 0 if the read back trajectories
+ * ended cleanly and the stall was reported as an underflow.
+ */
+static int test_trajectory(const char *iface, int points, int period)
+{
+	static const int drifts[] = { 1, 0, -1 };
+	TEmulator *emu;
+	TEmulatorPvt *pvt;
+	TTrajectory traj;
+	TCan *can;
+	unsigned long dropped;
+	int failed = 0;
+	int check, i, rval;
+
+	if (points < 1 || period < 2) {
+		printf("at least 1 point and 2 ms\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!(emu = startDrives(iface, 1, &can, 0))) {
+		printf("Could not open a drive on %s\n", iface);
+		return EXIT_FAILURE;
+	}
+	pvt = &emu->drive[1]->pvt;
+
+	for (i = 0; i <= 3; i++) {
+		for (check = 0; check <= TRAJECTORY_CHECK_PERIOD; check += TRAJECTORY_CHECK_PERIOD) {
+			if (i == 3 && !check) {
+				continue;
+			}
+			dropped = pvt->dropped;
+			rval = runTrajectory(can, &traj, points, period, i < 3 ? drifts[i] : 0, check,
+					     i < 3 ? 0 : TRAJECTORY_DRIVE_BUFFER * period * 2);
+			if (check && (i < 3 ? rval != 1 || pvt->dropped != dropped :
+					      rval != TRAJECTORY_UNDERFLOW)) {
+				failed = 1;
+			}
+
+			printf("{\"test\": \"trajectory\", \"check_ms\": %d, \"drift_ms\": %d, "
+			       "\"stall\": %d, \"status\": %d, \"points\": %d, \"refills\": %lu, "
+			       "\"corrections\": %lu, \"underruns\": %lu, \"underflows\": %lu, "
+			       "\"drive_dropped\": %lu}\n",
+			       check, i < 3 ? drifts[i] : 0, i == 3, rval, points, traj.refills,
+			       traj.corrections, traj.underruns, traj.underflows, pvt->dropped - dropped);
+			fflush(stdout);
+		}
+	}
+
+	stopDrives(emu, 1, &can);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Downloads and uploads an object of the given size on every node at once with each SDO
+ * protocol and prints the throughput, and the frames per kB the protocol puts on the bus
+ * with the throughput that makes possible on a saturated 1 Mbit/s bus. The uploaded data
+ * is compared to the downloaded. Returns 0 if every transfer succeeded and matched.
+ */
+static int bench_sdo(const char *transport, TEmulator *emu, TCan **can, int nodes,
+		     const unsigned char *data, unsigned char *readback, unsigned int size)
+{
+	static const char *modes[] = { "expedited", "segmented", "block" };
+	static TSdoTransfer t[EMULATOR_MAX_NODES];
+	unsigned long frames;
+	long long start, elapsed;
+	int mode, upload, rval, mismatch, i;
+	int failed = 0;
+
+	for (mode = SDO_SEGMENTED; mode <= SDO_BLOCK; mode++) {
+		for (upload = 0; upload <= 1; upload++) {
+			frames = emu->frames + emu->replies;
+			if (upload) {
+				memset(readback, 0, (size_t)nodes * size);
+			}
+			for (i = 0; i < nodes; i++) {
+				if (upload) {
+					sdoInitUpload(&t[i], can[i], 0x2200, 0, readback + i * size, size, mode);
+				} else {
+					sdoInitDownload(&t[i], can[i], 0x2200, 0,
+							(unsigned char *)data + i * size, size, mode);
+				}
+			}
+
+			start = timeNow();
+			rval = sdoRun(t, nodes);
+			elapsed = timeNow() - start;
+			frames = emu->frames + emu->replies - frames;
+			mismatch = upload && memcmp(data, readback, (size_t)nodes * size) != 0;
+			if (rval || mismatch) {
+				failed = 1;
+			}
+
+			printf("{\"transport\": \"%s\", \"test\": \"sdo\", \"mode\": \"%s\", "
+			       "\"direction\": \"%s\", \"nodes\": %d, \"bytes\": %u, \"status\": %d, "
+			       "\"mismatch\": %d, \"kBps\": %.1f, \"frames_per_kB\": %.1f, "
+			       "\"bus_kBps_1M\": %.1f}\n",
+			       transport, modes[mode], upload ? "upload" : "download", nodes, size, rval,
+			       mismatch, (double)nodes * size / (elapsed / 1e9) / 1000,
+			       frames * 1000.0 / ((double)nodes * size),
+			       (double)nodes * size / (frames * (double)CAN_FRAME_BITS / 1e6) / 1000);
+			fflush(stdout);
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+static int test_sdo(const char *iface, int nodes, unsigned int size)
+{
+	TEmulator *emu;
+	TCan *can[BENCH_MAX_NODES];
+	unsigned char *data;
+	int rval;
+	unsigned int i;
+
+	if (nodes < 1 || nodes > BENCH_MAX_NODES || size > EMULATOR_DOMAIN_SIZE) {
+		printf("1-%d nodes and at most %d bytes\n", BENCH_MAX_NODES, EMULATOR_DOMAIN_SIZE);
+		return EXIT_FAILURE;
+	}
+
+	if (!(data = (unsigned char *)malloc(2 * (size_t)nodes * size))) {
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < (unsigned int)nodes * size; i++) {
+		data[i] = (unsigned char)rand();
+	}
+
+	if (!(emu = startDrives(iface, nodes, can, 0))) {
+		printf("Could not open %d nodes on %s\n", nodes, iface);
+		free(data);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < (unsigned int)nodes; i++) {
+		setReceiveTimeout(can[i], 1000000);
+	}
+
+	/* The second half of the buffer receives the uploads. */
+	rval = bench_sdo(iface, emu, can, nodes, data, data + (size_t)nodes * size, size);
+
+	stopDrives(emu, nodes, can);
+	free(data);
+	return rval < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Reconfigures all the axes by replaying the elmo.c setters as at commissioning, then by
+ * restoring a captured configuration when nothing and when one parameter changed, and
+ * prints the time each took for the whole cell.
+ */
+static void bench_config(const char *transport, TCan **can, int axes)
+{
+	static TDriveConfig cfg[EMULATOR_MAX_NODES];
+	const char *tests[] = { "replay", "restore_unchanged", "restore_one" };
+	long long start, elapsed;
+	int test, rval, i;
+
+	for (test = 0; test < 3; test++) {
+		rval = 0;
+		start = timeNow();
+		for (i = 0; i < axes; i++) {
+			switch (test) {
+			case 0:
+				invalidateCache(can[i]);
+				if (setUnitMode(can[i], MODE_POS) < 0 || setSpeed(can[i], 50000) < 0 ||
+				    setLimits(can[i], -100000, 100000, -200000, 200000) < 0 ||
+				    startMotor(can[i]) < 0) {
+					rval = -1;
+				}
+				break;
+			case 1:
+				if (restoreConfig(can[i], &cfg[i]) < 0) {
+					rval = -1;
+				}
+				break;
+			case 2:
+				cfg[i].value[3].i = 60000; /* SP */
+				if (restoreConfig(can[i], &cfg[i]) < 0) {
+					rval = -1;
+				}
+				break;
+			}
+		}
+		elapsed = timeNow() - start;
+
+		/* The configuration the replay left is the one restored. */
+		for (i = 0; test == 0 && i < axes; i++) {
+			if (captureConfig(can[i], &cfg[i]) < 0) {
+				rval = -1;
+			}
+		}
+
+		printf("{\"transport\": \"%s\", \"test\": \"config\", \"mode\": \"%s\", "
+		       "\"axes\": %d, \"status\": %d, \"ms\": %.3f}\n",
+		       transport, tests[test], axes, rval, elapsed / 1e6);
+		fflush(stdout);
+	}
+}
+
+static int test_config(const char *iface, int axes, long latency)
+{
+	TEmulator *emu;
+	TCan *can[BENCH_MAX_NODES];
+
+	if (axes < 1 || axes > BENCH_MAX_NODES) {
+		printf("1-%d axes\n", BENCH_MAX_NODES);
+		return EXIT_FAILURE;
+	}
+
+	if (!(emu = startDrives(iface, axes, can, latency))) {
+		printf("Could not open %d axes on %s\n", axes, iface);
+		return EXIT_FAILURE;
+	}
+
+	bench_config(iface, can, axes);
+	stopDrives(emu, axes, can);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Records all the signals of an emulated drive in torque mode at the full recorder rate,
+ * uploads them with segmented and block SDO transfers into a recording file and reads it
+ * back, against polling PX and IQ from the host for as long as the recording took. The
+ * polling rate a 1 Mbit/s bus allows (two commands and two replies per sample) is printed
+ * too, as loopback has no bus to limit it.
+ */
+static int test_recorder(const char *iface, int length, const char *path)
+{
+	const unsigned int signals = (1u << RECORDER_SIGNALS) - 1;
+	const char *modes[] = { "segmented", "block" };
+	TEmulator *emu;
+	TCan *can;
+	TRecording rec;
+	const TRecorderColumn *col;
+	long long start, recorded, elapsed;
+	unsigned long polls = 0;
+	int position, mode, rval;
+	float current;
+
+	if (!(emu = startDrives(iface, 1, &can, 0))) {
+		printf("Could not open node 1 on %s\n", iface);
+		return EXIT_FAILURE;
+	}
+
+	if (setUnitMode(can, MODE_TORQUE) < 0 || startMotor(can) < 0 || setTorque(can, 1.0f) < 0 ||
+	    configureRecorder(can, signals, 1, length) < 0) {
+		printf("Could not configure the drive\n");
+		stopDrives(emu, 1, &can);
+		return EXIT_FAILURE;
+	}
+
+	for (mode = 0; mode < 2; mode++) {
+		/* The host polls while the drive records. */
+		start = timeNow();
+		rval = triggerRecorder(can, RECORDER_IMMEDIATE);
+		recorded = start + (long long)length * RECORDER_QUANTUM * 1000;
+		for (polls = 0; rval == 0 && timeNow() < recorded; polls++) {
+			rval = getPosition(can, &position) < 0 || getForce(can, &current) < 0 ? -1 : 0;
+		}
+		if (rval == 0) {
+			rval = waitRecorder(can, 1000000);
+		}
+		recorded = timeNow() - start;
+
+		start = timeNow();
+		if (rval == 0 && (rval = createRecording(&rec, path, RECORDER_SIGNALS, length,
+							 RECORDER_QUANTUM * 1000)) == 0) {
+			rval = uploadRecorder(can, &rec, signals, mode == 0 ? SDO_SEGMENTED : SDO_BLOCK);
+			closeRecording(&rec);
+		}
+		elapsed = timeNow() - start;
+
+		if (rval == 0 && (rval = openRecording(&rec, path)) == 0) {
+			if (!recordingColumn(&rec, 1, RECORDER_CURRENT, &col) || (int)col->samples != length) {
+				rval = -2;
+			}
+			closeRecording(&rec);
+		}
+
+		printf("{\"transport\": \"%s\", \"test\": \"recorder\", \"mode\": \"%s\", "
+		       "\"status\": %d, \"samples\": %d, \"record_ms\": %.3f, \"upload_ms\": %.3f, "
+		       "\"kbytes_per_s\": %.1f, \"recorded_hz\": %.0f, \"polled_hz\": %.0f, "
+		       "\"bus_polled_hz\": %.0f}\n",
+		       iface, modes[mode], rval, length, recorded / 1e6, elapsed / 1e6,
+		       RECORDER_SIGNALS * length * 4 / (elapsed / 1e9) / 1000,
+		       1e6 / RECORDER_QUANTUM, polls / (recorded / 1e9),
+		       (double)MOTION_BITRATE / (4 * CAN_FRAME_BITS));
+		fflush(stdout);
+	}
+
+	unlink(path);
+	stopDrives(emu, 1, &can);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * A writer or the reader of the telemetry log test.
+ */
+typedef struct {
+	TTelemetryLog *log;       /** the log */
+	int node;                 /** node id written by the writer */
+	long records;             /** records to write */
+	volatile int *running;    /** cleared when the writers are done */
+	unsigned long read;       /** records read by the reader */
+	unsigned long torn;       /** records read with fields of different writes */
+	pthread_t thread;
+} TBenchLogger;
+
+static void *logWriter(void *arg)
+{
+	TBenchLogger *w = (TBenchLogger *)arg;
+	TLogRecord record;
+	long i;
+
+	memset(&record, 0, sizeof(record));
+	record.node = (unsigned short)w->node;
+	for (i = 0; i < w->records; i++) {
+		record.time = timeNow();
+		record.position = (int)i;
+		record.velocity = -(int)i;
+		record.current = (float)(i & 0xffff);
+		record.status = (unsigned short)i;
+		logRecord(w->log, &record);
+	}
+	return NULL;
+}
+
+/* Tails the log, checking that every record read is one consistent write. */
+static void *logReader(void *arg)
+{
+	TBenchLogger *r = (TBenchLogger *)arg;
+	TLogRecord record[256];
+	unsigned long long cursor = 0;
+	int count, i;
+
+	while (*r->running || cursor < logHead(r->log)) {
+		count = readLog(r->log, &cursor, record, 256);
+		for (i = 0; i < count; i++) {
+			if (record[i].velocity != -record[i].position ||
+			    record[i].current != (float)(record[i].position & 0xffff) ||
+			    record[i].status != (unsigned short)record[i].position) {
+				r->torn++;
+			}
+		}
+		r->read += count;
+	}
+	return NULL;
+}
+
+/**
+ * Times appending records to a telemetry log from 1 and from several writer threads
+ * while a reader tails it, against formatting the same samples with fprintf.
+ */
+static int test_log(const char *path, long records, int writers)
+{
+	TTelemetryLog log;
+	TBenchLogger w[BENCH_MAX_CLIENTS], r;
+	volatile int running;
+	long long start, elapsed;
+	FILE *out;
+	int threads, i;
+	long j;
+
+	if (writers < 1 || writers > BENCH_MAX_CLIENTS) {
+		printf("1-%d writers\n", BENCH_MAX_CLIENTS);
+		return EXIT_FAILURE;
+	}
+
+	for (threads = 1; threads <= writers; threads = threads < writers && threads * 2 > writers ?
+							 writers : threads * 2) {
+		if (createTelemetryLog(&log, path, 1 << 16) < 0) {
+			return EXIT_FAILURE;
+		}
+
+		running = 1;
+		memset(&r, 0, sizeof(r));
+		r.log = &log;
+		r.running = &running;
+		pthread_create(&r.thread, NULL, logReader, &r);
+
+		start = timeNow();
+		for (i = 0; i < threads; i++) {
+			memset(&w[i], 0, sizeof(w[i]));
+			w[i].log = &log;
+			w[i].node = i + 1;
+			w[i].records = records;
+			pthread_create(&w[i].thread, NULL, logWriter, &w[i]);
+		}
+		for (i = 0; i < threads; i++) {
+			pthread_join(w[i].thread, NULL);
+		}
+		elapsed = timeNow() - start;
+		running = 0;
+		pthread_join(r.thread, NULL);
+
+		printf("{\"test\": \"log\", \"sink\": \"ring\", \"writers\": %d, \"records\": %ld, "
+		       "\"ns_per_record\": %.1f, \"read\": %lu, \"lost\": %llu, \"torn\": %lu}\n",
+		       threads, records * threads, (double)elapsed / records, r.read, log.ring.lost,
+		       r.torn);
+		fflush(stdout);
+		closeTelemetryLog(&log);
+		if (threads == writers) {
+			break;
+		}
+	}
+	unlink(path);
+
+	/* What print_info() did: one formatted line per sample. */
+	if (!(out = fopen("/dev/null", "w"))) {
+		return EXIT_FAILURE;
+	}
+	start = timeNow();
+	for (j = 0; j < records; j++) {
+		fprintf(out, "position = %ld\tforce = %f\n", j, (float)(j & 0xffff));
+	}
+	fflush(out);
+	elapsed = timeNow() - start;
+	fclose(out);
+	printf("{\"test\": \"log\", \"sink\": \"printf\", \"writers\": 1, \"records\": %ld, "
+	       "\"ns_per_record\": %.1f}\n", records, (double)elapsed / records);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * The library side of a replay: receives the replayed frames on a TCan.
+ */
+typedef struct {
+	TCan *can;                /** the TCan connected by replayConnect() */
+	unsigned long expected;   /** frames to receive */
+	unsigned long received;   /** frames received */
+	pthread_t thread;
+} TBenchReplay;
+
+static void *replayReceiver(void *arg)
+{
+	TBenchReplay *r = (TBenchReplay *)arg;
+	struct can_frame frame;
+
+	while (r->received < r->expected && receiveFrame(r->can, &frame) == 0) {
+		r->received++;
+	}
+	return NULL;
+}
+
+/**
+ * Times PX queries to an emulated drive with the capture off and on, then replays the
+ * received frames of the capture into a TCan at the recorded speed and as fast as
+ * possible.
+ */
+static int test_capture(const char *path, int commands)
+{
+	const double speeds[] = { 1.0, 0.0 };
+	TEmulator *emu;
+	TCan *can, *target;
+	TCapture cap;
+	TReplayStats stats;
+	TBenchReplay r;
+	long long start, elapsed;
+	int socket, position, on, i, rval;
+
+	if (!(emu = startDrives("loopback", 1, &can, 0))) {
+		printf("Could not start the emulator\n");
+		return EXIT_FAILURE;
+	}
+	if (createCapture(&cap, path, 1 << 20) < 0) {
+		stopDrives(emu, 1, &can);
+		return EXIT_FAILURE;
+	}
+
+	for (on = 0; on < 2; on++) {
+		if (on) {
+			enableCapture(can, &cap);
+		}
+		rval = 0;
+		start = timeNow();
+		for (i = 0; i < commands && rval == 0; i++) {
+			rval = getPosition(can, &position);
+		}
+		elapsed = timeNow() - start;
+		printf("{\"test\": \"capture\", \"mode\": \"%s\", \"status\": %d, \"commands\": %d, "
+		       "\"us_per_command\": %.2f, \"frames\": %llu}\n", on ? "on" : "off", rval,
+		       commands, elapsed / 1e3 / commands, captureHead(&cap));
+		fflush(stdout);
+	}
+	disableCapture(can);
+
+	for (i = 0; i < 2; i++) {
+		if (!(target = TCanConstruct("replay")) || (socket = replayConnect(target, 1)) < 0) {
+			if (target) {
+				TCanDestruct(target);
+			}
+			closeCapture(&cap);
+			unlink(path);
+			stopDrives(emu, 1, &can);
+			return EXIT_FAILURE;
+		}
+		setReceiveTimeout(target, 1000000);
+		memset(&r, 0, sizeof(r));
+		r.can = target;
+		r.expected = captureHead(&cap) / 2;
+		pthread_create(&r.thread, NULL, replayReceiver, &r);
+
+		rval = replayCapture(&cap, socket, speeds[i], CAPTURE_RX, &stats);
+		pthread_join(r.thread, NULL);
+		printf("{\"test\": \"replay\", \"speed\": %.1f, \"status\": %d, \"frames\": %lu, "
+		       "\"received\": %lu, \"ms\": %.3f, \"frames_per_s\": %.0f, "
+		       "\"late_p50_us\": %ld, \"late_p99_us\": %ld}\n",
+		       speeds[i], rval, stats.frames, r.received, stats.elapsed / 1e6,
+		       stats.frames / (stats.elapsed / 1e9), histogramPercentile(&stats.late, 50),
+		       histogramPercentile(&stats.late, 99));
+		fflush(stdout);
+		close(socket);
+		TCanClose(target);
+		TCanDestruct(target);
+	}
+
+	closeCapture(&cap);
+	unlink(path);
+	stopDrives(emu, 1, &can);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * An element of the raw ring test.
+ */
+typedef struct {
+	unsigned long seq;        /** sequence number */
+	long long stamp;          /** timeNow() when pushed */
+} TBenchElement;
+
+/**
+ * The consumer side of the raw ring test.
+ */
+typedef struct {
+	TSpscRing *ring;          /** the ring */
+	unsigned long count;      /** elements to pop */
+	unsigned long misordered; /** elements popped out of sequence */
+	THistogram latency;       /** push to pop, in nanoseconds */
+	pthread_t thread;
+} TBenchConsumer;
+
+static void *ringConsumer(void *arg)
+{
+	TBenchConsumer *c = (TBenchConsumer *)arg;
+	TBenchElement e;
+	unsigned long next = 0;
+
+	while (next < c->count) {
+		if (spscPop(c->ring, &e) < 0) {
+			sched_yield();
+			continue;
+		}
+		histogramAdd(&c->latency, (long)(timeNow() - e.stamp));
+		if (e.seq != next) {
+			c->misordered++;
+		}
+		next = e.seq + 1;
+	}
+	return NULL;
+}
+
+/**
+ * A client thread of the I/O thread test: sets PA of its node to the tag of each command,
+ * keeping up to window commands in flight, and checks that the completions come back in
+ * order with its own values.
+ */
+typedef struct {
+	TRtChannel *channel;      /** the channel of the client */
+	int node;                 /** index of the node */
+	unsigned int commands;    /** commands to submit */
+	int window;               /** commands in flight */
+	unsigned int completed;   /** completions received */
+	unsigned long misordered; /** completions out of order or with another client's value */
+	unsigned long failed;     /** completions with an error status */
+	THistogram latency;       /** submit to completion, in microseconds */
+	pthread_t thread;
+} TBenchRtClient;
+
+static void *rtClient(void *arg)
+{
+	TBenchRtClient *c = (TBenchRtClient *)arg;
+	const unsigned int base = (unsigned int)(c->node + 1) << 24;
+	TRtCommand cmd;
+	TRtCompletion done;
+	TElmoValue value;
+	unsigned int submitted = 0;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.node = (unsigned char)c->node;
+	while (c->completed < c->commands) {
+		while (submitted < c->commands && submitted - c->completed < (unsigned int)c->window) {
+			cmd.tag = base | submitted;
+			value.i = (int)cmd.tag;
+			cmd.size = (unsigned char)elmoEncode(ELMO_CMD(PA), cmd.data, &value);
+			if (rtioSubmit(c->channel, &cmd) < 0) {
+				break;
+			}
+			submitted++;
+		}
+
+		if (rtioWait(c->channel, &done, 1000000) < 0) {
+			break;
+		}
+		if (done.status < 0) {
+			c->failed++;
+		} else if (done.tag != (base | c->completed) || intFromData(done.data) != (int)done.tag) {
+			c->misordered++;
+		}
+		histogramAdd(&c->latency, (long)((done.completed - done.submitted) / 1000));
+		c->completed++;
+	}
+	return NULL;
+}
+
+/**
+ * Stress test of the lock-free rings: first one producer and one consumer thread on a
+ * bare ring, then client threads talking to emulated drives through an I/O thread that
+ * owns their sockets. Checks the ordering and reports the handoff latency. Fails if any
+ * element or completion is out of order or failed, or a client did not get all of them.
+ */
+static int test_rings(int clients, unsigned int commands, int priority)
+{
+	TSpscRing ring;
+	TBenchConsumer c;
+	TBenchElement e;
+	TEmulator *emu;
+	TCan *can[BENCH_MAX_CLIENTS];
+	TRtIo *io;
+	TBenchRtClient client[BENCH_MAX_CLIENTS];
+	THistogram latency;
+	unsigned long misordered = 0, failed = 0, completed = 0;
+	long long start, elapsed;
+	int rval = EXIT_SUCCESS;
+	int window, i;
+
+	if (clients < 1 || clients > BENCH_MAX_CLIENTS) {
+		printf("1-%d clients\n", BENCH_MAX_CLIENTS);
+		return EXIT_FAILURE;
+	}
+
+	if (initSpscRing(&ring, RTIO_RING_SIZE, sizeof(TBenchElement)) < 0) {
+		return EXIT_FAILURE;
+	}
+	memset(&c, 0, sizeof(c));
+	c.ring = &ring;
+	c.count = commands * 100UL;
+	pthread_create(&c.thread, NULL, ringConsumer, &c);
+
+	start = timeNow();
+	for (e.seq = 0; e.seq < c.count; e.seq++) {
+		e.stamp = timeNow();
+		while (spscPush(&ring, &e) < 0) {
+			sched_yield();
+			e.stamp = timeNow();
+		}
+	}
+	pthread_join(c.thread, NULL);
+	elapsed = timeNow() - start;
+	freeSpscRing(&ring);
+
+	printf("{\"test\": \"rings\", \"mode\": \"spsc\", \"elements\": %lu, \"misordered\": %lu, "
+	       "\"ns_per_element\": %.1f, \"p50_ns\": %ld, \"p99_ns\": %ld, \"max_ns\": %ld}\n",
+	       c.count, c.misordered, (double)elapsed / c.count, histogramPercentile(&c.latency, 50),
+	       histogramPercentile(&c.latency, 99), c.latency.max);
+	fflush(stdout);
+	if (c.misordered) {
+		rval = EXIT_FAILURE;
+	}
+
+	for (window = 1; window <= CAN_MAX_PENDING; window *= CAN_MAX_PENDING) {
+		if (!(emu = startDrives("loopback", clients, can, 0))) {
+			printf("Could not open %d nodes\n", clients);
+			return EXIT_FAILURE;
+		}
+		if (!(io = TRtIoConstruct())) {
+			stopDrives(emu, clients, can);
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < clients; i++) {
+			if (rtioAddNode(io, can[i]) != i) {
+				break;
+			}
+			setReceiveTimeout(can[i], 1000000);
+			memset(&client[i], 0, sizeof(client[i]));
+			client[i].channel = rtioAddChannel(io);
+			client[i].node = i;
+			client[i].commands = commands;
+			client[i].window = window;
+		}
+		if (i < clients || rtioStart(io, -1, priority) < 0) {
+			printf("Could not start the I/O thread\n");
+			TRtIoDestruct(io);
+			stopDrives(emu, clients, can);
+			return EXIT_FAILURE;
+		}
+
+		start = timeNow();
+		for (i = 0; i < clients; i++) {
+			pthread_create(&client[i].thread, NULL, rtClient, &client[i]);
+		}
+		histogramReset(&latency);
+		for (i = 0; i < clients; i++) {
+			pthread_join(client[i].thread, NULL);
+			histogramMerge(&latency, &client[i].latency);
+			misordered += client[i].misordered;
+			failed += client[i].failed;
+			completed += client[i].completed;
+		}
+		elapsed = timeNow() - start;
+		rtioStop(io);
+
+		printf("{\"test\": \"rings\", \"mode\": \"rtio\", \"clients\": %d, \"window\": %d, "
+		       "\"completed\": %lu, \"misordered\": %lu, \"failed\": %lu, "
+		       "\"commands_per_s\": %.0f, \"p50_us\": %ld, \"p99_us\": %ld, \"max_us\": %ld, "
+		       "\"loops\": %lu, \"sleeps\": %lu}\n",
+		       clients, window, completed, misordered, failed, completed / (elapsed / 1e9),
+		       histogramPercentile(&latency, 50), histogramPercentile(&latency, 99), latency.max,
+		       io->loops, io->sleeps);
+		fflush(stdout);
+		/* A client stops early when a submit or a wait fails. */
+		if (misordered || failed || completed < (unsigned long)clients * commands) {
+			rval = EXIT_FAILURE;
+		}
+
+		TRtIoDestruct(io);
+		stopDrives(emu, clients, can);
+		misordered = failed = completed = 0;
+	}
+	return rval;
+}
+
+/**
+ * A background load thread of the worst-case test, like the workers of stress(1).
+ */
+typedef struct {
+	int kind;                 /** 0 spins the CPU, 1 maps and touches memory, 2 writes a file */
+	volatile int *running;    /** cleared when the test is done */
+	pthread_t thread;
+} TBenchLoad;
+
+static void *loadThread(void *arg)
+{
+	TBenchLoad *l = (TBenchLoad *)arg;
+	const size_t size = 8 << 20;
+	char path[64];
+	volatile double x = 1.0;
+	void *p;
+	int fd;
+
+	snprintf(path, sizeof(path), "/tmp/bench-load-%d", (int)getpid());
+	fd = l->kind == 2 ? open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600) : -1;
+	p = l->kind == 2 ? calloc(1, 1 << 20) : NULL;
+
+	while (*l->running) {
+		switch (l->kind) {
+		case 0:
+			x = x * 1.0000001 + 1.0;
+			break;
+		case 1:
+			if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+				      -1, 0)) != MAP_FAILED) {
+				memset(p, 1, size);
+				munmap(p, size);
+			}
+			break;
+		default:
+			if (fd < 0 || !p || write(fd, p, 1 << 20) < 0 || fsync(fd) < 0 ||
+			    ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+				return NULL;
+			}
+		}
+	}
+
+	if (l->kind == 2) {
+		free(p);
+		close(fd);
+		unlink(path);
+	}
+	return NULL;
+}
+
+/**
+ * The control loop of the worst-case test: a PX round trip every millisecond.
+ */
+typedef struct {
+	TCan *can;                /** the node */
+	int priority;             /** SCHED_FIFO priority, 0 for none */
+	long long duration;       /** run time in nanoseconds */
+	int status;               /** first failure */
+	long faults;              /** page faults of the thread while it ran */
+	THistogram wakeup;        /** lateness of the wakeups in microseconds */
+	THistogram cycle;         /** wakeup deadline to reply in microseconds */
+	pthread_t thread;
+} TBenchControl;
+
+static void *controlLoop(void *arg)
+{
+	TBenchControl *c = (TBenchControl *)arg;
+	struct sched_param param;
+	struct timespec deadline;
+	struct rusage before, after;
+	long long due, end;
+	int position, rval;
+
+	if (c->priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = c->priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			c->status = -1;
+			return NULL;
+		}
+	}
+	if (realtimeEnabled()) {
+		prefaultStack();
+	}
+
+	getrusage(RUSAGE_THREAD, &before);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	due = deadline.tv_sec * 1000000000LL + deadline.tv_nsec;
+	end = due + c->duration;
+	while (due < end) {
+		due += 1000000;
+		deadline.tv_sec = due / 1000000000LL;
+		deadline.tv_nsec = due % 1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		histogramAdd(&c->wakeup, (long)((timeNow() - due) / 1000));
+
+		if ((rval = getPosition(c->can, &position)) < 0 && c->status == 0) {
+			c->status = rval;
+		}
+		histogramAdd(&c->cycle, (long)((timeNow() - due) / 1000));
+	}
+	getrusage(RUSAGE_THREAD, &after);
+	c->faults = after.ru_minflt - before.ru_minflt + after.ru_majflt - before.ru_majflt;
+	return NULL;
+}
+
+/**
+ * Runs a 1 kHz control loop against an emulated drive under CPU, memory and file system
+ * load, first as is and then in the real-time mode, and reports the worst case. The
+ * page faults of the control thread show whether its hot path touched new memory.
+ */
+static int test_rt(int seconds, int priority, int loads)
+{
+	const char *modes[] = { "default", "realtime" };
+	TBenchLoad load[BENCH_MAX_CLIENTS];
+	TBenchControl c;
+	TEmulator *emu;
+	struct sched_param param;
+	unsigned long long cursor = 0;
+	volatile int running;
+	int mode, i;
+
+	if (loads < 0 || loads > BENCH_MAX_CLIENTS) {
+		printf("0-%d load threads\n", BENCH_MAX_CLIENTS);
+		return EXIT_FAILURE;
+	}
+
+	for (mode = 0; mode < 2; mode++) {
+		if (mode == 1 && enableRealtime() < 0) {
+			printf("Could not enter the real-time mode\n");
+			return EXIT_FAILURE;
+		}
+
+		memset(&c, 0, sizeof(c));
+		c.priority = priority;
+		c.duration = seconds * 1000000000LL;
+		if (!(emu = TEmulatorConstruct()) || !(c.can = TCanConstruct("loopback")) ||
+		    emulatorConnect(emu, c.can, 1) < 0 || emulatorStart(emu) < 0) {
+			printf("Could not start the emulator\n");
+			return EXIT_FAILURE;
+		}
+		if (priority > 0) {
+			memset(&param, 0, sizeof(param));
+			param.sched_priority = priority;
+			pthread_setschedparam(emu->thread, SCHED_FIFO, &param);
+		}
+
+		running = 1;
+		for (i = 0; i < loads; i++) {
+			load[i].kind = i % 3;
+			load[i].running = &running;
+			pthread_create(&load[i].thread, NULL, loadThread, &load[i]);
+		}
+		pthread_create(&c.thread, NULL, controlLoop, &c);
+		pthread_join(c.thread, NULL);
+		running = 0;
+		for (i = 0; i < loads; i++) {
+			pthread_join(load[i].thread, NULL);
+		}
+
+		emulatorStop(emu);
+		TCanClose(c.can);
+		if (mode == 1) {
+			/* A send on the closed socket fails; the error goes to the log, not stderr. */
+			sendPDO2(c.can, 4, (unsigned char *)"PX\0\0");
+		}
+
+		printf("{\"test\": \"rt\", \"mode\": \"%s\", \"status\": %d, \"priority\": %d, "
+		       "\"loads\": %d, \"cycles\": %lu, \"faults\": %ld, \"wakeup_p99_us\": %ld, "
+		       "\"wakeup_max_us\": %ld, \"cycle_p50_us\": %ld, \"cycle_p99_us\": %ld, "
+		       "\"cycle_max_us\": %ld, \"deferred_errors\": %llu}\n",
+		       modes[mode], c.status, priority, loads, c.cycle.count, c.faults,
+		       histogramPercentile(&c.wakeup, 99), c.wakeup.max,
+		       histogramPercentile(&c.cycle, 50), histogramPercentile(&c.cycle, 99),
+		       c.cycle.max, errorCount());
+		fflush(stdout);
+		TCanDestruct(c.can);
+		TEmulatorDestruct(emu);
+	}
+
+	printErrors(stderr, &cursor);
+	disableRealtime();
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Moves frames from tx to rx in bursts of CAN_BATCH through their transport and returns
+ * the frames per second.
+ */
+static double transfer(TCan *tx, TCan *rx, int frames)
+{
+	struct can_frame out[CAN_BATCH], in;
+	long long start = timeNow();
+	int sent, i;
+
+	fill(out, CAN_BATCH);
+	for (sent = 0; sent < frames; sent += CAN_BATCH) {
+		if (sendFrames(tx, out, CAN_BATCH) < 0) {
+			return 0;
+		}
+		for (i = 0; i < CAN_BATCH; i++) {
+			if (receiveFrame(rx, &in) < 0) {
+				return 0;
+			}
+		}
+	}
+	return sent / ((timeNow() - start) / 1e9);
+}
+
+/**
+ * Compares the transports: raw frame throughput between two TCans over a socketpair with
+ * the raw and the batch SocketCAN backends and over the in-process loopback, then the
+ * cost of a PX query to an emulated drive over a socketpair served by the emulator
+ * thread and over the loopback served inline, where no kernel is involved.
+ */
+static int test_transport(int frames, int commands)
+{
+	const TCanTransport *transports[] = { &canRawTransport, &canBatchTransport };
+	TEmulator *emu;
+	TCan *tx, *rx, *can;
+	long long start, elapsed;
+	int sv[2];
+	int position, mode, i, rval;
+
+	for (mode = 0; mode < 3; mode++) {
+		if (!(tx = TCanConstruct("loopback")) || !(rx = TCanConstruct("loopback"))) {
+			return EXIT_FAILURE;
+		}
+		if (mode < 2) {
+			if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+				return EXIT_FAILURE;
+			}
+			setTransport(tx, transports[mode]);
+			setTransport(rx, transports[mode]);
+			tx->socket = sv[0];
+			rx->socket = sv[1];
+		} else if (loopbackConnect(tx, rx) < 0 || tx->transport->open(tx) < 0 ||
+			   rx->transport->open(rx) < 0) {
+			return EXIT_FAILURE;
+		}
+		rx->id = BENCH_RX_ID;
+		setReceiveTimeout(rx, 1000000);
+
+		printf("{\"test\": \"transport\", \"mode\": \"frames\", \"transport\": \"%s\", "
+		       "\"link\": \"%s\", \"frames\": %d, \"frames_per_s\": %.0f}\n",
+		       tx->transport->name, mode < 2 ? "socketpair" : "memory", frames,
+		       transfer(tx, rx, frames));
+		fflush(stdout);
+		TCanClose(tx);
+		TCanClose(rx);
+		TCanDestruct(tx);
+		TCanDestruct(rx);
+	}
+
+	for (mode = 0; mode < 2; mode++) {
+		if (!(emu = TEmulatorConstruct()) || !(can = TCanConstruct("loopback")) ||
+		    (mode == 0 ? emulatorConnect(emu, can, 1) < 0 || emulatorStart(emu) < 0 :
+		     emulatorLoopback(emu, can, 1) < 0)) {
+			printf("Could not start the emulator\n");
+			return EXIT_FAILURE;
+		}
+
+		rval = 0;
+		start = timeNow();
+		for (i = 0; i < commands && rval == 0; i++) {
+			rval = getPosition(can, &position);
+		}
+		elapsed = timeNow() - start;
+
+		printf("{\"test\": \"transport\", \"mode\": \"commands\", \"transport\": \"%s\", "
+		       "\"link\": \"%s\", \"status\": %d, \"commands\": %d, \"ns_per_command\": %.0f}\n",
+		       can->transport->name, mode == 0 ? "socketpair" : "memory", rval, commands,
+		       (double)elapsed / commands);
+		fflush(stdout);
+
+		if (mode == 0) {
+			emulatorStop(emu);
+		}
+		TCanClose(can);
+		TCanDestruct(can);
+		TEmulatorDestruct(emu);
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Emergency codes injected by the monitor test and the descriptions they must decode to.
+ */
+static const struct {
+	unsigned short code;
+	const char *text;
+} injected[] = {
+	{ 0x8611, "position tracking error" },
+	{ 0x3120, "under-voltage: the power supply voltage is too low" },
+	{ 0x7300, "feedback error" },
+	{ 0x2310, "current, device output side" },
+};
+
+/**
+ * A drive watched by the monitor test: the thread polling it, if any, and what the
+ * fault callback saw.
+ */
+typedef struct {
+	TCan *can;
+	TMonitor monitor;
+	volatile int running;     /** cleared to stop the polling thread */
+	int status;               /** first error of the polling thread */
+	unsigned long polls;      /** PX queries of the polling thread */
+	long long handled;        /** timeNow() in the callback, 0 while waiting */
+	int source;               /** enum FaultSource of the last fault */
+	const char *text;         /** description of the last fault */
+	pthread_t thread;
+} TBenchMonitor;
+
+static void faultHandled(TCan *can, const TFault *fault, void *arg)
+{
+	TBenchMonitor *m = (TBenchMonitor *)arg;
+
+	(void)can;
+	m->source = fault->source;
+	m->text = fault->text;
+	__atomic_store_n(&m->handled, timeNow(), __ATOMIC_RELEASE);
+}
+
+/* Polls the position like a control loop; the monitor runs while it waits for replies. */
+static void *pollDrive(void *arg)
+{
+	TBenchMonitor *m = (TBenchMonitor *)arg;
+	int position, rval;
+
+	while (m->running) {
+		if ((rval = getPosition(m->can, &position)) < 0 && m->status == 0) {
+			m->status = rval;
+		}
+		m->polls++;
+	}
+	return NULL;
+}
+
+/**
+ * Injects emergencies into an emulated drive and measures how soon the monitor reacts:
+ * first in a thread polling the drive, where the EMCY frame is handled by the receive
+ * call waiting for a reply, then with the drive owned by an idle TRtIo thread, where the
+ * I/O thread handles it. Each fault is followed by an error reset, which must not raise
+ * a fault. The reaction is the armed MO=0 stop frame. Then the drive sends heartbeats
+ * for a while and stops: the loss must be raised by the same thread, within the timeout.
+ */
+static int test_monitor(int faults)
+{
+	const char *modes[] = { "receive", "rtio" };
+	TBenchMonitor m;
+	TEmulator *emu;
+	TRtIo *io = NULL;
+	THistogram callback, stop;
+	unsigned long decoded;
+	long long injected_at, deadline, lost;
+	struct timespec pause = { 0, 1000000 };
+	int mode, i, k;
+
+	for (mode = 0; mode < 2; mode++) {
+		memset(&m, 0, sizeof(m));
+		if (!(emu = TEmulatorConstruct()) || !(m.can = TCanConstruct("loopback")) ||
+		    emulatorConnect(emu, m.can, 1) < 0) {
+			printf("Could not start the emulator\n");
+			return EXIT_FAILURE;
+		}
+		setReceiveTimeout(m.can, 1000000);
+		startMonitor(m.can, &m.monitor, faultHandled, &m);
+		armStop(m.can, NULL, FAULT_EMCY);
+
+		if (emulatorStart(emu) < 0) {
+			return EXIT_FAILURE;
+		}
+		if (mode == 0) {
+			m.running = 1;
+			pthread_create(&m.thread, NULL, pollDrive, &m);
+		} else if (!(io = TRtIoConstruct()) || rtioAddNode(io, m.can) < 0 ||
+			   rtioStart(io, -1, 0) < 0) {
+			printf("Could not start the I/O thread\n");
+			return EXIT_FAILURE;
+		}
+
+		histogramReset(&callback);
+		histogramReset(&stop);
+		decoded = 0;
+		for (i = 0; i < faults; i++) {
+			k = i % (int)(sizeof(injected) / sizeof(injected[0]));
+			__atomic_store_n(&m.handled, 0, __ATOMIC_RELEASE);
+			injected_at = timeNow();
+			deadline = injected_at + 1000000000LL;
+			emulatorEmergency(emu, 1, injected[k].code, 0x01);
+			while (!__atomic_load_n(&m.handled, __ATOMIC_ACQUIRE) && timeNow() < deadline) {
+				sched_yield();
+			}
+			if (!m.handled) {
+				break;
+			}
+
+			histogramAdd(&callback, (long)(m.handled - injected_at));
+			histogramAdd(&stop, (long)(m.monitor.reacted - injected_at));
+			if (m.text && !strcmp(m.text, injected[k].text)) {
+				decoded++;
+			}
+			emulatorEmergency(emu, 1, 0x0000, 0x00);
+			nanosleep(&pause, NULL);
+		}
+
+		setHeartbeatTimeout(m.can, BENCH_HEARTBEAT_TIMEOUT);
+		__atomic_store_n(&m.handled, 0, __ATOMIC_RELEASE);
+		for (k = 0; k < 2 * BENCH_HEARTBEAT_TIMEOUT / 1000; k++) {
+			emulatorHeartbeat(emu, 1, NMT_OPERATIONAL);
+			nanosleep(&pause, NULL);
+		}
+		injected_at = timeNow();
+		deadline = injected_at + 1000000000LL;
+		while (!__atomic_load_n(&m.handled, __ATOMIC_ACQUIRE) && timeNow() < deadline) {
+			sched_yield();
+		}
+		lost = m.handled && m.source == FAULT_HEARTBEAT_LOST ? m.handled - injected_at : -1;
+
+		if (mode == 0) {
+			m.running = 0;
+			pthread_join(m.thread, NULL);
+		} else {
+			rtioStop(io);
+		}
+
+		printf("{\"test\": \"monitor\", \"mode\": \"%s\", \"status\": %d, \"injected\": %d, "
+		       "\"emergencies\": %lu, \"faults\": %lu, \"decoded\": %lu, \"stops\": %lu, "
+		       "\"polls\": %lu, \"callback_p50_ns\": %ld, \"callback_p99_ns\": %ld, "
+		       "\"callback_max_ns\": %ld, \"stop_p50_ns\": %ld, \"stop_p99_ns\": %ld, "
+		       "\"stop_max_ns\": %ld, \"reaction_p50_ns\": %ld, \"reaction_max_ns\": %ld, "
+		       "\"heartbeats\": %lu, \"heartbeat_lost_ns\": %lld}\n",
+		       modes[mode], m.status, i, m.monitor.emergencies, m.monitor.faults, decoded,
+		       m.monitor.stops, m.polls, histogramPercentile(&callback, 50),
+		       histogramPercentile(&callback, 99), callback.max, histogramPercentile(&stop, 50),
+		       histogramPercentile(&stop, 99), stop.max,
+		       histogramPercentile(&m.monitor.reaction, 50), m.monitor.reaction.max,
+		       m.monitor.heartbeats, lost);
+		fflush(stdout);
+
+		emulatorStop(emu);
+		stopMonitor(m.can);
+		TCanClose(m.can);
+		TCanDestruct(m.can);
+		if (io) {
+			TRtIoDestruct(io);
+			io = NULL;
+		}
+		TEmulatorDestruct(emu);
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Usage:
+ *   bench io [interface] [frames]
+ *     Compares the per-frame and the batched frame I/O paths of can.c.
+ *   bench sync [interface] [frequency] [seconds] [priority] [cpu]
+ *     Runs the SYNC producer and reports its cycle jitter and overruns.
+ *   bench rtt [interface|loopback] [nodes] [seconds]
+ *     Measures the commands per second and the p50/p99/p99.9 latency of the elmo.c
+ *     commands and of telemetry streaming against emulated drives, with 1, 2, 4 ...
+ *     up to the given number of nodes (127 by default), each test for the given time.
+ *     "loopback" connects the nodes to the drives in-process, without any CAN
+ *     interface. One JSON object per line, latencies in microseconds.
+ *   bench buses [buses] [nodes] [seconds]
+ *     Measures the total command throughput of a TCanRuntime with 1 to the given number
+ *     of buses, vcan0, vcan1 and so on. Each bus gets its own I/O thread and an emulator
+ *     with the drives, each node a client thread.
+ *   bench motion [interface|loopback] [axes] [starts]
+ *     Starts a motion group of emulated drives sequentially, batched and with one
+ *     broadcast BG, and reports the start skew (trigger 0, 1 and 2) against the frame
+ *     time. One JSON object per line, times in nanoseconds.
+ *   bench trajectory [interface|loopback] [points] [period]
+ *     Streams PT trajectories to an emulated drive whose clock is 1 ms per point slow, on
+ *     time and fast, open loop and reading back the buffer status of the drive, then
+ *     stalls the host until the drive runs out of points. One JSON object per line, with
+ *     the points the drive dropped on a full table.
+ *   bench sdo [interface|loopback] [nodes] [bytes]
+ *     Downloads and uploads an object on all the nodes at once with segmented and block
+ *     SDO transfers against emulated drives. One JSON object per line.
+ *   bench config [interface|loopback] [axes] [latency]
+ *     Times the reconfiguration of emulated drives replying after the given latency in
+ *     microseconds: replaying the setters against restoring a captured configuration.
+ *   bench recorder [interface|loopback] [samples] [file]
+ *     Records an emulated drive at the full recorder rate and uploads the samples into a
+ *     recording file with segmented and block SDO transfers, against the rate the host
+ *     reaches polling PX and IQ. One JSON object per line.
+ *   bench log [file] [records] [writers]
+ *     Times appending records to a telemetry log by 1, 2, 4 ... writer threads while a
+ *     reader tails it and checks every record, against fprintf to /dev/null.
+ *   bench capture [file] [commands]
+ *     Times PX queries to an emulated drive with the frame capture off and on, and
+ *     replays the captured replies into a TCan at the recorded speed and as fast as
+ *     possible. One JSON object per line.
+ *   bench rings [clients] [commands] [priority]
+ *     Checks the ordering and measures the handoff latency of the SPSC rings, bare
+ *     between two threads and between client threads and an I/O thread owning the
+ *     sockets of emulated drives, with 1 and CAN_MAX_PENDING commands in flight.
+ *   bench rt [seconds] [priority] [loads]
+ *     Runs a 1 kHz control loop against an emulated drive under CPU, memory and file
+ *     system load threads, as is and in the real-time mode, and reports the worst-case
+ *     wakeup and cycle latency and the page faults of the control thread.
+ *   bench transport [frames] [commands]
+ *     Compares the frame throughput of the raw and batch SocketCAN backends over a
+ *     socketpair with the in-process loopback, and the cost of a PX query to an emulated
+ *     drive over a socketpair against the loopback, where no kernel is involved.
+ *   bench monitor [faults]
+ *     Injects emergencies into an emulated drive polled by a control thread and owned by
+ *     an idle I/O thread, and reports the time from the injection to the fault callback
+ *     and to the stop frame, and whether the codes were decoded. Then stops the heartbeat
+ *     of the drive and reports the time from the last heartbeat to the heartbeat lost
+ *     fault (-1 if it was not raised). Times in nanoseconds.
+ */
+int main(int argc, char **argv)
+{
+	const char *test = argc > 1 ? argv[1] : "io";
+	const char *iface = argc > 2 ? argv[2] : BENCH_INTERFACE;
+
+	if (!strcmp(test, "io")) {
+		return test_io(iface, argc > 3 ? atoi(argv[3]) : BENCH_FRAMES);
+	}
+
+	if (!strcmp(test, "sync")) {
+		return test_sync(iface, argc > 3 ? atoi(argv[3]) : 1000, argc > 4 ? atoi(argv[4]) : 10,
+				 argc > 5 ? atoi(argv[5]) : 0, argc > 6 ? atoi(argv[6]) : -1);
+	}
+
+	if (!strcmp(test, "rtt")) {
+		return test_rtt(argc > 2 ? argv[2] : BENCH_INTERFACE, argc > 3 ? atoi(argv[3]) : BENCH_MAX_NODES,
+				argc > 4 ? atof(argv[4]) : 1.0);
+	}
+
+	if (!strcmp(test, "buses")) {
+		return test_buses(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 4,
+				  argc > 4 ? atoi(argv[4]) : 5);
+	}
+
+	if (!strcmp(test, "motion")) {
+		return test_motion(argc > 2 ? argv[2] : "loopback", argc > 3 ? atoi(argv[3]) : 8,
+				   argc > 4 ? atoi(argv[4]) : 100);
+	}
+
+	if (!strcmp(test, "trajectory")) {
+		return test_trajectory(argc > 2 ? argv[2] : "loopback", argc > 3 ? atoi(argv[3]) : 200,
+				       argc > 4 ? atoi(argv[4]) : 10);
+	}
+
+	if (!strcmp(test, "sdo")) {
+		return test_sdo(argc > 2 ? argv[2] : "loopback", argc > 3 ? atoi(argv[3]) : 4,
+				argc > 4 ? (unsigned int)atoi(argv[4]) : 65536);
+	}
+
+	if (!strcmp(test, "config")) {
+		return test_config(argc > 2 ? argv[2] : "loopback", argc > 3 ? atoi(argv[3]) : 8,
+				   argc > 4 ? atol(argv[4]) : 200);
+	}
+
+	if (!strcmp(test, "recorder")) {
+		return test_recorder(argc > 2 ? argv[2] : "loopback", argc > 3 ? atoi(argv[3]) : 4096,
+				     argc > 4 ? argv[4] : "/tmp/bench.rec");
+	}
+
+	if (!strcmp(test, "log")) {
+		return test_log(argc > 2 ? argv[2] : "/tmp/bench.tlog", argc > 3 ? atol(argv[3]) : 1000000,
+				argc > 4 ? atoi(argv[4]) : 4);
+	}
+
+	if (!strcmp(test, "capture")) {
+		return test_capture(argc > 2 ? argv[2] : "/tmp/bench.cap", argc > 3 ? atoi(argv[3]) : 20000);
+	}
+
+	if (!strcmp(test, "rings")) {
+		return test_rings(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? (unsigned int)atoi(argv[3]) : 20000,
+				  argc > 4 ? atoi(argv[4]) : 0);
+	}
+
+	if (!strcmp(test, "rt")) {
+		return test_rt(argc > 2 ? atoi(argv[2]) : 5, argc > 3 ? atoi(argv[3]) : 80,
+			       argc > 4 ? atoi(argv[4]) : 3);
+	}
+
+	if (!strcmp(test, "transport")) {
+		return test_transport(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100000);
+	}
+
+	if (!strcmp(test, "monitor")) {
+		return test_monitor(argc > 2 ? atoi(argv[2]) : 1000);
+	}
+
+	printf("Unknown test %s\n", test);
+	return EXIT_FAILURE;
+}
@@ -1,3 +1,7 @@
 #!/bin/sh
-gcc -Wall -Wextra -g -o main main.c can.c elmo.c
-
+SRC="can.c canbus.c elmo.c elmoasync.c sdo.c telemetry.c sync.c trajectory.c runtime.c histogram.c trace.c emulator.c elmocmd.c motion.c config.c recorder.c recordring.c telemetrylog.c capture.c spsc.c rtio.c realtime.c transport.c monitor.c"
+gcc -Wall -Wextra -g -pthread -o main main.c $SRC
+gcc -Wall -Wextra -g -pthread -o bench bench.c $SRC
+gcc -Wall -Wextra -g -pthread -o emulator emu.c $SRC
+gcc -Wall -Wextra -g -pthread -o tlog tlog.c $SRC
+gcc -Wall -Wextra -g -pthread -o cantrace cantrace.c $SRC
@@ -14,67 +14,387 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE /* sendmmsg, recvmmsg, ppoll */
+
+#include <poll.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+
 #include "can.h"
+#include "canbus.h"
+#include "capture.h"
+#include "elmoasync.h"
+#include "monitor.h"
+#include "realtime.h"
+#include "transport.h"
+
+/*
+ * A preallocated TCan with room for the interface name.
+ */
+typedef struct {
+	TCan can;
+	char iface[IFNAMSIZ];
+	int used;
+} TCanSlot;
+
+static TCanSlot *pool;
+
+int TCanPreallocate(void)
+{
+	if (pool) {
+		return 0;
+	}
+
+	if (!(pool = (TCanSlot *)malloc(CAN_MAX_NODES * sizeof(TCanSlot)))) {
+		return -1;
+	}
+	memset(pool, 0, CAN_MAX_NODES * sizeof(TCanSlot)); /* fault the pages in now */
+	return 0;
+}
+
+static TCanSlot *takeSlot(const char *iface)
+{
+	int i;
+
+	if (!pool || strlen(iface) >= IFNAMSIZ) {
+		return NULL;
+	}
+
+	for (i = 0; i < CAN_MAX_NODES; i++) {
+		if (!__atomic_exchange_n(&pool[i].used, 1, __ATOMIC_ACQUIRE)) {
+			return &pool[i];
+		}
+	}
+	return NULL;
+}
 
 TCan *TCanConstruct(const char *iface)
 {
-	TCan *can = (TCan *)malloc(sizeof(TCan));
+	TCanSlot *slot = takeSlot(iface);
+	TCan *can = slot ? &slot->can : (TCan *)malloc(sizeof(TCan));
 	if (!can) {
 		return NULL;
 	}
 
-	can->iface = (char *)malloc(strlen(iface) + 1);
+	memset(can, 0, sizeof(*can));
+
+	can->iface = slot ? slot->iface : (char *)malloc(strlen(iface) + 1);
 	if (!can->iface) {
 		free(can);
 		return NULL;
 	}
 
 	strcpy(can->iface, iface);
+	can->socket = -1;
+	can->transport = &canBatchTransport;
+	can->readytimeout = CAN_READY_TIMEOUT;
+	can->cachetimeout = CAN_CACHE_TIMEOUT;
+	can->rxtimeout = CAN_RX_TIMEOUT;
+	can->maxretries = CAN_RETRIES;
+	can->backoff = CAN_BACKOFF;
+	can->nmtstate = -1;
 	return can;
 }
 
 void TCanDestruct(TCan *can)
 {
+	TCanSlot *slot = (TCanSlot *)can;
+
+	free(can->trace);
+	if (pool && slot >= pool && slot < pool + CAN_MAX_NODES) {
+		__atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+		return;
+	}
 	free(can->iface);
 	free(can);
 }
 
 int TCanOpen(TCan *can, int canid)
 {
+	int rval;
+
 	can->id = canid;
+	/* Registered before the open, so that the filters it sets pass the replies. */
+	if (registerReplies(can) < 0) {
+		return -1;
+	}
+	if ((rval = can->transport->open(can)) < 0) {
+		return rval;
+	}
+
+	return setOperational(can);
+}
+
+int TCanClose(TCan *can)
+{
+	if (can->bus) {
+		TCanBusDetach(can->bus, can);
+		return 0;
+	}
+
+	return can->transport->close(can);
+}
+
+void invalidateCache(TCan *can)
+{
+	memset(can->cache.stamp, 0, sizeof(can->cache.stamp));
+}
+
+void trackDriveState(TCan *can, const struct can_frame *frame)
+{
+	int state;
+
+	if (frame->can_id == COBID_EMCY(can->id)) {
+		__atomic_store_n(&can->cachestale, 1, __ATOMIC_RELEASE);
+	} else if (frame->can_id == COBID_HEARTBEAT(can->id) && frame->can_dlc >= 1) {
+		state = frame->data[0] & 0x7f;
+		if (__atomic_exchange_n(&can->nmtstate, state, __ATOMIC_RELAXED) != state ||
+		    state == 0x00) {
+			__atomic_store_n(&can->cachestale, 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+int cacheValid(TCan *can, enum CacheItem item)
+{
+	long long stamp;
+
+	if (__atomic_load_n(&can->cachestale, __ATOMIC_ACQUIRE) &&
+	    __atomic_exchange_n(&can->cachestale, 0, __ATOMIC_ACQUIRE)) {
+		invalidateCache(can);
+	}
+
+	stamp = can->cache.stamp[item];
+	if (!stamp) {
+		return 0;
+	}
+	return !can->cachetimeout || timeNow() - stamp < can->cachetimeout * 1000LL;
+}
+
+void cacheUpdate(TCan *can, enum CacheItem item)
+{
+	can->cache.stamp[item] = timeNow();
+}
+
+void setCacheTimeout(TCan *can, long timeout)
+{
+	can->cachetimeout = timeout;
+}
+
+long long timeNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void addLatency(TCanLatency *latency, long us)
+{
+	latency->count++;
+	latency->last = us;
+	latency->total += us;
+	if (us > latency->max) {
+		latency->max = us;
+	}
+}
+
+int readRxPackets(const char *iface, unsigned long long *packets)
+{
+	char path[64 + IFNAMSIZ];
+	FILE *f;
+	int rval;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_packets", iface);
+	if (!(f = fopen(path, "r"))) {
+		return -1;
+	}
+
+	rval = fscanf(f, "%llu", packets) == 1 ? 0 : -1;
+	fclose(f);
+	return rval;
+}
+
+int setDefaultFilters(TCan *can)
+{
+	struct can_filter filter[CAN_MAX_FILTERS];
+	canid_t mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG; /* standard data frames only */
+	int count = 0;
+	int i;
+
+	filter[count++].can_id = COBID_RPDO2(can->id);
+	filter[count++].can_id = COBID_EMCY(can->id);
+	filter[count++].can_id = COBID_SDO_TX(can->id);
+	filter[count++].can_id = COBID_HEARTBEAT(can->id);
+	for (i = 0; i < can->nhandlers && count < CAN_MAX_FILTERS; i++) {
+		filter[count++].can_id = can->handler[i].cobid;
+	}
+
+	for (i = 0; i < count; i++) {
+		filter[i].can_mask = mask;
+	}
+
+	if (setFilters(can, filter, count) < 0) {
+		return -1;
+	}
+
+	return setErrorMask(can, CAN_DEFAULT_ERR_MASK);
+}
 
-	if ((can->socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("socket error");
+int setFilters(TCan *can, const struct can_filter *filter, int count)
+{
+	if (count < 0 || count > CAN_MAX_FILTERS) {
 		return -1;
 	}
 
-	can->addr.can_family = AF_CAN;
-	strcpy(can->ifr.ifr_name, can->iface);
+	if (can->bus) {
+		memcpy(can->filter, filter, count * sizeof(*filter));
+		can->filters = count;
+		can->rxframes = 0;
+		can->rxdiscard = 0;
+		return TCanBusUpdateFilters(can->bus) < 0 ? -2 : 0;
+	}
 
-	if (ioctl(can->socket, SIOCGIFINDEX, &can->ifr) < 0) {
-		perror("SIOCGIFINDEX error");
+	if (can->transport->option(can, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
+				   count * sizeof(*filter)) < 0) {
+		reportError("CAN_RAW_FILTER error");
 		return -2;
 	}
 
-	can->addr.can_ifindex = can->ifr.ifr_ifindex;
+	memcpy(can->filter, filter, count * sizeof(*filter));
+	can->filters = count;
+	can->rxframes = 0;
+	can->rxdiscard = 0;
+	if (readRxPackets(can->iface, &can->rxbase) < 0) {
+		can->rxbase = 0;
+	}
+	return 0;
+}
 
-        if (bind(can->socket, (struct sockaddr *)&can->addr, sizeof(can->addr)) < 0) {
-                perror("bind error");
-                return -3;
-        }
+int setErrorMask(TCan *can, can_err_mask_t mask)
+{
+	if (can->bus) {
+		can->errmask = mask;
+		return TCanBusUpdateFilters(can->bus);
+	}
 
-	return setOperational(can);
+	if (can->transport->option(can, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &mask, sizeof(mask)) < 0) {
+		reportError("CAN_RAW_ERR_FILTER error");
+		return -1;
+	}
+
+	can->errmask = mask;
+	return 0;
 }
 
-int TCanClose(TCan *can)
+/* The socket options only deliver the stamps; the controller must be told to take them. */
+static int enableHardwareStamps(int socket, const char *iface)
+{
+	struct hwtstamp_config config;
+	struct ifreq ifr;
+
+	memset(&config, 0, sizeof(config));
+	config.tx_type = HWTSTAMP_TX_OFF;
+	config.rx_filter = HWTSTAMP_FILTER_ALL;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+	ifr.ifr_data = (char *)&config;
+
+	if (ioctl(socket, SIOCSHWTSTAMP, &ifr) < 0) {
+		reportError("SIOCSHWTSTAMP error");
+		return -1;
+	}
+
+	/* The driver writes back what it does, which may be less than asked for. */
+	return config.rx_filter == HWTSTAMP_FILTER_NONE ? -1 : 0;
+}
+
+int setTimestampOptions(int socket, const char *iface, int mode)
+{
+	int software = mode == CAN_TIMESTAMP_SOFTWARE;
+	int flags = 0;
+	int own = mode != CAN_TIMESTAMP_OFF;
+
+	if (mode == CAN_TIMESTAMP_HARDWARE) {
+		if (enableHardwareStamps(socket, iface) < 0) {
+			return -4;
+		}
+		flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	}
+
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &software, sizeof(software)) < 0) {
+		reportError("SO_TIMESTAMPNS error");
+		return -1;
+	}
+
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+		reportError("SO_TIMESTAMPING error");
+		return -2;
+	}
+
+	/* The echo of a sent frame is stamped like a received one: that is the transmit time. */
+	if (setsockopt(socket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &own, sizeof(own)) < 0) {
+		reportError("CAN_RAW_RECV_OWN_MSGS error");
+		return -3;
+	}
+
+	return 0;
+}
+
+int setTimestamping(TCan *can, int mode)
 {
-	return close(can->socket);
+	int rval;
+
+	if (can->bus) {
+		rval = TCanBusSetTimestamping(can->bus, mode);
+	} else if (can->socket >= 0) {
+		rval = setTimestampOptions(can->socket, can->iface, mode);
+	} else {
+		rval = 0; /* TCanOpen() sets the options. */
+	}
+
+	if (rval == 0) {
+		can->timestamping = mode;
+	}
+	if (rval == 0 && mode && can->socket >= 0) {
+		rval = registerReplies(can); /* the echoes of the commands too */
+	}
+	return rval;
+}
+
+int getFilterStats(TCan *can, TCanFilterStats *stats)
+{
+	unsigned long long packets;
+
+	stats->read = can->rxframes;
+	stats->discarded = can->rxdiscard;
+	stats->filtered = 0;
+
+	if (can->bus) {
+		if (readRxPackets(can->bus->iface, &packets) < 0) {
+			return -1;
+		}
+		if (packets - can->bus->rxbase > can->bus->rxframes) {
+			stats->filtered = packets - can->bus->rxbase - can->bus->rxframes;
+		}
+		return 0;
+	}
+
+	if (readRxPackets(can->iface, &packets) < 0) {
+		return -1;
+	}
+
+	if (packets - can->rxbase > can->rxframes) {
+		stats->filtered = packets - can->rxbase - can->rxframes;
+	}
+	return 0;
 }
 
 int setOperational(TCan *can)
 {
 	struct can_frame frame;
 	unsigned char data[8] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	invalidateCache(can);
 	createFrame(&frame, can->id, 2, data);
 	return sendFrame(can, &frame);
 }
@@ -83,6 +403,7 @@ int setPreOperational(TCan *can)
 {
 	struct can_frame frame;
 	unsigned char data[8] = { 0x81, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	invalidateCache(can);
 	createFrame(&frame, can->id, 2, data);
 	return sendFrame(can, &frame);
 }
@@ -99,54 +420,395 @@ void createFrame(struct can_frame *frame, int id, int len, unsigned char *data)
 	}
 }
 
+/*
+ * Sends the frames queued in batch mode with one system call.
+ */
+static int sendQueued(TCan *can)
+{
+	int count = can->ntx;
+
+	can->ntx = 0;
+	if (count == 0) {
+		return 0;
+	}
+	return sendFrames(can, can->txbatch, count);
+}
+
 int sendFrame(TCan *can, struct can_frame *frame)
 {
-	int bytes;
-	if ((bytes = write(can->socket, frame, sizeof(*frame))) != sizeof(*frame)) {
-		perror("write");
+	if (can->batching) {
+		if (can->ntx == CAN_BATCH && sendQueued(can) < 0) {
+			return -1;
+		}
+		can->txbatch[can->ntx++] = *frame;
+		return 0;
+	}
+
+	if (can->transport->send(can, frame, 1) < 0) {
 		return -1;
 	}
+
+	if (can->capture) {
+		captureFrames(can->capture, can->id, frame, 1, CAPTURE_TX);
+	}
 	return 0;
 }
 
-int sendPDO2(TCan *can, int size, unsigned char *data)
+int writeFrames(int socket, struct can_frame *frame, int count)
 {
-	struct can_frame frame;
-	createFrame(&frame, can->id | (6 << 7), size, data); /* TPDO2 COB-ID: 0x301-0x37f */
+	struct mmsghdr msg[CAN_BATCH];
+	struct iovec iov[CAN_BATCH];
+	struct timespec wait = { 0, CAN_TX_WAIT * 1000 };
+	int sent = 0;
+	int waits = 0;
+	int i, n;
 
-	if (sendFrame(can, &frame) < 0) {
+	while (sent < count) {
+		n = count - sent < CAN_BATCH ? count - sent : CAN_BATCH;
+		memset(msg, 0, n * sizeof(*msg));
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = &frame[sent + i];
+			iov[i].iov_len = sizeof(*frame);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		if ((n = sendmmsg(socket, msg, n, 0)) < 0) {
+			/* At full bus load the transmit queue of the interface fills up: let it drain. */
+			if (errno == ENOBUFS && waits++ < CAN_TX_WAITS) {
+				nanosleep(&wait, NULL);
+				continue;
+			}
+			reportError("sendmmsg");
+			return -1;
+		}
+		sent += n;
+		waits = 0;
+	}
+	return sent;
+}
+
+int readFrames(int socket, struct can_frame *frame, int count)
+{
+	return readFramesStamped(socket, frame, NULL, count);
+}
+
+static long long stampOf(struct msghdr *hdr)
+{
+	struct cmsghdr *cmsg;
+	struct timespec ts;
+	struct scm_timestamping tss;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET) {
+			continue;
+		}
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		}
+		if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			/* ts[2] is the raw hardware time, 0 if the controller did not stamp it. */
+			memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+			return tss.ts[2].tv_sec * 1000000000LL + tss.ts[2].tv_nsec;
+		}
+	}
+	return 0;
+}
+
+int readFramesStamped(int socket, struct can_frame *frame, long long *stamp, int count)
+{
+	struct mmsghdr msg[CAN_BATCH];
+	struct iovec iov[CAN_BATCH];
+	char control[CAN_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping))];
+	int i, n;
+
+	if (count > CAN_BATCH) {
+		count = CAN_BATCH;
+	}
+
+	memset(msg, 0, count * sizeof(*msg));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = &frame[i];
+		iov[i].iov_len = sizeof(*frame);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		if (stamp) {
+			msg[i].msg_hdr.msg_control = control[i];
+			msg[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		}
+	}
+
+	/* Block for the first frame only, then take whatever is already queued. */
+	if ((n = recvmmsg(socket, msg, count, MSG_WAITFORONE, NULL)) < 0) {
+		reportError("recvmmsg error");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (msg[i].msg_len < sizeof(*frame)) {
+			return -2;
+		}
+		if (stamp) {
+			stamp[i] = stampOf(&msg[i].msg_hdr);
+		}
+	}
+	return n;
+}
+
+int sendFrames(TCan *can, struct can_frame *frame, int count)
+{
+	if (can->transport->send(can, frame, count) < 0) {
 		return -1;
 	}
 
+	if (can->capture) {
+		captureFrames(can->capture, can->id, frame, count, CAPTURE_TX);
+	}
 	return 0;
 }
 
-int receivePDO2(TCan *can, struct can_frame *frame)
+void beginBatch(TCan *can)
+{
+	can->batching = 1;
+}
+
+int flushBatch(TCan *can)
+{
+	can->batching = 0;
+	return sendQueued(can);
+}
+
+long long receiveDeadline(TCan *can)
+{
+	return can->rxtimeout ? timeNow() + can->rxtimeout * 1000LL : 0;
+}
+
+int waitReadable(int socket, long long deadline)
 {
-	int bytes;
+	struct pollfd fd;
+	struct timespec timeout;
+	long long remaining;
+	int rval;
+
+	if (!deadline) {
+		return 0; /* the read blocks */
+	}
+
+	fd.fd = socket;
+	fd.events = POLLIN;
 	for (;;) {
-		bytes = read(can->socket, frame, sizeof(*frame));
-		if (bytes < 0) {
-			perror("read error");
+		/* A passed deadline still gets one look, so that it can be used to poll. */
+		remaining = deadline - timeNow();
+		if (remaining < 0) {
+			remaining = 0;
+		}
+
+		timeout.tv_sec = remaining / 1000000000LL;
+		timeout.tv_nsec = remaining % 1000000000LL;
+		rval = ppoll(&fd, 1, &timeout, NULL);
+		if (rval > 0) {
+			return 0;
+		}
+		if (rval < 0 && errno != EINTR) {
+			reportError("ppoll");
 			return -1;
 		}
+		if (rval == 0 && remaining == 0) {
+			return CAN_TIMEOUT;
+		}
+	}
+}
 
-		if ((unsigned int)bytes < sizeof(struct can_frame)) {
-			return -2;
+void setReceiveTimeout(TCan *can, long timeout)
+{
+	can->rxtimeout = timeout;
+}
+
+void setRetries(TCan *can, int retries, long backoff)
+{
+	can->maxretries = retries;
+	can->backoff = backoff;
+}
+
+int receiveFrame(TCan *can, struct can_frame *frame)
+{
+	return receiveFrameUntil(can, frame, receiveDeadline(can));
+}
+
+int receiveFrameUntil(TCan *can, struct can_frame *frame, long long deadline)
+{
+	int n;
+
+	/* Anything still batched must go out before we wait for the replies to it. */
+	if (can->ntx > 0 && flushBatch(can) < 0) {
+		return -1;
+	}
+
+	if (can->bus) {
+		if ((n = TCanBusReceive(can->bus, can->id, frame, deadline)) == 0 && can->capture) {
+			captureFrames(can->capture, can->id, frame, 1, CAPTURE_RX);
+		}
+		return n;
+	}
+
+	if (can->rxhead == can->nrx) {
+		n = can->transport->receive(can, can->rxbatch, can->rxstamps, CAN_BATCH, deadline);
+		/* The thread receiving the frames of the node also checks its heartbeat. */
+		if (can->monitor) {
+			checkHeartbeat(can);
+		}
+		if (n < 0) {
+			return n;
 		}
+		can->rxhead = 0;
+		can->nrx = n;
+	}
+
+	can->rxstamp = can->rxstamps[can->rxhead];
+	*frame = can->rxbatch[can->rxhead++];
+	if (can->capture) {
+		captureFrames(can->capture, can->id, frame, 1, CAPTURE_RX);
+	}
+	return 0;
+}
 
-		/*
-		 * Read CAN-messages until we get a message from our
-		 * own can device with RPDO2 COB-ID (0x281-0x2ff)
-		 */
-		if (frame->can_id == (can->id | (5 << 7))) {
+int sendPDO2(TCan *can, int size, unsigned char *data)
+{
+	struct can_frame frame;
+	createFrame(&frame, COBID_TPDO2(can->id), size, data); /* TPDO2 COB-ID: 0x301-0x37f */
+
+	if (sendFrame(can, &frame) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int addHandler(TCan *can, canid_t cobid, TCanHandler handler, void *arg)
+{
+	int i;
+
+	for (i = 0; i < can->nhandlers; i++) {
+		if (can->handler[i].cobid == cobid) {
+			can->handler[i].handler = handler;
+			can->handler[i].arg = arg;
 			return 0;
 		}
 	}
 
+	if (can->nhandlers == CAN_MAX_HANDLERS) {
+		return -1;
+	}
+
+	can->handler[can->nhandlers].cobid = cobid;
+	can->handler[can->nhandlers].handler = handler;
+	can->handler[can->nhandlers].arg = arg;
+	can->nhandlers++;
+
+	if (can->socket < 0) {
+		return 0; /* TCanOpen() sets the filters. */
+	}
+
+	/* Only touch the kernel filters if they do not pass the COB-ID yet. */
+	for (i = 0; i < can->filters; i++) {
+		if (((cobid ^ can->filter[i].can_id) & can->filter[i].can_mask) == 0) {
+			return 0;
+		}
+	}
+	return setDefaultFilters(can);
+}
+
+void removeHandler(TCan *can, canid_t cobid)
+{
+	int i;
+	for (i = 0; i < can->nhandlers; i++) {
+		if (can->handler[i].cobid == cobid) {
+			can->nhandlers--;
+			can->handler[i] = can->handler[can->nhandlers];
+			return;
+		}
+	}
+}
+
+void dispatchFrame(TCan *can, struct can_frame *frame)
+{
+	int i;
+
+	/*
+	 * After an emergency or a NMT state change nothing we know about the drive holds.
+	 * The bus already tracked the frames it queued for its nodes.
+	 */
+	if (!can->bus) {
+		trackDriveState(can, frame);
+	}
+
+	/*
+	 * The monitored frames are consumed. Those of a bus node were already monitored when
+	 * the bus dispatched them.
+	 */
+	if (can->monitor &&
+	    (can->bus ? monitoredFrame(can, frame) : monitorFrame(can, frame, can->rxstamp))) {
+		return;
+	}
+
+	for (i = 0; i < can->nhandlers; i++) {
+		if (can->handler[i].cobid == frame->can_id) {
+			can->handler[i].handler(can, frame, can->handler[i].arg);
+			return;
+		}
+	}
+
+	can->rxdiscard++;
+}
+
+int processFrame(TCan *can)
+{
+	struct can_frame frame;
+	int rval;
+
+	if ((rval = receiveFrame(can, &frame)) < 0) {
+		return rval;
+	}
+
+	can->rxframes++;
+	dispatchFrame(can, &frame);
 	return 0;
 }
 
+int receiveCob(TCan *can, canid_t cobid, struct can_frame *frame)
+{
+	return receiveCobUntil(can, cobid, frame, receiveDeadline(can));
+}
+
+int receiveCobUntil(TCan *can, canid_t cobid, struct can_frame *frame, long long deadline)
+{
+	int rval;
+
+	for (;;) {
+		if ((rval = receiveFrameUntil(can, frame, deadline)) < 0) {
+			return rval;
+		}
+
+		can->rxframes++;
+		if (frame->can_id == cobid) {
+			return 0;
+		}
+		dispatchFrame(can, frame);
+	}
+}
+
+int receivePDO2(TCan *can, struct can_frame *frame)
+{
+	/*
+	 * Read CAN-messages until we get a message from our
+	 * own can device with RPDO2 COB-ID (0x281-0x2ff).
+	 * The kernel filters let through only the COB-IDs of
+	 * our own node and the error frames.
+	 */
+	return receiveCob(can, COBID_RPDO2(can->id), frame);
+}
+
 int sendPDO2DiscardReply(TCan *can, int size, unsigned char *data)
 {
 	int rval = sendPDO2(can, size, data);
@@ -155,41 +817,42 @@ int sendPDO2DiscardReply(TCan *can, int size, unsigned char *data)
 	return rval;
 }
 
+/*
+ * The values are little endian. They are converted through an unsigned integer so that
+ * no signed value is shifted, and floats are copied bit by bit with memcpy() instead of
+ * accessing them through an int pointer, which breaks strict aliasing.
+ */
 void setDataInt(unsigned char *data, int i)
 {
-	data[7] = (i >> 24);
-	data[6] = ((i << 8) >> 24);
-	data[5] = ((i << 16) >> 24);
-	data[4] = ((i << 24) >> 24);
+	unsigned int u = (unsigned int)i;
+	data[4] = u & 0xff;
+	data[5] = (u >> 8) & 0xff;
+	data[6] = (u >> 16) & 0xff;
+	data[7] = (u >> 24) & 0xff;
 }
 
 void setDataFloat(unsigned char *data, float f)
 {
-	int i = *(int *)&f;
-	data[7] = (i >> 24);
-	data[6] = ((i << 8) >> 24);
-	data[5] = ((i << 16) >> 24);
-	data[4] = ((i << 24) >> 24);
+	unsigned int u;
+	memcpy(&u, &f, sizeof(u));
+	setDataInt(data, (int)u);
 	data[3] |= 1 << 7; /* float mode ON */
 }
 
-float floatFromData(unsigned char *data)
+float floatFromData(const unsigned char *data)
 {
-	int i = 0x00;
-	i |= (data[7] << 24);
-	i |= (data[6] << 16);
-	i |= (data[5] << 8);
-	i |= (data[4]);
-	return *(float *)&i;
+	unsigned int u = (unsigned int)intFromData(data);
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
 }
 
-int intFromData(unsigned char *data)
+int intFromData(const unsigned char *data)
 {
-	int i = 0x00;
-	i |= (data[7] << 24);
-	i |= (data[6] << 16);
-	i |= (data[5] << 8);
-	i |= (data[4]);
-	return i;
+	unsigned int u = (unsigned int)data[4] |
+			 (unsigned int)data[5] << 8 |
+			 (unsigned int)data[6] << 16 |
+			 (unsigned int)data[7] << 24;
+	return (int)u;
 }
 
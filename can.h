@@ -22,6 +22,8 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -31,6 +33,7 @@
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/error.h>
 
 /** Protocol family */
 #ifndef PF_CAN
@@ -41,17 +44,214 @@
 #define AF_CAN PF_CAN
 #endif
 
+/** COB-ID of the SYNC message */
+#define COBID_SYNC 0x080
+
+/** COB-ID of the emergency messages of the node */
+#define COBID_EMCY(id) (0x080 + (id))
+
+/** COB-ID of the binary interpreter replies of the node (RPDO2) */
+#define COBID_RPDO2(id) (0x280 + (id))
+
+/** COB-ID of the binary interpreter commands to the node (TPDO2) */
+#define COBID_TPDO2(id) (0x300 + (id))
+
+/** COB-ID of the telemetry PDO with position and velocity (RPDO3) */
+#define COBID_RPDO3(id) (0x380 + (id))
+
+/** COB-ID of the trajectory points to the node (TPDO3) */
+#define COBID_TPDO3(id) (0x400 + (id))
+
+/** COB-ID of the telemetry PDO with current and status word (RPDO4) */
+#define COBID_RPDO4(id) (0x480 + (id))
+
+/** COB-ID of the SDO responses of the node */
+#define COBID_SDO_TX(id) (0x580 + (id))
+
+/** COB-ID of the SDO requests to the node */
+#define COBID_SDO_RX(id) (0x600 + (id))
+
+/** COB-ID of the heartbeat messages of the node */
+#define COBID_HEARTBEAT(id) (0x700 + (id))
+
+/** Number of TCans preallocated by TCanPreallocate(), one per CANOpen node id 1-127 */
+#define CAN_MAX_NODES 127
+
+/** Maximum number of kernel receive filters of a TCan */
+#define CAN_MAX_FILTERS 16
+
+/** Maximum number of frame handlers of a TCan */
+#define CAN_MAX_HANDLERS 8
+
+/** Maximum number of binary interpreter requests in flight per node */
+#define CAN_MAX_PENDING 16
+
+/** Maximum number of frames moved by one batched send or receive system call */
+#define CAN_BATCH 32
+
+/** Bits of a standard 8 byte frame with worst case bit stuffing and the interframe space */
+#define CAN_FRAME_BITS 135
+
+/** Times a full transmit queue is waited for before a send fails, and the wait in microseconds */
+#define CAN_TX_WAITS 1000
+#define CAN_TX_WAIT 100
+
+/** Default deadline for the drive to report a requested state, in microseconds */
+#define CAN_READY_TIMEOUT 100000
+
+/** Default receive timeout, in microseconds (0 waits forever) */
+#define CAN_RX_TIMEOUT 100000
+
+/** Default number of retries of a command whose reply timed out */
+#define CAN_RETRIES 2
+
+/** Default wait before the first retry, in microseconds; doubled for every retry */
+#define CAN_BACKOFF 1000
+
+/** Returned by the receive functions when the deadline passed without the frame */
+#define CAN_TIMEOUT (-ETIMEDOUT)
+
+/** Default lifetime of the cached drive state, in microseconds (0 never expires) */
+#define CAN_CACHE_TIMEOUT 1000000
+
+/** Error frame classes passed to the socket by default */
+#define CAN_DEFAULT_ERR_MASK (CAN_ERR_TX_TIMEOUT | CAN_ERR_CRTL | CAN_ERR_BUSOFF | CAN_ERR_RESTARTED)
+
+struct TCan;
+struct TCanBus;
+struct TCanTransport;
+struct TCanLink;
+struct TElmoRequest;
+struct TTrace;
+struct TCapture;
+struct TMonitor;
+
 /**
- * CAN Device information
+ * Kernel timestamping of the received frames.
+ */
+enum CanTimestamp
+{
+	CAN_TIMESTAMP_OFF = 0,      /** no timestamps */
+	CAN_TIMESTAMP_SOFTWARE = 1, /** time the kernel received the frame (SO_TIMESTAMPNS) */
+	CAN_TIMESTAMP_HARDWARE = 2  /** time the controller received the frame (SO_TIMESTAMPING, SIOCSHWTSTAMP) */
+};
+
+/**
+ * Handler of frames with a given COB-ID. Called for the frames nobody is waiting for
+ * from whatever function happens to receive them.
+ */
+typedef void (*TCanHandler)(struct TCan *can, struct can_frame *frame, void *arg);
+
+/**
+ * A registered frame handler.
+ */
+typedef struct {
+	canid_t cobid;            /** COB-ID of the frames */
+	TCanHandler handler;      /** handler function */
+	void *arg;                /** argument of the handler */
+} TCanHandlerEntry;
+
+/**
+ * Latency statistics of a state transition, in microseconds.
+ */
+typedef struct {
+	unsigned long count;      /** completed transitions */
+	unsigned long timeouts;   /** transitions that missed the deadline */
+	long last;                /** latency of the last transition */
+	long max;                 /** worst latency */
+	long long total;          /** sum of the latencies, for the average */
+} TCanLatency;
+
+/**
+ * Items of the drive state cache.
+ */
+enum CacheItem
+{
+	CACHE_MOTOR,      /** motor on (MO) */
+	CACHE_MODE,       /** unit mode (UM) */
+	CACHE_SPEED,      /** speed (SP) */
+	CACHE_LIMITS,     /** speed and feedback limits (VL, VH, LL, HL) */
+	CACHE_MAXCURRENT, /** maximum current (MC) */
+	CACHE_ITEMS
+};
+
+/**
+ * Last known state of the drive, used to skip commands that would not change anything.
  */
 typedef struct {
+	long long stamp[CACHE_ITEMS]; /** time each item was last known to be valid, 0 if not */
+	int motoron;              /** MO */
+	int unitmode;             /** UM */
+	int speed;                /** SP */
+	int limits[4];            /** VL[2], VH[2], LL[2], HL[2] */
+	float maxcurrent;         /** MC */
+} TCanCache;
+
+/**
+ * CAN Device information
+ */
+typedef struct TCan {
 	char *iface;              /** can interface device (e.g. "can0") */
 	struct sockaddr_can addr; /** socket address structure for CAN address family */
 	struct ifreq ifr;         /** interface request structure */
 	unsigned int id;          /** CANOpen device node id: 1-127 (e.g. 127) */
 	int socket;               /** socket file descriptor */
+	const struct TCanTransport *transport; /** frame I/O backend, canBatchTransport by default */
+	struct TCanLink *link;    /** loopback link of canLoopbackTransport, NULL otherwise */
+	struct can_filter filter[CAN_MAX_FILTERS]; /** kernel receive filters */
+	int filters;              /** number of kernel receive filters in use */
+	can_err_mask_t errmask;   /** error frame classes received from the kernel */
+	unsigned long rxframes;   /** frames read from the socket */
+	unsigned long rxdiscard;  /** frames read from the socket but not wanted */
+	unsigned long long rxbase; /** interface rx_packets counter when the filters were set */
+	struct TCanBus *bus;      /** shared bus the node is attached to, NULL if it has its own socket */
+	struct TElmoRequest *pending[CAN_MAX_PENDING]; /** requests waiting for a reply, oldest first */
+	int npending;             /** number of requests waiting for a reply */
+	unsigned long rxunmatched; /** replies that matched no pending request */
+	int batching;             /** nonzero between beginBatch() and flushBatch() */
+	struct can_frame txbatch[CAN_BATCH]; /** frames queued in batch mode */
+	int ntx;                  /** number of frames queued in batch mode */
+	struct can_frame rxbatch[CAN_BATCH]; /** frames received but not yet consumed */
+	int rxhead;               /** index of the next frame in rxbatch */
+	int nrx;                  /** number of frames in rxbatch */
+	long readytimeout;        /** deadline for state transitions of the drive in microseconds */
+	TCanLatency motoron;      /** latency from MO=1 until the drive reports motor on */
+	TCanLatency motoroff;     /** latency from MO=0 until the drive reports motor off */
+	TCanCache cache;          /** last known state of the drive */
+	int cachestale;           /** set by trackDriveState() from any thread, cleared by cacheValid() */
+	int nmtstate;             /** NMT state of the last heartbeat, -1 if none */
+	long cachetimeout;        /** lifetime of the cached items in microseconds, 0 never expires */
+	unsigned long cachehits;  /** commands skipped because of the cache */
+	TCanHandlerEntry handler[CAN_MAX_HANDLERS]; /** frame handlers by COB-ID */
+	int nhandlers;            /** number of frame handlers */
+	unsigned int sdoabort;    /** abort code of the last aborted SDO transfer */
+	unsigned long sdotransfers; /** SDO transfers completed */
+	unsigned long sdofailures; /** SDO transfers aborted or timed out */
+	unsigned long long sdobytes; /** bytes moved by the completed SDO transfers */
+	long long sdotime;        /** time spent in the completed SDO transfers in nanoseconds */
+	long rxtimeout;           /** receive timeout in microseconds, 0 waits forever */
+	int maxretries;           /** retries of a command whose reply timed out */
+	long backoff;             /** wait before the first retry in microseconds */
+	unsigned long retries;    /** commands sent again after a timeout */
+	unsigned long timeouts;   /** commands that failed after all the retries */
+	TCanLatency reply;        /** latency from sending a command until its reply */
+	int timestamping;         /** enum CanTimestamp, applied by TCanOpen() */
+	long long rxstamps[CAN_BATCH]; /** kernel timestamps of the frames in rxbatch */
+	long long rxstamp;        /** kernel timestamp of the last received frame in ns, 0 if none */
+	struct TTrace *trace;     /** per command round-trip histograms, NULL if not traced */
+	struct TCapture *capture; /** capture of the frames sent and received, NULL if none */
+	struct TMonitor *monitor; /** fault monitor of the drive, NULL if none */
 } TCan;
 
+/**
+ * Receive filter statistics of a TCan.
+ */
+typedef struct {
+	unsigned long read;      /** frames read from the socket */
+	unsigned long discarded; /** frames read from the socket but discarded in userspace */
+	unsigned long filtered;  /** frames dropped by the kernel filters, never read at all */
+} TCanFilterStats;
+
 /**
  * Constructs a new TCan. This function must be called before anything else can be done.
  * 
@@ -60,6 +260,14 @@ typedef struct {
  */
 TCan *TCanConstruct(const char *iface);
 
+/**
+ * Preallocates CAN_MAX_NODES TCans. TCanConstruct() takes them before it allocates
+ * memory, and TCanDestruct() gives them back. Called by enableRealtime().
+ *
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanPreallocate(void);
+
 /**
  * Destructs a TCan.
  *
@@ -86,6 +294,144 @@ int TCanOpen(TCan *can, int canid);
  */
 int TCanClose(TCan *can);
 
+/**
+ * Sets the kernel receive filters to the ones needed by a single node: RPDO2 replies,
+ * emergency messages, SDO responses and heartbeat of the node and the COB-IDs of the
+ * frame handlers, plus the CAN_DEFAULT_ERR_MASK error frames. TCanOpen() calls this
+ * before binding the socket, and addHandler() when it needs a new COB-ID.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 otherwise.
+ */
+int setDefaultFilters(TCan *can);
+
+/**
+ * Replaces the kernel receive filters of the socket. Can be called at any time after
+ * TCanOpen(). Frames not matching any of the filters are dropped by the kernel and never
+ * wake up the reader.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param filter The filters to be set.
+ * @param count The number of filters, at most CAN_MAX_FILTERS. 0 drops all data frames.
+ * @return 0 on success, <0 otherwise.
+ */
+int setFilters(TCan *can, const struct can_filter *filter, int count);
+
+/**
+ * Sets the error frame classes (CAN_ERR_*) passed to the socket.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param mask The error class mask, 0 disables error frames.
+ * @return 0 on success, <0 otherwise.
+ */
+int setErrorMask(TCan *can, can_err_mask_t mask);
+
+/**
+ * Sets the kernel timestamping of the received frames. Can be called before TCanOpen(),
+ * which applies it, or at any time after. When on, the socket also receives the frames
+ * it sends itself once they are on the bus: their timestamp is the transmit time. The
+ * timestamp of the last frame returned by receiveFrame() is in can->rxstamp.
+ *
+ * Software and hardware timestamps use different clocks, and neither is timeNow(). The
+ * hardware mode fails unless the controller can be set to stamp the received frames.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param mode The enum CanTimestamp mode.
+ * @return 0 on success, <0 otherwise.
+ */
+int setTimestamping(TCan *can, int mode);
+
+/**
+ * Sets the timestamping socket options of a CAN socket, see setTimestamping(). The
+ * hardware mode also turns on the stamping of all received frames in the controller
+ * (SIOCSHWTSTAMP, which needs CAP_NET_ADMIN), and fails if the driver cannot do it.
+ *
+ * @param socket The socket file descriptor.
+ * @param iface The interface of the socket (e.g. "can0").
+ * @param mode The enum CanTimestamp mode.
+ * @return 0 on success, <0 otherwise.
+ */
+int setTimestampOptions(int socket, const char *iface, int mode);
+
+/**
+ * Returns the receive filter statistics. The number of frames filtered by the kernel is
+ * derived from the rx_packets counter of the interface in sysfs since the last call of
+ * setFilters(). For a node on a shared TCanBus the kernel filters are those of the bus.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param stats The pointer where the statistics are stored.
+ * @return 0 on success, <0 if the interface counter could not be read (filtered is 0 then).
+ */
+int getFilterStats(TCan *can, TCanFilterStats *stats);
+
+/**
+ * Forgets the cached drive state. Called when a NMT command is sent to the drive.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void invalidateCache(TCan *can);
+
+/**
+ * Marks the cached drive state stale when the frame is an emergency or a heartbeat with
+ * a new NMT state (or a boot-up). Only atomics are used, so it may be called by whichever
+ * thread sees the frame first, such as the I/O thread of a bus; the thread using the node
+ * forgets the cache at its next cacheValid().
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame received for the node.
+ */
+void trackDriveState(TCan *can, const struct can_frame *frame);
+
+/**
+ * Returns whether a cached item is valid and not older than the cache timeout.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param item The cache item.
+ * @return Nonzero if the item is valid.
+ */
+int cacheValid(TCan *can, enum CacheItem item);
+
+/**
+ * Marks a cached item valid from now on. The value itself is set by the caller.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param item The cache item.
+ */
+void cacheUpdate(TCan *can, enum CacheItem item);
+
+/**
+ * Sets the lifetime of the cached drive state. The default is CAN_CACHE_TIMEOUT.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param timeout The lifetime in microseconds, 0 never expires.
+ */
+void setCacheTimeout(TCan *can, long timeout);
+
+/**
+ * Returns the time of the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ */
+long long timeNow(void);
+
+/**
+ * Adds a sample to latency statistics.
+ *
+ * @param latency The statistics.
+ * @param us The latency in microseconds.
+ */
+void addLatency(TCanLatency *latency, long us);
+
+/**
+ * Reads the rx_packets counter of the interface from sysfs. The counter includes the frames
+ * dropped by the kernel filters.
+ *
+ * @param iface The name of the CAN interface.
+ * @param packets The pointer where the counter value is stored.
+ * @return 0 on success, <0 otherwise.
+ */
+int readRxPackets(const char *iface, unsigned long long *packets);
+
 /**
  * Sets the motor controller operational.
  * 
@@ -121,6 +467,182 @@ void createFrame(struct can_frame *frame, int id, int len, unsigned char *data);
  */
 int sendFrame(TCan *can, struct can_frame *frame);
 
+/**
+ * Sends the given frames to the bus with as few system calls (sendmmsg) as possible.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frames to be sent.
+ * @param count The number of frames.
+ * @return 0 on success, <0 otherwise.
+ */
+int sendFrames(TCan *can, struct can_frame *frame, int count);
+
+/**
+ * Starts batch mode: sendFrame() (and so all the PDO2 commands) only queue the frames
+ * until flushBatch() sends them with one system call. Receiving flushes the batch
+ * automatically so that no reply is waited for before its command is sent.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void beginBatch(TCan *can);
+
+/**
+ * Sends the frames queued since beginBatch() and ends batch mode.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 otherwise.
+ */
+int flushBatch(TCan *can);
+
+/**
+ * Registers a handler for the frames with the given COB-ID, replacing an earlier handler
+ * of the same COB-ID. The kernel filters are updated if needed.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cobid The COB-ID.
+ * @param handler The handler function.
+ * @param arg The argument of the handler.
+ * @return 0 on success, <0 otherwise.
+ */
+int addHandler(TCan *can, canid_t cobid, TCanHandler handler, void *arg);
+
+/**
+ * Removes the handler of the given COB-ID.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cobid The COB-ID.
+ */
+void removeHandler(TCan *can, canid_t cobid);
+
+/**
+ * Handles a received frame nobody was waiting for: emergencies and NMT state changes
+ * invalidate the cache, frames with a handler are passed to it, the rest are discarded.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame.
+ */
+void dispatchFrame(TCan *can, struct can_frame *frame);
+
+/**
+ * Receives one frame and dispatches it.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 otherwise.
+ */
+int processFrame(TCan *can);
+
+/**
+ * Receives frames until one with the given COB-ID arrives. The other frames are
+ * dispatched. Waits at most the receive timeout of the TCan in total.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cobid The COB-ID to wait for.
+ * @param frame The frame pointer where the received message is written.
+ * @return 0 on success, CAN_TIMEOUT if the frame did not arrive in time, <0 otherwise.
+ */
+int receiveCob(TCan *can, canid_t cobid, struct can_frame *frame);
+
+/**
+ * Like receiveCob(), but waits until an absolute deadline. A deadline that has already
+ * passed returns the frames already received without waiting.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cobid The COB-ID to wait for.
+ * @param frame The frame pointer where the received message is written.
+ * @param deadline The deadline in timeNow() time, 0 waits forever.
+ * @return 0 on success, CAN_TIMEOUT if the frame did not arrive in time, <0 otherwise.
+ */
+int receiveCobUntil(TCan *can, canid_t cobid, struct can_frame *frame, long long deadline);
+
+/**
+ * Receives the next frame of the node, whatever its COB-ID. Frames are read from the
+ * socket in batches (recvmmsg) and handed out one at a time. Waits at most the receive
+ * timeout of the TCan.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame pointer where the received message is written.
+ * @return 0 on success, CAN_TIMEOUT if no frame arrived in time, <0 otherwise.
+ */
+int receiveFrame(TCan *can, struct can_frame *frame);
+
+/**
+ * Like receiveFrame(), but waits until an absolute deadline.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame pointer where the received message is written.
+ * @param deadline The deadline in timeNow() time, 0 waits forever.
+ * @return 0 on success, CAN_TIMEOUT if no frame arrived in time, <0 otherwise.
+ */
+int receiveFrameUntil(TCan *can, struct can_frame *frame, long long deadline);
+
+/**
+ * Returns the absolute deadline of a receive started now.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return The deadline in timeNow() time, 0 if the TCan has no receive timeout.
+ */
+long long receiveDeadline(TCan *can);
+
+/**
+ * Waits until the socket is readable or the deadline passes. A deadline that has already
+ * passed polls the socket once.
+ *
+ * @param socket The socket file descriptor.
+ * @param deadline The deadline in timeNow() time, 0 waits forever.
+ * @return 0 when readable, CAN_TIMEOUT if the deadline passed, <0 otherwise.
+ */
+int waitReadable(int socket, long long deadline);
+
+/**
+ * Sets the receive timeout of the TCan. The default is CAN_RX_TIMEOUT.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param timeout The timeout in microseconds, 0 waits forever.
+ */
+void setReceiveTimeout(TCan *can, long timeout);
+
+/**
+ * Sets how commands whose reply timed out are retried. The defaults are CAN_RETRIES and
+ * CAN_BACKOFF.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param retries The number of retries, 0 not to retry.
+ * @param backoff The wait before the first retry in microseconds, doubled for every retry.
+ */
+void setRetries(TCan *can, int retries, long backoff);
+
+/**
+ * Writes frames to a CAN socket with sendmmsg.
+ *
+ * @param socket The socket file descriptor.
+ * @param frame The frames to be sent.
+ * @param count The number of frames.
+ * @return The number of frames sent, <0 on errors.
+ */
+int writeFrames(int socket, struct can_frame *frame, int count);
+
+/**
+ * Reads frames from a CAN socket with recvmmsg. Blocks until at least one frame is
+ * available and then returns all the frames already queued, up to count.
+ *
+ * @param socket The socket file descriptor.
+ * @param frame The array where the frames are written.
+ * @param count The size of the array, at most CAN_BATCH is used.
+ * @return The number of frames read, <0 on errors.
+ */
+int readFrames(int socket, struct can_frame *frame, int count);
+
+/**
+ * Like readFrames(), but also returns the kernel timestamps of the frames.
+ *
+ * @param socket The socket file descriptor.
+ * @param frame The array where the frames are written.
+ * @param stamp The array where the timestamps are written in ns, 0 if the frame has none.
+ * @param count The size of the arrays, at most CAN_BATCH is used.
+ * @return The number of frames read, <0 on errors.
+ */
+int readFramesStamped(int socket, struct can_frame *frame, long long *stamp, int count);
+
 /**
  * Sends a PDO2 message to the bus.
  * 
@@ -132,11 +654,11 @@ int sendFrame(TCan *can, struct can_frame *frame);
 int sendPDO2(TCan *can, int size, unsigned char *data);
 
 /**
- * Receives a PDO2 message.
+ * Receives a PDO2 message. Waits at most the receive timeout of the TCan.
  *
  * @param can The TCan pointer of the motor controller.
  * @param frame The frame pointer where the received messge is written.
- * @return 0 on success, <0 otherwise. 
+ * @return 0 on success, CAN_TIMEOUT if the message did not arrive in time, <0 otherwise. 
  */
 int receivePDO2(TCan *can, struct can_frame *frame);
 
@@ -178,7 +700,7 @@ void setDataFloat(unsigned char *data, float f);
  * @param data The pointer to the data which is to be read.
  * @return The float of the message.
  */
-float floatFromData(unsigned char *data);
+float floatFromData(const unsigned char *data);
 
 /**
  * Extracts the integer out of a message.
@@ -186,6 +708,6 @@ float floatFromData(unsigned char *data);
  * @param data The pointer to the data which is to be read.
  * @return The integer of the message.
  */
-int intFromData(unsigned char *data);
+int intFromData(const unsigned char *data);
 
 #endif /* ELMO_CAN_H */
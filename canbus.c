@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* recvmmsg, CPU_SET */
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "canbus.h"
+#include "elmoasync.h"
+#include "monitor.h"
+#include "realtime.h"
+
+static int allocQueue(TCanBus *bus, int canid)
+{
+	pthread_condattr_t attr;
+
+	if (!(bus->queue[canid] = (TCanQueue *)malloc(sizeof(TCanQueue)))) {
+		return -1;
+	}
+	memset(bus->queue[canid], 0, sizeof(TCanQueue));
+
+	/* The deadlines are in timeNow() time. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&bus->queue[canid]->ready, &attr);
+	pthread_condattr_destroy(&attr);
+	return 0;
+}
+
+TCanBus *TCanBusConstruct(const char *iface)
+{
+	TCanBus *bus = (TCanBus *)malloc(sizeof(TCanBus));
+	int i;
+
+	if (!bus) {
+		return NULL;
+	}
+
+	memset(bus, 0, sizeof(*bus));
+	bus->iface = (char *)malloc(strlen(iface) + 1);
+	if (!bus->iface) {
+		free(bus);
+		return NULL;
+	}
+
+	strcpy(bus->iface, iface);
+	bus->socket = -1;
+	bus->epoll = -1;
+	bus->wake = -1;
+	bus->cpu = -1;
+	pthread_mutex_init(&bus->lock, NULL);
+
+	/* In the real-time mode nodes are attached without allocating. */
+	for (i = 1; realtimeEnabled() && i < CANBUS_MAX_NODES; i++) {
+		if (allocQueue(bus, i) < 0) {
+			TCanBusDestruct(bus);
+			return NULL;
+		}
+	}
+	return bus;
+}
+
+void TCanBusDestruct(TCanBus *bus)
+{
+	int i;
+	for (i = 0; i < CANBUS_MAX_NODES; i++) {
+		if (bus->queue[i]) {
+			pthread_cond_destroy(&bus->queue[i]->ready);
+			free(bus->queue[i]);
+		}
+	}
+	pthread_mutex_destroy(&bus->lock);
+	free(bus->iface);
+	free(bus);
+}
+
+int TCanBusOpen(TCanBus *bus)
+{
+	if ((bus->socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		reportError("socket error");
+		return -1;
+	}
+
+	bus->addr.can_family = AF_CAN;
+	strcpy(bus->ifr.ifr_name, bus->iface);
+
+	if (ioctl(bus->socket, SIOCGIFINDEX, &bus->ifr) < 0) {
+		reportError("SIOCGIFINDEX error");
+		return -2;
+	}
+
+	bus->addr.can_ifindex = bus->ifr.ifr_ifindex;
+
+	/* No nodes attached yet: drop everything until they are. */
+	if (TCanBusUpdateFilters(bus) < 0) {
+		return -4;
+	}
+
+	if (bind(bus->socket, (struct sockaddr *)&bus->addr, sizeof(bus->addr)) < 0) {
+		reportError("bind error");
+		return -3;
+	}
+
+	return 0;
+}
+
+int TCanBusClose(TCanBus *bus)
+{
+	int rval;
+
+	TCanBusStop(bus);
+	rval = close(bus->socket);
+	bus->socket = -1;
+	return rval;
+}
+
+int TCanOpenOnBus(TCan *can, TCanBus *bus, int canid)
+{
+	int rval;
+
+	if (canid <= 0 || canid >= CANBUS_MAX_NODES) {
+		return -1;
+	}
+
+	/* Registered before the node has a socket, so that its filters pass the replies. */
+	can->id = canid;
+	if (registerReplies(can) < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&bus->lock);
+	if (bus->node[canid]) {
+		pthread_mutex_unlock(&bus->lock);
+		return -1;
+	}
+
+	if (!bus->queue[canid] && allocQueue(bus, canid) < 0) {
+		pthread_mutex_unlock(&bus->lock);
+		return -2;
+	}
+
+	bus->queue[canid]->head = 0;
+	bus->queue[canid]->tail = 0;
+	bus->queue[canid]->dropped = 0;
+
+	can->id = canid;
+	can->socket = bus->socket;
+	can->addr = bus->addr;
+	can->ifr = bus->ifr;
+	can->bus = bus;
+	bus->node[canid] = can;
+	pthread_mutex_unlock(&bus->lock);
+
+	if (can->timestamping && TCanBusSetTimestamping(bus, can->timestamping) < 0) {
+		TCanBusDetach(bus, can);
+		return -5;
+	}
+
+	if (setDefaultFilters(can) < 0) {
+		TCanBusDetach(bus, can);
+		return -4;
+	}
+
+	if ((rval = setOperational(can)) < 0) {
+		TCanBusDetach(bus, can);
+	}
+	return rval;
+}
+
+void TCanBusDetach(TCanBus *bus, TCan *can)
+{
+	pthread_mutex_lock(&bus->lock);
+	if (bus->node[can->id] == can) {
+		bus->node[can->id] = NULL;
+	}
+	pthread_mutex_unlock(&bus->lock);
+	can->bus = NULL;
+	can->socket = -1;
+	TCanBusUpdateFilters(bus);
+}
+
+int TCanBusUpdateFilters(TCanBus *bus)
+{
+	struct can_filter filter[CAN_RAW_FILTER_MAX];
+	can_err_mask_t errmask = 0;
+	int rval = 0;
+	int count = 0;
+	int i, j;
+
+	pthread_mutex_lock(&bus->lock);
+	for (i = 0; i < CANBUS_MAX_NODES; i++) {
+		TCan *can = bus->node[i];
+		if (!can) {
+			continue;
+		}
+
+		errmask |= can->errmask;
+		for (j = 0; j < can->filters; j++) {
+			if (count < CAN_RAW_FILTER_MAX) {
+				filter[count] = can->filter[j];
+			}
+			count++;
+		}
+	}
+
+	if (count > CAN_RAW_FILTER_MAX) {
+		/* Too many filters for the kernel: receive everything. */
+		filter[0].can_id = 0;
+		filter[0].can_mask = 0;
+		count = 1;
+	}
+
+	if (setsockopt(bus->socket, SOL_CAN_RAW, CAN_RAW_FILTER, filter,
+		       count * sizeof(*filter)) < 0) {
+		reportError("CAN_RAW_FILTER error");
+		rval = -1;
+	} else if (setsockopt(bus->socket, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errmask,
+			      sizeof(errmask)) < 0) {
+		reportError("CAN_RAW_ERR_FILTER error");
+		rval = -2;
+	} else {
+		bus->rxframes = 0;
+		bus->rxunclaimed = 0;
+		if (readRxPackets(bus->iface, &bus->rxbase) < 0) {
+			bus->rxbase = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&bus->lock);
+	return rval;
+}
+
+int TCanBusSetTimestamping(TCanBus *bus, int mode)
+{
+	int rval = setTimestampOptions(bus->socket, bus->iface, mode);
+	if (rval == 0) {
+		bus->timestamping = mode;
+	}
+	return rval;
+}
+
+/* The frames a node waits for: binary interpreter replies and SDO responses. */
+static int isReply(canid_t cobid, unsigned int id)
+{
+	return cobid == COBID_RPDO2(id) || cobid == COBID_SDO_TX(id);
+}
+
+/*
+ * Puts the frame in the queue of node id. If the queue is full, the oldest frame that is
+ * not a reply makes room, so that heartbeats, emergencies and error frames piling up in
+ * the queue of an idle node never starve the reply it then waits for. The frames left
+ * stay in order. Only if the queue is all replies is the new frame dropped.
+ */
+static void enqueue(TCanQueue *queue, unsigned int id, struct can_frame *frame, long long stamp)
+{
+	unsigned int i;
+
+	if (queue->tail - queue->head >= CANBUS_QUEUE_SIZE) {
+		queue->dropped++;
+		for (i = queue->head; i != queue->tail; i++) {
+			if (!isReply(queue->frame[i % CANBUS_QUEUE_SIZE].can_id, id)) {
+				break;
+			}
+		}
+		if (i == queue->tail) {
+			return;
+		}
+
+		for (; i + 1 != queue->tail; i++) {
+			queue->frame[i % CANBUS_QUEUE_SIZE] = queue->frame[(i + 1) % CANBUS_QUEUE_SIZE];
+			queue->stamp[i % CANBUS_QUEUE_SIZE] = queue->stamp[(i + 1) % CANBUS_QUEUE_SIZE];
+		}
+		queue->tail--;
+	}
+
+	queue->stamp[queue->tail % CANBUS_QUEUE_SIZE] = stamp;
+	queue->frame[queue->tail % CANBUS_QUEUE_SIZE] = *frame;
+	queue->tail++;
+	pthread_cond_signal(&queue->ready);
+}
+
+int TCanBusDispatch(TCanBus *bus)
+{
+	struct can_frame frame[CAN_BATCH];
+	long long stamp[CAN_BATCH];
+	TCan *watched[CANBUS_MAX_NODES];
+	unsigned int id;
+	int nwatched = 0;
+	int count;
+	int i, j;
+
+	if ((count = readFramesStamped(bus->socket, frame, stamp, CAN_BATCH)) < 0) {
+		return count;
+	}
+
+	pthread_mutex_lock(&bus->lock);
+	bus->rxframes += count;
+
+	for (i = 0; i < CANBUS_MAX_NODES; i++) {
+		if (bus->node[i] && bus->node[i]->monitor) {
+			watched[nwatched++] = bus->node[i];
+		}
+	}
+
+	/*
+	 * Faults are reacted to here, before the nodes get to the frames. The fault callbacks
+	 * run without the lock, so that they may use the bus and the other nodes go on.
+	 */
+	if (nwatched > 0) {
+		pthread_mutex_unlock(&bus->lock);
+		for (j = 0; j < count; j++) {
+			for (i = 0; i < nwatched; i++) {
+				monitorFrame(watched[i], &frame[j], stamp[j]);
+			}
+		}
+		pthread_mutex_lock(&bus->lock);
+	}
+
+	for (j = 0; j < count; j++) {
+		if (frame[j].can_id & CAN_ERR_FLAG) {
+			for (i = 0; i < CANBUS_MAX_NODES; i++) {
+				if (bus->node[i]) {
+					enqueue(bus->queue[i], i, &frame[j], stamp[j]);
+				}
+			}
+			continue;
+		}
+
+		/* All the node specific COB-IDs carry the node id in the lowest 7 bits. */
+		id = frame[j].can_id & 0x7f;
+		if (!(frame[j].can_id & CAN_EFF_FLAG) && id && bus->node[id]) {
+			/* Even if the queue drops the frame, the cache of the node is not trusted. */
+			trackDriveState(bus->node[id], &frame[j]);
+			enqueue(bus->queue[id], id, &frame[j], stamp[j]);
+		} else {
+			bus->rxunclaimed++;
+		}
+	}
+
+	pthread_mutex_unlock(&bus->lock);
+	return 0;
+}
+
+/*
+ * Checks the heartbeat of the monitored nodes. Called by the thread dispatching the
+ * frames, without the lock, like the fault callbacks. Returns the number of nodes whose
+ * heartbeat is watched.
+ */
+static int checkHeartbeats(TCanBus *bus)
+{
+	TCan *watched[CANBUS_MAX_NODES];
+	int nwatched = 0;
+	int i;
+
+	pthread_mutex_lock(&bus->lock);
+	for (i = 0; i < CANBUS_MAX_NODES; i++) {
+		if (bus->node[i] && bus->node[i]->monitor &&
+		    __atomic_load_n(&bus->node[i]->monitor->heartbeattimeout, __ATOMIC_RELAXED)) {
+			watched[nwatched++] = bus->node[i];
+		}
+	}
+	pthread_mutex_unlock(&bus->lock);
+
+	for (i = 0; i < nwatched; i++) {
+		checkHeartbeat(watched[i]);
+	}
+	return nwatched;
+}
+
+/*
+ * Marks the I/O thread stopped and wakes up the nodes waiting for frames, which then
+ * return an error instead of waiting for frames nobody dispatches.
+ */
+static void stopped(TCanBus *bus)
+{
+	int i;
+
+	pthread_mutex_lock(&bus->lock);
+	bus->running = 0;
+	for (i = 0; i < CANBUS_MAX_NODES; i++) {
+		if (bus->queue[i]) {
+			pthread_cond_broadcast(&bus->queue[i]->ready);
+		}
+	}
+	pthread_mutex_unlock(&bus->lock);
+}
+
+static void *ioThread(void *arg)
+{
+	TCanBus *bus = (TCanBus *)arg;
+	struct epoll_event event[2];
+	int timeout;
+	int count;
+	int i;
+
+	if (realtimeEnabled()) {
+		prefaultStack();
+	}
+
+	for (;;) {
+		/* Nothing to check, nothing to wake up for but the frames. */
+		timeout = checkHeartbeats(bus) ? MONITOR_HEARTBEAT_CHECK / 1000 : -1;
+		if ((count = epoll_wait(bus->epoll, event, 2, timeout)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			reportError("epoll_wait");
+			stopped(bus);
+			return NULL;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (event[i].data.fd == bus->wake) {
+				return NULL;
+			}
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		bus->wakeups++;
+		if (TCanBusDispatch(bus) < 0) {
+			reportError("TCanBusDispatch");
+			stopped(bus);
+			return NULL;
+		}
+	}
+}
+
+int TCanBusStart(TCanBus *bus, int cpu)
+{
+	struct epoll_event event;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int rval = 0;
+
+	if (bus->epoll >= 0) {
+		if (bus->running) {
+			return 0;
+		}
+		TCanBusStop(bus); /* The thread stopped on an error, start it anew. */
+	}
+
+	if ((bus->epoll = epoll_create1(0)) < 0) {
+		reportError("epoll_create1");
+		return -1;
+	}
+
+	if ((bus->wake = eventfd(0, 0)) < 0) {
+		reportError("eventfd");
+		close(bus->epoll);
+		bus->epoll = -1;
+		return -1;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = bus->socket;
+	if (epoll_ctl(bus->epoll, EPOLL_CTL_ADD, bus->socket, &event) < 0) {
+		reportError("epoll_ctl");
+		rval = -2;
+	}
+
+	event.data.fd = bus->wake;
+	if (!rval && epoll_ctl(bus->epoll, EPOLL_CTL_ADD, bus->wake, &event) < 0) {
+		reportError("epoll_ctl");
+		rval = -2;
+	}
+
+	pthread_attr_init(&attr);
+	bus->cpu = cpu;
+	if (!rval && cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+			rval = -3;
+		}
+	}
+
+	bus->running = 1;
+	if (!rval && pthread_create(&bus->thread, &attr, ioThread, bus) != 0) {
+		rval = -4;
+	}
+	pthread_attr_destroy(&attr);
+
+	if (rval < 0) {
+		bus->running = 0;
+		close(bus->wake);
+		close(bus->epoll);
+		bus->wake = -1;
+		bus->epoll = -1;
+	}
+	return rval;
+}
+
+void TCanBusStop(TCanBus *bus)
+{
+	uint64_t one = 1;
+
+	if (bus->epoll < 0) {
+		return;
+	}
+
+	/* The thread may have stopped on an error already, it is joined all the same. */
+	if (write(bus->wake, &one, sizeof(one)) != sizeof(one)) {
+		reportError("eventfd write");
+	}
+	pthread_join(bus->thread, NULL);
+	stopped(bus);
+
+	close(bus->wake);
+	close(bus->epoll);
+	bus->wake = -1;
+	bus->epoll = -1;
+}
+
+/*
+ * Waits for the I/O thread to queue a frame for the node. Called with the lock held.
+ */
+static int waitQueued(TCanBus *bus, TCanQueue *queue, long long deadline)
+{
+	struct timespec ts;
+	int rval;
+
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+
+	while (queue->head == queue->tail) {
+		if (!bus->running) {
+			return -1;
+		}
+		if (!deadline) {
+			pthread_cond_wait(&queue->ready, &bus->lock);
+			continue;
+		}
+		rval = pthread_cond_timedwait(&queue->ready, &bus->lock, &ts);
+		if (rval == ETIMEDOUT && queue->head == queue->tail) {
+			return CAN_TIMEOUT;
+		}
+	}
+	return 0;
+}
+
+int TCanBusReceive(TCanBus *bus, unsigned int id, struct can_frame *frame, long long deadline)
+{
+	TCanQueue *queue = bus->queue[id];
+	int rval;
+
+	/* Once started, only the I/O thread reads the socket, even after it stopped on an error. */
+	if (bus->epoll >= 0) {
+		pthread_mutex_lock(&bus->lock);
+		if ((rval = waitQueued(bus, queue, deadline)) == 0) {
+			bus->node[id]->rxstamp = queue->stamp[queue->head % CANBUS_QUEUE_SIZE];
+			*frame = queue->frame[queue->head % CANBUS_QUEUE_SIZE];
+			queue->head++;
+		}
+		pthread_mutex_unlock(&bus->lock);
+		return rval;
+	}
+
+	while (queue->head == queue->tail) {
+		rval = waitReadable(bus->socket, deadline);
+		checkHeartbeats(bus);
+		if (rval < 0) {
+			return rval;
+		}
+		if ((rval = TCanBusDispatch(bus)) < 0) {
+			return rval;
+		}
+	}
+
+	bus->node[id]->rxstamp = queue->stamp[queue->head % CANBUS_QUEUE_SIZE];
+	*frame = queue->frame[queue->head % CANBUS_QUEUE_SIZE];
+	queue->head++;
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_CANBUS_H
+#define ELMO_CANBUS_H
+
+#include <pthread.h>
+
+#include "can.h"
+
+/** Maximum number of filters the kernel accepts on a socket */
+#ifndef CAN_RAW_FILTER_MAX
+#define CAN_RAW_FILTER_MAX 512
+#endif
+
+/** Number of CANOpen node ids (0 is not a valid node) */
+#define CANBUS_MAX_NODES 128
+
+/** Number of frames in the receive queue of a node, must be a power of two */
+#define CANBUS_QUEUE_SIZE 32
+
+/**
+ * Receive queue of a single node on the bus.
+ */
+typedef struct {
+	struct can_frame frame[CANBUS_QUEUE_SIZE]; /** queued frames */
+	unsigned int head;        /** index of the next frame to be read */
+	unsigned int tail;        /** index of the next free slot */
+	long long stamp[CANBUS_QUEUE_SIZE]; /** kernel timestamps of the queued frames */
+	unsigned long dropped;    /** frames dropped because the queue was full, oldest non-replies first */
+	pthread_cond_t ready;     /** signalled by the I/O thread when a frame is queued */
+} TCanQueue;
+
+/**
+ * A CAN bus shared by several nodes. The bus owns the only socket of the interface and
+ * demultiplexes the incoming frames by COB-ID to the receive queues of the nodes.
+ *
+ * Without an I/O thread the frames are dispatched by whichever node is receiving, so the
+ * bus and its nodes must be used from one thread. With TCanBusStart() the I/O thread
+ * dispatches, and the nodes can be used from different threads (each node from one
+ * thread at a time).
+ */
+typedef struct TCanBus {
+	char *iface;              /** can interface device (e.g. "can0") */
+	struct sockaddr_can addr; /** socket address structure for CAN address family */
+	struct ifreq ifr;         /** interface request structure */
+	int socket;               /** socket file descriptor */
+	TCan *node[CANBUS_MAX_NODES];       /** attached nodes by node id */
+	TCanQueue *queue[CANBUS_MAX_NODES]; /** receive queues of the attached nodes */
+	unsigned long rxframes;   /** frames read from the socket */
+	unsigned long rxunclaimed; /** frames read but not belonging to any attached node */
+	unsigned long long rxbase; /** interface rx_packets counter when the filters were set */
+	pthread_mutex_t lock;     /** protects the nodes, queues, filters and counters */
+	pthread_t thread;         /** the I/O thread */
+	int running;              /** nonzero while the I/O thread runs */
+	int epoll;                /** epoll instance of the I/O thread */
+	int wake;                 /** eventfd stopping the I/O thread */
+	int cpu;                  /** CPU of the I/O thread, -1 for any */
+	unsigned long wakeups;    /** times the I/O thread woke up to read frames */
+	int timestamping;         /** enum CanTimestamp of the socket */
+} TCanBus;
+
+/**
+ * Constructs a new TCanBus.
+ *
+ * @param iface The name of the CAN interface.
+ * @return The pointer to a new TCanBus.
+ */
+TCanBus *TCanBusConstruct(const char *iface);
+
+/**
+ * Destructs a TCanBus. The bus must be closed first.
+ *
+ * @param bus The pointer to the TCanBus to be destructed.
+ */
+void TCanBusDestruct(TCanBus *bus);
+
+/**
+ * Opens the socket of the bus. No frames are received until nodes are attached.
+ *
+ * @param bus The pointer to the TCanBus to be opened.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanBusOpen(TCanBus *bus);
+
+/**
+ * Closes the socket of the bus. All the nodes must be closed first.
+ *
+ * @param bus The pointer to the TCanBus to be closed.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanBusClose(TCanBus *bus);
+
+/**
+ * Like TCanOpen(), but the TCan uses the socket of the bus instead of opening its own.
+ * TCanClose() detaches the node from the bus. All the other TCan functions work as usual.
+ * On failure the node is left detached and must not be closed.
+ *
+ * @param can The pointer to the TCan to be opened.
+ * @param bus The pointer to an opened TCanBus.
+ * @param canid The ID of the CAN node in the bus.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanOpenOnBus(TCan *can, TCanBus *bus, int canid);
+
+/**
+ * Detaches the node from the bus. Called by TCanClose().
+ *
+ * @param bus The pointer to the TCanBus.
+ * @param can The pointer to the TCan to be detached.
+ */
+void TCanBusDetach(TCanBus *bus, TCan *can);
+
+/**
+ * Sets the kernel filters of the bus socket to the union of the filters and error masks
+ * of all the attached nodes. Called by setFilters() and setErrorMask() of the nodes.
+ *
+ * @param bus The pointer to the TCanBus.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanBusUpdateFilters(TCanBus *bus);
+
+/**
+ * Sets the kernel timestamping of the bus socket, see setTimestamping(). The mode applies
+ * to all the nodes of the bus.
+ *
+ * @param bus The pointer to an opened TCanBus.
+ * @param mode The enum CanTimestamp mode.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanBusSetTimestamping(TCanBus *bus, int mode);
+
+/**
+ * Starts an I/O thread that waits on the socket with epoll and dispatches the frames to
+ * the queues of the nodes as they arrive. If the thread stops on a receive error, the
+ * nodes waiting for frames return an error, and so do all receives until the thread is
+ * started again.
+ *
+ * @param bus The pointer to an opened TCanBus.
+ * @param cpu The CPU the thread is pinned to, -1 for any.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanBusStart(TCanBus *bus, int cpu);
+
+/**
+ * Stops the I/O thread. Nodes waiting for a frame return an error.
+ *
+ * @param bus The pointer to the TCanBus.
+ */
+void TCanBusStop(TCanBus *bus);
+
+/**
+ * Reads the frames available on the socket (at least one, at most CAN_BATCH) with one
+ * system call and puts each in the queue of the node it belongs to. Error frames are
+ * queued to all the nodes. Nodes with a monitor (see startMonitor()) see the frames
+ * first, without the lock held, so a fault is reacted to by the I/O thread.
+ *
+ * @param bus The pointer to the TCanBus.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanBusDispatch(TCanBus *bus);
+
+/**
+ * Returns the next frame of the given node. Frames are dispatched from the socket, or by
+ * the I/O thread when it runs, until one is available for the node or the deadline passes.
+ *
+ * @param bus The pointer to the TCanBus.
+ * @param id The node id.
+ * @param frame The frame pointer where the received message is written.
+ * @param deadline The deadline in timeNow() time, 0 waits forever.
+ * @return 0 on success, CAN_TIMEOUT if the deadline passed, <0 otherwise.
+ */
+int TCanBusReceive(TCanBus *bus, unsigned int id, struct can_frame *frame, long long deadline);
+
+#endif /* ELMO_CANBUS_H */
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "canbus.h"
+#include "capture.h"
+
+/**
+ * Default number of frames of an imported capture.
+ */
+#define CANTRACE_CAPACITY (1 << 20)
+
+static int directionsOf(const char *name)
+{
+	return !strcmp(name, "rx") ? CAPTURE_RX : !strcmp(name, "tx") ? CAPTURE_TX :
+	       CAPTURE_RX | CAPTURE_TX;
+}
+
+static int exportCapture(const char *path, const char *iface, int directions)
+{
+	TCapture cap;
+	long count;
+
+	if (openCapture(&cap, path) < 0) {
+		fprintf(stderr, "Could not open the capture %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	count = exportCandump(&cap, stdout, iface, directions);
+	closeCapture(&cap);
+	fprintf(stderr, "%ld frames\n", count);
+	return count < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int importCapture(const char *log, const char *path, unsigned int capacity)
+{
+	TCapture cap;
+	FILE *in;
+	long count;
+
+	if (!(in = fopen(log, "r"))) {
+		perror("fopen");
+		return EXIT_FAILURE;
+	}
+
+	if (createCapture(&cap, path, capacity) < 0) {
+		fprintf(stderr, "Could not create the capture %s\n", path);
+		fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	count = importCandump(&cap, in);
+	fclose(in);
+	closeCapture(&cap);
+	if (count < 0) {
+		fprintf(stderr, "%s:%ld: not a candump log line\n", log, -count);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%ld frames\n", count);
+	return EXIT_SUCCESS;
+}
+
+static int replay(const char *path, const char *iface, double speed, int directions)
+{
+	TCapture cap;
+	TCanBus *bus;
+	TReplayStats stats;
+	int rval;
+
+	if (openCapture(&cap, path) < 0) {
+		fprintf(stderr, "Could not open the capture %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	/* A bus without nodes receives nothing: the socket only sends. */
+	if (!(bus = TCanBusConstruct(iface)) || TCanBusOpen(bus) < 0) {
+		fprintf(stderr, "Could not open %s\n", iface);
+		closeCapture(&cap);
+		return EXIT_FAILURE;
+	}
+
+	rval = replayCapture(&cap, bus->socket, speed, directions, &stats);
+	printf("%lu frames in %.3f s, %.0f frames/s\n", stats.frames, stats.elapsed / 1e9,
+	       stats.frames / (stats.elapsed / 1e9));
+	if (speed > 0) {
+		printHistogram(&stats.late, "late_us", stdout);
+	}
+
+	TCanBusClose(bus);
+	TCanBusDestruct(bus);
+	closeCapture(&cap);
+	return rval < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Converts and replays the frame captures of enableCapture().
+ *
+ * Usage:
+ *   cantrace export file [interface] [rx|tx|all]
+ *     Writes the captured frames as a candump log to the standard output.
+ *   cantrace import log file [frames]
+ *     Creates a capture of the given number of frames from a candump log.
+ *   cantrace replay file interface [speed] [rx|tx|all]
+ *     Sends the captured frames to a CAN interface (such as vcan0) at the recorded
+ *     times scaled by 1 / speed, or as fast as possible with speed 0.
+ */
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : "";
+
+	if (!strcmp(mode, "export") && argc > 2) {
+		return exportCapture(argv[2], argc > 3 ? argv[3] : "can0",
+				     directionsOf(argc > 4 ? argv[4] : "all"));
+	}
+
+	if (!strcmp(mode, "import") && argc > 3) {
+		return importCapture(argv[2], argv[3],
+				     argc > 4 ? (unsigned int)atoi(argv[4]) : CANTRACE_CAPACITY);
+	}
+
+	if (!strcmp(mode, "replay") && argc > 3) {
+		return replay(argv[2], argv[3], argc > 4 ? atof(argv[4]) : 1.0,
+			      directionsOf(argc > 5 ? argv[5] : "all"));
+	}
+
+	fprintf(stderr, "Usage: cantrace export|import|replay ...\n");
+	return EXIT_FAILURE;
+}
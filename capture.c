@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "capture.h"
+
+int createCapture(TCapture *cap, const char *path, unsigned int capacity)
+{
+	return createRing(&cap->ring, path, CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(TCaptureRecord),
+			  capacity);
+}
+
+int openCapture(TCapture *cap, const char *path)
+{
+	return openRing(&cap->ring, path, CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(TCaptureRecord));
+}
+
+int closeCapture(TCapture *cap)
+{
+	return closeRing(&cap->ring);
+}
+
+void enableCapture(TCan *can, TCapture *cap)
+{
+	can->capture = cap;
+}
+
+void disableCapture(TCan *can)
+{
+	can->capture = NULL;
+}
+
+/* Writes record number index, claimed with ringClaim(). */
+static void writeRecord(TCapture *cap, unsigned long long index, long long time,
+			unsigned int node, const struct can_frame *frame, int direction)
+{
+	TCaptureRecord *slot = (TCaptureRecord *)ringBegin(&cap->ring, index);
+
+	if (!slot) {
+		return;
+	}
+	slot->time = time;
+	slot->id = frame->can_id;
+	slot->dlc = frame->can_dlc;
+	slot->direction = (unsigned char)direction;
+	slot->node = (unsigned short)node;
+	memcpy(slot->data, frame->data, 8);
+	ringCommit(slot, index);
+}
+
+void captureFrames(TCapture *cap, unsigned int node, const struct can_frame *frame, int count,
+		   int direction)
+{
+	unsigned long long index = ringClaim(&cap->ring, count);
+	long long now = timeNow();
+	int i;
+
+	for (i = 0; i < count; i++) {
+		writeRecord(cap, index + i, now, node, &frame[i], direction);
+	}
+}
+
+unsigned long long captureHead(const TCapture *cap)
+{
+	return ringHead(&cap->ring);
+}
+
+unsigned long long captureTail(const TCapture *cap)
+{
+	return ringTail(&cap->ring);
+}
+
+int readCapture(TCapture *cap, unsigned long long *cursor, TCaptureRecord *record, int max)
+{
+	return readRing(&cap->ring, cursor, record, max);
+}
+
+long exportCandump(TCapture *cap, FILE *out, const char *iface, int directions)
+{
+	const TRingHeader *header = cap->ring.header;
+	TCaptureRecord record[CAN_BATCH];
+	unsigned long long cursor = captureTail(cap);
+	unsigned long long end = captureHead(cap);
+	long long wall;
+	long written = 0;
+	int count, i, j;
+
+	while (cursor < end && (count = readCapture(cap, &cursor, record, CAN_BATCH)) > 0) {
+		for (i = 0; i < count; i++) {
+			if (!(record[i].direction & directions)) {
+				continue;
+			}
+
+			wall = header->created + (record[i].time - header->epoch);
+			fprintf(out, "(%lld.%06lld) %s ", wall / 1000000000LL, wall % 1000000000LL / 1000,
+				iface);
+			if (record[i].id & CAN_ERR_FLAG) {
+				fprintf(out, "%08X#", record[i].id & (CAN_ERR_MASK | CAN_ERR_FLAG));
+			} else if (record[i].id & CAN_EFF_FLAG) {
+				fprintf(out, "%08X#", record[i].id & CAN_EFF_MASK);
+			} else {
+				fprintf(out, "%03X#", record[i].id & CAN_SFF_MASK);
+			}
+
+			if (record[i].id & CAN_RTR_FLAG) {
+				fputc('R', out);
+			} else {
+				for (j = 0; j < record[i].dlc && j < 8; j++) {
+					fprintf(out, "%02X", record[i].data[j]);
+				}
+			}
+			fprintf(out, " %c\n", record[i].direction == CAPTURE_TX ? 'T' : 'R');
+			written++;
+		}
+	}
+	return ferror(out) ? -1 : written;
+}
+
+/*
+ * Parses the frame of a candump log line, "123#0102", "12345678#", "123#R" or "123#R4".
+ * Eight id digits are an extended frame, or an error frame with CAN_ERR_FLAG.
+ */
+static int parseFrame(const char *text, struct can_frame *frame)
+{
+	const char *hash = strchr(text, '#');
+	char *end;
+	unsigned long id;
+	int digits, hi, lo;
+
+	if (!hash) {
+		return -1;
+	}
+	if ((digits = (int)(hash - text)) != 3 && digits != 8) {
+		return -1;
+	}
+
+	memset(frame, 0, sizeof(*frame));
+	id = strtoul(text, &end, 16);
+	if (end != hash) {
+		return -1;
+	}
+	frame->can_id = (canid_t)id;
+	if (digits == 8 && !(id & CAN_ERR_FLAG)) {
+		frame->can_id |= CAN_EFF_FLAG;
+	}
+
+	text = hash + 1;
+	if (*text == 'R') {
+		frame->can_id |= CAN_RTR_FLAG;
+		frame->can_dlc = text[1] >= '0' && text[1] <= '8' ? text[1] - '0' : 0;
+		return 0;
+	}
+
+	while (*text && frame->can_dlc < 8) {
+		if (*text == '.') {
+			text++;
+			continue;
+		}
+		if (sscanf(text, "%1x%1x", &hi, &lo) != 2) {
+			return -1;
+		}
+		frame->data[frame->can_dlc++] = (unsigned char)(hi << 4 | lo);
+		text += 2;
+	}
+	return *text ? -1 : 0;
+}
+
+long importCandump(TCapture *cap, FILE *in)
+{
+	TRingHeader *header = cap->ring.header;
+	char line[CAPTURE_LINE];
+	char iface[32], text[64], direction[4], fraction[10];
+	struct can_frame frame;
+	long long sec, wall;
+	unsigned long long index;
+	long count = 0;
+	long n = 0;
+	int fields, digits, i;
+
+	if (!cap->ring.writable) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		n++;
+		if (line[0] == '\n' || line[0] == '#') {
+			continue;
+		}
+
+		direction[0] = 'R';
+		fields = sscanf(line, "(%lld.%9[0-9]) %31s %63s %3s", &sec, fraction, iface, text,
+				direction);
+		if (fields < 4 || parseFrame(text, &frame) < 0) {
+			return -n;
+		}
+
+		/* candump writes microseconds, but any number of fraction digits is taken. */
+		digits = (int)strlen(fraction);
+		for (wall = sec, i = 0; i < 9; i++) {
+			wall = wall * 10 + (i < digits ? fraction[i] - '0' : 0);
+		}
+
+		/* The first frame of an empty capture sets the wall clock time of its epoch. */
+		if (captureHead(cap) == 0 && count == 0) {
+			header->created = wall;
+		}
+
+		index = ringClaim(&cap->ring, 1);
+		writeRecord(cap, index, header->epoch + (wall - header->created), 0, &frame,
+			    direction[0] == 'T' ? CAPTURE_TX : CAPTURE_RX);
+		count++;
+	}
+	return count;
+}
+
+int replayCapture(TCapture *cap, int socket, double speed, int directions, TReplayStats *stats)
+{
+	TCaptureRecord record[CAN_BATCH];
+	struct can_frame frame[CAN_BATCH];
+	struct timespec wait;
+	unsigned long long cursor = captureTail(cap);
+	unsigned long long end = captureHead(cap);
+	long long start = timeNow();
+	long long first = 0;
+	long long due, now;
+	int pending = 0;
+	int count, i;
+
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+	}
+
+	while (cursor < end && (count = readCapture(cap, &cursor, record, CAN_BATCH)) > 0) {
+		for (i = 0; i < count; i++) {
+			if (!(record[i].direction & directions)) {
+				continue;
+			}
+			if (!first) {
+				first = record[i].time;
+			}
+
+			/* Frames that are due go out together, then we sleep until the next one. */
+			if (speed > 0) {
+				due = start + (long long)((record[i].time - first) / speed);
+				if ((now = timeNow()) < due) {
+					if (pending && writeFrames(socket, frame, pending) < 0) {
+						return -1;
+					}
+					pending = 0;
+					wait.tv_sec = due / 1000000000LL;
+					wait.tv_nsec = due % 1000000000LL;
+					clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wait, NULL);
+					now = timeNow();
+				}
+				if (stats) {
+					histogramAdd(&stats->late, (long)((now - due) / 1000));
+				}
+			}
+
+			frame[pending].can_id = record[i].id;
+			frame[pending].can_dlc = record[i].dlc;
+			memcpy(frame[pending].data, record[i].data, 8);
+			if (++pending == CAN_BATCH) {
+				if (writeFrames(socket, frame, pending) < 0) {
+					return -1;
+				}
+				pending = 0;
+			}
+			if (stats) {
+				stats->frames++;
+			}
+		}
+	}
+
+	if (pending && writeFrames(socket, frame, pending) < 0) {
+		return -1;
+	}
+	if (stats) {
+		stats->elapsed = timeNow() - start;
+	}
+	return 0;
+}
+
+int replayConnect(TCan *can, int id)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	can->id = id;
+	can->socket = sv[0];
+	can->filter[0].can_id = 0;
+	can->filter[0].can_mask = 0;
+	can->filters = 1;
+	return sv[1];
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_CAPTURE_H
+#define ELMO_CAPTURE_H
+
+#include <stddef.h>
+
+#include "can.h"
+#include "histogram.h"
+#include "recordring.h"
+
+/** Magic and version at the start of a capture file */
+#define CAPTURE_MAGIC "ELMOCAP"
+#define CAPTURE_VERSION 1
+
+/** Longest line of a candump log accepted by importCandump() */
+#define CAPTURE_LINE 128
+
+/**
+ * Directions of the captured frames, also used as bit masks to select them.
+ */
+enum CaptureDirection
+{
+	CAPTURE_RX = 1,           /** received by the library */
+	CAPTURE_TX = 2            /** sent by the library */
+};
+
+/**
+ * One captured frame. It starts with the fields of a TRingRecord.
+ */
+typedef struct {
+	unsigned long long seq;   /** sequence number of the slot */
+	long long time;           /** timeNow() when the frame was sent or received */
+	unsigned int id;          /** can_id with the EFF, RTR and ERR flags */
+	unsigned char dlc;        /** data length */
+	unsigned char direction;  /** enum CaptureDirection */
+	unsigned short node;      /** node id of the TCan, 0 if imported */
+	unsigned char data[8];    /** the data */
+} TCaptureRecord;
+
+/**
+ * A capture of the frames sent and received by one or more TCans: a TRecordRing of the
+ * latest frames, written lock-free without system calls so that it can stay on in
+ * production. Readers in other processes can open the file at any time. The created and
+ * epoch of the header convert the times of the records to wall clock time.
+ */
+typedef struct TCapture {
+	TRecordRing ring;         /** the ring; ring.lost counts the records a reader skipped */
+} TCapture;
+
+/**
+ * Outcome of a replay.
+ */
+typedef struct {
+	unsigned long frames;     /** frames sent */
+	long long elapsed;        /** time the replay took in nanoseconds */
+	THistogram late;          /** lateness of the frames against the recorded times, in us */
+} TReplayStats;
+
+/**
+ * Creates a capture file and maps it for writing, faulting in all the pages.
+ *
+ * @param cap The capture.
+ * @param path The path of the file, replaced if it exists.
+ * @param capacity The number of frames kept, a power of two.
+ * @return 0 on success, <0 otherwise.
+ */
+int createCapture(TCapture *cap, const char *path, unsigned int capacity);
+
+/**
+ * Maps a capture file for reading. It can be written by another process at the same time.
+ *
+ * @param cap The capture.
+ * @param path The path of the file.
+ * @return 0 on success, -1 if the file cannot be mapped, -2 if it is not a valid capture.
+ */
+int openCapture(TCapture *cap, const char *path);
+
+/**
+ * Unmaps and closes a capture file. The TCans capturing to it must be disabled first.
+ *
+ * @param cap The capture.
+ * @return 0 on success, <0 otherwise.
+ */
+int closeCapture(TCapture *cap);
+
+/**
+ * Starts capturing every frame the TCan sends and every frame it receives. Several TCans,
+ * also on different threads, can capture to the same file.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cap A capture created by createCapture().
+ */
+void enableCapture(TCan *can, TCapture *cap);
+
+/**
+ * Stops capturing the frames of the TCan.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void disableCapture(TCan *can);
+
+/**
+ * Appends frames to a capture. Called by the send and receive functions of can.c.
+ *
+ * @param cap The capture.
+ * @param node The node id.
+ * @param frame The frames.
+ * @param count The number of frames.
+ * @param direction The enum CaptureDirection.
+ */
+void captureFrames(TCapture *cap, unsigned int node, const struct can_frame *frame, int count,
+		   int direction);
+
+/**
+ * Returns the index of the oldest record still in the capture.
+ *
+ * @param cap The capture.
+ * @return The index.
+ */
+unsigned long long captureTail(const TCapture *cap);
+
+/**
+ * Returns the index of the next record to be written.
+ *
+ * @param cap The capture.
+ * @return The index.
+ */
+unsigned long long captureHead(const TCapture *cap);
+
+/**
+ * Copies the records from the cursor on, like readLog().
+ *
+ * @param cap The capture.
+ * @param cursor The index of the next record to read.
+ * @param record The array the records are copied to.
+ * @param max The size of the array.
+ * @return The number of records copied.
+ */
+int readCapture(TCapture *cap, unsigned long long *cursor, TCaptureRecord *record, int max);
+
+/**
+ * Writes the records in the capture as a candump log, "(seconds) iface id#data" per
+ * frame, which canplayer and the other can-utils read.
+ *
+ * @param cap The capture.
+ * @param out The stream.
+ * @param iface The interface name written on each line.
+ * @param directions The enum CaptureDirection bits of the frames written.
+ * @return The number of frames written, <0 on errors.
+ */
+long exportCandump(TCapture *cap, FILE *out, const char *iface, int directions);
+
+/**
+ * Appends the frames of a candump log to a created capture, keeping their times. Frames
+ * followed by " T" are imported as sent, all the others as received.
+ *
+ * @param cap A capture created by createCapture().
+ * @param in The stream.
+ * @return The number of frames imported, or -line of the first line that is not valid.
+ */
+long importCandump(TCapture *cap, FILE *in);
+
+/**
+ * Sends the captured frames to a socket, oldest first: at the recorded times scaled by
+ * 1 / speed, or as fast as the socket takes them with speed 0.
+ *
+ * @param cap The capture.
+ * @param socket A CAN socket (see TCanBusOpen()) or the end of a socketpair given by
+ *               replayConnect().
+ * @param speed The replay speed, 1.0 for the recorded speed, 0 for as fast as possible.
+ * @param directions The enum CaptureDirection bits of the frames sent.
+ * @param stats The outcome of the replay, or NULL.
+ * @return 0 on success, <0 otherwise.
+ */
+int replayCapture(TCapture *cap, int socket, double speed, int directions, TReplayStats *stats);
+
+/**
+ * Connects a TCan to a socketpair instead of TCanOpen(), so that the frames replayed to
+ * the returned socket are received by the library as if they came from the bus. The
+ * frames the TCan sends can be read from the returned socket.
+ *
+ * @param can The pointer to a constructed TCan.
+ * @param id The node id.
+ * @return The socket to replay to, <0 on errors.
+ */
+int replayConnect(TCan *can, int id);
+
+#endif /* ELMO_CAPTURE_H */
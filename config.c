@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+#include "elmo.h"
+
+const TConfigParameter configParameters[CONFIG_PARAMETERS] = {
+	{ ELMO_CMD(AC), 0 },
+	{ ELMO_CMD(DC), 0 },
+	{ ELMO_CMD(SD), 0 },
+	{ ELMO_CMD(SP), 0 },
+	{ ELMO_CMD(MP4), 0 },
+	{ ELMO_CMD(VL2), 0 },
+	{ ELMO_CMD(VH2), 0 },
+	{ ELMO_CMD(LL2), CONFIG_MOTOR_OFF | CONFIG_POSITION_MODE },
+	{ ELMO_CMD(HL2), CONFIG_MOTOR_OFF | CONFIG_POSITION_MODE },
+	{ ELMO_CMD(CL1), CONFIG_MOTOR_OFF },
+	{ ELMO_CMD(PL1), CONFIG_MOTOR_OFF },
+	{ ELMO_CMD(UM), CONFIG_MOTOR_OFF },
+};
+
+/* Index of UM in configParameters */
+#define CONFIG_UM (CONFIG_PARAMETERS - 1)
+
+int captureConfig(TCan *can, TDriveConfig *cfg)
+{
+	const TElmoCommand *cmd[CONFIG_PARAMETERS];
+	int rval;
+	int i;
+
+	for (i = 0; i < CONFIG_PARAMETERS; i++) {
+		cmd[i] = configParameters[i].cmd;
+	}
+
+	memset(cfg, 0, sizeof(*cfg));
+	if ((rval = elmoReadParameters(can, cmd, CONFIG_PARAMETERS, cfg->value)) < 0) {
+		return rval;
+	}
+
+	memset(cfg->valid, 1, sizeof(cfg->valid));
+	return 0;
+}
+
+static void printValue(const TConfigParameter *param, const TElmoValue *value, FILE *out)
+{
+	if (param->cmd->type == ELMO_FLOAT) {
+		fprintf(out, "%.9g", value->f); /* enough digits to read back the same float */
+	} else {
+		fprintf(out, "%d", value->i);
+	}
+}
+
+int saveConfig(const TDriveConfig *cfg, FILE *out)
+{
+	char name[16];
+	int i;
+
+	for (i = 0; i < CONFIG_PARAMETERS; i++) {
+		if (!cfg->valid[i]) {
+			continue;
+		}
+		fprintf(out, "%s ", elmoCommandName(configParameters[i].cmd, name, sizeof(name)));
+		printValue(&configParameters[i], &cfg->value[i], out);
+		fputc('\n', out);
+	}
+	return ferror(out) ? -1 : 0;
+}
+
+int loadConfig(TDriveConfig *cfg, FILE *in)
+{
+	char line[128], key[16], value[64], name[16];
+	char *end;
+	int fields;
+	int n = 0;
+	int i;
+
+	memset(cfg, 0, sizeof(*cfg));
+	while (fgets(line, sizeof(line), in)) {
+		n++;
+		fields = sscanf(line, "%15s %63s", key, value);
+		if (fields < 1 || key[0] == '#') {
+			continue; /* blank or comment line */
+		}
+		if (fields != 2) {
+			return -n;
+		}
+
+		for (i = 0; i < CONFIG_PARAMETERS; i++) {
+			if (!strcmp(key, elmoCommandName(configParameters[i].cmd, name, sizeof(name)))) {
+				break;
+			}
+		}
+		if (i == CONFIG_PARAMETERS) {
+			return -n;
+		}
+
+		if (configParameters[i].cmd->type == ELMO_FLOAT) {
+			cfg->value[i].f = strtof(value, &end);
+		} else {
+			cfg->value[i].i = (int)strtol(value, &end, 0);
+		}
+		if (end == value || *end) {
+			return -n;
+		}
+		cfg->valid[i] = 1;
+	}
+	return ferror(in) ? -1 : 0;
+}
+
+int diffConfig(const TDriveConfig *cfg, const TDriveConfig *live, int *changed)
+{
+	int n = 0;
+	int i;
+
+	/* The values are compared bit by bit: a float reads back exactly as it was written. */
+	for (i = 0; i < CONFIG_PARAMETERS; i++) {
+		if (cfg->valid[i] &&
+		    (!live->valid[i] || memcmp(&cfg->value[i], &live->value[i], sizeof(TElmoValue)))) {
+			if (changed) {
+				changed[n] = i;
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+void printConfigDiff(const TDriveConfig *cfg, const TDriveConfig *live, FILE *out)
+{
+	int changed[CONFIG_PARAMETERS];
+	char name[16];
+	int n = diffConfig(cfg, live, changed);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fprintf(out, "%s ", elmoCommandName(configParameters[changed[i]].cmd, name, sizeof(name)));
+		if (live->valid[changed[i]]) {
+			printValue(&configParameters[changed[i]], &live->value[changed[i]], out);
+		} else {
+			fputc('-', out);
+		}
+		fprintf(out, " -> ");
+		printValue(&configParameters[changed[i]], &cfg->value[changed[i]], out);
+		fputc('\n', out);
+	}
+}
+
+/*
+ * Writes the changed parameters with or without CONFIG_MOTOR_OFF, pipelined. With um set,
+ * UM is written last even if it did not change, to undo a switch to position mode.
+ */
+static int writeChanged(TCan *can, const TDriveConfig *cfg, const int *changed, int n,
+			int flags, int um)
+{
+	const TElmoCommand *cmd[CONFIG_PARAMETERS];
+	TElmoValue value[CONFIG_PARAMETERS];
+	int count = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((configParameters[changed[i]].flags & CONFIG_MOTOR_OFF) == flags &&
+		    !(um && changed[i] == CONFIG_UM)) {
+			cmd[count] = configParameters[changed[i]].cmd;
+			value[count++] = cfg->value[changed[i]];
+		}
+	}
+
+	if (um) {
+		cmd[count] = ELMO_CMD(UM);
+		value[count++].i = um;
+	}
+
+	return count ? elmoWriteParameters(can, cmd, count, value) : 0;
+}
+
+int restoreConfig(TCan *can, const TDriveConfig *cfg)
+{
+	TDriveConfig live;
+	int changed[CONFIG_PARAMETERS];
+	int off = 0, position = 0, um = 0;
+	int on = 0;
+	int rval;
+	int n, i;
+
+	if ((rval = captureConfig(can, &live)) < 0) {
+		return rval;
+	}
+
+	if ((n = diffConfig(cfg, &live, changed)) == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		off |= configParameters[changed[i]].flags & CONFIG_MOTOR_OFF;
+		position |= configParameters[changed[i]].flags & CONFIG_POSITION_MODE;
+	}
+
+	invalidateCache(can);
+	if ((rval = writeChanged(can, cfg, changed, n, 0, 0)) < 0) {
+		return rval;
+	}
+
+	if (!off) {
+		return n;
+	}
+
+	/* The one window with the motor off. */
+	if ((rval = getMotorOn(can, &on)) < 0 || (on && (rval = stopMotor(can)) < 0)) {
+		return rval;
+	}
+
+	if (position && live.value[CONFIG_UM].i != MODE_POS) {
+		if ((rval = elmoSetInt(can, ELMO_CMD(UM), MODE_POS)) < 0) {
+			return rval;
+		}
+		um = cfg->valid[CONFIG_UM] ? cfg->value[CONFIG_UM].i : live.value[CONFIG_UM].i;
+	}
+
+	if ((rval = writeChanged(can, cfg, changed, n, CONFIG_MOTOR_OFF, um)) < 0) {
+		return rval;
+	}
+
+	invalidateCache(can);
+	if (on && (rval = startMotor(can)) < 0) {
+		return rval;
+	}
+	return n;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_CONFIG_H
+#define ELMO_CONFIG_H
+
+#include <stdio.h>
+
+#include "elmocmd.h"
+
+/** Number of parameters of a drive configuration */
+#define CONFIG_PARAMETERS 12
+
+/**
+ * Conditions for writing a configuration parameter.
+ */
+enum ConfigFlag
+{
+	CONFIG_MOTOR_OFF = 1,     /** only with the motor off */
+	CONFIG_POSITION_MODE = 2  /** only in position mode (UM=5) */
+};
+
+/**
+ * A parameter of the drive configuration.
+ */
+typedef struct {
+	const TElmoCommand *cmd;  /** the command */
+	int flags;                /** enum ConfigFlag bits */
+} TConfigParameter;
+
+/** The parameters of a configuration, in the order they are written (UM last) */
+extern const TConfigParameter configParameters[CONFIG_PARAMETERS];
+
+/**
+ * The configuration of a drive. A configuration loaded from a file may set only some of
+ * the parameters, the others are left as they are by restoreConfig().
+ */
+typedef struct {
+	TElmoValue value[CONFIG_PARAMETERS];      /** values by configParameters index */
+	unsigned char valid[CONFIG_PARAMETERS];   /** nonzero for the parameters set */
+} TDriveConfig;
+
+/**
+ * Reads all the parameters of the configuration from the drive, pipelined.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cfg The configuration the values are written to.
+ * @return 0 on success, <0 otherwise.
+ */
+int captureConfig(TCan *can, TDriveConfig *cfg);
+
+/**
+ * Writes the parameters set in a configuration as text, one "name value" line each,
+ * e.g. "VL[2] -100000".
+ *
+ * @param cfg The configuration.
+ * @param out The stream.
+ * @return 0 on success, <0 otherwise.
+ */
+int saveConfig(const TDriveConfig *cfg, FILE *out);
+
+/**
+ * Reads a configuration written by saveConfig(). Empty lines and lines starting with '#'
+ * are skipped.
+ *
+ * @param cfg The configuration, only the parameters in the file are set.
+ * @param in The stream.
+ * @return 0 on success, -n if line n is invalid.
+ */
+int loadConfig(TDriveConfig *cfg, FILE *in);
+
+/**
+ * Compares a configuration to another, typically captured from the live drive.
+ *
+ * @param cfg The configuration.
+ * @param live The configuration it is compared to.
+ * @param changed The array where the indexes of the differing parameters are written,
+ *        CONFIG_PARAMETERS long, or NULL.
+ * @return The number of parameters set in cfg whose values differ in live.
+ */
+int diffConfig(const TDriveConfig *cfg, const TDriveConfig *live, int *changed);
+
+/**
+ * Prints the parameters that differ as "name live -> cfg" lines.
+ *
+ * @param cfg The configuration.
+ * @param live The configuration it is compared to.
+ * @param out The stream.
+ */
+void printConfigDiff(const TDriveConfig *cfg, const TDriveConfig *live, FILE *out);
+
+/**
+ * Brings the drive to the configuration writing only the parameters that differ. The
+ * ones allowed with the motor on are written first, pipelined. If any parameter needs
+ * the motor off, the motor is turned off once, those parameters are written pipelined
+ * and the motor is turned back on if it was on. The state cache is invalidated.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cfg The configuration.
+ * @return The number of parameters written, <0 on errors.
+ */
+int restoreConfig(TCan *can, const TDriveConfig *cfg);
+
+#endif /* ELMO_CONFIG_H */
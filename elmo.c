@@ -15,17 +15,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "elmo.h"
+#include "elmocmd.h"
 
 int sendEchoMessage(TCan *can)
 {
 	struct can_frame frame;
 	unsigned char data[8] = { 0x53, 0x4e, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 };
 	
-	if (sendPDO2(can, 4, data) < 0) {
-		return -1;
-	}
-
-	if (receivePDO2(can, &frame) < 0) {
+	if (transact(can, 4, data, &frame) < 0) {
 		return -2;
 	}
 
@@ -46,7 +43,6 @@ int sendEchoMessage(TCan *can)
 int setPosition(TCan *can, int pos)
 {
 	int rval;
-	stopMotor(can); /* The motor must be stopped before any changes in the unit mode can be made. */ 
 	rval = setUnitMode(can, MODE_POS);
 	rval |= startMotor(can);
 	rval |= setAbsolutePosition(can, pos);
@@ -56,25 +52,22 @@ int setPosition(TCan *can, int pos)
 
 int getPosition(TCan *can, int *pos)
 {
-	struct can_frame frame;
-	unsigned char data[8] = { 0x50, 0x58, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* PX */
-	
-	if (sendPDO2(can, 4, data) < 0) {
-		return -1;
-	}
+	int rval;
 
-	if (receivePDO2(can, &frame)) {
-		return -2;
+	if ((rval = elmoGetInt(can, ELMO_CMD(PX), pos)) < 0) {
+		return rval == CAN_TIMEOUT ? rval : -2;
 	}
-
-	*pos = intFromData(frame.data);
 	return 0;
 }
 
+int getPositionAsync(TCan *can, TElmoRequest *req)
+{
+	return elmoSendGet(can, ELMO_CMD(PX), req);
+}
+
 int setForce(TCan *can, float force)
 {
 	int rval;
-	stopMotor(can); /* The motor must be stopped before any changes in the unit mode can be made. */ 
 	rval = setUnitMode(can, MODE_TORQUE);
 	rval |= startMotor(can);
 	rval |= setTorque(can, force);
@@ -83,124 +76,256 @@ int setForce(TCan *can, float force)
 
 int getForce(TCan *can, float *pos)
 {
-	struct can_frame frame;
-	unsigned char data[8] = { 0x49, 0x51, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* IQ */
-	
-	if (sendPDO2(can, 4, data)) {
-		return -1;
+	int rval;
+
+	if ((rval = elmoGetFloat(can, ELMO_CMD(IQ), pos)) < 0) {
+		return rval == CAN_TIMEOUT ? rval : -1;
 	}
+	return 0;
+}
 
-	if (receivePDO2(can, &frame)) {
-		return -1;
+int getForceAsync(TCan *can, TElmoRequest *req)
+{
+	return elmoSendGet(can, ELMO_CMD(IQ), req);
+}
+
+int getMotorOn(TCan *can, int *on)
+{
+	int rval;
+
+	if ((rval = elmoGetInt(can, ELMO_CMD(MO), on)) < 0) {
+		return rval == CAN_TIMEOUT ? rval : -1;
 	}
 
-	*pos = floatFromData(frame.data);
+	can->cache.motoron = *on;
+	cacheUpdate(can, CACHE_MOTOR);
 	return 0;
 }
 
+/*
+ * Polls MO until the drive reports the requested state or the deadline of the TCan
+ * passes. Every poll is one bus round trip, so we return as soon as the drive is ready.
+ */
+static int waitMotor(TCan *can, int on, TCanLatency *latency, long long start)
+{
+	long long deadline = start + can->readytimeout * 1000LL;
+	int mo;
+
+	for (;;) {
+		if (getMotorOn(can, &mo) < 0) {
+			return -1;
+		}
+
+		if (mo == on) {
+			addLatency(latency, (timeNow() - start) / 1000);
+			return 0;
+		}
+
+		if (timeNow() >= deadline) {
+			latency->timeouts++;
+			return -2;
+		}
+	}
+}
+
 int startMotor(TCan *can)
 {
-	unsigned char data[8] = { 0x4d, 0x4f, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 }; /* MO=1 */
-	int rval = sendPDO2DiscardReply(can, 8, data);
-	usleep(50 * 1000); /* >10 ms delay required after MO=1 */
-	return rval;
+	long long start = timeNow();
+	int rval;
+
+	if (cacheValid(can, CACHE_MOTOR) && can->cache.motoron == 1) {
+		can->cachehits++;
+		return 0;
+	}
+
+	rval = elmoSetInt(can, ELMO_CMD(MO), 1);
+	if (rval < 0) {
+		return rval;
+	}
+	return waitMotor(can, 1, &can->motoron, start);
 }
 
 int stopMotor(TCan *can)
 {
-	unsigned char data[8] = { 0x4d, 0x4f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* MO=0 */
-	int rval = sendPDO2DiscardReply(can, 8, data);
-	usleep(50 * 1000); /* >10 ms delay required after MO=0 */
-	return rval;
+	long long start = timeNow();
+	int rval;
+
+	if (cacheValid(can, CACHE_MOTOR) && can->cache.motoron == 0) {
+		can->cachehits++;
+		return 0;
+	}
+
+	rval = elmoSetInt(can, ELMO_CMD(MO), 0);
+	if (rval < 0) {
+		return rval;
+	}
+	return waitMotor(can, 0, &can->motoroff, start);
+}
+
+void setReadyTimeout(TCan *can, long timeout)
+{
+	can->readytimeout = timeout;
 }
 
 int beginMotion(TCan *can)
 {
-	unsigned char data[8] = { 0x42, 0x47, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* BG */
-	return sendPDO2DiscardReply(can, 4, data);
+	return elmoExecute(can, ELMO_CMD(BG));
 }
 
 int stop(TCan *can)
 {
-	stopMotor(can);
-	setUnitMode(can, MODE_POS); /* UnitMode must be MODE_POS for ST to work. */
-	unsigned char data[8] = { 0x53, 0x54, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* ST */
-	return sendPDO2DiscardReply(can, 4, data);
+	int rval;
+
+	/* UnitMode must be MODE_POS for ST to work; the motor is stopped first only to change it. */
+	if ((rval = setUnitMode(can, MODE_POS)) < 0 ||
+	    (rval = elmoExecute(can, ELMO_CMD(ST))) < 0) {
+		return rval;
+	}
+	return stopMotor(can);
 }
 
 int setUnitMode(TCan *can, enum Mode mode)
 {
-	stopMotor(can);
-	unsigned char data[8] = { 0x55, 0x4d, 0x00, 0x00, mode, 0x00, 0x00, 0x00 }; /* UM=mode */
-	return sendPDO2DiscardReply(can, 8, data);
+	int rval;
+
+	if (cacheValid(can, CACHE_MODE) && can->cache.unitmode == (int)mode) {
+		can->cachehits++;
+		return 0;
+	}
+
+	stopMotor(can); /* The motor must be stopped before any changes in the unit mode can be made. */
+	if ((rval = elmoSetInt(can, ELMO_CMD(UM), mode)) < 0) {
+		return rval;
+	}
+
+	can->cache.unitmode = mode;
+	cacheUpdate(can, CACHE_MODE);
+	return 0;
 }
 
 int setSpeed(TCan *can, int speed)
 {
-	unsigned char data[8] = { 0x53, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* SP */
-	setDataInt(data, speed);
-	return sendPDO2DiscardReply(can, 8, data);
+	int rval;
+
+	if (cacheValid(can, CACHE_SPEED) && can->cache.speed == speed) {
+		can->cachehits++;
+		return 0;
+	}
+
+	if ((rval = elmoSetInt(can, ELMO_CMD(SP), speed)) < 0) {
+		return rval;
+	}
+
+	can->cache.speed = speed;
+	cacheUpdate(can, CACHE_SPEED);
+	return 0;
 }
 
 int setAbsolutePosition(TCan *can, int pos)
 {
-	unsigned char data[8] = { 0x50, 0x41, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* PA */
-	setDataInt(data, pos);
-	return sendPDO2DiscardReply(can, 8, data);
+	return elmoSetInt(can, ELMO_CMD(PA), pos);
 }
 
 int setRelativePosition(TCan *can, int pos)
 {
-	unsigned char data[8] = { 0x50, 0x52, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* PR */
-	setDataInt(data, pos);
-	return sendPDO2DiscardReply(can, 8, data);;
+	/* PR adds to the target, so it is ELMO_ONCE: a command whose reply was lost is not repeated. */
+	return elmoSetInt(can, ELMO_CMD(PR), pos);
 }
 
 int setTorque(TCan *can, float torque)
 {
-	unsigned char data[8] = { 0x54, 0x43, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* TC */
-	setDataFloat(data, torque);
-	return sendPDO2DiscardReply(can, 8, data);
+	return elmoSetFloat(can, ELMO_CMD(TC), torque);
 }
 
 int getMaxCurrent(TCan *can, float *current)
 {
-	struct can_frame frame;
-	unsigned char data[8] = { 0x4d, 0x43, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* MC */
 	int rval;
-	
-	rval = sendPDO2(can, 4, data);
-	if (rval < 0) {
-		return rval;
-	}
 
-	rval = receivePDO2(can, &frame);
+	/* MC is a property of the drive, it only changes when the drive is reconfigured. */
+	if (cacheValid(can, CACHE_MAXCURRENT)) {
+		can->cachehits++;
+		*current = can->cache.maxcurrent;
+		return 0;
+	}
+	
+	rval = elmoGetFloat(can, ELMO_CMD(MC), current);
 	if (rval < 0) {
 		return rval;
 	}
 
-	*current = floatFromData(frame.data);
+	can->cache.maxcurrent = *current;
+	cacheUpdate(can, CACHE_MAXCURRENT);
 	return 0;
 }
 
 int setLimits(TCan *can, int vmin, int vmax, int fmin, int fmax)
 {
-	unsigned char data1[8] = { 0x56, 0x4c, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* VL[2] */
-	unsigned char data2[8] = { 0x56, 0x48, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* VH[2] */
-	unsigned char data3[8] = { 0x4c, 0x4c, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* LL[2] */
-	unsigned char data4[8] = { 0x48, 0x4c, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 }; /* HL[2] */
-	
-	setDataInt(data1, vmin);
-	setDataInt(data2, vmax);
-	setDataInt(data3, fmin);
-	setDataInt(data4, fmax);
-
-	stopMotor(can); /* The motor must be stopped before any changes in the unit mode can be made. */ 
-	setUnitMode(can, MODE_POS); /* Again the damn LL and HL commands work only in MODE_POS. */
-	sendPDO2DiscardReply(can, 8, data1);
-	sendPDO2DiscardReply(can, 8, data2);
-	sendPDO2DiscardReply(can, 8, data3);
-	sendPDO2DiscardReply(can, 8, data4);
+	const TElmoCommand *cmd[4] = { ELMO_CMD(VL2), ELMO_CMD(VH2), ELMO_CMD(LL2), ELMO_CMD(HL2) };
+	TElmoValue value[4];
+	TElmoRequest req[4];
+	int changed[4];
+	int known = cacheValid(can, CACHE_LIMITS);
+	int n = 0;
+	int rval;
+	int i;
+
+	value[0].i = vmin;
+	value[1].i = vmax;
+	value[2].i = fmin;
+	value[3].i = fmax;
+
+	for (i = 0; i < 4; i++) {
+		if (!known || can->cache.limits[i] != value[i].i) {
+			changed[n++] = i;
+		}
+	}
+
+	if (n == 0) {
+		can->cachehits++;
+		return 0;
+	}
+
+	/* The damn LL and HL commands work only in MODE_POS, which needs the motor stopped. */
+	if (!known || can->cache.limits[2] != fmin || can->cache.limits[3] != fmax) {
+		if ((rval = stopMotor(can)) < 0 || (rval = setUnitMode(can, MODE_POS)) < 0) {
+			return rval;
+		}
+	}
+
+	/*
+	 * The writes are independent, so they are all put in flight with one system call
+	 * before waiting.
+	 */
+	beginBatch(can);
+	for (i = 0; i < n; i++) {
+		if (elmoSendSet(can, cmd[changed[i]], &value[changed[i]], &req[i]) < 0) {
+			break;
+		}
+	}
+
+	if (i < n) {
+		flushBatch(can);
+		waitAllRequests(can);
+		for (i = 0; i < n; i++) {
+			cancelRequest(can, &req[i]);
+		}
+		return -1;
+	}
+
+	if (flushBatch(can) < 0) {
+		for (i = 0; i < n; i++) {
+			cancelRequest(can, &req[i]);
+		}
+		return -1;
+	}
+
+	if ((rval = waitRequests(can, req, n)) < 0) {
+		return rval;
+	}
+
+	for (i = 0; i < 4; i++) {
+		can->cache.limits[i] = value[i].i;
+	}
+	cacheUpdate(can, CACHE_LIMITS);
 	return 0;
 }
-
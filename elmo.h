@@ -18,6 +18,7 @@
 #define ELMO_H
 
 #include "can.h"
+#include "elmoasync.h"
 
 /**
  * Elmo motor controller command mode (unit mode).
@@ -56,6 +57,16 @@ int setPosition(TCan *can, int pos);
  */
 int getPosition(TCan *can, int *pos);
 
+/**
+ * Requests the absolute position of the motor without waiting for the reply. The position
+ * is requestInt(req) when the request is done.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The request handle.
+ * @return 0 on success, <0 otherwise.
+ */
+int getPositionAsync(TCan *can, TElmoRequest *req);
+
 /**
  * Commands the motor to drive with the given force. beginMotion() must be called afterwards to
  * make the motor begin the motion.
@@ -78,21 +89,53 @@ int setForce(TCan *can, float force);
 int getForce(TCan *can, float *force);
 
 /**
- * Sets the motor in a state in which it can be given motion commands.
+ * Requests the force (in amperes) without waiting for the reply. The force is
+ * requestFloat(req) when the request is done.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The request handle.
+ * @return 0 on success, <0 otherwise.
+ */
+int getForceAsync(TCan *can, TElmoRequest *req);
+
+/**
+ * Sets the motor in a state in which it can be given motion commands. Returns as soon as
+ * the drive reports the motor on, or fails if it does not within the ready timeout. The
+ * latency is recorded in can->motoron. Nothing is sent if the motor is known to be on.
  * 
  * @param can The TCan pointer of the motor controller.
- * @return 0 on success, <0 otherwise. 
+ * @return 0 on success, -2 on timeout, <0 otherwise. 
  */
 int startMotor(TCan *can);
 
 /**
- * Sets the motor in a state in which it can not be given motion commands.
+ * Sets the motor in a state in which it can not be given motion commands. Returns as soon
+ * as the drive reports the motor off, or fails if it does not within the ready timeout.
+ * The latency is recorded in can->motoroff. Nothing is sent if the motor is known to be off.
  * 
  * @param can The TCan pointer of the motor controller.
- * @return 0 on success, <0 otherwise. 
+ * @return 0 on success, -2 on timeout, <0 otherwise. 
  */
 int stopMotor(TCan *can);
 
+/**
+ * Returns whether the motor is on (MO).
+ * 
+ * @param can The TCan pointer of the motor controller.
+ * @param on The pointer where 1 (on) or 0 (off) is stored.
+ * @return 0 on success, <0 otherwise. 
+ */
+int getMotorOn(TCan *can, int *on);
+
+/**
+ * Sets the deadline of startMotor() and stopMotor() for the drive to report the new
+ * state. The default is CAN_READY_TIMEOUT.
+ * 
+ * @param can The TCan pointer of the motor controller.
+ * @param timeout The deadline in microseconds.
+ */
+void setReadyTimeout(TCan *can, long timeout);
+
 /**
  * Commands the motor to begin motion.
  * 
@@ -102,7 +145,7 @@ int stopMotor(TCan *can);
 int beginMotion(TCan *can);
 
 /**
- * Commands the motor to stop.
+ * Commands the motor to stop: ends the motion with ST, then turns the motor off.
  * 
  * @param can The TCan pointer of the motor controller.
  * @return 0 on success, <0 otherwise. 
@@ -112,6 +155,7 @@ int stop(TCan *can);
 /**
  * Sets the unit mode of the motor controller. Roughly speaking the unit mode is MODE_POS
  * when the motor is position commands and MODE_TORQUE if it is given torque commands.
+ * Nothing is sent, and the motor is not stopped, if the cached unit mode is already mode.
  * 
  * @param can The TCan pointer of the motor controller.
  * @param mode The unit mode.
@@ -121,6 +165,7 @@ int setUnitMode(TCan *can, enum Mode mode);
 
 /**
  * Sets the speed which the motor will be trying to run when given a position command.
+ * Nothing is sent if the cached speed is already speed.
  * 
  * @param can The TCan pointer of the motor controller.
  * @param speed The speed
@@ -159,7 +204,7 @@ int setRelativePosition(TCan *can, int pos);
 int setTorque(TCan *can, float torque);
 
 /**
- * Returns the maximum current that can be used with the motor.
+ * Returns the maximum current that can be used with the motor. The value is cached.
  * 
  * @param can The TCan pointer of the motor controller.
  * @param current The pointer where the maximum current value is stored.
@@ -168,7 +213,9 @@ int setTorque(TCan *can, float torque);
 int getMaxCurrent(TCan *can, float *current);
 
 /**
- * Sets the speed limits of the motor and the feedback limits of the encoder.
+ * Sets the speed limits of the motor and the feedback limits of the encoder. The limits
+ * that differ from the cached ones are written pipelined, all four if the cache is not
+ * valid. The motor is stopped and put in MODE_POS only if the feedback limits change.
  * 
  * @param can The TCan pointer of the motor controller.
  * @param vmin The minimum speed of the motor (e.g. the negation of vmax).
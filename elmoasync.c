@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "elmoasync.h"
+#include "trace.h"
+
+/*
+ * The reply echoes the mnemonic (bytes 0-1) and the 14 bit index (byte 2 and the low
+ * bits of byte 3). The two high bits of byte 3 are the float and error flags.
+ */
+static int sameCommand(const unsigned char *a, const unsigned char *b)
+{
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && (a[3] & 0x3f) == (b[3] & 0x3f);
+}
+
+/*
+ * Completes the oldest pending request the reply belongs to. Also registered as the
+ * handler of RPDO2 so that replies received while waiting for something else (an SDO
+ * response, telemetry) are not lost.
+ */
+static void completeReply(TCan *can, struct can_frame *frame, void *arg)
+{
+	TElmoRequest *req;
+	long long replied;
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < can->npending; i++) {
+		if (sameCommand(can->pending[i]->data, frame->data)) {
+			break;
+		}
+	}
+
+	if (i == can->npending) {
+		can->rxunmatched++;
+		return;
+	}
+
+	req = can->pending[i];
+	can->npending--;
+	memmove(&can->pending[i], &can->pending[i + 1], (can->npending - i) * sizeof(req));
+
+	replied = timeNow();
+	addLatency(&can->reply, (long)((replied - req->sent) / 1000));
+	req->rxstamp = can->rxstamp;
+	if (can->trace) {
+		traceRequest(can, req, replied);
+	}
+	req->reply = *frame;
+	req->status = (frame->data[3] & ELMO_REPLY_ERROR) ? -3 : 0;
+	req->done = 1;
+	if (req->callback) {
+		req->callback(can, req, req->arg);
+	}
+}
+
+/*
+ * With timestamping on, the socket receives the commands it sent once they are on the
+ * bus. The timestamp of the echo is the transmit time of the oldest such request.
+ */
+static void confirmRequest(TCan *can, struct can_frame *frame, void *arg)
+{
+	int i;
+
+	(void)arg;
+
+	for (i = 0; i < can->npending; i++) {
+		if (!can->pending[i]->txstamp && sameCommand(can->pending[i]->data, frame->data)) {
+			can->pending[i]->txstamp = can->rxstamp;
+			return;
+		}
+	}
+}
+
+int registerReplies(TCan *can)
+{
+	if (addHandler(can, COBID_RPDO2(can->id), completeReply, NULL) < 0) {
+		return -1;
+	}
+
+	if (can->timestamping && addHandler(can, COBID_TPDO2(can->id), confirmRequest, NULL) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fills in the request. The handlers registered by registerReplies() when the node was
+ * opened complete it.
+ */
+static int prepareRequest(TCan *can, TElmoRequest *req, int size, const unsigned char *data,
+			  TElmoCallback callback, void *arg)
+{
+	if (can->npending >= CAN_MAX_PENDING) {
+		return -1;
+	}
+
+	memcpy(req->data, data, 8);
+	req->size = size;
+	req->done = 0;
+	req->status = 0;
+	req->callback = callback;
+	req->arg = arg;
+	req->txstamp = 0;
+	req->rxstamp = 0;
+	return 0;
+}
+
+int sendRequest(TCan *can, TElmoRequest *req, int size, const unsigned char *data,
+		TElmoCallback callback, void *arg)
+{
+	int rval;
+
+	if ((rval = prepareRequest(can, req, size, data, callback, arg)) < 0) {
+		return rval;
+	}
+
+	req->sent = timeNow();
+	if (sendPDO2(can, size, req->data) < 0) {
+		return -2;
+	}
+
+	can->pending[can->npending++] = req;
+	return 0;
+}
+
+int expectRequest(TCan *can, TElmoRequest *req, int size, const unsigned char *data)
+{
+	int rval;
+
+	if ((rval = prepareRequest(can, req, size, data, NULL, NULL)) < 0) {
+		return rval;
+	}
+
+	req->sent = timeNow();
+	can->pending[can->npending++] = req;
+	return 0;
+}
+
+int receiveReply(TCan *can)
+{
+	return receiveReplyUntil(can, receiveDeadline(can));
+}
+
+int receiveReplyUntil(TCan *can, long long deadline)
+{
+	struct can_frame frame;
+	int rval;
+
+	if ((rval = receiveCobUntil(can, COBID_RPDO2(can->id), &frame, deadline)) < 0) {
+		return rval;
+	}
+
+	completeReply(can, &frame, NULL);
+	return 0;
+}
+
+/*
+ * The deadline is taken once by the caller: unrelated replies arriving now and then must
+ * not extend the wait.
+ */
+static int waitRequestUntil(TCan *can, TElmoRequest *req, long long deadline)
+{
+	int rval;
+
+	while (!req->done) {
+		if ((rval = receiveReplyUntil(can, deadline)) < 0) {
+			return rval;
+		}
+	}
+	return req->status;
+}
+
+int waitRequest(TCan *can, TElmoRequest *req)
+{
+	return waitRequestUntil(can, req, receiveDeadline(can));
+}
+
+int waitAllRequests(TCan *can)
+{
+	long long deadline = receiveDeadline(can);
+	int rval;
+
+	while (can->npending > 0) {
+		if ((rval = receiveReplyUntil(can, deadline)) < 0) {
+			return rval;
+		}
+	}
+	return 0;
+}
+
+int waitRequests(TCan *can, TElmoRequest *req, int count)
+{
+	long long deadline = receiveDeadline(can);
+	int rval = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int status = waitRequestUntil(can, &req[i], deadline);
+		if (status < 0 && !req[i].done) {
+			/* Nothing more is coming in time, the rest must not outlive the caller. */
+			for (; i < count; i++) {
+				cancelRequest(can, &req[i]);
+			}
+			return status;
+		}
+		if (status < 0 && rval == 0) {
+			rval = status;
+		}
+	}
+	return rval;
+}
+
+void cancelRequest(TCan *can, TElmoRequest *req)
+{
+	int i;
+	for (i = 0; i < can->npending; i++) {
+		if (can->pending[i] == req) {
+			can->npending--;
+			memmove(&can->pending[i], &can->pending[i + 1],
+				(can->npending - i) * sizeof(req));
+			return;
+		}
+	}
+}
+
+static int transactRetries(TCan *can, int size, const unsigned char *data,
+			   struct can_frame *reply, int retries)
+{
+	TElmoRequest req;
+	struct timespec wait;
+	long backoff = can->backoff;
+	int rval;
+
+	if (can->npending >= CAN_MAX_PENDING && (rval = waitAllRequests(can)) < 0) {
+		return rval;
+	}
+
+	for (;;) {
+		if ((rval = sendRequest(can, &req, size, data, NULL, NULL)) < 0) {
+			return rval;
+		}
+
+		rval = waitRequest(can, &req);
+		if (!req.done) {
+			cancelRequest(can, &req);
+		}
+		if (rval != CAN_TIMEOUT || retries-- <= 0) {
+			break;
+		}
+
+		/* A late reply to the lost attempt completes the retry, it echoes the same command. */
+		can->retries++;
+		wait.tv_sec = backoff / 1000000;
+		wait.tv_nsec = (backoff % 1000000) * 1000;
+		nanosleep(&wait, NULL);
+		backoff *= 2;
+	}
+
+	if (rval == CAN_TIMEOUT) {
+		can->timeouts++;
+	}
+	if (reply) {
+		*reply = req.reply;
+	}
+	return rval;
+}
+
+int transact(TCan *can, int size, const unsigned char *data, struct can_frame *reply)
+{
+	return transactRetries(can, size, data, reply, can->maxretries);
+}
+
+int transactOnce(TCan *can, int size, const unsigned char *data, struct can_frame *reply)
+{
+	return transactRetries(can, size, data, reply, 0);
+}
+
+int requestInt(TElmoRequest *req)
+{
+	return intFromData(req->reply.data);
+}
+
+float requestFloat(TElmoRequest *req)
+{
+	return floatFromData(req->reply.data);
+}
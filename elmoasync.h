@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_ASYNC_H
+#define ELMO_ASYNC_H
+
+#include "can.h"
+
+/** Error bit in byte 3 of a binary interpreter reply */
+#define ELMO_REPLY_ERROR (1 << 6)
+
+typedef struct TElmoRequest TElmoRequest;
+
+/**
+ * Completion callback of a request. Called from the function that received the reply.
+ */
+typedef void (*TElmoCallback)(TCan *can, TElmoRequest *req, void *arg);
+
+/**
+ * A binary interpreter request. Several requests can be in flight per node at the same
+ * time, the replies are matched to them by the echoed mnemonic and index. The request
+ * must stay valid until it is done.
+ */
+struct TElmoRequest {
+	unsigned char data[8];    /** the command */
+	int size;                 /** the size of the command in bytes */
+	struct can_frame reply;   /** the reply, valid when done */
+	int done;                 /** nonzero when the reply has been received */
+	int status;               /** 0 on success, <0 if the drive replied with an error */
+	long long sent;           /** timeNow() when the command was sent */
+	long long txstamp;        /** kernel timestamp of the command on the bus, 0 if unknown */
+	long long rxstamp;        /** kernel timestamp of the reply, 0 if unknown */
+	TElmoCallback callback;   /** completion callback or NULL */
+	void *arg;                /** argument of the callback */
+};
+
+/**
+ * Registers the handlers that complete the requests of the node when their replies (and
+ * with timestamping, the echoes of the commands) are received by any function. Called
+ * once when the node is opened, and by setTimestamping().
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 if the handler table is full.
+ */
+int registerReplies(TCan *can);
+
+/**
+ * Sends a binary interpreter command without waiting for the reply.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The request, filled in by this function.
+ * @param size The size of the message in bytes.
+ * @param data The data of the message.
+ * @param callback The completion callback or NULL.
+ * @param arg The argument of the callback.
+ * @return 0 on success, -1 if CAN_MAX_PENDING requests are already in flight, <-1 otherwise.
+ */
+int sendRequest(TCan *can, TElmoRequest *req, int size, const unsigned char *data,
+		TElmoCallback callback, void *arg);
+
+/**
+ * Registers a request for a command the caller sends by other means, such as a group
+ * command addressed to several nodes at once, so that the reply of this node completes
+ * it. The command must be sent right after this call.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The request, filled in by this function.
+ * @param size The size of the message in bytes.
+ * @param data The data of the message.
+ * @return 0 on success, -1 if CAN_MAX_PENDING requests are already in flight, <-1 otherwise.
+ */
+int expectRequest(TCan *can, TElmoRequest *req, int size, const unsigned char *data);
+
+/**
+ * Receives one reply and completes the oldest pending request with the same mnemonic and
+ * index. Replies matching no request are counted in rxunmatched and dropped.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, CAN_TIMEOUT if no reply arrived in time, <0 otherwise.
+ */
+int receiveReply(TCan *can);
+
+/**
+ * Like receiveReply(), but waits until an absolute deadline instead of the receive
+ * timeout of the node.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param deadline The deadline in timeNow() time, 0 waits forever.
+ * @return 0 on success, CAN_TIMEOUT if no reply arrived in time, <0 otherwise.
+ */
+int receiveReplyUntil(TCan *can, long long deadline);
+
+/**
+ * Receives replies until the given request is done. The receive timeout of the node
+ * bounds the whole wait, however many other replies arrive meanwhile.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The request to wait for.
+ * @return The status of the request, or <0 on receive errors (CAN_TIMEOUT on timeout).
+ */
+int waitRequest(TCan *can, TElmoRequest *req);
+
+/**
+ * Receives replies until no requests are pending, within one receive timeout. The outcome
+ * of each request is in its status.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 on receive errors (CAN_TIMEOUT on timeout).
+ */
+int waitAllRequests(TCan *can);
+
+/**
+ * Receives replies until all the given requests are done, within one receive timeout.
+ * Stops at the first receive error and cancels the requests that are not done, so that the array can be released.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The array of requests to wait for.
+ * @param count The number of requests.
+ * @return 0 if all the requests succeeded, the receive error (CAN_TIMEOUT on timeout) or
+ *         the first failure otherwise.
+ */
+int waitRequests(TCan *can, TElmoRequest *req, int count);
+
+/**
+ * Forgets a pending request. A reply arriving later is counted as unmatched.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The request to be cancelled.
+ */
+void cancelRequest(TCan *can, TElmoRequest *req);
+
+/**
+ * Sends a command and waits for its reply. Other requests in flight are completed while
+ * waiting. If the reply times out, the command is sent again up to maxretries times,
+ * waiting backoff microseconds before the first retry and twice as long before each next
+ * one. Only for commands that can be repeated safely.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param size The size of the message in bytes.
+ * @param data The data of the message.
+ * @param reply The frame pointer where the reply is written, or NULL.
+ * @return 0 on success, CAN_TIMEOUT if every attempt timed out, <0 otherwise.
+ */
+int transact(TCan *can, int size, const unsigned char *data, struct can_frame *reply);
+
+/**
+ * Like transact(), but never sends the command again. For commands that must not be
+ * executed twice, such as relative moves.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param size The size of the message in bytes.
+ * @param data The data of the message.
+ * @param reply The frame pointer where the reply is written, or NULL.
+ * @return 0 on success, CAN_TIMEOUT if the reply timed out, <0 otherwise.
+ */
+int transactOnce(TCan *can, int size, const unsigned char *data, struct can_frame *reply);
+
+/**
+ * Returns the integer value of a done request.
+ *
+ * @param req The request.
+ * @return The integer of the reply.
+ */
+int requestInt(TElmoRequest *req);
+
+/**
+ * Returns the floating point value of a done request.
+ *
+ * @param req The request.
+ * @return The float of the reply.
+ */
+float requestFloat(TElmoRequest *req);
+
+#endif /* ELMO_ASYNC_H */
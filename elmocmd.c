@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "elmocmd.h"
+
+const TElmoCommand elmoCommands[ELMO_COMMANDS] = {
+	[ELMO_AC] = ELMO_COMMAND('A', 'C', 0, ELMO_INT, ELMO_RW),
+	[ELMO_BG] = ELMO_COMMAND('B', 'G', 0, ELMO_EXEC, ELMO_WRITE),
+	[ELMO_CL1] = ELMO_COMMAND('C', 'L', 1, ELMO_FLOAT, ELMO_RW),
+	[ELMO_DC] = ELMO_COMMAND('D', 'C', 0, ELMO_INT, ELMO_RW),
+	[ELMO_HL2] = ELMO_COMMAND('H', 'L', 2, ELMO_INT, ELMO_RW),
+	[ELMO_IQ] = ELMO_COMMAND('I', 'Q', 0, ELMO_FLOAT, ELMO_READ),
+	[ELMO_LL2] = ELMO_COMMAND('L', 'L', 2, ELMO_INT, ELMO_RW),
+	[ELMO_MC] = ELMO_COMMAND('M', 'C', 0, ELMO_FLOAT, ELMO_READ),
+	[ELMO_MO] = ELMO_COMMAND('M', 'O', 0, ELMO_INT, ELMO_RW),
+	[ELMO_MP4] = ELMO_COMMAND('M', 'P', 4, ELMO_INT, ELMO_RW),
+	[ELMO_MS] = ELMO_COMMAND('M', 'S', 0, ELMO_INT, ELMO_READ),
+	[ELMO_PA] = ELMO_COMMAND('P', 'A', 0, ELMO_INT, ELMO_RW),
+	[ELMO_PL1] = ELMO_COMMAND('P', 'L', 1, ELMO_FLOAT, ELMO_RW),
+	[ELMO_PR] = ELMO_COMMAND('P', 'R', 0, ELMO_INT, ELMO_RW | ELMO_ONCE),
+	[ELMO_PT] = ELMO_COMMAND('P', 'T', 0, ELMO_INT, ELMO_RW),
+	[ELMO_PV] = ELMO_COMMAND('P', 'V', 0, ELMO_INT, ELMO_RW),
+	[ELMO_PX] = ELMO_COMMAND('P', 'X', 0, ELMO_INT, ELMO_RW),
+	[ELMO_RC] = ELMO_COMMAND('R', 'C', 0, ELMO_INT, ELMO_RW),
+	[ELMO_RG] = ELMO_COMMAND('R', 'G', 0, ELMO_INT, ELMO_RW),
+	[ELMO_RL] = ELMO_COMMAND('R', 'L', 0, ELMO_INT, ELMO_RW),
+	[ELMO_RR] = ELMO_COMMAND('R', 'R', 0, ELMO_INT, ELMO_RW | ELMO_ONCE),
+	[ELMO_SD] = ELMO_COMMAND('S', 'D', 0, ELMO_INT, ELMO_RW),
+	[ELMO_SN2] = ELMO_COMMAND('S', 'N', 2, ELMO_INT, ELMO_READ),
+	[ELMO_SP] = ELMO_COMMAND('S', 'P', 0, ELMO_INT, ELMO_RW),
+	[ELMO_ST] = ELMO_COMMAND('S', 'T', 0, ELMO_EXEC, ELMO_WRITE),
+	[ELMO_TC] = ELMO_COMMAND('T', 'C', 0, ELMO_FLOAT, ELMO_RW),
+	[ELMO_UM] = ELMO_COMMAND('U', 'M', 0, ELMO_INT, ELMO_RW),
+	[ELMO_VH2] = ELMO_COMMAND('V', 'H', 2, ELMO_INT, ELMO_RW),
+	[ELMO_VL2] = ELMO_COMMAND('V', 'L', 2, ELMO_INT, ELMO_RW),
+	[ELMO_VX] = ELMO_COMMAND('V', 'X', 0, ELMO_INT, ELMO_READ),
+};
+
+int elmoEncode(const TElmoCommand *cmd, unsigned char *data, const TElmoValue *value)
+{
+	memcpy(data, cmd->header, 4);
+	memset(&data[4], 0, 4);
+
+	if (!value || cmd->type == ELMO_EXEC) {
+		return 4;
+	}
+
+	if (cmd->type == ELMO_FLOAT) {
+		setDataFloat(data, value->f);
+	} else {
+		setDataInt(data, value->i);
+	}
+	return 8;
+}
+
+TElmoValue elmoDecode(const TElmoCommand *cmd, const unsigned char *data)
+{
+	TElmoValue value;
+
+	if (cmd->type == ELMO_FLOAT) {
+		value.f = floatFromData(data);
+	} else {
+		value.i = intFromData(data);
+	}
+	return value;
+}
+
+char *elmoCommandName(const TElmoCommand *cmd, char *name, int size)
+{
+	int index = cmd->header[2] | ((cmd->header[3] & 0x3f) << 8);
+
+	if (index) {
+		snprintf(name, size, "%s[%d]", cmd->name, index);
+	} else {
+		snprintf(name, size, "%s", cmd->name);
+	}
+	return name;
+}
+
+/*
+ * Sends the command and waits for the reply. A lost reply is retried unless the command
+ * is ELMO_ONCE.
+ */
+static int execute(TCan *can, const TElmoCommand *cmd, const TElmoValue *value,
+		   struct can_frame *reply)
+{
+	unsigned char data[8];
+	int size = elmoEncode(cmd, data, value);
+
+	if (cmd->access & ELMO_ONCE) {
+		return transactOnce(can, size, data, reply);
+	}
+	return transact(can, size, data, reply);
+}
+
+static int get(TCan *can, const TElmoCommand *cmd, int type, TElmoValue *value)
+{
+	struct can_frame reply;
+	int rval;
+
+	if (cmd->type != type || !(cmd->access & ELMO_READ)) {
+		return ELMO_BAD_COMMAND;
+	}
+
+	if ((rval = execute(can, cmd, NULL, &reply)) < 0) {
+		return rval;
+	}
+
+	*value = elmoDecode(cmd, reply.data);
+	return 0;
+}
+
+int elmoGetInt(TCan *can, const TElmoCommand *cmd, int *value)
+{
+	TElmoValue v;
+	int rval;
+
+	if ((rval = get(can, cmd, ELMO_INT, &v)) == 0) {
+		*value = v.i;
+	}
+	return rval;
+}
+
+int elmoGetFloat(TCan *can, const TElmoCommand *cmd, float *value)
+{
+	TElmoValue v;
+	int rval;
+
+	if ((rval = get(can, cmd, ELMO_FLOAT, &v)) == 0) {
+		*value = v.f;
+	}
+	return rval;
+}
+
+int elmoSetInt(TCan *can, const TElmoCommand *cmd, int value)
+{
+	TElmoValue v;
+
+	if (cmd->type != ELMO_INT || !(cmd->access & ELMO_WRITE)) {
+		return ELMO_BAD_COMMAND;
+	}
+
+	v.i = value;
+	return execute(can, cmd, &v, NULL);
+}
+
+int elmoSetFloat(TCan *can, const TElmoCommand *cmd, float value)
+{
+	TElmoValue v;
+
+	if (cmd->type != ELMO_FLOAT || !(cmd->access & ELMO_WRITE)) {
+		return ELMO_BAD_COMMAND;
+	}
+
+	v.f = value;
+	return execute(can, cmd, &v, NULL);
+}
+
+int elmoExecute(TCan *can, const TElmoCommand *cmd)
+{
+	if (cmd->type != ELMO_EXEC) {
+		return ELMO_BAD_COMMAND;
+	}
+	return execute(can, cmd, NULL, NULL);
+}
+
+int elmoSendGet(TCan *can, const TElmoCommand *cmd, TElmoRequest *req)
+{
+	unsigned char data[8];
+
+	if (cmd->type == ELMO_EXEC || !(cmd->access & ELMO_READ)) {
+		return ELMO_BAD_COMMAND;
+	}
+
+	return sendRequest(can, req, elmoEncode(cmd, data, NULL), data, NULL, NULL);
+}
+
+int elmoSendSet(TCan *can, const TElmoCommand *cmd, const TElmoValue *value, TElmoRequest *req)
+{
+	unsigned char data[8];
+
+	if (!(cmd->access & ELMO_WRITE)) {
+		return ELMO_BAD_COMMAND;
+	}
+
+	return sendRequest(can, req, elmoEncode(cmd, data, value), data, NULL, NULL);
+}
+
+/*
+ * Sends the queries or the sets in windows of CAN_MAX_PENDING, each window with one system
+ * call, and waits for the replies.
+ */
+static int pipeline(TCan *can, const TElmoCommand *const *cmd, int count, TElmoValue *value,
+		    int write)
+{
+	TElmoRequest req[CAN_MAX_PENDING];
+	int rval = 0;
+	int status;
+	int done, n, i;
+
+	for (done = 0; done < count; done += n) {
+		/* The whole window must be free, requests of others may still be in flight. */
+		if (can->npending > 0 && (status = waitAllRequests(can)) < 0) {
+			return status;
+		}
+
+		n = count - done < CAN_MAX_PENDING ? count - done : CAN_MAX_PENDING;
+
+		beginBatch(can);
+		for (i = 0; i < n; i++) {
+			status = write ? elmoSendSet(can, cmd[done + i], &value[done + i], &req[i]) :
+					 elmoSendGet(can, cmd[done + i], &req[i]);
+			if (status < 0) {
+				flushBatch(can);
+				waitAllRequests(can);
+				while (i-- > 0) {
+					cancelRequest(can, &req[i]);
+				}
+				return status;
+			}
+		}
+
+		if (flushBatch(can) < 0) {
+			for (i = 0; i < n; i++) {
+				cancelRequest(can, &req[i]);
+			}
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((status = waitRequest(can, &req[i])) < 0 && !req[i].done) {
+				/* Nothing more is coming in time, give up the rest of the window. */
+				for (; i < n; i++) {
+					cancelRequest(can, &req[i]);
+				}
+				return status;
+			}
+			if (status == 0 && !write) {
+				value[done + i] = elmoDecode(cmd[done + i], req[i].reply.data);
+			} else if (status < 0 && rval == 0) {
+				rval = status;
+			}
+		}
+	}
+	return rval;
+}
+
+int elmoReadParameters(TCan *can, const TElmoCommand *const *cmd, int count, TElmoValue *value)
+{
+	return pipeline(can, cmd, count, value, 0);
+}
+
+int elmoWriteParameters(TCan *can, const TElmoCommand *const *cmd, int count,
+			const TElmoValue *value)
+{
+	return pipeline(can, cmd, count, (TElmoValue *)value, 1);
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_CMD_H
+#define ELMO_CMD_H
+
+#include "elmoasync.h"
+
+/** Returned when a command is used against its type or access */
+#define ELMO_BAD_COMMAND (-7)
+
+/**
+ * Value type of a binary interpreter command.
+ */
+enum ElmoType
+{
+	ELMO_INT = 0,   /** 32 bit integer */
+	ELMO_FLOAT = 1, /** 32 bit float, flagged in byte 3 of the frame */
+	ELMO_EXEC = 2   /** executed without a value (BG, ST) */
+};
+
+/**
+ * Access of a binary interpreter command, a bit mask.
+ */
+enum ElmoAccess
+{
+	ELMO_READ = 1,  /** can be queried */
+	ELMO_WRITE = 2, /** can be set */
+	ELMO_RW = 3,    /** both */
+	ELMO_ONCE = 4   /** not idempotent: never sent again after a lost reply */
+};
+
+/**
+ * A binary interpreter command. header is bytes 0-3 of its frames: the mnemonic, the
+ * 14 bit index and the float flag. It is encoded at compile time by ELMO_COMMAND(), so
+ * building a frame only copies the header and writes the value.
+ */
+typedef struct {
+	unsigned char header[4];  /** bytes 0-3 of the frame */
+	unsigned char type;       /** enum ElmoType */
+	unsigned char access;     /** enum ElmoAccess bits */
+	char name[3];             /** the mnemonic as a string */
+} TElmoCommand;
+
+/**
+ * Encodes a command, e.g. ELMO_COMMAND('V', 'L', 2, ELMO_INT, ELMO_RW) for VL[2]. Can be
+ * used for any parameter not in elmoCommands.
+ */
+#define ELMO_COMMAND(a, b, index, type, access) \
+	{ { (a), (b), (index) & 0xff, (((index) >> 8) & 0x3f) | ((type) == ELMO_FLOAT ? 0x80 : 0) }, \
+	  (type), (access), { (a), (b), 0 } }
+
+/**
+ * The commands used by this library, indexes of elmoCommands.
+ */
+enum ElmoCommandId
+{
+	ELMO_AC, ELMO_BG, ELMO_CL1, ELMO_DC, ELMO_HL2, ELMO_IQ, ELMO_LL2, ELMO_MC, ELMO_MO,
+	ELMO_MP4, ELMO_MS, ELMO_PA, ELMO_PL1, ELMO_PR, ELMO_PT, ELMO_PV, ELMO_PX, ELMO_RC,
+	ELMO_RG, ELMO_RL, ELMO_RR, ELMO_SD, ELMO_SN2, ELMO_SP, ELMO_ST, ELMO_TC, ELMO_UM, ELMO_VH2,
+	ELMO_VL2, ELMO_VX, ELMO_COMMANDS
+};
+
+extern const TElmoCommand elmoCommands[ELMO_COMMANDS];
+
+/** The TElmoCommand of a command of the table, e.g. ELMO_CMD(PX) */
+#define ELMO_CMD(name) (&elmoCommands[ELMO_##name])
+
+/**
+ * A command value of either type.
+ */
+typedef union {
+	int i;                    /** ELMO_INT */
+	float f;                  /** ELMO_FLOAT */
+} TElmoValue;
+
+/**
+ * Writes the frame data of a command with the given value.
+ *
+ * @param cmd The command.
+ * @param data The 8 bytes of frame data.
+ * @param value The value, ignored for queries and ELMO_EXEC.
+ * @return The size of the message: 8 with a value, 4 without.
+ */
+int elmoEncode(const TElmoCommand *cmd, unsigned char *data, const TElmoValue *value);
+
+/**
+ * Returns the value of a reply to a command.
+ *
+ * @param cmd The command.
+ * @param data The 8 bytes of reply data.
+ * @return The value.
+ */
+TElmoValue elmoDecode(const TElmoCommand *cmd, const unsigned char *data);
+
+/**
+ * Writes the name of a command with its index, e.g. "VL[2]", or "UM" for index 0.
+ *
+ * @param cmd The command.
+ * @param name The buffer, at least 10 bytes.
+ * @param size The size of the buffer.
+ * @return The name.
+ */
+char *elmoCommandName(const TElmoCommand *cmd, char *name, int size);
+
+/**
+ * Queries an integer command and waits for the reply.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @param value The pointer where the value is written.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not a readable integer, <0 otherwise.
+ */
+int elmoGetInt(TCan *can, const TElmoCommand *cmd, int *value);
+
+/**
+ * Queries a float command and waits for the reply.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @param value The pointer where the value is written.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not a readable float, <0 otherwise.
+ */
+int elmoGetFloat(TCan *can, const TElmoCommand *cmd, float *value);
+
+/**
+ * Sets an integer command and waits for the reply.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @param value The value.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not a writable integer, <0 otherwise.
+ */
+int elmoSetInt(TCan *can, const TElmoCommand *cmd, int value);
+
+/**
+ * Sets a float command and waits for the reply.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @param value The value.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not a writable float, <0 otherwise.
+ */
+int elmoSetFloat(TCan *can, const TElmoCommand *cmd, float value);
+
+/**
+ * Executes a command without a value, such as BG or ST, and waits for the reply.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not ELMO_EXEC, <0 otherwise.
+ */
+int elmoExecute(TCan *can, const TElmoCommand *cmd);
+
+/**
+ * Sends a query without waiting for the reply, see sendRequest().
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @param req The request, the value is elmoDecode(cmd, req->reply.data) when done.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not readable, <0 otherwise.
+ */
+int elmoSendGet(TCan *can, const TElmoCommand *cmd, TElmoRequest *req);
+
+/**
+ * Sends a set without waiting for the reply, see sendRequest().
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The command.
+ * @param value The value.
+ * @param req The request.
+ * @return 0 on success, ELMO_BAD_COMMAND if the command is not writable, <0 otherwise.
+ */
+int elmoSendSet(TCan *can, const TElmoCommand *cmd, const TElmoValue *value, TElmoRequest *req);
+
+/**
+ * Reads several parameters with the queries pipelined: up to CAN_MAX_PENDING are put on
+ * the bus with one system call before waiting for the replies.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The commands.
+ * @param count The number of commands.
+ * @param value The array where the values are written.
+ * @return 0 if all the queries succeeded, the first failure otherwise.
+ */
+int elmoReadParameters(TCan *can, const TElmoCommand *const *cmd, int count, TElmoValue *value);
+
+/**
+ * Writes several parameters with the sets pipelined like elmoReadParameters(). The drive
+ * executes them in the given order.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param cmd The commands.
+ * @param count The number of commands.
+ * @param value The values.
+ * @return 0 if all the sets succeeded, the first failure otherwise.
+ */
+int elmoWriteParameters(TCan *can, const TElmoCommand *const *cmd, int count,
+			const TElmoValue *value);
+
+#endif /* ELMO_CMD_H */
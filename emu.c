@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <signal.h>
+
+#include "emulator.h"
+
+/**
+ * Default CAN device interface name.
+ */
+#define EMULATOR_INTERFACE "vcan0"
+
+static TEmulator *emu;
+
+static void interrupt(int signal)
+{
+	(void)signal;
+	emu->running = 0;
+}
+
+/**
+ * Emulates Elmo drives on a CAN interface, so that the programs of this library can be
+ * run and load-tested without hardware:
+ *   ip link add dev vcan0 type vcan && ip link set vcan0 up
+ *   ./emulator vcan0 1 127 &
+ *   ./main vcan0
+ *
+ * Usage: emulator [interface] [first id] [last id] [latency us] [jitter us]
+ */
+int main(int argc, char **argv)
+{
+	const char *iface = argc > 1 ? argv[1] : EMULATOR_INTERFACE;
+	int first = argc > 2 ? atoi(argv[2]) : 1;
+	int last = argc > 3 ? atoi(argv[3]) : 127;
+	TEmulatorDrive *drive;
+	int i;
+
+	if (!(emu = TEmulatorConstruct())) {
+		printf("Could not construct the emulator\n");
+		return EXIT_FAILURE;
+	}
+
+	if (emulatorOpen(emu, iface) < 0) {
+		printf("Could not open %s\n", iface);
+		return EXIT_FAILURE;
+	}
+
+	for (i = first; i <= last; i++) {
+		if (emulatorAddDrive(emu, i) < 0) {
+			printf("Could not add drive %d\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	emulatorSetLatency(emu, argc > 4 ? atol(argv[4]) : 0, argc > 5 ? atol(argv[5]) : 0);
+	signal(SIGINT, interrupt);
+	signal(SIGTERM, interrupt);
+
+	printf("Emulating drives %d-%d on %s\n", first, last, iface);
+	if (emulatorRun(emu) < 0) {
+		printf("Emulator failed\n");
+	}
+
+	printf("%lu frames received, %lu sent, %lu dropped\n", emu->frames, emu->replies, emu->dropped);
+	for (i = first; i <= last; i++) {
+		drive = emu->drive[i];
+		if (drive->commands) {
+			printf("drive %d: %lu commands, %lu errors, position %d\n",
+			       i, drive->commands, drive->errors, (int)drive->position);
+		}
+	}
+
+	TEmulatorDestruct(emu);
+	return EXIT_SUCCESS;
+}
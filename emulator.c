@@ -0,0 +1,1354 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "emulator.h"
+#include "elmoasync.h"
+#include "sdo.h"
+#include "recorder.h"
+
+#define MNEMONIC(a, b) ((a) | ((b) << 8))
+
+/* unit modes of the model */
+#define UM_TORQUE 1
+#define UM_POSITION 5
+
+/* statusword bits (0x6041) */
+#define STATUS_ENABLED 0x0027
+#define STATUS_DISABLED 0x0040
+#define STATUS_TARGET_REACHED 0x0400
+
+/* MS of a drive executing a motion, and of one at rest */
+#define MOTION_IN_PROGRESS 2
+#define MOTION_STOPPED 0
+
+/* SN[2], the reply sendEchoMessage() checks */
+#define SERIAL_NUMBER 0x0003012a
+
+static int watch(TEmulator *emu, int socket)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = socket;
+	if (epoll_ctl(emu->epoll, EPOLL_CTL_ADD, socket, &event) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+TEmulator *TEmulatorConstruct(void)
+{
+	TEmulator *emu = (TEmulator *)malloc(sizeof(TEmulator));
+	if (!emu) {
+		return NULL;
+	}
+
+	memset(emu, 0, sizeof(*emu));
+	emu->seed = 1;
+	emu->running = 1;
+
+	if ((emu->epoll = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		free(emu);
+		return NULL;
+	}
+
+	if ((emu->timer = timerfd_create(CLOCK_MONOTONIC, 0)) < 0) {
+		perror("timerfd_create");
+		close(emu->epoll);
+		free(emu);
+		return NULL;
+	}
+
+	if (watch(emu, emu->timer) < 0) {
+		close(emu->timer);
+		close(emu->epoll);
+		free(emu);
+		return NULL;
+	}
+
+	return emu;
+}
+
+void TEmulatorDestruct(TEmulator *emu)
+{
+	int i;
+
+	for (i = 0; i < EMULATOR_MAX_NODES; i++) {
+		if (emu->drive[i]) {
+			if (emu->drive[i]->socket >= 0 &&
+			    (!emu->can || emu->drive[i]->socket != emu->can->socket)) {
+				close(emu->drive[i]->socket);
+			}
+			free(emu->drive[i]->domain);
+			free(emu->drive[i]->recorder.data);
+			free(emu->drive[i]);
+		}
+	}
+
+	if (emu->can) {
+		TCanClose(emu->can);
+		TCanDestruct(emu->can);
+	}
+	close(emu->timer);
+	close(emu->epoll);
+	free(emu);
+}
+
+int emulatorOpen(TEmulator *emu, const char *iface)
+{
+	struct can_filter filter[3];
+
+	/* Commands and SDO requests of any node, and SYNC. */
+	filter[0].can_id = COBID_TPDO2(0);
+	filter[0].can_mask = 0x780 | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	filter[1].can_id = COBID_SDO_RX(0);
+	filter[1].can_mask = 0x780 | CAN_EFF_FLAG | CAN_RTR_FLAG;
+	filter[2].can_id = COBID_SYNC;
+	filter[2].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+
+	if (!(emu->can = TCanConstruct(iface))) {
+		return -1;
+	}
+
+	if (TCanOpen(emu->can, 0) < 0 || setFilters(emu->can, filter, 3) < 0) {
+		return -2;
+	}
+
+	if (watch(emu, emu->can->socket) < 0) {
+		return -3;
+	}
+	return 0;
+}
+
+static TEmulatorDrive *createDrive(TEmulator *emu, int id, int socket)
+{
+	TEmulatorDrive *drive;
+
+	if (id <= 0 || id >= EMULATOR_MAX_NODES || emu->drive[id]) {
+		return NULL;
+	}
+
+	if (!(drive = (TEmulatorDrive *)malloc(sizeof(TEmulatorDrive)))) {
+		return NULL;
+	}
+
+	memset(drive, 0, sizeof(*drive));
+	drive->id = id;
+	drive->socket = socket;
+	drive->unitmode = UM_POSITION;
+	drive->speed = EMULATOR_DEFAULT_SPEED;
+	drive->maxcurrent = EMULATOR_DEFAULT_MAXCURRENT;
+	drive->updated = timeNow();
+	emu->drive[id] = drive;
+	return drive;
+}
+
+int emulatorAddDrive(TEmulator *emu, int id)
+{
+	if (!emu->can) {
+		return -1;
+	}
+	return createDrive(emu, id, emu->can->socket) ? 0 : -2;
+}
+
+int emulatorConnect(TEmulator *emu, TCan *can, int id)
+{
+	int sv[2];
+
+	can->id = id;
+	if (registerReplies(can) < 0) {
+		return -4;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	if (!createDrive(emu, id, sv[1])) {
+		close(sv[0]);
+		close(sv[1]);
+		return -2;
+	}
+
+	if (watch(emu, sv[1]) < 0) {
+		free(emu->drive[id]);
+		emu->drive[id] = NULL;
+		close(sv[0]);
+		close(sv[1]);
+		return -3;
+	}
+
+	can->socket = sv[0];
+	can->filter[0].can_id = 0;
+	can->filter[0].can_mask = 0;
+	can->filters = 1;
+	return 0;
+}
+
+int emulatorSetGroup(TEmulator *emu, int id, int group)
+{
+	if (id <= 0 || id >= EMULATOR_MAX_NODES || !emu->drive[id] ||
+	    group <= 0 || group >= EMULATOR_MAX_NODES) {
+		return -1;
+	}
+
+	emu->drive[id]->group = group;
+	return 0;
+}
+
+void emulatorSetLatency(TEmulator *emu, long latency, long jitter)
+{
+	emu->latency = latency;
+	emu->jitter = jitter;
+}
+
+static int motorOn(TEmulatorDrive *drive, long long now)
+{
+	return drive->motoron && now >= drive->enabled;
+}
+
+static double limit(double value, double low, double high)
+{
+	return value < low ? low : value > high ? high : value;
+}
+
+/*
+ * Integrates the motor model to now in steps of at most 1 ms. A motor at rest stays at
+ * rest, so idle drives are not integrated at all.
+ */
+static void integrate(TEmulatorDrive *drive, long long now)
+{
+	long long step;
+	double dt, distance, speed;
+
+	if (!motorOn(drive, now) || (drive->unitmode != UM_TORQUE && !drive->moving)) {
+		drive->velocity = 0;
+		drive->current = 0;
+		drive->updated = now;
+		return;
+	}
+
+	while (drive->updated < now) {
+		step = now - drive->updated < 1000000 ? now - drive->updated : 1000000;
+		dt = step * 1e-9;
+
+		if (drive->unitmode == UM_TORQUE) {
+			drive->current = (float)limit(drive->torque, -drive->maxcurrent, drive->maxcurrent);
+			drive->velocity += (EMULATOR_TORQUE_GAIN * drive->current -
+					    EMULATOR_DAMPING * drive->velocity) * dt;
+			drive->position += drive->velocity * dt;
+		} else if (drive->moving) {
+			distance = drive->target - drive->position;
+			speed = drive->speed > 0 ? drive->speed : EMULATOR_DEFAULT_SPEED;
+			if (distance <= speed * dt && distance >= -speed * dt) {
+				drive->position = drive->target;
+				drive->velocity = 0;
+				drive->moving = 0;
+			} else {
+				drive->velocity = distance > 0 ? speed : -speed;
+				drive->position += drive->velocity * dt;
+			}
+			drive->current = (float)(drive->velocity / speed);
+		}
+
+		/* LL[2] and HL[2] are the feedback limits: the motor stops at them. */
+		if (drive->limits[2] < drive->limits[3] &&
+		    (drive->position < drive->limits[2] || drive->position > drive->limits[3])) {
+			drive->position = limit(drive->position, drive->limits[2], drive->limits[3]);
+			drive->velocity = 0;
+			drive->moving = 0;
+		}
+
+		drive->updated += step;
+	}
+}
+
+static void putInt(unsigned char *data, int value)
+{
+	data[0] = value & 0xff;
+	data[1] = (value >> 8) & 0xff;
+	data[2] = (value >> 16) & 0xff;
+	data[3] = (value >> 24) & 0xff;
+}
+
+/* Records one sample of each signal of RC at the time the model was integrated to. */
+static void sample(TEmulatorDrive *drive)
+{
+	TEmulatorRecorder *rec = &drive->recorder;
+	unsigned char *data;
+	int value;
+	int signal;
+
+	for (signal = 0; signal < RECORDER_SIGNALS; signal++) {
+		if (!(rec->signals & (1u << signal))) {
+			continue;
+		}
+		data = rec->data + ((size_t)signal * RECORDER_MAX_LENGTH + rec->samples) * 4;
+		switch (signal) {
+		case RECORDER_POSITION: value = (int)drive->position; break;
+		case RECORDER_VELOCITY: value = (int)drive->velocity; break;
+		case RECORDER_CURRENT: memcpy(&value, &drive->current, 4); break;
+		default: value = drive->target; break;
+		}
+		putInt(data, value);
+	}
+
+	if (++rec->samples >= rec->length) {
+		rec->state = RECORDER_DONE;
+	}
+	rec->next += rec->gap * RECORDER_QUANTUM * 1000LL;
+}
+
+static unsigned char *registerOf(TEmulatorDrive *drive, unsigned int key, int sdo, int create);
+
+/* Duration of point number index of the PVT/PT table in nanoseconds, at least 1 ms. */
+static long long segmentTime(TEmulatorDrive *drive, unsigned int index)
+{
+	unsigned char *mp4;
+	int ms = drive->pvt.time[index % EMULATOR_PVT_POINTS];
+
+	if (!ms && (mp4 = registerOf(drive, MNEMONIC('M', 'P') | (4 << 16), 0, 0))) {
+		ms = mp4[0] | (mp4[1] << 8);
+	}
+	return (ms > 0 ? ms : 1) * 1000000LL;
+}
+
+/*
+ * Executes the PVT/PT table to now, moving linearly from point to point. Running out of
+ * points ends the motion where the last segment ended.
+ */
+static void interpolate(TEmulatorDrive *drive, long long now)
+{
+	TEmulatorPvt *pvt = &drive->pvt;
+	long long length;
+	int to;
+
+	while (pvt->running) {
+		if (!motorOn(drive, now)) {
+			pvt->running = 0;
+			break;
+		}
+		if (pvt->read == pvt->write) {
+			pvt->running = 0;
+			pvt->underflows++;
+			break;
+		}
+
+		length = segmentTime(drive, pvt->read);
+		to = pvt->position[pvt->read % EMULATOR_PVT_POINTS];
+		if (pvt->begun + length > now) {
+			drive->position = pvt->from + (to - pvt->from) * (now - pvt->begun) / length;
+			drive->velocity = (to - pvt->from) * 1e9 / length;
+			break;
+		}
+		drive->position = pvt->from = to;
+		pvt->begun += length;
+		pvt->read++;
+	}
+}
+
+/* Advances the motor model and the PVT/PT table to now. */
+static void step(TEmulatorDrive *drive, long long now)
+{
+	integrate(drive, now);
+	interpolate(drive, now);
+}
+
+/*
+ * Advances the drive to now. While the recorder runs, the model is integrated to each
+ * sample time on the way.
+ */
+static void advance(TEmulatorDrive *drive, long long now)
+{
+	TEmulatorRecorder *rec = &drive->recorder;
+
+	while (rec->state == RECORDER_RECORDING && rec->next <= now) {
+		step(drive, rec->next);
+		sample(drive);
+	}
+	step(drive, now);
+}
+
+/* Writes a point received on the RPDO3 of the drive to its PVT/PT table. */
+static void queuePoint(TEmulatorDrive *drive, const struct can_frame *frame, long long now)
+{
+	TEmulatorPvt *pvt = &drive->pvt;
+	unsigned int slot;
+
+	advance(drive, now);
+
+	/* An idle, empty table is written from index 1 again. */
+	if (!pvt->running && pvt->read == pvt->write) {
+		pvt->read = pvt->write = 0;
+	}
+	if (pvt->write - pvt->read >= EMULATOR_PVT_POINTS) {
+		pvt->dropped++;
+		return;
+	}
+
+	slot = pvt->write % EMULATOR_PVT_POINTS;
+	pvt->position[slot] = (int)(frame->data[0] | (frame->data[1] << 8) | (frame->data[2] << 16) |
+				    ((unsigned int)frame->data[3] << 24));
+	pvt->time[slot] = frame->can_dlc == 8 ? frame->data[7] : 0;
+	pvt->write++;
+}
+
+/* Starts or stops the recorder as written to RR, returns nonzero if the value is rejected. */
+static int trigger(TEmulatorDrive *drive, int value, long long now)
+{
+	TEmulatorRecorder *rec = &drive->recorder;
+
+	if (value == RECORDER_STOP) {
+		rec->state = RECORDER_IDLE;
+		return 0;
+	}
+
+	if ((value != RECORDER_IMMEDIATE && value != RECORDER_ON_BEGIN) || !rec->signals ||
+	    rec->gap < 1 || rec->length < 1 || rec->length > RECORDER_MAX_LENGTH) {
+		return 1;
+	}
+
+	if (!rec->data && !(rec->data = (unsigned char *)malloc(RECORDER_SIGNALS *
+								 RECORDER_MAX_LENGTH * 4))) {
+		return 1;
+	}
+
+	rec->samples = 0;
+	rec->next = now;
+	rec->state = value == RECORDER_IMMEDIATE ? RECORDER_RECORDING : RECORDER_ARMED;
+	return 0;
+}
+
+static int setDomain(TEmulatorDrive *drive, unsigned int key);
+
+/* Makes the recorded samples of a signal the domain of the upload of key. */
+static void recordedData(TEmulatorDrive *drive, unsigned int key)
+{
+	TEmulatorRecorder *rec = &drive->recorder;
+	unsigned int signal = (key >> 16) - 1;
+
+	if (rec->state != RECORDER_DONE || signal >= RECORDER_SIGNALS ||
+	    !(rec->signals & (1u << signal)) || setDomain(drive, key) < 0) {
+		return;
+	}
+
+	memcpy(drive->domain, rec->data + (size_t)signal * RECORDER_MAX_LENGTH * 4,
+	       (size_t)rec->samples * 4);
+	drive->domainsize = (unsigned int)rec->samples * 4;
+}
+
+static void armTimer(TEmulator *emu)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (emu->head != emu->tail) {
+		its.it_value.tv_sec = emu->queue[emu->head % EMULATOR_QUEUE_SIZE].due / 1000000000LL;
+		its.it_value.tv_nsec = emu->queue[emu->head % EMULATOR_QUEUE_SIZE].due % 1000000000LL;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+			its.it_value.tv_nsec = 1;
+		}
+	}
+	timerfd_settime(emu->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Sends frames of a drive on its socket or its loopback link. */
+static void sendReplies(TEmulatorDrive *drive, struct can_frame *frame, int count)
+{
+	if (drive->link) {
+		loopbackPush(drive->link, frame, count);
+	} else {
+		writeFrames(drive->socket, frame, count);
+	}
+}
+
+/* Sends the replies whose latency has passed, consecutive ones to a link at once. */
+static void flushReplies(TEmulator *emu, long long now)
+{
+	struct can_frame frame[CAN_BATCH];
+	TEmulatorDrive *drive = NULL;
+	int count = 0;
+	TEmulatorReply *reply;
+
+	while (emu->head != emu->tail) {
+		reply = &emu->queue[emu->head % EMULATOR_QUEUE_SIZE];
+		if (reply->due > now) {
+			break;
+		}
+		if (count == CAN_BATCH || (count > 0 && (reply->drive->socket != drive->socket ||
+							 reply->drive->link != drive->link))) {
+			sendReplies(drive, frame, count);
+			count = 0;
+		}
+		drive = reply->drive;
+		frame[count++] = reply->frame;
+		emu->head++;
+	}
+
+	if (count > 0) {
+		sendReplies(drive, frame, count);
+	}
+	armTimer(emu);
+}
+
+/*
+ * Queues a reply. The jitter never reorders the replies: like on a real bus, a reply is
+ * never sent before the ones queued earlier.
+ */
+static void reply(TEmulator *emu, TEmulatorDrive *drive, struct can_frame *frame, long long now)
+{
+	TEmulatorReply *last;
+	long long due;
+
+	emu->replies++;
+	if (!emu->latency && !emu->jitter && emu->head == emu->tail) {
+		sendReplies(drive, frame, 1);
+		return;
+	}
+
+	if (emu->tail - emu->head >= EMULATOR_QUEUE_SIZE) {
+		emu->dropped++;
+		return;
+	}
+
+	due = now + emu->latency * 1000LL;
+	if (emu->jitter) {
+		due += (rand_r(&emu->seed) % (emu->jitter + 1)) * 1000LL;
+	}
+	if (emu->head != emu->tail) {
+		last = &emu->queue[(emu->tail - 1) % EMULATOR_QUEUE_SIZE];
+		if (due < last->due) {
+			due = last->due;
+		}
+	}
+
+	emu->queue[emu->tail % EMULATOR_QUEUE_SIZE].frame = *frame;
+	emu->queue[emu->tail % EMULATOR_QUEUE_SIZE].drive = drive;
+	emu->queue[emu->tail % EMULATOR_QUEUE_SIZE].due = due;
+	emu->tail++;
+	if (emu->tail - emu->head == 1) {
+		armTimer(emu);
+	}
+}
+
+static unsigned char *registerOf(TEmulatorDrive *drive, unsigned int key, int sdo, int create)
+{
+	TEmulatorRegister *reg;
+	int i;
+
+	for (i = 0; i < drive->nreg; i++) {
+		if (drive->reg[i].key == key && drive->reg[i].sdo == sdo) {
+			return drive->reg[i].value;
+		}
+	}
+
+	if (!create || drive->nreg == EMULATOR_REGISTERS) {
+		return NULL;
+	}
+
+	reg = &drive->reg[drive->nreg++];
+	memset(reg, 0, sizeof(*reg));
+	reg->key = key;
+	reg->sdo = sdo;
+	return reg->value;
+}
+
+static void replyInt(struct can_frame *frame, int value)
+{
+	frame->data[3] &= ~(1 << 7);
+	setDataInt(frame->data, value);
+}
+
+static void replyFloat(struct can_frame *frame, float value)
+{
+	setDataFloat(frame->data, value);
+}
+
+static int *limitOf(TEmulatorDrive *drive, int mnemonic, int index)
+{
+	if (index != 2) {
+		return NULL;
+	}
+	switch (mnemonic) {
+	case MNEMONIC('V', 'L'): return &drive->limits[0];
+	case MNEMONIC('V', 'H'): return &drive->limits[1];
+	case MNEMONIC('L', 'L'): return &drive->limits[2];
+	case MNEMONIC('H', 'L'): return &drive->limits[3];
+	}
+	return NULL;
+}
+
+/*
+ * Executes a binary interpreter command. A set carries a value in bytes 4-7 (8 bytes),
+ * a get or an executable command does not (4 bytes).
+ */
+static void command(TEmulator *emu, TEmulatorDrive *drive, struct can_frame *frame, long long now)
+{
+	struct can_frame out = *frame;
+	unsigned char *data = frame->data;
+	int mnemonic = MNEMONIC(data[0], data[1]);
+	int index = data[2] | ((data[3] & 0x3f) << 8);
+	int set = frame->can_dlc == 8;
+	int value = intFromData(data);
+	float fvalue = floatFromData(data);
+	unsigned char *reg;
+	int *lim;
+	int error = 0;
+
+	advance(drive, now);
+	out.can_id = COBID_RPDO2(drive->id);
+	out.can_dlc = 8;
+
+	switch (mnemonic) {
+	case MNEMONIC('M', 'O'):
+		if (!set) {
+			replyInt(&out, motorOn(drive, now));
+		} else if (value && !drive->motoron) {
+			drive->motoron = 1;
+			drive->enabled = now + EMULATOR_ENABLE_TIME * 1000LL;
+			drive->updated = now;
+		} else if (!value) {
+			drive->motoron = 0;
+			drive->moving = 0;
+			drive->pvt.running = 0;
+			drive->pvt.read = drive->pvt.write = 0;
+		}
+		break;
+	case MNEMONIC('U', 'M'):
+		if (!set) {
+			replyInt(&out, drive->unitmode);
+		} else if (drive->motoron || (value != UM_TORQUE && value != UM_POSITION)) {
+			error = 1;
+		} else {
+			drive->unitmode = value;
+		}
+		break;
+	case MNEMONIC('P', 'A'):
+		if (set) {
+			drive->target = value;
+		} else {
+			replyInt(&out, drive->target);
+		}
+		break;
+	case MNEMONIC('P', 'R'):
+		if (set) {
+			drive->target = (int)drive->position + value;
+		} else {
+			replyInt(&out, drive->target - (int)drive->position);
+		}
+		break;
+	case MNEMONIC('S', 'P'):
+		if (set) {
+			drive->speed = value;
+		} else {
+			replyInt(&out, drive->speed);
+		}
+		break;
+	case MNEMONIC('B', 'G'):
+		if (!motorOn(drive, now)) {
+			error = 1;
+		} else if (drive->pvt.armed) {
+			drive->pvt.armed = 0;
+			drive->pvt.running = 1;
+			drive->pvt.from = drive->position;
+			drive->pvt.begun = now;
+		} else if (drive->unitmode == UM_POSITION) {
+			/* VL[2] and VH[2] limit the position reference. */
+			if (drive->limits[0] < drive->limits[1]) {
+				drive->target = (int)limit(drive->target, drive->limits[0], drive->limits[1]);
+			}
+			drive->moving = 1;
+			drive->updated = now;
+		}
+		drive->started = now;
+		if (drive->recorder.state == RECORDER_ARMED) {
+			drive->recorder.state = RECORDER_RECORDING;
+			drive->recorder.next = now;
+		}
+		break;
+	case MNEMONIC('S', 'T'):
+		drive->moving = 0;
+		drive->pvt.running = 0;
+		drive->pvt.armed = 0;
+		drive->pvt.read = drive->pvt.write = 0;
+		drive->velocity = 0;
+		drive->target = (int)drive->position;
+		break;
+	case MNEMONIC('P', 'V'):
+	case MNEMONIC('P', 'T'):
+		/* The query returns the table index of the point in progress. */
+		if (!set) {
+			replyInt(&out, (int)(drive->pvt.read % EMULATOR_PVT_POINTS) + 1);
+		} else if (value != 1 || drive->unitmode != UM_POSITION || drive->pvt.running) {
+			error = 1;
+		} else {
+			drive->pvt.armed = mnemonic;
+		}
+		break;
+	case MNEMONIC('M', 'S'):
+		replyInt(&out, drive->moving || drive->pvt.running ? MOTION_IN_PROGRESS :
+								      MOTION_STOPPED);
+		break;
+	case MNEMONIC('P', 'X'):
+		if (set) {
+			drive->position = value;
+		} else {
+			replyInt(&out, (int)drive->position);
+		}
+		break;
+	case MNEMONIC('V', 'X'):
+		replyInt(&out, (int)drive->velocity);
+		break;
+	case MNEMONIC('I', 'Q'):
+		replyFloat(&out, drive->current);
+		break;
+	case MNEMONIC('M', 'C'):
+		if (set) {
+			drive->maxcurrent = fvalue;
+		} else {
+			replyFloat(&out, drive->maxcurrent);
+		}
+		break;
+	case MNEMONIC('T', 'C'):
+		if (set && drive->unitmode != UM_TORQUE) {
+			error = 1;
+		} else if (set) {
+			drive->torque = fvalue;
+			drive->updated = now;
+		} else {
+			replyFloat(&out, drive->torque);
+		}
+		break;
+	case MNEMONIC('S', 'N'):
+		replyInt(&out, index == 2 ? SERIAL_NUMBER : 0);
+		break;
+	case MNEMONIC('R', 'C'):
+		if (set) {
+			drive->recorder.signals = (unsigned int)value;
+		} else {
+			replyInt(&out, (int)drive->recorder.signals);
+		}
+		break;
+	case MNEMONIC('R', 'G'):
+		if (set) {
+			drive->recorder.gap = value;
+		} else {
+			replyInt(&out, drive->recorder.gap);
+		}
+		break;
+	case MNEMONIC('R', 'L'):
+		if (set) {
+			drive->recorder.length = value;
+		} else {
+			replyInt(&out, drive->recorder.length);
+		}
+		break;
+	case MNEMONIC('R', 'R'):
+		if (set) {
+			error = trigger(drive, value, now);
+		} else {
+			replyInt(&out, drive->recorder.state);
+		}
+		break;
+	default:
+		if ((lim = limitOf(drive, mnemonic, index))) {
+			if (set) {
+				*lim = value;
+			} else {
+				replyInt(&out, *lim);
+			}
+			break;
+		}
+
+		/* Any other command just keeps its value. */
+		reg = registerOf(drive, mnemonic | (index << 16), 0, set);
+		if (set && reg) {
+			memcpy(reg, &data[4], 4);
+		} else if (!set) {
+			memcpy(&out.data[4], reg ? reg : (unsigned char *)"\0\0\0\0", 4);
+		}
+		break;
+	}
+
+	drive->commands++;
+	if (error) {
+		drive->errors++;
+		out.data[3] |= ELMO_REPLY_ERROR;
+	}
+	reply(emu, drive, &out, now);
+}
+
+/* States of the SDO server of a drive */
+enum {
+	SDO_IDLE,
+	SDO_DOWNLOAD,             /* segmented download */
+	SDO_UPLOAD,               /* segmented upload */
+	SDO_BLOCK_DOWNLOAD,       /* receiving block segments */
+	SDO_BLOCK_DOWNLOAD_END,   /* waiting for the end of a block download */
+	SDO_BLOCK_UPLOAD_START,   /* waiting for the start of a block upload */
+	SDO_BLOCK_UPLOAD,         /* waiting for the confirmation of a block */
+	SDO_BLOCK_UPLOAD_END      /* waiting for the end of a block upload */
+};
+
+static void sdoAbort(TEmulatorDrive *drive, struct can_frame *out, unsigned int code)
+{
+	drive->sdo.state = SDO_IDLE;
+	out->data[0] = 0x80;
+	setDataInt(out->data, (int)code);
+}
+
+/* Makes the domain the object of key, EMULATOR_DOMAIN_SIZE bytes and a segment to spare. */
+static int setDomain(TEmulatorDrive *drive, unsigned int key)
+{
+	if (!drive->domain &&
+	    !(drive->domain = (unsigned char *)malloc(EMULATOR_DOMAIN_SIZE + 7))) {
+		return -1;
+	}
+
+	drive->domainkey = key;
+	drive->domainsize = 0;
+	return 0;
+}
+
+/* Sends the segments of a block of a block upload. */
+static void sendBlock(TEmulator *emu, TEmulatorDrive *drive, long long now)
+{
+	TEmulatorSdo *sdo = &drive->sdo;
+	struct can_frame out;
+	unsigned int pos = sdo->blockstart;
+	int seqno = 0;
+	int n;
+
+	memset(&out, 0, sizeof(out));
+	out.can_id = COBID_SDO_TX(drive->id);
+	out.can_dlc = 8;
+	do {
+		n = drive->domainsize - pos < 7 ? drive->domainsize - pos : 7;
+		memset(out.data, 0, 8);
+		memcpy(&out.data[1], drive->domain + pos, n);
+		pos += n;
+		out.data[0] = ++seqno | (pos == drive->domainsize ? 0x80 : 0x00);
+		reply(emu, drive, &out, now);
+	} while (seqno < sdo->blksize && pos < drive->domainsize);
+}
+
+/* Receives a segment of a block download, confirming the block after its last segment. */
+static void blockSegment(TEmulator *emu, TEmulatorDrive *drive, struct can_frame *frame,
+			 long long now)
+{
+	TEmulatorSdo *sdo = &drive->sdo;
+	struct can_frame out;
+	int seqno = frame->data[0] & 0x7f;
+	int last = frame->data[0] & 0x80;
+
+	if (seqno == sdo->seqno + 1 && sdo->pos < EMULATOR_DOMAIN_SIZE) {
+		memcpy(drive->domain + sdo->pos, &frame->data[1], 7);
+		sdo->pos += 7;
+		sdo->seqno++;
+		sdo->last = last != 0;
+	}
+
+	if (seqno != sdo->blksize && !last) {
+		return;
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.can_id = COBID_SDO_TX(drive->id);
+	out.can_dlc = 8;
+	out.data[0] = 0xa2;
+	out.data[1] = sdo->seqno;
+	out.data[2] = sdo->blksize;
+	sdo->seqno = 0;
+	if (sdo->last) {
+		sdo->state = SDO_BLOCK_DOWNLOAD_END;
+	}
+	reply(emu, drive, &out, now);
+}
+
+/*
+ * Answers an SDO request. The objects up to four bytes are plain values, uploading an
+ * object never downloaded is aborted. Larger objects go to the domain.
+ */
+static void sdo(TEmulator *emu, TEmulatorDrive *drive, struct can_frame *frame, long long now)
+{
+	TEmulatorSdo *sdo = &drive->sdo;
+	struct can_frame out;
+	unsigned char *data = frame->data;
+	unsigned int key = data[1] | (data[2] << 8) | (data[3] << 16);
+	unsigned char *reg;
+	unsigned int size;
+	int n;
+
+	if (data[0] == 0x80) {
+		sdo->state = SDO_IDLE; /* aborted by the client */
+		return;
+	}
+
+	if (sdo->state == SDO_BLOCK_DOWNLOAD) {
+		blockSegment(emu, drive, frame, now);
+		return;
+	}
+
+	/* An upload of the recorded data starts with the samples copied to the domain. */
+	if ((key & 0xffff) == RECORDER_OBJECT &&
+	    ((data[0] & 0xe0) == 0x40 || data[0] == 0xa0 || data[0] == 0xa4)) {
+		advance(drive, now);
+		recordedData(drive, key);
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.can_id = COBID_SDO_TX(drive->id);
+	out.can_dlc = 8;
+	memcpy(&out.data[1], &data[1], 3);
+
+	switch (data[0] & 0xe0) {
+	case 0x20: /* initiate download */
+		if (data[0] & 0x02) {
+			if (!(reg = registerOf(drive, key, 1, 1))) {
+				sdoAbort(drive, &out, 0x05040005); /* out of memory */
+				break;
+			}
+			memcpy(reg, &data[4], 4);
+			out.data[0] = 0x60;
+			break;
+		}
+		size = (data[0] & 0x01) ? (unsigned int)intFromData(data) : 0;
+		if (size > EMULATOR_DOMAIN_SIZE || setDomain(drive, key) < 0) {
+			sdoAbort(drive, &out, 0x05040005);
+			break;
+		}
+		sdo->state = SDO_DOWNLOAD;
+		sdo->pos = 0;
+		sdo->toggle = 0;
+		out.data[0] = 0x60;
+		break;
+	case 0x00: /* download segment */
+		if (sdo->state != SDO_DOWNLOAD || ((data[0] >> 4) & 0x01) != sdo->toggle) {
+			sdoAbort(drive, &out, 0x05030000); /* toggle bit not alternated */
+			break;
+		}
+		n = 7 - ((data[0] >> 1) & 0x07);
+		if (sdo->pos + n > EMULATOR_DOMAIN_SIZE) {
+			sdoAbort(drive, &out, 0x05040005);
+			break;
+		}
+		memcpy(drive->domain + sdo->pos, &data[1], n);
+		sdo->pos += n;
+		memset(&out.data[1], 0, 3);
+		out.data[0] = 0x20 | (sdo->toggle << 4);
+		sdo->toggle ^= 1;
+		if (data[0] & 0x01) {
+			drive->domainsize = sdo->pos;
+			sdo->state = SDO_IDLE;
+		}
+		break;
+	case 0x40: /* initiate upload */
+		if (drive->domain && key == drive->domainkey &&
+		    (drive->domainsize > 4 || drive->domainsize == 0)) {
+			out.data[0] = 0x41;
+			setDataInt(out.data, (int)drive->domainsize);
+			sdo->state = SDO_UPLOAD;
+			sdo->pos = 0;
+			sdo->toggle = 0;
+		} else if (drive->domain && key == drive->domainkey) {
+			out.data[0] = 0x43 | ((4 - drive->domainsize) << 2);
+			memcpy(&out.data[4], drive->domain, drive->domainsize);
+		} else if ((reg = registerOf(drive, key, 1, 0))) {
+			out.data[0] = 0x43;
+			memcpy(&out.data[4], reg, 4);
+		} else {
+			sdoAbort(drive, &out, 0x06020000); /* object does not exist */
+		}
+		break;
+	case 0x60: /* upload segment */
+		if (sdo->state != SDO_UPLOAD || ((data[0] >> 4) & 0x01) != sdo->toggle) {
+			sdoAbort(drive, &out, 0x05030000);
+			break;
+		}
+		n = drive->domainsize - sdo->pos < 7 ? drive->domainsize - sdo->pos : 7;
+		memset(&out.data[1], 0, 7);
+		memcpy(&out.data[1], drive->domain + sdo->pos, n);
+		sdo->pos += n;
+		out.data[0] = (sdo->toggle << 4) | ((7 - n) << 1) | (sdo->pos == drive->domainsize);
+		sdo->toggle ^= 1;
+		if (sdo->pos == drive->domainsize) {
+			sdo->state = SDO_IDLE;
+		}
+		break;
+	case 0xc0: /* block download */
+		if (!(data[0] & 0x01)) {
+			size = (data[0] & 0x02) ? (unsigned int)intFromData(data) : 0;
+			if (size > EMULATOR_DOMAIN_SIZE || setDomain(drive, key) < 0) {
+				sdoAbort(drive, &out, 0x05040005);
+				break;
+			}
+			sdo->state = SDO_BLOCK_DOWNLOAD;
+			sdo->crc = (data[0] >> 2) & 0x01;
+			sdo->pos = 0;
+			sdo->seqno = 0;
+			sdo->last = 0;
+			sdo->blksize = EMULATOR_SDO_BLOCK;
+			out.data[0] = 0xa4; /* CRC supported */
+			out.data[4] = sdo->blksize;
+		} else if (sdo->state == SDO_BLOCK_DOWNLOAD_END) {
+			sdo->pos -= (data[0] >> 2) & 0x07;
+			if (sdo->crc && (data[1] | (data[2] << 8)) != sdoCrc(0, drive->domain, sdo->pos)) {
+				sdoAbort(drive, &out, 0x05040004); /* CRC error */
+				break;
+			}
+			drive->domainsize = sdo->pos;
+			sdo->state = SDO_IDLE;
+			memset(out.data, 0, 8);
+			out.data[0] = 0xa1;
+		} else {
+			sdoAbort(drive, &out, 0x05040001);
+		}
+		break;
+	case 0xa0: /* block upload */
+		switch (data[0] & 0x03) {
+		case 0x00: /* initiate */
+			if (!drive->domain || key != drive->domainkey || data[4] < 1 || data[4] > 127) {
+				sdoAbort(drive, &out, 0x06020000);
+				break;
+			}
+			sdo->state = SDO_BLOCK_UPLOAD_START;
+			sdo->crc = (data[0] >> 2) & 0x01;
+			sdo->blksize = data[4];
+			sdo->blockstart = 0;
+			out.data[0] = 0xc6; /* CRC supported, size indicated */
+			setDataInt(out.data, (int)drive->domainsize);
+			break;
+		case 0x03: /* start */
+			if (sdo->state != SDO_BLOCK_UPLOAD_START) {
+				sdoAbort(drive, &out, 0x05040001);
+				break;
+			}
+			sdo->state = SDO_BLOCK_UPLOAD;
+			sendBlock(emu, drive, now);
+			return;
+		case 0x02: /* block confirmed */
+			if (sdo->state != SDO_BLOCK_UPLOAD || data[1] > sdo->blksize ||
+			    data[2] < 1 || data[2] > 127) {
+				sdoAbort(drive, &out, 0x05040003); /* invalid sequence number */
+				break;
+			}
+			sdo->blockstart += data[1] * 7;
+			sdo->blksize = data[2];
+			if (sdo->blockstart < drive->domainsize) {
+				sendBlock(emu, drive, now);
+				return;
+			}
+			sdo->state = SDO_BLOCK_UPLOAD_END;
+			memset(out.data, 0, 8);
+			out.data[0] = 0xc1 | ((drive->domainsize ? (7 - drive->domainsize % 7) % 7 : 7) << 2);
+			if (sdo->crc) {
+				size = sdoCrc(0, drive->domain, drive->domainsize);
+				out.data[1] = size & 0xff;
+				out.data[2] = (size >> 8) & 0xff;
+			}
+			break;
+		default: /* end */
+			sdo->state = SDO_IDLE;
+			return;
+		}
+		break;
+	default:
+		sdoAbort(drive, &out, 0x05040001); /* command specifier not valid */
+		break;
+	}
+
+	reply(emu, drive, &out, now);
+}
+
+int emulatorSetDomain(TEmulator *emu, int id, unsigned short index, unsigned char subindex,
+		      const void *data, unsigned int size)
+{
+	TEmulatorDrive *drive;
+
+	if (id <= 0 || id >= EMULATOR_MAX_NODES || !(drive = emu->drive[id]) ||
+	    size > EMULATOR_DOMAIN_SIZE) {
+		return -1;
+	}
+
+	if (setDomain(drive, index | (subindex << 16)) < 0) {
+		return -2;
+	}
+	memcpy(drive->domain, data, size);
+	drive->domainsize = size;
+	return 0;
+}
+
+int emulatorEmergency(TEmulator *emu, int id, unsigned short code, unsigned char reg)
+{
+	TEmulatorDrive *drive;
+	struct can_frame frame;
+	unsigned char data[8] = { code & 0xff, code >> 8, reg, 0, 0, 0, 0, 0 };
+
+	if (id <= 0 || id >= EMULATOR_MAX_NODES || !(drive = emu->drive[id])) {
+		return -1;
+	}
+
+	createFrame(&frame, COBID_EMCY(id), 8, data);
+	sendReplies(drive, &frame, 1);
+	return 0;
+}
+
+int emulatorHeartbeat(TEmulator *emu, int id, unsigned char state)
+{
+	TEmulatorDrive *drive;
+	struct can_frame frame;
+	unsigned char data[8] = { state, 0, 0, 0, 0, 0, 0, 0 };
+
+	if (id <= 0 || id >= EMULATOR_MAX_NODES || !(drive = emu->drive[id])) {
+		return -1;
+	}
+
+	createFrame(&frame, COBID_HEARTBEAT(id), 1, data);
+	sendReplies(drive, &frame, 1);
+	return 0;
+}
+
+/* The PDO is on if its COB-ID object was written without the invalid bit. */
+static int pdoEnabled(TEmulatorDrive *drive, unsigned int pdo)
+{
+	unsigned char *reg = registerOf(drive, pdo | (1 << 16), 1, 0);
+	return reg && !(reg[3] & 0x80);
+}
+
+/*
+ * Sends the telemetry PDOs configured by configureTelemetry(): position and velocity,
+ * then current and statusword.
+ */
+static void sendTelemetry(TEmulator *emu, long long now)
+{
+	TEmulatorDrive *drive;
+	struct can_frame frame;
+	int position, velocity, status, i;
+	short current;
+
+	for (i = 1; i < EMULATOR_MAX_NODES; i++) {
+		if (!(drive = emu->drive[i])) {
+			continue;
+		}
+		advance(drive, now);
+
+		if (pdoEnabled(drive, 0x1802)) {
+			position = (int)drive->position;
+			velocity = (int)drive->velocity;
+			memset(&frame, 0, sizeof(frame));
+			frame.can_id = COBID_RPDO3(drive->id);
+			frame.can_dlc = 8;
+			putInt(&frame.data[0], position);
+			putInt(&frame.data[4], velocity);
+			reply(emu, drive, &frame, now);
+		}
+
+		if (pdoEnabled(drive, 0x1803)) {
+			/* 0x6078 is in thousandths of the rated current, which MC=0 leaves undefined. */
+			current = drive->maxcurrent > 0 ?
+				  (short)(drive->current / drive->maxcurrent * 1000) : 0;
+			status = motorOn(drive, now) ? STATUS_ENABLED : STATUS_DISABLED;
+			if (!drive->moving && !drive->pvt.running) {
+				status |= STATUS_TARGET_REACHED;
+			}
+			memset(&frame, 0, sizeof(frame));
+			frame.can_id = COBID_RPDO4(drive->id);
+			frame.can_dlc = 4;
+			frame.data[0] = current & 0xff;
+			frame.data[1] = (current >> 8) & 0xff;
+			frame.data[2] = status & 0xff;
+			frame.data[3] = status >> 8;
+			reply(emu, drive, &frame, now);
+		}
+	}
+}
+
+/* Executes frames received from any link. */
+static void execute(TEmulator *emu, struct can_frame *frame, int count)
+{
+	TEmulatorDrive *drive;
+	long long now = timeNow();
+	unsigned int id;
+	int i, j;
+
+	emu->frames += count;
+	for (i = 0; i < count; i++) {
+		if (frame[i].can_id == COBID_SYNC) {
+			sendTelemetry(emu, now);
+			continue;
+		}
+
+		id = frame[i].can_id & 0x7f;
+		if (frame[i].can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) {
+			continue;
+		}
+
+		/* Commands to node 0 or to a group id are executed by all the drives addressed. */
+		if (frame[i].can_id == COBID_TPDO2(id) && frame[i].can_dlc >= 4 && !emu->drive[id]) {
+			for (j = 1; j < EMULATOR_MAX_NODES; j++) {
+				if ((drive = emu->drive[j]) && (id == 0 || drive->group == id)) {
+					command(emu, drive, &frame[i], now);
+				}
+			}
+			continue;
+		}
+
+		if (!(drive = emu->drive[id])) {
+			continue;
+		}
+
+		/* Like on a bus, a drive answers on its own link whichever socket the request came from. */
+		if (frame[i].can_id == COBID_TPDO2(id) && frame[i].can_dlc >= 4) {
+			command(emu, drive, &frame[i], now);
+		} else if (frame[i].can_id == COBID_SDO_RX(id) && frame[i].can_dlc == 8) {
+			sdo(emu, drive, &frame[i], now);
+		} else if (frame[i].can_id == COBID_TPDO3(id) && frame[i].can_dlc >= 4 &&
+			   pdoEnabled(drive, 0x1402)) {
+			queuePoint(drive, &frame[i], now);
+		}
+	}
+}
+
+static int serve(TEmulator *emu, int socket)
+{
+	struct can_frame frame[CAN_BATCH];
+	int count;
+
+	if ((count = readFrames(socket, frame, CAN_BATCH)) < 0) {
+		return count;
+	}
+
+	execute(emu, frame, count);
+	return 0;
+}
+
+/* The TCan executes the frames it sends in its own thread: no emulator thread, no system calls. */
+static void deliver(void *arg, const struct can_frame *frame, int count)
+{
+	struct can_frame copy[CAN_BATCH];
+	int n;
+
+	for (; count > 0; frame += n, count -= n) {
+		n = count < CAN_BATCH ? count : CAN_BATCH;
+		memcpy(copy, frame, n * sizeof(*frame));
+		execute((TEmulator *)arg, copy, n);
+	}
+}
+
+/*
+ * Replies held back by the latency are sent while the TCan waits for them. Returns when
+ * the next one is due, so that the TCan sleeps until then.
+ */
+static long long pollReplies(void *arg)
+{
+	TEmulator *emu = (TEmulator *)arg;
+
+	if (emu->head != emu->tail && emu->queue[emu->head % EMULATOR_QUEUE_SIZE].due <= timeNow()) {
+		flushReplies(emu, timeNow());
+	}
+	return emu->head != emu->tail ? emu->queue[emu->head % EMULATOR_QUEUE_SIZE].due : 0;
+}
+
+int emulatorLoopback(TEmulator *emu, TCan *can, int id)
+{
+	TEmulatorDrive *drive;
+
+	if (!(drive = createDrive(emu, id, -1))) {
+		return -1;
+	}
+
+	if (!(drive->link = loopbackAttach(can, deliver, pollReplies, emu))) {
+		emu->drive[id] = NULL;
+		free(drive);
+		return -2;
+	}
+
+	can->id = id;
+	if (registerReplies(can) < 0) {
+		return -3;
+	}
+	return can->transport->open(can);
+}
+
+int emulatorStep(TEmulator *emu, int timeout)
+{
+	struct epoll_event event[16];
+	unsigned long long expirations;
+	int count;
+	int i;
+
+	if ((count = epoll_wait(emu->epoll, event, 16, timeout)) < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror("epoll_wait");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (event[i].data.fd == emu->timer) {
+			if (read(emu->timer, &expirations, sizeof(expirations)) < 0) {
+				continue;
+			}
+		} else if (serve(emu, event[i].data.fd) < 0) {
+			return -2;
+		}
+	}
+
+	flushReplies(emu, timeNow());
+	return 0;
+}
+
+int emulatorRun(TEmulator *emu)
+{
+	int rval;
+
+	while (emu->running) {
+		/* Wake up now and then to notice running being cleared. */
+		if ((rval = emulatorStep(emu, 100)) < 0) {
+			return rval;
+		}
+	}
+	return 0;
+}
+
+static void *emulatorThread(void *arg)
+{
+	emulatorRun((TEmulator *)arg);
+	return NULL;
+}
+
+int emulatorStart(TEmulator *emu)
+{
+	emu->running = 1;
+	if (pthread_create(&emu->thread, NULL, emulatorThread, emu) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+void emulatorStop(TEmulator *emu)
+{
+	emu->running = 0;
+	pthread_join(emu->thread, NULL);
+}
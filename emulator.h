@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_EMULATOR_H
+#define ELMO_EMULATOR_H
+
+#include <pthread.h>
+
+#include "can.h"
+#include "transport.h"
+
+/** Number of CANOpen node ids (0 is not a valid node) */
+#define EMULATOR_MAX_NODES 128
+
+/** Values kept per drive for the commands and objects without a model */
+#define EMULATOR_REGISTERS 64
+
+/** Largest object a drive keeps from a segmented or block SDO download */
+#define EMULATOR_DOMAIN_SIZE (1 << 20)
+
+/** Segments per block of the block SDO downloads */
+#define EMULATOR_SDO_BLOCK 127
+
+/** Replies waiting for their latency to pass, must be a power of two */
+#define EMULATOR_QUEUE_SIZE 1024
+
+/** Speed used by position mode motions before SP is set, in counts/s */
+#define EMULATOR_DEFAULT_SPEED 100000
+
+/** Continuous current limit before MC is set, in A */
+#define EMULATOR_DEFAULT_MAXCURRENT 10.0f
+
+/** Points in the PVT/PT table of a drive, as TRAJECTORY_DRIVE_BUFFER */
+#define EMULATOR_PVT_POINTS 64
+
+/** Time from MO=1 until the drive reports the motor on, in microseconds */
+#define EMULATOR_ENABLE_TIME 2000
+
+/** Torque mode acceleration per ampere, in counts/s^2 */
+#define EMULATOR_TORQUE_GAIN 200000.0
+
+/** Torque mode viscous damping, in 1/s */
+#define EMULATOR_DAMPING 5.0
+
+/**
+ * A value kept for a binary interpreter command or an SDO object without a model.
+ */
+typedef struct {
+	unsigned int key;         /** mnemonic and index, or object index and subindex */
+	int sdo;                  /** nonzero for an SDO object */
+	unsigned char value[4];   /** the value as sent */
+} TEmulatorRegister;
+
+/**
+ * State of the SDO server of a drive during a segmented or block transfer.
+ */
+typedef struct {
+	int state;                /** transfer in progress, 0 if none */
+	unsigned int pos;         /** bytes transferred */
+	int toggle;               /** toggle bit of the next segment */
+	int blksize;              /** segments per block */
+	int seqno;                /** last segment received in order */
+	unsigned int blockstart;  /** byte offset of the block being uploaded */
+	int crc;                  /** nonzero if the client checks the CRC */
+	int last;                 /** nonzero once the last segment was received */
+} TEmulatorSdo;
+
+/**
+ * The data recorder of a drive. It samples the motor model every gap RECORDER_QUANTUM
+ * units, catching up whenever the model is advanced.
+ */
+typedef struct {
+	unsigned int signals;     /** RC */
+	int gap;                  /** RG */
+	int length;               /** RL */
+	int state;                /** enum RecorderState, read by RR */
+	long long next;           /** timeNow() of the next sample */
+	int samples;              /** samples recorded */
+	unsigned char *data;      /** RECORDER_MAX_LENGTH samples of each signal, little endian */
+} TEmulatorRecorder;
+
+/**
+ * The PVT/PT table of a drive. The points received on its RPDO3 (objects 0x2001 and
+ * 0x2002) are written to it cyclically from index 1 on, and executed from BG after PV=1
+ * or PT=1 until the table runs out, which ends the motion. MO=0 and ST empty it.
+ */
+typedef struct {
+	int position[EMULATOR_PVT_POINTS]; /** positions at the ends of the segments */
+	unsigned char time[EMULATOR_PVT_POINTS]; /** segment times in ms, 0 for MP[4] (PT) */
+	unsigned int read;        /** points executed, the one in progress is read % size */
+	unsigned int write;       /** points received */
+	int armed;                /** PV or PT set and waiting for BG, 0 if not */
+	int running;              /** nonzero while the points are executed */
+	double from;              /** position at the start of the segment in progress */
+	long long begun;          /** timeNow() the segment in progress began */
+	unsigned long underflows; /** motions ended by running out of points */
+	unsigned long dropped;    /** points lost because the table was full */
+} TEmulatorPvt;
+
+/**
+ * An emulated drive: the motor model and the state of the interpreter.
+ */
+typedef struct {
+	unsigned int id;          /** node id */
+	int socket;               /** socket the drive sends on, -1 on a loopback link */
+	struct TCanLink *link;    /** loopback end of the TCan of the drive, NULL if none */
+	int motoron;              /** MO as commanded */
+	long long enabled;        /** timeNow() when MO=1 takes effect */
+	int unitmode;             /** UM */
+	int speed;                /** SP in counts/s */
+	int limits[4];            /** VL[2], VH[2], LL[2], HL[2] */
+	float maxcurrent;         /** MC */
+	float torque;             /** TC */
+	int target;               /** PA, moved by PR */
+	int moving;               /** nonzero between BG and the end of the motion */
+	long long started;        /** timeNow() of the last BG */
+	unsigned int group;       /** group id the drive also accepts commands on, 0 for none */
+	double position;          /** PX */
+	double velocity;          /** VX in counts/s */
+	float current;            /** IQ */
+	long long updated;        /** timeNow() the model was last advanced to */
+	TEmulatorRegister reg[EMULATOR_REGISTERS]; /** other commands and objects */
+	unsigned char *domain;    /** the object of the segmented and block SDO transfers */
+	unsigned int domainkey;   /** its index and subindex */
+	unsigned int domainsize;  /** its size in bytes */
+	TEmulatorSdo sdo;         /** the SDO server */
+	TEmulatorRecorder recorder; /** the data recorder */
+	TEmulatorPvt pvt;         /** the PVT/PT table */
+	int nreg;                 /** number of registers */
+	unsigned long commands;   /** commands answered */
+	unsigned long errors;     /** commands answered with the error flag */
+} TEmulatorDrive;
+
+/**
+ * A reply waiting for its latency to pass.
+ */
+typedef struct {
+	struct can_frame frame;   /** the reply */
+	TEmulatorDrive *drive;    /** the drive sending it */
+	long long due;            /** timeNow() when it is sent */
+} TEmulatorReply;
+
+/**
+ * Emulates Elmo drives answering the binary interpreter over PDO2 (MO, UM, PA, PR, SP,
+ * BG, ST, MS, PX, IQ, MC, TC, VL/VH/LL/HL, the recorder RC/RG/RL/RR, PV/PT with the
+ * trajectory points of TPDO3 and the SN[2] echo), also when sent to a group id or to all
+ * the drives, SDO transfers and SYNC driven telemetry PDOs, for any number of node ids. Objects up to four bytes are kept as registers; each
+ * drive also keeps one larger object (the domain), written by a segmented or block
+ * download or by emulatorSetDomain(), and read back by any upload. The recorded samples
+ * are uploaded from RECORDER_OBJECT. The drives are reached over a CAN interface (vcan)
+ * or in-process over socketpairs or the loopback transport.
+ *
+ * Like a real drive it rejects UM while the motor is on and BG while it is off, and MO=1
+ * takes EMULATOR_ENABLE_TIME to take effect. Replies are sent in order after a latency
+ * and a random jitter.
+ */
+typedef struct {
+	TCan *can;                /** CAN interface socket, NULL if only socketpairs are used */
+	TEmulatorDrive *drive[EMULATOR_MAX_NODES]; /** drives by node id */
+	int epoll;                /** epoll instance of the sockets and the timer */
+	int timer;                /** timerfd of the next due reply */
+	long latency;             /** reply latency in microseconds */
+	long jitter;              /** maximum random extra latency in microseconds */
+	unsigned int seed;        /** state of the jitter generator */
+	TEmulatorReply queue[EMULATOR_QUEUE_SIZE]; /** delayed replies in due order */
+	unsigned int head;        /** index of the next reply to send */
+	unsigned int tail;        /** index of the next free slot */
+	unsigned long frames;     /** frames received */
+	unsigned long replies;    /** frames sent */
+	unsigned long dropped;    /** replies dropped because the queue was full */
+	volatile int running;     /** cleared to stop emulatorRun() */
+	pthread_t thread;         /** thread of emulatorStart() */
+} TEmulator;
+
+/**
+ * Constructs a new TEmulator without drives.
+ *
+ * @return The pointer to a new TEmulator, NULL on errors.
+ */
+TEmulator *TEmulatorConstruct(void);
+
+/**
+ * Destructs a TEmulator, closing its sockets. The emulator must be stopped first.
+ *
+ * @param emu The pointer to the TEmulator to be destructed.
+ */
+void TEmulatorDestruct(TEmulator *emu);
+
+/**
+ * Opens a CAN interface. The drives added with emulatorAddDrive() answer on it.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param iface The name of the CAN interface.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorOpen(TEmulator *emu, const char *iface);
+
+/**
+ * Adds a drive answering on the CAN interface.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param id The node id of the drive.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorAddDrive(TEmulator *emu, int id);
+
+/**
+ * Adds a drive connected to a TCan in the same process by a socketpair, and opens the
+ * TCan on it instead of TCanOpen(). The filters of the TCan pass everything: the drive
+ * only sends the frames of its own node.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param can The pointer to a constructed TCan.
+ * @param id The node id of the drive.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorConnect(TEmulator *emu, TCan *can, int id);
+
+/**
+ * Adds a drive connected to a TCan by the in-process loopback transport, and opens the
+ * TCan on it instead of TCanOpen(). The frames the TCan sends are executed in its own
+ * thread as they are sent and the replies put straight into its receive ring, without
+ * system calls or the emulator thread, so loopback drives run at memory speed. They must
+ * be used from one thread, and the emulator must not be started while they are used.
+ * @param emu The pointer to the TEmulator.
+ * @param can The pointer to a constructed TCan.
+ * @param id The node id of the drive.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorLoopback(TEmulator *emu, TCan *can, int id);
+
+/**
+ * Makes a drive also execute the binary interpreter commands sent to the PDO2 COB-ID of
+ * a group id. Commands to node 0 are executed by all the drives.
+ * @param emu The pointer to the TEmulator.
+ * @param id The node id of the drive.
+ * @param group The group id, a node id no drive uses.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorSetGroup(TEmulator *emu, int id, int group);
+
+/**
+ * Sets the object a drive returns to the uploads of the given index and subindex.
+ * @param emu The pointer to the TEmulator.
+ * @param id The node id of the drive.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param data The data, copied.
+ * @param size The size in bytes, at most EMULATOR_DOMAIN_SIZE.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorSetDomain(TEmulator *emu, int id, unsigned short index, unsigned char subindex,
+		      const void *data, unsigned int size);
+
+/**
+ * Sends an emergency message of a drive at once, bypassing the reply latency. The state
+ * of the drive is not changed. For a socket drive it may be called from any thread; for
+ * a loopback drive only from the thread using its TCan.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param id The node id of the drive.
+ * @param code The EMCY error code, 0 for an error reset.
+ * @param reg The error register.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorEmergency(TEmulator *emu, int id, unsigned short code, unsigned char reg);
+
+/**
+ * Sends a heartbeat message of a drive at once, like emulatorEmergency().
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param id The node id of the drive.
+ * @param state The NMT state reported.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorHeartbeat(TEmulator *emu, int id, unsigned char state);
+
+/**
+ * Sets the latency of the replies.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param latency The latency in microseconds.
+ * @param jitter The maximum random extra latency in microseconds.
+ */
+void emulatorSetLatency(TEmulator *emu, long latency, long jitter);
+
+/**
+ * Waits for frames and due replies and handles them, at most for the given time.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @param timeout The longest wait in milliseconds, -1 waits forever.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorStep(TEmulator *emu, int timeout);
+
+/**
+ * Runs emulatorStep() until running is cleared.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @return 0 when stopped, <0 on errors.
+ */
+int emulatorRun(TEmulator *emu);
+
+/**
+ * Runs the emulator in a thread of its own.
+ *
+ * @param emu The pointer to the TEmulator.
+ * @return 0 on success, <0 otherwise.
+ */
+int emulatorStart(TEmulator *emu);
+
+/**
+ * Stops the thread of emulatorStart().
+ *
+ * @param emu The pointer to the TEmulator.
+ */
+void emulatorStop(TEmulator *emu);
+
+#endif /* ELMO_EMULATOR_H */
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "histogram.h"
+
+void histogramReset(THistogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static int bucketOf(long value)
+{
+	int shift = 0;
+
+	if (value >= 1L << HISTOGRAM_RANGE_BITS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	/* Keep the HISTOGRAM_SUB_BITS + 1 highest bits, the first of them is always set. */
+	while (value >> shift >= 2 * HISTOGRAM_SUB) {
+		shift++;
+	}
+	return shift * HISTOGRAM_SUB + (int)(value >> shift);
+}
+
+static long bucketMax(int index)
+{
+	int shift = index < 2 * HISTOGRAM_SUB ? 0 : index / HISTOGRAM_SUB - 1;
+	long mantissa = index - shift * HISTOGRAM_SUB;
+
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void histogramAdd(THistogram *h, long value)
+{
+	if (value < 0) {
+		value = 0;
+	}
+
+	h->bucket[bucketOf(value)]++;
+	if (h->count == 0 || value < h->min) {
+		h->min = value;
+	}
+	if (value > h->max) {
+		h->max = value;
+	}
+	h->total += value;
+	h->count++;
+}
+
+void histogramMerge(THistogram *h, const THistogram *other)
+{
+	int i;
+
+	if (other->count == 0) {
+		return;
+	}
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		h->bucket[i] += other->bucket[i];
+	}
+	if (h->count == 0 || other->min < h->min) {
+		h->min = other->min;
+	}
+	if (other->max > h->max) {
+		h->max = other->max;
+	}
+	h->total += other->total;
+	h->count += other->count;
+}
+
+long histogramPercentile(const THistogram *h, double percentile)
+{
+	unsigned long rank, seen = 0;
+	int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	rank = (unsigned long)(percentile / 100.0 * h->count + 0.5);
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank) {
+			return bucketMax(i) < h->max ? bucketMax(i) : h->max;
+		}
+	}
+	return h->max;
+}
+
+void printHistogram(const THistogram *h, const char *name, FILE *out)
+{
+	fprintf(out, "%-8s %8lu %8ld %8lld %8ld %8ld %8ld %8ld %8ld\n", name, h->count, h->min,
+		h->count ? h->total / (long long)h->count : 0,
+		histogramPercentile(h, 50), histogramPercentile(h, 90), histogramPercentile(h, 99),
+		histogramPercentile(h, 99.9), h->max);
+}
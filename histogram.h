@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_HISTOGRAM_H
+#define ELMO_HISTOGRAM_H
+
+#include <stdio.h>
+
+/** Bits of resolution per power of two: values are recorded within 1/32 (3 %) */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+
+/** Values up to 2^HISTOGRAM_RANGE_BITS - 1 are recorded, larger ones in the last bucket */
+#define HISTOGRAM_RANGE_BITS 27
+
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_RANGE_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+/**
+ * A log-linear (HDR style) histogram of non-negative values. Values below HISTOGRAM_SUB
+ * are exact, above that every power of two is split into HISTOGRAM_SUB buckets, so the
+ * relative error is constant over the whole range.
+ */
+typedef struct {
+	unsigned long bucket[HISTOGRAM_BUCKETS]; /** counts by bucket */
+	unsigned long count;      /** recorded values */
+	long min;                 /** smallest recorded value */
+	long max;                 /** largest recorded value */
+	long long total;          /** sum of the recorded values */
+} THistogram;
+
+/**
+ * Clears a histogram.
+ *
+ * @param h The histogram.
+ */
+void histogramReset(THistogram *h);
+
+/**
+ * Records a value. Negative values are recorded as 0.
+ *
+ * @param h The histogram.
+ * @param value The value.
+ */
+void histogramAdd(THistogram *h, long value);
+
+/**
+ * Adds the values recorded in one histogram to another.
+ *
+ * @param h The histogram added to.
+ * @param other The histogram added.
+ */
+void histogramMerge(THistogram *h, const THistogram *other);
+
+/**
+ * Returns the value below which the given percentage of the recorded values fall, as
+ * the upper bound of its bucket.
+ *
+ * @param h The histogram.
+ * @param percentile The percentile, 0-100.
+ * @return The value, 0 if the histogram is empty.
+ */
+long histogramPercentile(const THistogram *h, double percentile);
+
+/**
+ * Writes one line of statistics: count, min, mean, p50, p90, p99, p99.9 and max.
+ *
+ * @param h The histogram.
+ * @param name The name of the line.
+ * @param out The stream.
+ */
+void printHistogram(const THistogram *h, const char *name, FILE *out);
+
+#endif /* ELMO_HISTOGRAM_H */
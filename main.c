@@ -18,7 +18,12 @@
 #include <stdlib.h>
 
 #include "can.h"
+#include "capture.h"
 #include "elmo.h"
+#include "emulator.h"
+#include "telemetry.h"
+#include "telemetrylog.h"
+#include "trace.h"
 
 /**
  * CAN device interface name.
@@ -31,21 +36,88 @@
 #define CANOPEN_ID 127
 
 /**
- * Prints position and force readings from the motor controller.
+ * Telemetry log file the readings are written to. Watch it with: ./tlog elmo.tlog tail
+ */
+#define TELEMETRY_LOG "elmo.tlog"
+
+/**
+ * Number of records kept in the telemetry log.
+ */
+#define TELEMETRY_LOG_SIZE 65536
+
+/**
+ * Capture file of the frames on the bus, always on. Convert it to a candump log with:
+ * ./cantrace export elmo.cap can0
+ */
+#define CAPTURE_FILE "elmo.cap"
+
+/**
+ * Number of frames kept in the capture.
+ */
+#define CAPTURE_SIZE (1 << 20)
+
+static TTelemetryLog tlog;
+static TCapture capture;
+
+/**
+ * Logs position and force readings from the motor controller to the telemetry log.
  * Note: this function will never exit.
  */
 void print_info(TCan *can)
 {
-	int f;
-	float a;
+	TElmoRequest req[2];
+	TLogRecord record;
+
+	memset(&record, 0, sizeof(record));
+	record.node = can->id;
 	while (1) {
-		getPosition(can, &f);
-		getForce(can, &a);
-		printf("position = %d\tforce = %f\n", f, a);
+		/* Both queries are put in flight at once: one round trip per sample. */
+		if (getPositionAsync(can, &req[0]) < 0 || getForceAsync(can, &req[1]) < 0) {
+			cancelRequest(can, &req[0]);
+			cancelRequest(can, &req[1]);
+			usleep(500 * 1000);
+			continue;
+		}
+		if (waitRequests(can, req, 2) < 0) {
+			/* A lost or failed reply is not logged, the requests are no longer pending. */
+			usleep(500 * 1000);
+			continue;
+		}
+		record.time = timeNow();
+		record.position = requestInt(&req[0]);
+		record.current = requestFloat(&req[1]);
+		logRecord(&tlog, &record);
 		usleep(500 * 1000);
 	}
 }
 
+/**
+ * Logs the position and force telemetry streamed by the motor controller every 10 ms,
+ * without polling. Falls back to print_info() if the drive does not stream.
+ * Note: this function will never exit.
+ */
+void print_telemetry(TCan *can)
+{
+	TTelemetry tm;
+	TTelemetrySample sample;
+
+	if (subscribeTelemetry(can, &tm, logTelemetry, &tlog) < 0 ||
+	    configureTelemetry(can, TELEMETRY_EVENT, 10) < 0) {
+		printf("Telemetry PDOs not configured, polling instead\n");
+		unsubscribeTelemetry(can);
+		print_info(can);
+	}
+
+	while (readTelemetry(can, &tm, &sample) == 0) {
+		/* The callback has logged the sample. */
+	}
+
+	printf("Telemetry lost, polling instead\n");
+	disableTelemetry(can);
+	unsubscribeTelemetry(can);
+	print_info(can);
+}
+
 /**
  * Drive the motor with speed 30000 to position 4000000.
  */
@@ -53,7 +125,7 @@ void test_position(TCan *can)
 {
 	setSpeed(can, 30000);
 	setPosition(can, 500000);
-	print_info(can);
+	print_telemetry(can);
 }
 
 /**
@@ -62,7 +134,7 @@ void test_position(TCan *can)
 void test_force(TCan *can)
 {
 	setForce(can, 0.6);
-	print_info(can);
+	print_telemetry(can);
 }
 
 /**
@@ -86,6 +158,13 @@ void test(TCan *can)
 	//test_force(can);
 
 	stop(can);
+
+	printf("motor on: %lu transitions, last %ld us, max %ld us\n",
+	       can->motoron.count, can->motoron.last, can->motoron.max);
+	printf("motor off: %lu transitions, last %ld us, max %ld us\n",
+	       can->motoroff.count, can->motoroff.last, can->motoroff.max);
+	printf("replies: %lu, max %ld us, %lu retries, %lu timeouts\n",
+	       can->reply.count, can->reply.max, can->retries, can->timeouts);
 }
 
 /**
@@ -94,28 +173,60 @@ void test(TCan *can)
  * function calls to be given afterwards. The useful commands are put in
  * the test() function. To be able to run the useful commands one has to
  * remember to use first start.sh and run the useful commands in it.
+ *
+ * Usage: main [interface], the default interface is CAN_INTERFACE. With "loopback" the
+ * test runs against a drive emulated in this process.
  */
-int main()
+int main(int argc, char **argv)
 {
+	const char *iface = argc > 1 ? argv[1] : CAN_INTERFACE;
+	TEmulator *emu = NULL;
+
 	printf("CAN test begins\n");
 
-	TCan *can = TCanConstruct(CAN_INTERFACE);
+	TCan *can = TCanConstruct(iface);
 	if (!can) {
 		printf("Could not construct can\n");
 		return EXIT_FAILURE;
 	}
 	
-	if (TCanOpen(can, CANOPEN_ID) < 0) {
+	/* Kernel timestamps split the round trips into host and bus + drive time. */
+	setTimestamping(can, CAN_TIMESTAMP_SOFTWARE);
+
+	/* Every frame sent and received from the start, NMT included. */
+	if (createCapture(&capture, CAPTURE_FILE, CAPTURE_SIZE) < 0) {
+		printf("Could not create the capture\n");
+		return EXIT_FAILURE;
+	}
+	enableCapture(can, &capture);
+
+	if (!strcmp(iface, "loopback")) {
+		emu = TEmulatorConstruct();
+		if (!emu || emulatorConnect(emu, can, CANOPEN_ID) < 0 || emulatorStart(emu) < 0) {
+			printf("Could not start the emulator\n");
+			return EXIT_FAILURE;
+		}
+	} else if (TCanOpen(can, CANOPEN_ID) < 0) {
 		printf("CanOpen failed\n");
 		return EXIT_FAILURE;
 	}
 
+	if (createTelemetryLog(&tlog, TELEMETRY_LOG, TELEMETRY_LOG_SIZE) < 0) {
+		printf("Could not create the telemetry log\n");
+		return EXIT_FAILURE;
+	}
+
+	if (enableTrace(can) < 0) {
+		printf("Could not enable tracing\n");
+	}
+
 	if (sendEchoMessage(can) < 0) {
 		printf("Echo failed\n");
 		return EXIT_FAILURE;
 	}
 
 	test(can);
+	printTrace(can, stdout);
 
 	if (TCanClose(can) < 0) {
 		printf("CanClose failed\n");
@@ -123,6 +234,13 @@ int main()
 	}
 
 	TCanDestruct(can);
+	closeTelemetryLog(&tlog);
+	closeCapture(&capture);
+
+	if (emu) {
+		emulatorStop(emu);
+		TEmulatorDestruct(emu);
+	}
 	
 	printf("CAN test end\n");
 	return EXIT_SUCCESS;
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "elmocmd.h"
+#include "monitor.h"
+
+/*
+ * Emergency codes of the Elmo drives (the CAN Emergency table of the Elmo CANopen
+ * implementation guide).
+ */
+static const struct {
+	unsigned short code;
+	const char *text;
+} elmoEmergencies[] = {
+	{ 0x2340, "short circuit: the motor or its wiring may be shorted" },
+	{ 0x3120, "under-voltage: the power supply voltage is too low" },
+	{ 0x3310, "over-voltage: the power supply voltage is too high" },
+	{ 0x4310, "temperature: the drive is overheating" },
+	{ 0x5441, "motor disabled by the inhibit or abort input" },
+	{ 0x5442, "motion aborted by a limit switch" },
+	{ 0x6180, "fatal CPU error: stack overflow" },
+	{ 0x6200, "user program aborted by an error" },
+	{ 0x7121, "motor stuck: current applied but no motion" },
+	{ 0x7300, "feedback error" },
+	{ 0x8110, "CAN message lost (receive overrun)" },
+	{ 0x8130, "heartbeat or life guard error" },
+	{ 0x8200, "CAN protocol error" },
+	{ 0x8210, "PDO not processed: length error" },
+	{ 0x8220, "PDO length exceeded" },
+	{ 0x8311, "peak current exceeded" },
+	{ 0x8380, "cannot find the electrical zero of the motor" },
+	{ 0x8381, "cannot tune the current offsets" },
+	{ 0x8480, "speed tracking error" },
+	{ 0x8481, "speed limit exceeded" },
+	{ 0x8611, "position tracking error" },
+	{ 0x8680, "position limit exceeded" },
+};
+
+/* CiA 301 error classes, by the high byte of the code. */
+static const struct {
+	unsigned char code;
+	const char *text;
+} errorClasses[] = {
+	{ 0x10, "generic error" },
+	{ 0x20, "current" },
+	{ 0x21, "current, device input side" },
+	{ 0x22, "current inside the device" },
+	{ 0x23, "current, device output side" },
+	{ 0x30, "voltage" },
+	{ 0x31, "mains voltage" },
+	{ 0x32, "voltage inside the device" },
+	{ 0x33, "output voltage" },
+	{ 0x40, "temperature" },
+	{ 0x41, "ambient temperature" },
+	{ 0x42, "device temperature" },
+	{ 0x50, "device hardware" },
+	{ 0x60, "device software" },
+	{ 0x61, "internal software" },
+	{ 0x62, "user software" },
+	{ 0x63, "data set" },
+	{ 0x70, "additional modules" },
+	{ 0x80, "monitoring" },
+	{ 0x81, "communication" },
+	{ 0x82, "protocol error" },
+	{ 0x84, "velocity monitoring" },
+	{ 0x86, "position monitoring" },
+	{ 0x90, "external error" },
+	{ 0xf0, "additional functions" },
+	{ 0xff, "device specific" },
+};
+
+const char *emergencyText(unsigned short code)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(elmoEmergencies) / sizeof(elmoEmergencies[0]); i++) {
+		if (elmoEmergencies[i].code == code) {
+			return elmoEmergencies[i].text;
+		}
+	}
+
+	/* The class of the high byte, or of its high nibble. */
+	for (i = 0; i < sizeof(errorClasses) / sizeof(errorClasses[0]); i++) {
+		if (errorClasses[i].code == code >> 8) {
+			return errorClasses[i].text;
+		}
+	}
+	for (i = 0; i < sizeof(errorClasses) / sizeof(errorClasses[0]); i++) {
+		if (errorClasses[i].code == ((code >> 8) & 0xf0)) {
+			return errorClasses[i].text;
+		}
+	}
+	return "unknown error";
+}
+
+static const char *busErrorText(unsigned int class)
+{
+	if (class & CAN_ERR_BUSOFF) {
+		return "bus off";
+	}
+	if (class & CAN_ERR_TX_TIMEOUT) {
+		return "transmit timeout";
+	}
+	if (class & CAN_ERR_CRTL) {
+		return "controller problem";
+	}
+	if (class & CAN_ERR_RESTARTED) {
+		return "controller restarted";
+	}
+	return "bus error";
+}
+
+int startMonitor(TCan *can, TMonitor *mon, TFaultCallback callback, void *arg)
+{
+	memset(mon, 0, sizeof(*mon));
+	mon->state = -1;
+	mon->callback = callback;
+	mon->arg = arg;
+	can->monitor = mon;
+	return 0;
+}
+
+void stopMonitor(TCan *can)
+{
+	can->monitor = NULL;
+}
+
+void armStop(TCan *can, const struct can_frame *frame, int sources)
+{
+	TMonitor *mon = can->monitor;
+	unsigned char data[8];
+	TElmoValue off;
+	int size;
+
+	if (frame) {
+		mon->stop = *frame;
+	} else {
+		off.i = 0;
+		size = elmoEncode(ELMO_CMD(MO), data, &off);
+		createFrame(&mon->stop, COBID_TPDO2(can->id), size, data);
+	}
+	mon->reactions = sources;
+}
+
+/*
+ * The stop frame goes out first, straight to the transport: not even a batch being
+ * collected holds it back. Then the fault is queued and passed to the callback.
+ */
+static void raiseFault(TCan *can, TMonitor *mon, TFault *fault)
+{
+	unsigned int tail = mon->tail;
+
+	if ((mon->reactions & fault->source) && sendFrames(can, &mon->stop, 1) == 0) {
+		mon->reacted = timeNow();
+		mon->stops++;
+		histogramAdd(&mon->reaction, (long)(mon->reacted - fault->time));
+	}
+
+	mon->faults++;
+	if (tail - __atomic_load_n(&mon->head, __ATOMIC_ACQUIRE) < MONITOR_QUEUE_SIZE) {
+		mon->queue[tail % MONITOR_QUEUE_SIZE] = *fault;
+		__atomic_store_n(&mon->tail, tail + 1, __ATOMIC_RELEASE);
+	} else {
+		mon->dropped++;
+	}
+
+	if (mon->callback) {
+		mon->callback(can, fault, mon->arg);
+	}
+}
+
+int monitoredFrame(TCan *can, const struct can_frame *frame)
+{
+	return (frame->can_id & CAN_ERR_FLAG) ||
+	       (frame->can_id == COBID_EMCY(can->id) && frame->can_dlc >= 2) ||
+	       (frame->can_id == COBID_HEARTBEAT(can->id) && frame->can_dlc >= 1);
+}
+
+int monitorFrame(TCan *can, const struct can_frame *frame, long long stamp)
+{
+	TMonitor *mon = can->monitor;
+	TFault fault;
+
+	if (!monitoredFrame(can, frame)) {
+		return 0;
+	}
+
+	memset(&fault, 0, sizeof(fault));
+	fault.time = timeNow();
+	fault.stamp = stamp;
+
+	if (frame->can_id & CAN_ERR_FLAG) {
+		mon->errorframes++;
+		fault.source = FAULT_BUS;
+		fault.code = (unsigned short)(frame->can_id & CAN_ERR_MASK);
+		memcpy(fault.data, frame->data, 8);
+		fault.text = busErrorText(frame->can_id & CAN_ERR_MASK);
+	} else if (frame->can_id == COBID_EMCY(can->id)) {
+		mon->emergencies++;
+		fault.source = FAULT_EMCY;
+		fault.code = frame->data[0] | (frame->data[1] << 8);
+		if (fault.code == 0x0000) {
+			return 1; /* error reset */
+		}
+		fault.reg = frame->data[2];
+		memcpy(fault.data, &frame->data[3], 5);
+		fault.text = emergencyText(fault.code);
+	} else {
+		mon->heartbeats++;
+		mon->heartbeat = fault.time;
+		mon->state = frame->data[0] & 0x7f;
+		if (mon->state != NMT_BOOTUP && mon->state != NMT_STOPPED) {
+			return 1;
+		}
+		fault.source = FAULT_HEARTBEAT;
+		fault.code = (unsigned short)mon->state;
+		fault.text = mon->state == NMT_BOOTUP ? "drive rebooted" : "drive stopped";
+	}
+
+	raiseFault(can, mon, &fault);
+	return 1;
+}
+
+void setHeartbeatTimeout(TCan *can, long timeout)
+{
+	__atomic_store_n(&can->monitor->heartbeattimeout, timeout, __ATOMIC_RELAXED);
+}
+
+int checkHeartbeat(TCan *can)
+{
+	TMonitor *mon = can->monitor;
+	long timeout = __atomic_load_n(&mon->heartbeattimeout, __ATOMIC_RELAXED);
+	TFault fault;
+
+	if (!timeout || !mon->heartbeat || timeNow() - mon->heartbeat <= timeout * 1000LL) {
+		return 0;
+	}
+
+	memset(&fault, 0, sizeof(fault));
+	fault.time = timeNow();
+	fault.source = FAULT_HEARTBEAT_LOST;
+	fault.text = "heartbeat lost";
+	mon->heartbeat = 0;
+	raiseFault(can, mon, &fault);
+	return 1;
+}
+
+int readFault(TMonitor *mon, TFault *fault)
+{
+	unsigned int head = mon->head;
+
+	if (head == __atomic_load_n(&mon->tail, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+
+	*fault = mon->queue[head % MONITOR_QUEUE_SIZE];
+	__atomic_store_n(&mon->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
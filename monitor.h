@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_MONITOR_H
+#define ELMO_MONITOR_H
+
+#include "can.h"
+#include "histogram.h"
+
+/** Faults kept until read with readFault(), a power of two */
+#define MONITOR_QUEUE_SIZE 32
+
+/** Longest wait of the I/O thread of a TCanBus between heartbeat checks, in microseconds */
+#define MONITOR_HEARTBEAT_CHECK 10000
+
+/** NMT states reported by the heartbeat (CiA 301) */
+#define NMT_BOOTUP 0x00
+#define NMT_STOPPED 0x04
+#define NMT_OPERATIONAL 0x05
+#define NMT_PRE_OPERATIONAL 0x7f
+
+/**
+ * What raised a fault.
+ */
+enum FaultSource
+{
+	FAULT_EMCY = 1,           /** an emergency message of the drive */
+	FAULT_HEARTBEAT = 2,      /** a heartbeat with the drive rebooted or stopped */
+	FAULT_HEARTBEAT_LOST = 4, /** no heartbeat within the timeout, see setHeartbeatTimeout() */
+	FAULT_BUS = 8             /** an error frame of the CAN controller */
+};
+
+/**
+ * A fault of a drive or of the bus.
+ */
+typedef struct {
+	long long time;           /** timeNow() when the frame was handled */
+	long long stamp;          /** kernel timestamp of the frame, 0 if unknown */
+	int source;               /** enum FaultSource */
+	unsigned short code;      /** EMCY error code, NMT state, or CAN_ERR_* class of an error frame */
+	unsigned char reg;        /** EMCY error register (object 0x1001) */
+	unsigned char data[8];    /** EMCY manufacturer specific bytes 3-7, error frame data */
+	const char *text;         /** description of the code */
+} TFault;
+
+/**
+ * Fault callback. Called from the function that received the frame: an I/O thread or
+ * the thread waiting for a reply. After the stop frame, if armed.
+ *
+ * The I/O thread of a TCanBus calls it without holding the lock of the bus, so it may
+ * send to any node. It must not wait for frames, since the thread calling it is the
+ * one dispatching them, nor stop the I/O thread or destruct a node of the bus.
+ */
+typedef void (*TFaultCallback)(TCan *can, const TFault *fault, void *arg);
+
+/**
+ * Monitor of the emergency, heartbeat and error frames of a drive. The frames are
+ * decoded into faults and passed to the callback as they are dispatched (by the I/O
+ * thread of a TCanBus or a TRtIo, or by any function of the TCan receiving frames), and
+ * dispatchFrame() consumes them instead of passing them to the frame handlers. If a stop frame is armed, it is sent before the
+ * callback is called, with no more work than one send.
+ */
+typedef struct TMonitor {
+	TFault queue[MONITOR_QUEUE_SIZE]; /** faults not read yet */
+	unsigned int head;        /** index of the next fault to be read */
+	unsigned int tail;        /** index of the next free slot */
+	unsigned long faults;     /** faults raised */
+	unsigned long dropped;    /** faults dropped because the queue was full */
+	unsigned long emergencies; /** EMCY messages, also error resets */
+	unsigned long heartbeats; /** heartbeat messages */
+	unsigned long errorframes; /** error frames */
+	int state;                /** NMT state of the last heartbeat, -1 if none yet */
+	long long heartbeat;      /** timeNow() of the last heartbeat, 0 if none */
+	long heartbeattimeout;    /** heartbeat timeout in microseconds, 0 if not checked */
+	TFaultCallback callback;  /** callback or NULL */
+	void *arg;                /** argument of the callback */
+	struct can_frame stop;    /** the frame sent on a fault */
+	int reactions;            /** enum FaultSource bits sending the stop frame, 0 for none */
+	unsigned long stops;      /** stop frames sent */
+	long long reacted;        /** timeNow() when the last stop frame was sent */
+	THistogram reaction;      /** frame handled to stop sent, ns */
+} TMonitor;
+
+/**
+ * Starts monitoring the drive. The emergency and heartbeat frames of the node pass the
+ * default filters; error frames pass the error mask (see setErrorMask()).
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param mon The monitor. Must stay valid until stopMonitor().
+ * @param callback The callback or NULL.
+ * @param arg The argument of the callback.
+ * @return 0 on success, <0 otherwise.
+ */
+int startMonitor(TCan *can, TMonitor *mon, TFaultCallback callback, void *arg);
+
+/**
+ * Stops monitoring the drive.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void stopMonitor(TCan *can);
+
+/**
+ * Arms the stop frame: it is sent as soon as a fault of the given sources is handled.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame, copied; NULL for MO=0 to the node of the TCan.
+ * @param sources The enum FaultSource bits reacted to, 0 disarms.
+ */
+void armStop(TCan *can, const struct can_frame *frame, int sources);
+
+/**
+ * Handles a frame if it is an emergency, heartbeat or error frame of the monitored
+ * drive. Called by dispatchFrame() and by the I/O thread of a TCanBus.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame.
+ * @param stamp The kernel timestamp of the frame, 0 if unknown.
+ * @return 1 if the frame was consumed, 0 otherwise.
+ */
+int monitorFrame(TCan *can, const struct can_frame *frame, long long stamp);
+
+/**
+ * Returns whether a frame is an emergency, heartbeat or error frame of the monitored
+ * drive, one monitorFrame() consumes.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param frame The frame.
+ * @return Nonzero if the frame is monitored.
+ */
+int monitoredFrame(TCan *can, const struct can_frame *frame);
+
+/**
+ * Sets the heartbeat timeout: FAULT_HEARTBEAT_LOST is raised when no heartbeat arrives
+ * within it. The heartbeat is checked by the thread dispatching the frames of the node:
+ * the I/O thread of a TCanBus (at least every MONITOR_HEARTBEAT_CHECK) or of a TRtIo,
+ * or else the thread receiving frames of the TCan.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param timeout The timeout in microseconds, 0 not to check.
+ */
+void setHeartbeatTimeout(TCan *can, long timeout);
+
+/**
+ * Raises FAULT_HEARTBEAT_LOST if no heartbeat arrived within the heartbeat timeout.
+ * Raised once per lost heartbeat; the timer starts at the first heartbeat. Like
+ * monitorFrame(), only to be called by the thread dispatching the frames of the node.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 1 if the fault was raised, 0 otherwise.
+ */
+int checkHeartbeat(TCan *can);
+
+/**
+ * Takes the oldest fault, if any. May be called from another thread than the one
+ * handling the frames.
+ *
+ * @param mon The monitor.
+ * @param fault The pointer where the fault is stored.
+ * @return 0 on success, -1 if there is none.
+ */
+int readFault(TMonitor *mon, TFault *fault);
+
+/**
+ * Returns the description of an emergency error code: the Elmo specific meaning if
+ * known, the CiA 301 error class otherwise.
+ *
+ * @param code The EMCY error code.
+ * @return The description.
+ */
+const char *emergencyText(unsigned short code);
+
+#endif /* ELMO_MONITOR_H */
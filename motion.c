@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "motion.h"
+#include "elmocmd.h"
+
+static const char *triggers[] = { "sequential", "batch", "group" };
+
+void initMotionGroup(TMotionGroup *group, int trigger, unsigned int id)
+{
+	memset(group, 0, sizeof(*group));
+	group->trigger = trigger;
+	group->group = id;
+	group->bitrate = MOTION_BITRATE;
+	group->skew = -1;
+}
+
+int addMotionAxis(TMotionGroup *group, TCan *can)
+{
+	if (group->axes >= MOTION_MAX_AXES) {
+		return -1;
+	}
+
+	group->axis[group->axes] = can;
+	return group->axes++;
+}
+
+int enableMotionGroup(TMotionGroup *group, enum Mode mode)
+{
+	int rval;
+	int i;
+
+	for (i = 0; i < group->axes; i++) {
+		if ((rval = setUnitMode(group->axis[i], mode)) < 0 ||
+		    (rval = startMotor(group->axis[i])) < 0) {
+			return rval;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Waits for the requests of all the axes. The axes are separate nodes, so each is waited
+ * for on its own TCan.
+ */
+static int waitAxes(TMotionGroup *group, int count)
+{
+	int rval = 0;
+	int status;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		status = waitRequest(group->axis[i], &group->req[i]);
+		if (!group->req[i].done) {
+			cancelRequest(group->axis[i], &group->req[i]);
+		}
+		if (status < 0 && rval == 0) {
+			rval = status;
+		}
+	}
+	return rval;
+}
+
+int stageMotionGroup(TMotionGroup *group, const int *target)
+{
+	TElmoValue value;
+	int rval;
+	int i;
+
+	for (i = 0; i < group->axes; i++) {
+		value.i = target[i];
+		if ((rval = elmoSendSet(group->axis[i], ELMO_CMD(PA), &value, &group->req[i])) < 0) {
+			waitAxes(group, i);
+			return rval;
+		}
+	}
+	return waitAxes(group, group->axes);
+}
+
+/*
+ * Queues one BG frame per axis on the socket of the first axis and sends them with one
+ * system call.
+ */
+static int triggerBatch(TMotionGroup *group, const unsigned char *data, int size)
+{
+	struct can_frame frame[MOTION_MAX_AXES];
+	int i;
+
+	for (i = 0; i < group->axes; i++) {
+		createFrame(&frame[i], COBID_TPDO2(group->axis[i]->id), size, (unsigned char *)data);
+	}
+	return sendFrames(group->axis[0], frame, group->axes);
+}
+
+static int triggerGroup(TMotionGroup *group, const unsigned char *data, int size)
+{
+	struct can_frame frame;
+
+	createFrame(&frame, COBID_TPDO2(group->group), size, (unsigned char *)data);
+	return sendFrame(group->axis[0], &frame);
+}
+
+/*
+ * The spread of the transmit timestamps if every axis has one, else of the send times of
+ * a sequential start, else unknown.
+ */
+static long long measureSkew(TMotionGroup *group)
+{
+	long long first = 0, last = 0, t;
+	int stamped = 1;
+	int i;
+
+	if (group->trigger == MOTION_GROUP) {
+		return 0;
+	}
+
+	for (i = 0; i < group->axes; i++) {
+		if (!group->req[i].txstamp) {
+			stamped = 0;
+		}
+	}
+
+	if (!stamped && group->trigger != MOTION_SEQUENTIAL) {
+		return -1;
+	}
+
+	for (i = 0; i < group->axes; i++) {
+		t = stamped ? group->req[i].txstamp : group->req[i].sent;
+		if (i == 0 || t < first) {
+			first = t;
+		}
+		if (i == 0 || t > last) {
+			last = t;
+		}
+	}
+	return last - first;
+}
+
+int startMotionGroup(TMotionGroup *group)
+{
+	unsigned char data[8];
+	int size = elmoEncode(ELMO_CMD(BG), data, NULL);
+	int rval = 0;
+	int i;
+
+	if (group->axes == 0) {
+		return -1;
+	}
+
+	if (group->trigger == MOTION_SEQUENTIAL) {
+		for (i = 0; i < group->axes; i++) {
+			if ((rval = sendRequest(group->axis[i], &group->req[i], size, data, NULL, NULL)) < 0) {
+				return rval;
+			}
+			if ((rval = waitRequest(group->axis[i], &group->req[i])) < 0) {
+				if (!group->req[i].done) {
+					cancelRequest(group->axis[i], &group->req[i]);
+				}
+				return rval;
+			}
+		}
+	} else {
+		for (i = 0; i < group->axes; i++) {
+			if ((rval = expectRequest(group->axis[i], &group->req[i], size, data)) < 0) {
+				while (i-- > 0) {
+					cancelRequest(group->axis[i], &group->req[i]);
+				}
+				return rval;
+			}
+		}
+
+		if (group->trigger == MOTION_BATCH) {
+			rval = triggerBatch(group, data, size);
+		} else {
+			rval = triggerGroup(group, data, size);
+		}
+		if (rval < 0) {
+			for (i = 0; i < group->axes; i++) {
+				cancelRequest(group->axis[i], &group->req[i]);
+			}
+			return -2;
+		}
+
+		if ((rval = waitAxes(group, group->axes)) < 0) {
+			return rval;
+		}
+	}
+
+	group->starts++;
+	group->skew = measureSkew(group);
+	if (group->skew < 0) {
+		group->unknown++;
+		return 0;
+	}
+
+	histogramAdd(&group->skews, (long)group->skew);
+	if (group->skew > motionFrameTime(group)) {
+		group->late++;
+	}
+	return 0;
+}
+
+long motionFrameTime(const TMotionGroup *group)
+{
+	return (long)(CAN_FRAME_BITS * 1000000000LL / group->bitrate);
+}
+
+void printMotionStats(const TMotionGroup *group, FILE *out)
+{
+	fprintf(out, "%s start of %d axes: %lu starts, %lu unknown skew, %lu over one frame (%ld ns)\n",
+		triggers[group->trigger], group->axes, group->starts, group->unknown, group->late,
+		motionFrameTime(group));
+	fprintf(out, "%-8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "ns", "count", "min", "mean",
+		"p50", "p90", "p99", "p99.9", "max");
+	printHistogram(&group->skews, "skew", out);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_MOTION_H
+#define ELMO_MOTION_H
+
+#include "elmo.h"
+#include "histogram.h"
+
+/** Maximum number of axes in a motion group */
+#define MOTION_MAX_AXES 32
+
+/** Node id whose PDO2 COB-ID (0x300) addresses all the drives of the bus */
+#define MOTION_BROADCAST 0
+
+/** Default bit rate of the bus, for the frame time */
+#define MOTION_BITRATE 1000000
+
+/**
+ * How startMotionGroup() triggers the axes.
+ */
+enum MotionTrigger
+{
+	MOTION_SEQUENTIAL = 0, /** BG to each axis after the reply of the previous one */
+	MOTION_BATCH = 1,      /** BG to each axis, all queued with one system call */
+	MOTION_GROUP = 2       /** one BG frame to the group id, all axes start together */
+};
+
+/**
+ * A group of axes on one bus started together. The targets are staged on all the axes
+ * first, then one trigger starts the motion. For MOTION_GROUP the drives must accept
+ * binary interpreter commands on the PDO2 COB-ID of the group id (MOTION_BROADCAST, or a
+ * group id configured in the drives); the replies still come from each drive.
+ *
+ * The start skew is the spread of the times at which the axes got their BG, in
+ * nanoseconds. It is 0 for MOTION_GROUP, measured from the kernel transmit timestamps
+ * when timestamping is on, and otherwise from the send times of MOTION_SEQUENTIAL (a
+ * batch goes out in one system call, so its skew is unknown without timestamps).
+ */
+typedef struct {
+	TCan *axis[MOTION_MAX_AXES]; /** the axes, all on the same bus */
+	int axes;                 /** number of axes */
+	int trigger;              /** enum MotionTrigger */
+	unsigned int group;       /** group id of MOTION_GROUP */
+	long bitrate;             /** bit rate of the bus */
+	TElmoRequest req[MOTION_MAX_AXES]; /** requests of the last command of each axis */
+	long long skew;           /** start skew of the last start in nanoseconds, -1 if unknown */
+	THistogram skews;         /** measured start skews in nanoseconds */
+	unsigned long starts;     /** successful starts */
+	unsigned long unknown;    /** starts whose skew could not be measured */
+	unsigned long late;       /** starts whose skew exceeded one frame time */
+} TMotionGroup;
+
+/**
+ * Initializes an empty motion group.
+ *
+ * @param group The motion group.
+ * @param trigger The enum MotionTrigger.
+ * @param id The group id of MOTION_GROUP, MOTION_BROADCAST for all the drives.
+ */
+void initMotionGroup(TMotionGroup *group, int trigger, unsigned int id);
+
+/**
+ * Adds an axis to the group.
+ *
+ * @param group The motion group.
+ * @param can The TCan pointer of the motor controller, on the bus of the other axes.
+ * @return The index of the axis, <0 if the group is full.
+ */
+int addMotionAxis(TMotionGroup *group, TCan *can);
+
+/**
+ * Sets the unit mode and turns the motor on on every axis.
+ *
+ * @param group The motion group.
+ * @param mode The unit mode.
+ * @return 0 on success, the first failure otherwise.
+ */
+int enableMotionGroup(TMotionGroup *group, enum Mode mode);
+
+/**
+ * Stages absolute targets (PA) on all the axes. The commands are in flight on all the
+ * axes at once, nothing moves until startMotionGroup().
+ *
+ * @param group The motion group.
+ * @param target The target of each axis.
+ * @return 0 on success, the first failure otherwise.
+ */
+int stageMotionGroup(TMotionGroup *group, const int *target);
+
+/**
+ * Starts the staged motion of all the axes with the trigger of the group, waits for the
+ * replies and records the start skew.
+ *
+ * @param group The motion group.
+ * @return 0 on success, the first failure otherwise.
+ */
+int startMotionGroup(TMotionGroup *group);
+
+/**
+ * Returns the time of one frame on the bus of the group.
+ *
+ * @param group The motion group.
+ * @return The frame time in nanoseconds.
+ */
+long motionFrameTime(const TMotionGroup *group);
+
+/**
+ * Prints the start skew statistics.
+ *
+ * @param group The motion group.
+ * @param out The stream.
+ */
+void printMotionStats(const TMotionGroup *group, FILE *out);
+
+#endif /* ELMO_MOTION_H */
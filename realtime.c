@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "can.h"
+#include "realtime.h"
+#include "recordring.h"
+
+static int realtime;
+
+/* The deferred error log, created by the first enableRealtime() and kept. */
+static TRecordRing errorLog;
+
+int enableRealtime(void)
+{
+	/* Freed memory stays in the heap, and large blocks come from it too, not from mmap. */
+	if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+		return -1;
+	}
+
+	if (TCanPreallocate() < 0) {
+		return -2;
+	}
+
+	if (!errorLog.map && createRing(&errorLog, NULL, RT_ERROR_MAGIC, RT_ERROR_VERSION,
+					sizeof(TRtError), RT_ERROR_LOG_SIZE) < 0) {
+		return -4;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("mlockall");
+		return -3;
+	}
+
+	prefaultStack();
+	__atomic_store_n(&realtime, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void disableRealtime(void)
+{
+	__atomic_store_n(&realtime, 0, __ATOMIC_RELEASE);
+	munlockall();
+}
+
+int realtimeEnabled(void)
+{
+	return __atomic_load_n(&realtime, __ATOMIC_ACQUIRE);
+}
+
+void prefaultStack(void)
+{
+	unsigned char stack[RT_STACK_PREFAULT];
+
+	memset(stack, 0, sizeof(stack));
+	__asm__ __volatile__("" : : "r"(stack) : "memory"); /* keep the memset */
+}
+
+void reportError(const char *where)
+{
+	int error = errno;
+	unsigned long long index;
+	TRtError *slot;
+
+	if (!realtimeEnabled()) {
+		perror(where);
+		errno = error;
+		return;
+	}
+
+	index = ringClaim(&errorLog, 1);
+	if (!(slot = (TRtError *)ringBegin(&errorLog, index))) {
+		errno = error;
+		return;
+	}
+	slot->time = timeNow();
+	slot->where = where;
+	slot->error = error;
+	ringCommit(slot, index);
+	errno = error;
+}
+
+unsigned long long errorCount(void)
+{
+	return errorLog.map ? ringHead(&errorLog) : 0;
+}
+
+int readErrors(unsigned long long *cursor, TRtError *error, int count)
+{
+	return errorLog.map ? readRing(&errorLog, cursor, error, count) : 0;
+}
+
+int printErrors(FILE *out, unsigned long long *cursor)
+{
+	TRtError error[16];
+	unsigned long long last;
+	int total = 0;
+	int n, i;
+
+	/* A batch overwritten while it was copied returns 0 but still advances the cursor. */
+	while (*cursor < errorCount()) {
+		last = *cursor;
+		n = readErrors(cursor, error, 16);
+		for (i = 0; i < n; i++) {
+			fprintf(out, "%s: %s\n", error[i].where, strerror(error[i].error));
+		}
+		total += n;
+		if (*cursor == last) {
+			break; /* the next error is still being written */
+		}
+	}
+	return total;
+}
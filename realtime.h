@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_REALTIME_H
+#define ELMO_REALTIME_H
+
+#include <stdio.h>
+
+/** Entries in the deferred error log, a power of two */
+#define RT_ERROR_LOG_SIZE 256
+
+/** Magic and version of the deferred error log, a TRecordRing in memory */
+#define RT_ERROR_MAGIC "ELMOERR"
+#define RT_ERROR_VERSION 1
+
+/** Bytes of stack prefaulted by prefaultStack() */
+#define RT_STACK_PREFAULT (256 * 1024)
+
+/**
+ * An error of the deferred error log. It starts with the fields of a TRingRecord.
+ */
+typedef struct {
+	unsigned long long seq;   /** sequence number of the slot */
+	long long time;           /** timeNow() when the error happened */
+	const char *where;        /** the failed call, a string constant */
+	int error;                /** errno */
+} TRtError;
+
+/**
+ * Enters the real-time mode: the memory of the process is locked and prefaulted, the
+ * heap is never returned to the kernel, the TCans of all the node ids are preallocated
+ * (TCanConstruct() takes them instead of allocating, TCanBusConstruct() allocates the
+ * queues of all the node ids at once, so attaching a node allocates nothing) and the
+ * I/O functions stop writing errors to stderr: reportError() puts them in the
+ * deferred error log, which another thread prints with printErrors().
+ *
+ * Call it before the nodes are constructed and the threads started.
+ *
+ * @return 0 on success, <0 otherwise.
+ */
+int enableRealtime(void);
+
+/**
+ * Leaves the real-time mode and unlocks the memory. The preallocated TCans are kept.
+ */
+void disableRealtime(void);
+
+/**
+ * Returns nonzero in the real-time mode.
+ *
+ * @return Nonzero if enableRealtime() has been called.
+ */
+int realtimeEnabled(void);
+
+/**
+ * Touches RT_STACK_PREFAULT bytes of the stack of the calling thread, so that it does
+ * not page fault later. Called by the real-time threads of the library when they start.
+ */
+void prefaultStack(void);
+
+/**
+ * Reports the failure of a system call with errno, like perror(). In the real-time mode
+ * the error is put in the deferred error log instead, without locks or system calls.
+ * errno is preserved.
+ *
+ * @param where The failed call, a string constant.
+ */
+void reportError(const char *where);
+
+/**
+ * Copies the errors from the cursor on and advances the cursor. Errors overwritten
+ * before they were read are skipped.
+ *
+ * @param cursor The number of the next error to read, 0 at first.
+ * @param error The array where the errors are stored.
+ * @param count The size of the array.
+ * @return The number of errors copied.
+ */
+int readErrors(unsigned long long *cursor, TRtError *error, int count);
+
+/**
+ * Prints the errors from the cursor on like perror() did, and advances the cursor.
+ *
+ * @param out The stream.
+ * @param cursor The number of the next error to print, 0 at first.
+ * @return The number of errors printed.
+ */
+int printErrors(FILE *out, unsigned long long *cursor);
+
+/**
+ * Returns the number of errors reported in the real-time mode.
+ *
+ * @return The number of errors put in the log.
+ */
+unsigned long long errorCount(void);
+
+#endif /* ELMO_REALTIME_H */
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+#include "sdo.h"
+
+/* Time between the polls of waitRecorder(), in microseconds */
+#define RECORDER_POLL 1000
+
+const TElmoCommand *const recorderSignals[RECORDER_SIGNALS] = {
+	[RECORDER_POSITION] = ELMO_CMD(PX),
+	[RECORDER_VELOCITY] = ELMO_CMD(VX),
+	[RECORDER_CURRENT] = ELMO_CMD(IQ),
+	[RECORDER_TARGET] = ELMO_CMD(PA),
+};
+
+int configureRecorder(TCan *can, unsigned int signals, int gap, int length)
+{
+	const TElmoCommand *cmd[3] = { ELMO_CMD(RC), ELMO_CMD(RG), ELMO_CMD(RL) };
+	TElmoValue value[3];
+
+	if (!signals || signals >= (1u << RECORDER_SIGNALS) || gap < 1 ||
+	    length < 1 || length > RECORDER_MAX_LENGTH) {
+		return -5;
+	}
+
+	value[0].i = (int)signals;
+	value[1].i = gap;
+	value[2].i = length;
+	return elmoWriteParameters(can, cmd, 3, value);
+}
+
+int triggerRecorder(TCan *can, int trigger)
+{
+	return elmoSetInt(can, ELMO_CMD(RR), trigger);
+}
+
+int recorderState(TCan *can)
+{
+	int state;
+	int rval;
+
+	if ((rval = elmoGetInt(can, ELMO_CMD(RR), &state)) < 0) {
+		return rval;
+	}
+	return state;
+}
+
+int waitRecorder(TCan *can, long timeout)
+{
+	struct timespec wait = { 0, RECORDER_POLL * 1000L };
+	long long deadline = timeNow() + timeout * 1000LL;
+	int state;
+
+	for (;;) {
+		if ((state = recorderState(can)) < 0) {
+			return state;
+		}
+		if (state == RECORDER_DONE) {
+			return 0;
+		}
+		if (state == RECORDER_IDLE) {
+			return -4;
+		}
+		if (timeNow() >= deadline) {
+			return CAN_TIMEOUT;
+		}
+		nanosleep(&wait, NULL);
+	}
+}
+
+static size_t align(size_t size)
+{
+	return (size + RECORDER_ALIGN - 1) & ~(size_t)(RECORDER_ALIGN - 1);
+}
+
+/* Bytes between the starts of two columns */
+static size_t columnSize(const TRecorderHeader *header)
+{
+	return align((size_t)header->length * 4);
+}
+
+int createRecording(TRecording *rec, const char *path, int columns, int length,
+		    unsigned int period)
+{
+	struct timespec now;
+
+	if (columns < 1 || columns > RECORDER_MAX_COLUMNS || length < 1) {
+		return -5;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	rec->size = align(sizeof(TRecorderHeader)) + (size_t)columns * align((size_t)length * 4);
+	if ((rec->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("createRecording: open");
+		return -1;
+	}
+
+	if (ftruncate(rec->fd, (off_t)rec->size) < 0) {
+		perror("createRecording: ftruncate");
+		close(rec->fd);
+		return -1;
+	}
+
+	rec->map = (unsigned char *)mmap(NULL, rec->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+					 rec->fd, 0);
+	if (rec->map == MAP_FAILED) {
+		perror("createRecording: mmap");
+		close(rec->fd);
+		return -1;
+	}
+
+	rec->writable = 1;
+	rec->header = (TRecorderHeader *)rec->map;
+	memcpy(rec->header->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC));
+	rec->header->version = RECORDER_VERSION;
+	rec->header->length = (unsigned int)length;
+	rec->header->period = period;
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec->header->created = now.tv_sec * 1000000000LL + now.tv_nsec;
+	return 0;
+}
+
+/* The drive sends little endian samples, swapped in place on big endian hosts. */
+static void toHostOrder(unsigned char *data, unsigned int samples)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	unsigned char byte;
+	unsigned int i;
+
+	for (i = 0; i < samples * 4; i += 4) {
+		byte = data[i];
+		data[i] = data[i + 3];
+		data[i + 3] = byte;
+		byte = data[i + 1];
+		data[i + 1] = data[i + 2];
+		data[i + 2] = byte;
+	}
+#else
+	(void)data;
+	(void)samples;
+#endif
+}
+
+int uploadRecorder(TCan *can, TRecording *rec, unsigned int signals, int mode)
+{
+	TRecorderHeader *header = rec->header;
+	TRecorderColumn *col;
+	size_t offset;
+	unsigned int received;
+	int signal;
+	int rval;
+
+	if (!rec->writable) {
+		return -5;
+	}
+
+	for (signal = 0; signal < RECORDER_SIGNALS; signal++) {
+		if (!(signals & (1u << signal))) {
+			continue;
+		}
+
+		offset = align(sizeof(TRecorderHeader)) + header->columns * columnSize(header);
+		if (header->columns >= RECORDER_MAX_COLUMNS || offset + columnSize(header) > rec->size) {
+			return -5;
+		}
+		col = &header->column[header->columns];
+		col->offset = offset;
+
+		/* The samples go from the SDO segments straight to the mapped column. */
+		rval = sdoUploadData(can, RECORDER_OBJECT, (unsigned char)(signal + 1),
+				     rec->map + col->offset, header->length * 4, &received, mode);
+		if (rval < 0) {
+			return rval;
+		}
+
+		elmoCommandName(recorderSignals[signal], col->name, sizeof(col->name));
+		col->node = can->id;
+		col->signal = (unsigned int)signal;
+		col->type = recorderSignals[signal]->type;
+		col->samples = received / 4;
+		toHostOrder(rec->map + col->offset, col->samples);
+		header->columns++;
+	}
+	return 0;
+}
+
+int openRecording(TRecording *rec, const char *path)
+{
+	struct stat st;
+	const TRecorderHeader *header;
+	unsigned int i;
+
+	memset(rec, 0, sizeof(*rec));
+	if ((rec->fd = open(path, O_RDONLY)) < 0) {
+		perror("openRecording: open");
+		return -1;
+	}
+
+	if (fstat(rec->fd, &st) < 0 || (size_t)st.st_size < sizeof(TRecorderHeader)) {
+		close(rec->fd);
+		return -2;
+	}
+
+	rec->size = (size_t)st.st_size;
+	rec->map = (unsigned char *)mmap(NULL, rec->size, PROT_READ, MAP_SHARED, rec->fd, 0);
+	if (rec->map == MAP_FAILED) {
+		perror("openRecording: mmap");
+		close(rec->fd);
+		return -1;
+	}
+
+	rec->header = (TRecorderHeader *)rec->map;
+	header = rec->header;
+	if (memcmp(header->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) ||
+	    header->version != RECORDER_VERSION || header->columns > RECORDER_MAX_COLUMNS) {
+		closeRecording(rec);
+		return -2;
+	}
+
+	for (i = 0; i < header->columns; i++) {
+		if (header->column[i].samples > header->length ||
+		    header->column[i].offset + (size_t)header->column[i].samples * 4 > rec->size) {
+			closeRecording(rec);
+			return -2;
+		}
+	}
+	return 0;
+}
+
+int closeRecording(TRecording *rec)
+{
+	size_t used = rec->size;
+	int rval = 0;
+
+	if (rec->writable) {
+		used = align(sizeof(TRecorderHeader)) + rec->header->columns * columnSize(rec->header);
+	}
+
+	if (munmap(rec->map, rec->size) < 0) {
+		perror("closeRecording: munmap");
+		rval = -1;
+	}
+
+	if (rec->writable && used < rec->size && ftruncate(rec->fd, (off_t)used) < 0) {
+		perror("closeRecording: ftruncate");
+		rval = -1;
+	}
+
+	if (close(rec->fd) < 0) {
+		perror("closeRecording: close");
+		rval = -1;
+	}
+	return rval;
+}
+
+const void *recordingColumn(const TRecording *rec, unsigned int node, int signal,
+			    const TRecorderColumn **column)
+{
+	const TRecorderHeader *header = rec->header;
+	unsigned int i;
+
+	for (i = 0; i < header->columns; i++) {
+		if (header->column[i].node == node && header->column[i].signal == (unsigned int)signal) {
+			if (column) {
+				*column = &header->column[i];
+			}
+			return rec->map + header->column[i].offset;
+		}
+	}
+	return NULL;
+}
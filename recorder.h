@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_RECORDER_H
+#define ELMO_RECORDER_H
+
+#include <stddef.h>
+
+#include "elmocmd.h"
+
+/** Object the recorded samples of a signal are uploaded from, the subindex is the signal + 1 */
+#define RECORDER_OBJECT 0x2030
+
+/** Time unit of the recorder gap RG, in microseconds */
+#define RECORDER_QUANTUM 50
+
+/** Largest recorder length RL, in samples per signal */
+#define RECORDER_MAX_LENGTH 16384
+
+/** Number of columns a recording file can hold */
+#define RECORDER_MAX_COLUMNS 64
+
+/** Alignment of the columns in a recording file, in bytes */
+#define RECORDER_ALIGN 4096
+
+/** Magic and version at the start of a recording file */
+#define RECORDER_MAGIC "ELMOREC"
+#define RECORDER_VERSION 1
+
+/**
+ * Signals of the recorder, the bits of RC. Each sample is four bytes, an integer or a
+ * float as given by recorderSignals.
+ */
+enum RecorderSignal
+{
+	RECORDER_POSITION = 0,    /** PX in counts */
+	RECORDER_VELOCITY = 1,    /** VX in counts/s */
+	RECORDER_CURRENT = 2,     /** IQ in A */
+	RECORDER_TARGET = 3,      /** PA in counts */
+	RECORDER_SIGNALS = 4
+};
+
+/**
+ * Values written to RR to start the recorder.
+ */
+enum RecorderTrigger
+{
+	RECORDER_STOP = 0,        /** stops the recorder */
+	RECORDER_IMMEDIATE = 1,   /** starts recording right away */
+	RECORDER_ON_BEGIN = 2     /** starts recording at the next BG */
+};
+
+/**
+ * States of the recorder read from RR.
+ */
+enum RecorderState
+{
+	RECORDER_IDLE = 0,        /** never started or stopped */
+	RECORDER_ARMED = 1,       /** waiting for the trigger */
+	RECORDER_RECORDING = 2,   /** recording */
+	RECORDER_DONE = 3         /** RL samples recorded, ready to be uploaded */
+};
+
+/** The command each signal records, giving its name and type */
+extern const TElmoCommand *const recorderSignals[RECORDER_SIGNALS];
+
+/**
+ * A column of a recording file: the samples of one signal of one drive, in host byte
+ * order.
+ */
+typedef struct {
+	char name[8];             /** name of the signal ("PX") */
+	unsigned int node;        /** node id of the drive */
+	unsigned int signal;      /** enum RecorderSignal */
+	unsigned int type;        /** enum ElmoType, ELMO_INT or ELMO_FLOAT */
+	unsigned int samples;     /** number of samples */
+	unsigned long long offset; /** offset of the first sample from the start of the file */
+} TRecorderColumn;
+
+/**
+ * Header at the start of a recording file. The columns follow, each aligned to
+ * RECORDER_ALIGN, so that a reader can map the file and use the columns in place.
+ */
+typedef struct {
+	char magic[8];            /** RECORDER_MAGIC */
+	unsigned int version;     /** RECORDER_VERSION */
+	unsigned int columns;     /** number of columns */
+	unsigned int length;      /** room for samples per column */
+	unsigned int period;      /** sample period in nanoseconds */
+	long long created;        /** wall clock time the file was created, in nanoseconds */
+	TRecorderColumn column[RECORDER_MAX_COLUMNS]; /** the columns */
+} TRecorderHeader;
+
+/**
+ * A memory-mapped recording file.
+ */
+typedef struct {
+	int fd;                   /** file descriptor */
+	unsigned char *map;       /** the mapping of the whole file */
+	size_t size;              /** size of the file in bytes */
+	int writable;             /** nonzero if created by createRecording() */
+	TRecorderHeader *header;  /** the header at the start of the mapping */
+} TRecording;
+
+/**
+ * Configures the recorder of the drive: the signals, the sample period and the number of
+ * samples. The commands are pipelined.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param signals The signals to be recorded, bits of enum RecorderSignal.
+ * @param gap The sample period in units of RECORDER_QUANTUM.
+ * @param length The number of samples per signal, at most RECORDER_MAX_LENGTH.
+ * @return 0 on success, <0 otherwise.
+ */
+int configureRecorder(TCan *can, unsigned int signals, int gap, int length);
+
+/**
+ * Starts or stops the recorder.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param trigger The enum RecorderTrigger.
+ * @return 0 on success, <0 otherwise.
+ */
+int triggerRecorder(TCan *can, int trigger);
+
+/**
+ * Reads the state of the recorder.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return The enum RecorderState, <0 on errors.
+ */
+int recorderState(TCan *can);
+
+/**
+ * Polls the recorder until it is done.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param timeout The timeout in microseconds.
+ * @return 0 on success, CAN_TIMEOUT if the recorder did not finish in time, -4 if it is
+ * not started, <0 otherwise.
+ */
+int waitRecorder(TCan *can, long timeout);
+
+/**
+ * Creates a recording file with room for the given columns and maps it for writing.
+ *
+ * @param rec The recording.
+ * @param path The path of the file, replaced if it exists.
+ * @param columns The number of columns, at most RECORDER_MAX_COLUMNS.
+ * @param length The number of samples per column.
+ * @param period The sample period in nanoseconds.
+ * @return 0 on success, <0 otherwise.
+ */
+int createRecording(TRecording *rec, const char *path, int columns, int length,
+		    unsigned int period);
+
+/**
+ * Uploads the recorded signals of a finished recording in bulk, each straight into a new
+ * column of the mapped file.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param rec A recording created by createRecording().
+ * @param signals The signals to be uploaded, bits of enum RecorderSignal.
+ * @param mode The enum SdoMode of the uploads, SDO_BLOCK for the fastest.
+ * @return 0 on success, -5 if the file has no room for the columns, <0 otherwise
+ * (see sdoRun()).
+ */
+int uploadRecorder(TCan *can, TRecording *rec, unsigned int signals, int mode);
+
+/**
+ * Maps a recording file for reading.
+ *
+ * @param rec The recording.
+ * @param path The path of the file.
+ * @return 0 on success, -1 if the file cannot be mapped, -2 if it is not a valid
+ * recording.
+ */
+int openRecording(TRecording *rec, const char *path);
+
+/**
+ * Unmaps and closes a recording file. A created file is truncated after its last column.
+ *
+ * @param rec The recording.
+ * @return 0 on success, <0 otherwise.
+ */
+int closeRecording(TRecording *rec);
+
+/**
+ * Returns the samples of a column, which are int or float as given by its type.
+ *
+ * @param rec The recording.
+ * @param node The node id of the drive.
+ * @param signal The enum RecorderSignal.
+ * @param column The pointer where the column is stored, or NULL.
+ * @return The first sample, NULL if the recording has no such column.
+ */
+const void *recordingColumn(const TRecording *rec, unsigned int node, int signal,
+			    const TRecorderColumn **column);
+
+#endif /* ELMO_RECORDER_H */
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "can.h"
+#include "recordring.h"
+
+/* The slot of record number index. */
+static unsigned char *slotOf(const TRecordRing *ring, unsigned long long index)
+{
+	return ring->records + (size_t)(index & (ring->header->capacity - 1)) *
+				       ring->header->recordsize;
+}
+
+int createRing(TRecordRing *ring, const char *path, const char *magic, unsigned int version,
+	       unsigned int recordsize, unsigned int capacity)
+{
+	struct timespec now;
+
+	if (!capacity || (capacity & (capacity - 1)) || recordsize < sizeof(TRingRecord)) {
+		return -5;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	ring->size = RING_HEADER_SIZE + (size_t)capacity * recordsize;
+	if (path) {
+		if ((ring->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("createRing: open");
+			return -1;
+		}
+
+		if (ftruncate(ring->fd, (off_t)ring->size) < 0) {
+			perror("createRing: ftruncate");
+			close(ring->fd);
+			return -1;
+		}
+	}
+
+	ring->map = (unsigned char *)mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+					  path ? MAP_SHARED | MAP_POPULATE :
+						 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+					  ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("createRing: mmap");
+		if (path) {
+			close(ring->fd);
+		}
+		return -1;
+	}
+
+	/* Writing every page now allocates the blocks of the sparse file up front. */
+	memset(ring->map, 0, ring->size);
+
+	ring->writable = 1;
+	ring->header = (TRingHeader *)ring->map;
+	ring->records = ring->map + RING_HEADER_SIZE;
+	strncpy(ring->header->magic, magic, sizeof(ring->header->magic) - 1);
+	ring->header->version = version;
+	ring->header->recordsize = recordsize;
+	ring->header->capacity = capacity;
+	clock_gettime(CLOCK_REALTIME, &now);
+	ring->header->epoch = timeNow();
+	ring->header->created = now.tv_sec * 1000000000LL + now.tv_nsec;
+	return 0;
+}
+
+int openRing(TRecordRing *ring, const char *path, const char *magic, unsigned int version,
+	     unsigned int recordsize)
+{
+	struct stat st;
+	const TRingHeader *header;
+
+	memset(ring, 0, sizeof(*ring));
+	if ((ring->fd = open(path, O_RDONLY)) < 0) {
+		perror("openRing: open");
+		return -1;
+	}
+
+	if (fstat(ring->fd, &st) < 0 || (size_t)st.st_size < RING_HEADER_SIZE) {
+		close(ring->fd);
+		return -2;
+	}
+
+	ring->size = (size_t)st.st_size;
+	ring->map = (unsigned char *)mmap(NULL, ring->size, PROT_READ, MAP_SHARED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("openRing: mmap");
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->header = (TRingHeader *)ring->map;
+	ring->records = ring->map + RING_HEADER_SIZE;
+	header = ring->header;
+	if (strncmp(header->magic, magic, sizeof(header->magic)) || header->version != version ||
+	    header->recordsize != recordsize || !header->capacity ||
+	    (header->capacity & (header->capacity - 1)) ||
+	    RING_HEADER_SIZE + (size_t)header->capacity * recordsize > ring->size) {
+		closeRing(ring);
+		return -2;
+	}
+	return 0;
+}
+
+int closeRing(TRecordRing *ring)
+{
+	int rval = 0;
+
+	if (munmap(ring->map, ring->size) < 0) {
+		perror("closeRing: munmap");
+		rval = -1;
+	}
+
+	if (ring->fd >= 0 && close(ring->fd) < 0) {
+		perror("closeRing: close");
+		rval = -1;
+	}
+	return rval;
+}
+
+unsigned long long ringClaim(TRecordRing *ring, int count)
+{
+	return __atomic_fetch_add(&ring->header->head, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * The slot is marked odd while it is written, so a reader copying it at the same time
+ * sees the sequence number change. A writer a whole lap ahead waits for the one writing
+ * the slot before it, and a writer a lap behind leaves the slot alone: otherwise both
+ * would write it at once, or the older record would replace the newer one for good.
+ */
+void *ringBegin(TRecordRing *ring, unsigned long long index)
+{
+	TRingRecord *slot = (TRingRecord *)slotOf(ring, index);
+	unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	int spins = 0;
+
+	for (;;) {
+		if (seq > 2 * index + 1) {
+			return NULL;
+		}
+		if (seq & 1) {
+			if (++spins > RING_SPIN) {
+				sched_yield();
+			}
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&slot->seq, &seq, 2 * index + 1, 1, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return slot;
+}
+
+void ringCommit(void *slot, unsigned long long index)
+{
+	__atomic_store_n(&((TRingRecord *)slot)->seq, 2 * index + 2, __ATOMIC_RELEASE);
+}
+
+unsigned long long ringHead(const TRecordRing *ring)
+{
+	return __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+}
+
+unsigned long long ringTail(const TRecordRing *ring)
+{
+	unsigned long long head = ringHead(ring);
+	return head > ring->header->capacity ? head - ring->header->capacity : 0;
+}
+
+/* Copies size bytes of record number index, as readRingSlot(). */
+static int copySlot(const TRecordRing *ring, unsigned long long index, void *record, size_t size)
+{
+	const TRingRecord *slot = (const TRingRecord *)slotOf(ring, index);
+	unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+	if (seq < 2 * index + 2) {
+		return 0;
+	}
+	if (seq != 2 * index + 2) {
+		return -1;
+	}
+
+	memcpy(record, slot, size);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq ? 1 : -1;
+}
+
+int readRingSlot(const TRecordRing *ring, unsigned long long index, void *record)
+{
+	return copySlot(ring, index, record, ring->header->recordsize);
+}
+
+int readRing(TRecordRing *ring, unsigned long long *cursor, void *record, int max)
+{
+	unsigned char *next = (unsigned char *)record;
+	unsigned long long tail;
+	int count = 0;
+	int rval;
+
+	while (count < max && *cursor < ringHead(ring)) {
+		if (*cursor < (tail = ringTail(ring))) {
+			ring->lost += tail - *cursor;
+			*cursor = tail;
+			continue;
+		}
+
+		if ((rval = readRingSlot(ring, *cursor, next)) == 0) {
+			break;
+		}
+		if (rval < 0) {
+			ring->lost++;
+		} else {
+			next += ring->header->recordsize;
+			count++;
+		}
+		(*cursor)++;
+	}
+	return count;
+}
+
+unsigned long long seekRing(TRecordRing *ring, long long time)
+{
+	unsigned long long low = ringTail(ring);
+	unsigned long long high = ringHead(ring);
+	unsigned long long middle;
+	TRingRecord record;
+	int rval;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		rval = copySlot(ring, middle, &record, sizeof(record));
+		/* Overwritten records are older than any in the ring, unwritten ones newer. */
+		if (rval < 0 || (rval > 0 && record.time < time)) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
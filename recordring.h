@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_RECORD_RING_H
+#define ELMO_RECORD_RING_H
+
+#include <stddef.h>
+
+/** Size of the header of a ring file, the records follow */
+#define RING_HEADER_SIZE 4096
+
+/** Polls of a slot still being written by a writer a lap behind before yielding the CPU */
+#define RING_SPIN 1000
+
+/**
+ * The fields every record of a ring starts with. The sequence number tells a reader
+ * whether the slot holds the record it expects: it is odd while the record is being
+ * written and 2 * index + 2 once record number index is complete.
+ */
+typedef struct {
+	unsigned long long seq;   /** sequence number of the slot */
+	long long time;           /** timeNow() of the record */
+} TRingRecord;
+
+/**
+ * Header at the start of a ring. head only grows: the records of indexes head - capacity
+ * to head - 1 are in the slots index % capacity. created and epoch are the same instant
+ * in wall clock and timeNow() time, to convert between the two.
+ */
+typedef struct {
+	char magic[8];            /** identifies the kind of records */
+	unsigned int version;     /** version of the records */
+	unsigned int recordsize;  /** size of a record in bytes */
+	unsigned int capacity;    /** number of slots, a power of two */
+	unsigned int reserved;
+	long long created;        /** wall clock time of epoch, in nanoseconds */
+	long long epoch;          /** timeNow() when the ring was created */
+	unsigned long long head __attribute__((aligned(64))); /** records claimed by writers */
+} TRingHeader;
+
+/**
+ * A ring of fixed size records in a memory-mapped file, shared by the writers and by
+ * any number of readers in other processes. The telemetry log, the capture and the
+ * deferred error log of the real-time mode are rings.
+ *
+ * Writing a record takes an atomic increment and a few stores to pre-faulted memory, no
+ * system calls and no locks. Several threads can write to the same ring. The oldest
+ * records are overwritten; the readers notice it from the sequence numbers and skip them.
+ */
+typedef struct {
+	int fd;                   /** file descriptor, -1 if the ring is not in a file */
+	unsigned char *map;       /** the mapping of the whole ring */
+	size_t size;              /** size of the mapping in bytes */
+	int writable;             /** nonzero if created by createRing() */
+	TRingHeader *header;      /** the header */
+	unsigned char *records;   /** the slots */
+	unsigned long long lost;  /** records a reader skipped because they were overwritten */
+} TRecordRing;
+
+/**
+ * Creates a ring and maps it for writing. The pages are faulted in now so that writing
+ * never faults.
+ *
+ * @param ring The ring.
+ * @param path The path of the file, replaced if it exists, or NULL for a ring in the
+ *             memory of the process only.
+ * @param magic The magic of the header, at most 7 characters.
+ * @param version The version of the records.
+ * @param recordsize The size of a record, which starts with a TRingRecord.
+ * @param capacity The number of records kept, a power of two.
+ * @return 0 on success, <0 otherwise.
+ */
+int createRing(TRecordRing *ring, const char *path, const char *magic, unsigned int version,
+	       unsigned int recordsize, unsigned int capacity);
+
+/**
+ * Maps a ring file for reading. It can be written by another process at the same time.
+ *
+ * @param ring The ring.
+ * @param path The path of the file.
+ * @param magic The expected magic.
+ * @param version The expected version.
+ * @param recordsize The expected size of a record.
+ * @return 0 on success, -1 if the file cannot be mapped, -2 if it is not a valid ring.
+ */
+int openRing(TRecordRing *ring, const char *path, const char *magic, unsigned int version,
+	     unsigned int recordsize);
+
+/**
+ * Unmaps and closes a ring.
+ *
+ * @param ring The ring.
+ * @return 0 on success, <0 otherwise.
+ */
+int closeRing(TRecordRing *ring);
+
+/**
+ * Claims the indexes of records to be written. Lock-free, safe to call from several
+ * threads.
+ *
+ * @param ring A ring created by createRing().
+ * @param count The number of records.
+ * @return The index of the first record.
+ */
+unsigned long long ringClaim(TRecordRing *ring, int count);
+
+/**
+ * Marks the slot of a claimed record as being written and returns it. The fields after
+ * the TRingRecord are filled in by the caller, then the record is committed with
+ * ringCommit(). If the writers have lapped the ring meanwhile, the record would be
+ * overwritten anyway and is dropped.
+ *
+ * @param ring The ring.
+ * @param index The index of the record.
+ * @return The slot, or NULL if the record is dropped.
+ */
+void *ringBegin(TRecordRing *ring, unsigned long long index);
+
+/**
+ * Marks a record written with ringBegin() complete, publishing it to the readers.
+ *
+ * @param slot The slot returned by ringBegin().
+ * @param index The index of the record.
+ */
+void ringCommit(void *slot, unsigned long long index);
+
+/**
+ * Returns the index of the next record to be written.
+ *
+ * @param ring The ring.
+ * @return The index.
+ */
+unsigned long long ringHead(const TRecordRing *ring);
+
+/**
+ * Returns the index of the oldest record still in the ring.
+ *
+ * @param ring The ring.
+ * @return The index.
+ */
+unsigned long long ringTail(const TRecordRing *ring);
+
+/**
+ * Copies one record.
+ *
+ * @param ring The ring.
+ * @param index The index of the record.
+ * @param record The buffer of recordsize bytes the record is copied to.
+ * @return 1 on success, 0 if it is not completely written yet and -1 if it has been
+ *         overwritten, also while it was copied.
+ */
+int readRingSlot(const TRecordRing *ring, unsigned long long index, void *record);
+
+/**
+ * Copies the records from the cursor on, at most max, and advances the cursor past them.
+ * Records overwritten before they were read are skipped and counted in lost. Stops at a
+ * record still being written.
+ *
+ * @param ring The ring.
+ * @param cursor The index of the next record to read, ringTail() to read from the oldest,
+ *               ringHead() to wait for new ones.
+ * @param record The array the records are copied to.
+ * @param max The size of the array, in records.
+ * @return The number of records copied.
+ */
+int readRing(TRecordRing *ring, unsigned long long *cursor, void *record, int max);
+
+/**
+ * Finds the first record at or after a time by a binary search over the records in the
+ * ring. With several writers the records are in time order only approximately.
+ *
+ * @param ring The ring.
+ * @param time The time in timeNow() time.
+ * @return The index of the record, ringHead() if all the records are older.
+ */
+unsigned long long seekRing(TRecordRing *ring, long long time);
+
+#endif /* ELMO_RECORD_RING_H */
@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* CPU_SET, ppoll */
+
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "monitor.h"
+#include "realtime.h"
+#include "rtio.h"
+
+TRtIo *TRtIoConstruct(void)
+{
+	TRtIo *io;
+	int i;
+
+	if (!(io = (TRtIo *)malloc(sizeof(TRtIo)))) {
+		return NULL;
+	}
+
+	memset(io, 0, sizeof(*io));
+	if ((io->wake = eventfd(0, EFD_NONBLOCK)) < 0) {
+		reportError("eventfd");
+		free(io);
+		return NULL;
+	}
+
+	for (i = 0; i < RTIO_REQUESTS; i++) {
+		io->free[i] = &io->request[i];
+	}
+	io->nfree = RTIO_REQUESTS;
+	io->cpu = -1;
+	return io;
+}
+
+void TRtIoDestruct(TRtIo *io)
+{
+	int i;
+
+	for (i = 0; i < io->channels; i++) {
+		freeSpscRing(&io->channel[i].commands);
+		freeSpscRing(&io->channel[i].completions);
+		freeSpscRing(&io->channel[i].telemetry);
+	}
+	close(io->wake);
+	free(io);
+}
+
+int rtioAddNode(TRtIo *io, TCan *can)
+{
+	if (io->nodes == RTIO_MAX_NODES || can->bus || can->socket < 0) {
+		return -1;
+	}
+
+	io->node[io->nodes] = can;
+	return io->nodes++;
+}
+
+TRtChannel *rtioAddChannel(TRtIo *io)
+{
+	TRtChannel *channel;
+
+	if (io->channels == RTIO_MAX_CHANNELS) {
+		return NULL;
+	}
+
+	channel = &io->channel[io->channels];
+	memset(channel, 0, sizeof(*channel));
+	if (initSpscRing(&channel->commands, RTIO_RING_SIZE, sizeof(TRtCommand)) < 0 ||
+	    initSpscRing(&channel->completions, RTIO_RING_SIZE, sizeof(TRtCompletion)) < 0 ||
+	    initSpscRing(&channel->telemetry, RTIO_RING_SIZE, sizeof(TRtTelemetry)) < 0) {
+		freeSpscRing(&channel->commands);
+		freeSpscRing(&channel->completions);
+		freeSpscRing(&channel->telemetry);
+		return NULL;
+	}
+
+	channel->io = io;
+	io->channels++;
+	return channel;
+}
+
+/* Telemetry callback, in the I/O thread. */
+static void pushTelemetry(TCan *can, const TTelemetrySample *sample, void *arg)
+{
+	TRtChannel *channel = (TRtChannel *)arg;
+	TRtTelemetry telemetry;
+	int i;
+
+	for (i = 0; i < channel->io->nodes && channel->io->node[i] != can; i++) {
+	}
+
+	telemetry.node = (unsigned char)i;
+	telemetry.sample = *sample;
+	if (spscPush(&channel->telemetry, &telemetry) < 0) {
+		channel->dropped++;
+	}
+}
+
+int rtioSubscribeTelemetry(TRtIo *io, int node, TRtChannel *channel)
+{
+	if (node < 0 || node >= io->nodes) {
+		return -1;
+	}
+	return subscribeTelemetry(io->node[node], &io->telemetry[node], pushTelemetry, channel);
+}
+
+/*
+ * Returns the request to the pool and its outcome to the channel. The channel always has
+ * room: commands are only taken while the completions in flight fit in its ring.
+ */
+static void complete(TRtRequest *r, int status)
+{
+	TRtChannel *channel = r->channel;
+	TRtIo *io = channel->io;
+	TRtCompletion completion;
+
+	completion.tag = r->cmd.tag;
+	completion.node = r->cmd.node;
+	completion.status = status;
+	memcpy(completion.data, r->req.reply.data, 8);
+	completion.submitted = r->cmd.submitted;
+	completion.completed = timeNow();
+	spscPush(&channel->completions, &completion);
+
+	channel->inflight--;
+	io->free[io->nfree++] = r;
+}
+
+static void replied(TCan *can, TElmoRequest *req, void *arg)
+{
+	(void)can;
+	complete((TRtRequest *)arg, req->status);
+}
+
+/*
+ * Sends the commands of all the channels, each node's in one batch. A channel waits
+ * while its node has CAN_MAX_PENDING requests in flight, so its commands stay in order.
+ * Returns the number of commands taken.
+ */
+static int sendCommands(TRtIo *io)
+{
+	TRtChannel *channel;
+	TRtCommand *cmd;
+	TRtRequest *r;
+	TCan *can;
+	int taken = 0;
+	int i, rval;
+
+	for (i = 0; i < io->nodes; i++) {
+		beginBatch(io->node[i]);
+	}
+
+	for (i = 0; i < io->channels; i++) {
+		channel = &io->channel[i];
+		while ((cmd = (TRtCommand *)spscFront(&channel->commands)) && io->nfree &&
+		       channel->inflight < spscSpace(&channel->completions)) {
+			can = cmd->node < io->nodes ? io->node[cmd->node] : NULL;
+			if (can && can->npending >= CAN_MAX_PENDING) {
+				break;
+			}
+
+			r = io->free[--io->nfree];
+			r->channel = channel;
+			r->cmd = *cmd;
+			memset(&r->req.reply, 0, sizeof(r->req.reply));
+			spscDrop(&channel->commands);
+			channel->inflight++;
+			taken++;
+
+			if (!can) {
+				complete(r, -5);
+			} else if ((rval = sendRequest(can, &r->req, cmd->size, r->cmd.data, replied, r)) < 0) {
+				complete(r, rval);
+			} else {
+				io->commands++;
+			}
+		}
+	}
+
+	for (i = 0; i < io->nodes; i++) {
+		flushBatch(io->node[i]);
+	}
+	return taken;
+}
+
+static int commandsQueued(TRtIo *io)
+{
+	int i;
+
+	for (i = 0; i < io->channels; i++) {
+		if (spscFront(&io->channel[i].commands)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Reads the frames of a readable node with one system call and dispatches them. */
+static void receiveFrames(TCan *can)
+{
+	struct can_frame frame;
+	int n;
+
+	if ((n = readFramesStamped(can->socket, can->rxbatch, can->rxstamps, CAN_BATCH)) <= 0) {
+		return;
+	}
+	can->rxhead = 0;
+	can->nrx = n;
+
+	while (can->rxhead < can->nrx && receiveFrameUntil(can, &frame, 0) == 0) {
+		can->rxframes++;
+		dispatchFrame(can, &frame);
+	}
+}
+
+/* Completes the requests whose replies did not arrive within the receive timeout. */
+static void expireRequests(TRtIo *io)
+{
+	TElmoRequest *req;
+	TCan *can;
+	long long now = timeNow();
+	int i;
+
+	for (i = 0; i < io->nodes; i++) {
+		can = io->node[i];
+		while (can->npending > 0 && can->rxtimeout &&
+		       now - can->pending[0]->sent > can->rxtimeout * 1000LL) {
+			req = can->pending[0];
+			cancelRequest(can, req);
+			can->timeouts++;
+			complete((TRtRequest *)req->arg, CAN_TIMEOUT);
+		}
+	}
+}
+
+/* The frames of the nodes are dispatched here, so their heartbeat is checked here too. */
+static void checkHeartbeats(TRtIo *io)
+{
+	int i;
+
+	for (i = 0; i < io->nodes; i++) {
+		if (io->node[i]->monitor) {
+			checkHeartbeat(io->node[i]);
+		}
+	}
+}
+
+static void *rtioThread(void *arg)
+{
+	TRtIo *io = (TRtIo *)arg;
+	struct pollfd fd[RTIO_MAX_NODES + 1];
+	struct timespec idle = { 0, RTIO_IDLE * 1000L };
+	struct timespec zero = { 0, 0 };
+	struct timespec *timeout;
+	uint64_t wakeups;
+	int i;
+
+	for (i = 0; i < io->nodes; i++) {
+		fd[i].fd = io->node[i]->socket;
+		fd[i].events = POLLIN;
+	}
+	fd[io->nodes].fd = io->wake;
+	fd[io->nodes].events = POLLIN;
+
+	if (realtimeEnabled()) {
+		prefaultStack();
+	}
+
+	while (io->running) {
+		io->loops++;
+		timeout = &zero;
+
+		/*
+		 * With nothing to send, announce the sleep before the last look at the rings:
+		 * a command submitted after that look sees the flag and wakes us.
+		 */
+		if (!sendCommands(io)) {
+			__atomic_store_n(&io->sleeping, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST); /* pairs with the one in rtioSubmit() */
+			if (!commandsQueued(io)) {
+				timeout = &idle;
+				io->sleeps++;
+			}
+		}
+
+		if (ppoll(fd, io->nodes + 1, timeout, NULL) < 0 && errno != EINTR) {
+			reportError("ppoll");
+			break;
+		}
+		__atomic_store_n(&io->sleeping, 0, __ATOMIC_RELAXED);
+
+		if (fd[io->nodes].revents & POLLIN) {
+			if (read(io->wake, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+				reportError("eventfd read");
+			}
+		}
+
+		for (i = 0; i < io->nodes; i++) {
+			if (fd[i].revents & POLLIN) {
+				receiveFrames(io->node[i]);
+			}
+		}
+		expireRequests(io);
+		checkHeartbeats(io);
+	}
+	return NULL;
+}
+
+int rtioStart(TRtIo *io, int cpu, int priority)
+{
+	struct sched_param param;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int rval = 0;
+
+	if (io->running) {
+		return 0;
+	}
+
+	pthread_attr_init(&attr);
+	io->cpu = cpu;
+	io->priority = priority;
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+			rval = -1;
+		}
+	}
+
+	if (!rval && priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		if (pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) != 0 ||
+		    pthread_attr_setschedpolicy(&attr, SCHED_FIFO) != 0 ||
+		    pthread_attr_setschedparam(&attr, &param) != 0) {
+			rval = -2;
+		}
+	}
+
+	io->running = 1;
+	if (!rval && pthread_create(&io->thread, &attr, rtioThread, io) != 0) {
+		rval = -3;
+	}
+	pthread_attr_destroy(&attr);
+
+	if (rval < 0) {
+		io->running = 0;
+	}
+	return rval;
+}
+
+void rtioStop(TRtIo *io)
+{
+	uint64_t one = 1;
+
+	if (!io->running) {
+		return;
+	}
+
+	io->running = 0;
+	if (write(io->wake, &one, sizeof(one)) != sizeof(one)) {
+		reportError("eventfd write");
+	}
+	pthread_join(io->thread, NULL);
+}
+
+int rtioSubmit(TRtChannel *channel, const TRtCommand *cmd)
+{
+	TRtCommand c = *cmd;
+	uint64_t one = 1;
+
+	c.submitted = timeNow();
+	if (spscPush(&channel->commands, &c) < 0) {
+		return -1;
+	}
+
+	/* Pairs with the store of sleeping in rtioThread(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&channel->io->sleeping, __ATOMIC_RELAXED)) {
+		if (write(channel->io->wake, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			reportError("eventfd write");
+		}
+	}
+	return 0;
+}
+
+int rtioPoll(TRtChannel *channel, TRtCompletion *completion)
+{
+	return spscPop(&channel->completions, completion);
+}
+
+int rtioWait(TRtChannel *channel, TRtCompletion *completion, long timeout)
+{
+	struct timespec wait = { 0, 10000 };
+	long long deadline = timeNow() + timeout * 1000LL;
+	int polls = 0;
+
+	while (spscPop(&channel->completions, completion) < 0) {
+		if (timeNow() >= deadline) {
+			return CAN_TIMEOUT;
+		}
+		if (++polls > RTIO_SPIN) {
+			nanosleep(&wait, NULL);
+		}
+	}
+	return 0;
+}
+
+int rtioReadTelemetry(TRtChannel *channel, TRtTelemetry *telemetry)
+{
+	return spscPop(&channel->telemetry, telemetry);
+}
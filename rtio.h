@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_RTIO_H
+#define ELMO_RTIO_H
+
+#include <pthread.h>
+
+#include "elmoasync.h"
+#include "spsc.h"
+#include "telemetry.h"
+
+/** Maximum number of nodes owned by an I/O thread */
+#define RTIO_MAX_NODES 16
+
+/** Maximum number of channels of an I/O thread */
+#define RTIO_MAX_CHANNELS 16
+
+/** Elements in each ring of a channel, a power of two */
+#define RTIO_RING_SIZE 256
+
+/** Commands in flight over all the nodes */
+#define RTIO_REQUESTS (RTIO_MAX_NODES * CAN_MAX_PENDING)
+
+/** Longest sleep of the I/O thread with nothing to do, in microseconds */
+#define RTIO_IDLE 1000
+
+/** Polls of the ring by rtioWait() before it starts to sleep between the polls */
+#define RTIO_SPIN 1000
+
+/**
+ * A binary interpreter command put in a channel.
+ */
+typedef struct {
+	unsigned int tag;         /** chosen by the application, returned in the completion */
+	unsigned char node;       /** index of the node in the I/O thread */
+	unsigned char size;       /** size of the command in bytes */
+	unsigned char data[8];    /** the command */
+	long long submitted;      /** timeNow() when submitted, set by rtioSubmit() */
+} TRtCommand;
+
+/**
+ * The outcome of a command, returned in the channel it was submitted to, in the order
+ * the replies arrived.
+ */
+typedef struct {
+	unsigned int tag;         /** tag of the command */
+	unsigned char node;       /** index of the node */
+	int status;               /** 0 on success, -3 if the drive flagged an error, CAN_TIMEOUT,
+				      <0 if the command could not be sent */
+	unsigned char data[8];    /** the reply */
+	long long submitted;      /** timeNow() when the command was submitted */
+	long long completed;      /** timeNow() when the reply was received */
+} TRtCompletion;
+
+/**
+ * A telemetry sample put in the channel subscribed to the node.
+ */
+typedef struct {
+	unsigned char node;       /** index of the node */
+	TTelemetrySample sample;  /** the sample */
+} TRtTelemetry;
+
+struct TRtIo;
+
+/**
+ * The connection of one application thread to the I/O thread: a ring of commands to it,
+ * and rings of completions and telemetry from it. Each ring has one producer and one
+ * consumer, so no locks are needed; a channel must be used by one application thread.
+ */
+typedef struct {
+	TSpscRing commands;       /** application -> I/O thread */
+	TSpscRing completions;    /** I/O thread -> application */
+	TSpscRing telemetry;      /** I/O thread -> application */
+	struct TRtIo *io;         /** the I/O thread */
+	unsigned int inflight;    /** commands sent but not completed, I/O thread only */
+	unsigned long dropped;    /** telemetry samples dropped because the ring was full */
+} TRtChannel;
+
+/**
+ * A command sent by the I/O thread, from the preallocated pool.
+ */
+typedef struct {
+	TElmoRequest req;         /** the request */
+	TRtChannel *channel;      /** the channel of the command */
+	TRtCommand cmd;           /** the command */
+} TRtRequest;
+
+/**
+ * A real-time I/O thread owning the sockets of a set of nodes. Only this thread reads
+ * and writes them; the application threads submit commands and receive completions and
+ * telemetry through their channels, without locks, system calls or allocations (a
+ * sleeping I/O thread is woken with an eventfd).
+ *
+ * The nodes and channels are added, and the telemetry subscribed, before rtioStart().
+ */
+typedef struct TRtIo {
+	TCan *node[RTIO_MAX_NODES];          /** the nodes, each with its own socket */
+	int nodes;                           /** number of nodes */
+	TRtChannel channel[RTIO_MAX_CHANNELS]; /** the channels */
+	int channels;                        /** number of channels */
+	TRtRequest request[RTIO_REQUESTS];   /** the pool of requests */
+	TRtRequest *free[RTIO_REQUESTS];     /** the free requests */
+	int nfree;                           /** number of free requests */
+	TTelemetry telemetry[RTIO_MAX_NODES]; /** telemetry subscriptions of the nodes */
+	int wake;                 /** eventfd waking the thread */
+	int sleeping;             /** nonzero while the thread waits for the sockets */
+	volatile int running;     /** cleared by rtioStop() */
+	int cpu;                  /** CPU of the thread, -1 for any */
+	int priority;             /** SCHED_FIFO priority of the thread, 0 to keep the policy */
+	pthread_t thread;         /** the thread */
+	unsigned long loops;      /** iterations of the loop */
+	unsigned long sleeps;     /** times the thread slept */
+	unsigned long commands;   /** commands sent */
+} TRtIo;
+
+/**
+ * Constructs a new TRtIo without nodes or channels.
+ *
+ * @return The pointer to a new TRtIo, NULL on errors.
+ */
+TRtIo *TRtIoConstruct(void);
+
+/**
+ * Destructs a TRtIo. The thread must be stopped first; the nodes are not closed.
+ *
+ * @param io The pointer to the TRtIo to be destructed.
+ */
+void TRtIoDestruct(TRtIo *io);
+
+/**
+ * Hands an opened node with its own socket (not on a TCanBus) over to the I/O thread.
+ * No other thread may use the TCan until the thread is stopped.
+ *
+ * @param io The pointer to the TRtIo.
+ * @param can The TCan pointer of the motor controller.
+ * @return The index of the node, <0 otherwise.
+ */
+int rtioAddNode(TRtIo *io, TCan *can);
+
+/**
+ * Adds a channel for an application thread.
+ *
+ * @param io The pointer to the TRtIo.
+ * @return The channel, NULL if there are RTIO_MAX_CHANNELS already.
+ */
+TRtChannel *rtioAddChannel(TRtIo *io);
+
+/**
+ * Delivers the telemetry of a node (see configureTelemetry()) to a channel.
+ *
+ * @param io The pointer to the TRtIo.
+ * @param node The index of the node.
+ * @param channel The channel.
+ * @return 0 on success, <0 otherwise.
+ */
+int rtioSubscribeTelemetry(TRtIo *io, int node, TRtChannel *channel);
+
+/**
+ * Starts the I/O thread.
+ *
+ * @param io The pointer to the TRtIo.
+ * @param cpu The CPU the thread is pinned to, -1 for any.
+ * @param priority The SCHED_FIFO priority of the thread, 0 to keep the policy.
+ * @return 0 on success, <0 otherwise.
+ */
+int rtioStart(TRtIo *io, int cpu, int priority);
+
+/**
+ * Stops the I/O thread. Commands still in flight are not completed.
+ *
+ * @param io The pointer to the TRtIo.
+ */
+void rtioStop(TRtIo *io);
+
+/**
+ * Submits a command to the I/O thread.
+ *
+ * @param channel The channel of the calling thread.
+ * @param cmd The command.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int rtioSubmit(TRtChannel *channel, const TRtCommand *cmd);
+
+/**
+ * Takes the oldest completion of the channel, if any.
+ *
+ * @param channel The channel of the calling thread.
+ * @param completion The pointer where the completion is stored.
+ * @return 0 on success, -1 if there is none.
+ */
+int rtioPoll(TRtChannel *channel, TRtCompletion *completion);
+
+/**
+ * Waits for the oldest completion of the channel, polling the ring.
+ *
+ * @param channel The channel of the calling thread.
+ * @param completion The pointer where the completion is stored.
+ * @param timeout The timeout in microseconds.
+ * @return 0 on success, CAN_TIMEOUT if none arrived in time.
+ */
+int rtioWait(TRtChannel *channel, TRtCompletion *completion, long timeout);
+
+/**
+ * Takes the oldest telemetry sample of the channel, if any.
+ *
+ * @param channel The channel of the calling thread.
+ * @param telemetry The pointer where the sample is stored.
+ * @return 0 on success, -1 if there is none.
+ */
+int rtioReadTelemetry(TRtChannel *channel, TRtTelemetry *telemetry);
+
+#endif /* ELMO_RTIO_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "runtime.h"
+
+TCanRuntime *TCanRuntimeConstruct(void)
+{
+	TCanRuntime *rt = (TCanRuntime *)malloc(sizeof(TCanRuntime));
+	if (!rt) {
+		return NULL;
+	}
+
+	memset(rt, 0, sizeof(*rt));
+	return rt;
+}
+
+void TCanRuntimeDestruct(TCanRuntime *rt)
+{
+	int i, j;
+
+	for (i = 0; i < rt->buses; i++) {
+		for (j = 0; j < CANBUS_MAX_NODES; j++) {
+			if (rt->node[i][j]) {
+				pthread_mutex_destroy(&rt->node[i][j]->lock);
+				TCanDestruct(rt->node[i][j]->can);
+				free(rt->node[i][j]);
+			}
+		}
+		TCanBusDestruct(rt->bus[i]);
+	}
+	free(rt);
+}
+
+int TCanRuntimeAddBus(TCanRuntime *rt, const char *iface, int cpu)
+{
+	TCanBus *bus;
+
+	if (rt->buses >= RUNTIME_MAX_BUSES) {
+		return -1;
+	}
+
+	if (!(bus = TCanBusConstruct(iface))) {
+		return -2;
+	}
+
+	if (TCanBusOpen(bus) < 0) {
+		TCanBusDestruct(bus);
+		return -3;
+	}
+
+	if (TCanBusStart(bus, cpu) < 0) {
+		TCanBusClose(bus);
+		TCanBusDestruct(bus);
+		return -4;
+	}
+
+	rt->bus[rt->buses] = bus;
+	return rt->buses++;
+}
+
+int TCanRuntimeAddNode(TCanRuntime *rt, int bus, int id)
+{
+	TCanRuntimeNode *node;
+
+	if (bus < 0 || bus >= rt->buses || id <= 0 || id >= CANBUS_MAX_NODES || rt->node[bus][id]) {
+		return -1;
+	}
+
+	if (!(node = (TCanRuntimeNode *)malloc(sizeof(TCanRuntimeNode)))) {
+		return -2;
+	}
+
+	if (!(node->can = TCanConstruct(rt->bus[bus]->iface))) {
+		free(node);
+		return -2;
+	}
+
+	if (TCanOpenOnBus(node->can, rt->bus[bus], id) < 0) {
+		TCanDestruct(node->can);
+		free(node);
+		return -3;
+	}
+
+	pthread_mutex_init(&node->lock, NULL);
+	rt->node[bus][id] = node;
+	return 0;
+}
+
+static TCanRuntimeNode *findNode(TCanRuntime *rt, int bus, int id)
+{
+	if (bus < 0 || bus >= rt->buses || id <= 0 || id >= CANBUS_MAX_NODES) {
+		return NULL;
+	}
+	return rt->node[bus][id];
+}
+
+TCan *TCanRuntimeLock(TCanRuntime *rt, int bus, int id)
+{
+	TCanRuntimeNode *node = findNode(rt, bus, id);
+	if (!node) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&node->lock);
+	return node->can;
+}
+
+void TCanRuntimeUnlock(TCanRuntime *rt, int bus, int id)
+{
+	TCanRuntimeNode *node = findNode(rt, bus, id);
+	if (node) {
+		pthread_mutex_unlock(&node->lock);
+	}
+}
+
+int TCanRuntimeTransact(TCanRuntime *rt, int bus, int id, int size, const unsigned char *data,
+			struct can_frame *reply)
+{
+	TCan *can;
+	int rval;
+
+	if (!(can = TCanRuntimeLock(rt, bus, id))) {
+		return -1;
+	}
+
+	rval = transact(can, size, data, reply);
+	TCanRuntimeUnlock(rt, bus, id);
+	return rval;
+}
+
+int TCanRuntimeClose(TCanRuntime *rt)
+{
+	int rval = 0;
+	int i, j;
+
+	for (i = 0; i < rt->buses; i++) {
+		TCanBusStop(rt->bus[i]);
+		for (j = 0; j < CANBUS_MAX_NODES; j++) {
+			if (rt->node[i][j]) {
+				TCanClose(rt->node[i][j]->can);
+			}
+		}
+		if (TCanBusClose(rt->bus[i]) < 0) {
+			rval = -1;
+		}
+	}
+	return rval;
+}
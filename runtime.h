@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_RUNTIME_H
+#define ELMO_RUNTIME_H
+
+#include "canbus.h"
+#include "elmoasync.h"
+
+/** Maximum number of CAN interfaces in a runtime */
+#define RUNTIME_MAX_BUSES 8
+
+/**
+ * A node of the runtime: the TCan and the lock serializing its users.
+ */
+typedef struct {
+	TCan *can;                /** the node */
+	pthread_mutex_t lock;     /** held while a thread uses the node */
+} TCanRuntimeNode;
+
+/**
+ * Several CAN interfaces, each a TCanBus with its own I/O thread. The nodes of all the
+ * buses can be commanded from any thread: each command locks only its own node, so
+ * commands to different nodes and buses run in parallel.
+ *
+ * Buses and nodes are added before the threads start using the runtime.
+ */
+typedef struct {
+	TCanBus *bus[RUNTIME_MAX_BUSES];  /** the buses by index */
+	TCanRuntimeNode *node[RUNTIME_MAX_BUSES][CANBUS_MAX_NODES]; /** the nodes by bus and id */
+	int buses;                /** number of buses */
+} TCanRuntime;
+
+/**
+ * Constructs a new TCanRuntime without buses.
+ *
+ * @return The pointer to a new TCanRuntime.
+ */
+TCanRuntime *TCanRuntimeConstruct(void);
+
+/**
+ * Destructs a TCanRuntime. The runtime must be closed first.
+ *
+ * @param rt The pointer to the TCanRuntime to be destructed.
+ */
+void TCanRuntimeDestruct(TCanRuntime *rt);
+
+/**
+ * Opens a CAN interface and starts its I/O thread.
+ *
+ * @param rt The pointer to the TCanRuntime.
+ * @param iface The name of the CAN interface.
+ * @param cpu The CPU the I/O thread is pinned to, -1 for any.
+ * @return The index of the bus on success, <0 otherwise.
+ */
+int TCanRuntimeAddBus(TCanRuntime *rt, const char *iface, int cpu);
+
+/**
+ * Opens a node on a bus of the runtime.
+ *
+ * @param rt The pointer to the TCanRuntime.
+ * @param bus The index of the bus.
+ * @param id The ID of the CAN node in the bus.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanRuntimeAddNode(TCanRuntime *rt, int bus, int id);
+
+/**
+ * Locks a node for the calling thread. Any elmo.c function can be called on the returned
+ * TCan until TCanRuntimeUnlock().
+ *
+ * @param rt The pointer to the TCanRuntime.
+ * @param bus The index of the bus.
+ * @param id The ID of the CAN node in the bus.
+ * @return The locked TCan, NULL if there is no such node.
+ */
+TCan *TCanRuntimeLock(TCanRuntime *rt, int bus, int id);
+
+/**
+ * Unlocks a node locked with TCanRuntimeLock().
+ *
+ * @param rt The pointer to the TCanRuntime.
+ * @param bus The index of the bus.
+ * @param id The ID of the CAN node in the bus.
+ */
+void TCanRuntimeUnlock(TCanRuntime *rt, int bus, int id);
+
+/**
+ * Sends a binary interpreter command to a node and waits for the reply, see transact().
+ * Can be called from any thread.
+ *
+ * @param rt The pointer to the TCanRuntime.
+ * @param bus The index of the bus.
+ * @param id The ID of the CAN node in the bus.
+ * @param size The size of the message in bytes.
+ * @param data The data of the message.
+ * @param reply The frame pointer where the reply is written, or NULL.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanRuntimeTransact(TCanRuntime *rt, int bus, int id, int size, const unsigned char *data,
+			struct can_frame *reply);
+
+/**
+ * Closes all the nodes and buses of the runtime.
+ *
+ * @param rt The pointer to the TCanRuntime.
+ * @return 0 on success, <0 otherwise.
+ */
+int TCanRuntimeClose(TCanRuntime *rt);
+
+#endif /* ELMO_RUNTIME_H */
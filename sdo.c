@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sdo.h"
+
+/* Protocol states of a TSdoTransfer */
+enum {
+	STATE_INITIATE,           /* waiting for the response to the initiate request */
+	STATE_SEGMENT,            /* waiting for the response to a segment */
+	STATE_BLOCK,              /* download: waiting for the confirmation, upload: receiving */
+	STATE_BLOCK_END,          /* waiting for the end of a block transfer */
+	STATE_DONE
+};
+
+/*
+ * Counts a finished transfer in the throughput counters of the node.
+ */
+static void account(TCan *can, int status, unsigned int bytes, long long start)
+{
+	if (status < 0) {
+		can->sdofailures++;
+		return;
+	}
+
+	can->sdotransfers++;
+	can->sdobytes += bytes;
+	can->sdotime += timeNow() - start;
+}
+
+/*
+ * Sends a SDO request and waits for the response of the node. An abort response is
+ * reported as -3 with the abort code in can->sdoabort.
+ */
+static int sdoTransfer(TCan *can, unsigned char *data, struct can_frame *response)
+{
+	struct can_frame frame;
+	int rval;
+
+	createFrame(&frame, COBID_SDO_RX(can->id), 8, data);
+	if (sendFrame(can, &frame) < 0) {
+		return -1;
+	}
+
+	if ((rval = receiveCob(can, COBID_SDO_TX(can->id), response)) < 0) {
+		return rval;
+	}
+
+	if (response->data[0] == 0x80) {
+		can->sdoabort = response->data[4] | (response->data[5] << 8) |
+			(response->data[6] << 16) | ((unsigned int)response->data[7] << 24);
+		return -3;
+	}
+
+	return 0;
+}
+
+int sdoDownload(TCan *can, unsigned short index, unsigned char subindex,
+		unsigned int value, int size)
+{
+	struct can_frame response;
+	unsigned char data[8];
+	long long start = timeNow();
+	int rval;
+
+	if (size != 1 && size != 2 && size != 4) {
+		return -5;
+	}
+
+	data[0] = 0x23 | ((4 - size) << 2); /* initiate download, expedited, size indicated */
+	data[1] = index & 0xff;
+	data[2] = index >> 8;
+	data[3] = subindex;
+	data[4] = value & 0xff;
+	data[5] = (value >> 8) & 0xff;
+	data[6] = (value >> 16) & 0xff;
+	data[7] = (value >> 24) & 0xff;
+
+	if ((rval = sdoTransfer(can, data, &response)) < 0) {
+		account(can, rval, 0, start);
+		return rval;
+	}
+
+	rval = response.data[0] == 0x60 ? 0 : -6;
+	account(can, rval, size, start);
+	return rval;
+}
+
+int sdoUpload(TCan *can, unsigned short index, unsigned char subindex, unsigned int *value)
+{
+	struct can_frame response;
+	unsigned char data[8] = { 0x40, index & 0xff, index >> 8, subindex, 0x00, 0x00, 0x00, 0x00 };
+	long long start = timeNow();
+	int rval;
+	int size;
+	int i;
+
+	if ((rval = sdoTransfer(can, data, &response)) < 0) {
+		account(can, rval, 0, start);
+		return rval;
+	}
+
+	if ((response.data[0] & 0xe0) != 0x40) {
+		account(can, -6, 0, start);
+		return -6;
+	}
+
+	if (!(response.data[0] & 0x02)) {
+		/* The node waits for the segments, see sdoUploadData(). */
+		data[0] = 0x80;
+		setDataInt(data, SDO_ABORT_MEMORY);
+		createFrame(&response, COBID_SDO_RX(can->id), 8, data);
+		sendFrame(can, &response);
+		account(can, -4, 0, start);
+		return -4; /* not expedited */
+	}
+
+	/* Without the size indicated, all four bytes are data. */
+	size = (response.data[0] & 0x01) ? 4 - ((response.data[0] >> 2) & 0x03) : 4;
+	*value = 0;
+	for (i = 0; i < size; i++) {
+		*value |= (unsigned int)response.data[4 + i] << (8 * i);
+	}
+	account(can, 0, size, start);
+	return 0;
+}
+
+static int sendSdo(TCan *can, const unsigned char *data)
+{
+	struct can_frame frame;
+
+	createFrame(&frame, COBID_SDO_RX(can->id), 8, (unsigned char *)data);
+	return sendFrame(can, &frame);
+}
+
+/* Starts a request addressing the object of the transfer. */
+static void header(TSdoTransfer *t, unsigned char *data, unsigned char command)
+{
+	memset(data, 0, 8);
+	data[0] = command;
+	data[1] = t->index & 0xff;
+	data[2] = t->index >> 8;
+	data[3] = t->subindex;
+}
+
+static void finish(TSdoTransfer *t, int status)
+{
+	t->status = status;
+	t->state = STATE_DONE;
+	t->end = timeNow();
+	account(t->can, status, t->done, t->start);
+}
+
+/* Fails the transfer and aborts it on the node. */
+static void fail(TSdoTransfer *t, int status, unsigned int code)
+{
+	unsigned char data[8];
+
+	header(t, data, 0x80);
+	setDataInt(data, (int)code);
+	sendSdo(t->can, data);
+	t->abort = code;
+	finish(t, status);
+}
+
+static int min7(unsigned int remaining)
+{
+	return remaining < 7 ? (int)remaining : 7;
+}
+
+/* Sends the next segment of a segmented download. Its size is kept in seqno. */
+static int sendSegment(TSdoTransfer *t)
+{
+	unsigned char data[8] = { 0 };
+	int n = min7(t->size - t->done);
+
+	data[0] = (t->toggle << 4) | ((7 - n) << 1) | (t->done + n == t->size ? 0x01 : 0x00);
+	memcpy(&data[1], t->data + t->done, n);
+	t->seqno = n;
+	return sendSdo(t->can, data);
+}
+
+/* Sends the segments of a block from blockstart on with one system call. */
+static int sendBlock(TSdoTransfer *t)
+{
+	struct can_frame frame[SDO_BLOCK_SIZE];
+	unsigned int offset = t->blockstart;
+	unsigned char data[8];
+	int count = 0;
+	int n;
+
+	do {
+		n = min7(t->size - offset);
+		memset(data, 0, sizeof(data));
+		memcpy(&data[1], t->data + offset, n);
+		offset += n;
+		data[0] = (count + 1) | (offset == t->size ? 0x80 : 0x00);
+		createFrame(&frame[count++], COBID_SDO_RX(t->can->id), 8, data);
+	} while (count < t->blksize && offset < t->size);
+
+	t->seqno = count;
+	t->last = offset == t->size;
+	return sendFrames(t->can, frame, count);
+}
+
+static int start(TSdoTransfer *t)
+{
+	unsigned char data[8];
+
+	t->done = 0;
+	t->total = 0;
+	t->toggle = 0;
+	t->seqno = 0;
+	t->blockstart = 0;
+	t->crc = 0;
+	t->last = 0;
+	t->status = 0;
+	t->abort = 0;
+	t->state = STATE_INITIATE;
+	t->start = timeNow();
+
+	if (t->upload && t->mode == SDO_BLOCK) {
+		header(t, data, 0xa4);    /* initiate block upload, CRC supported */
+		data[4] = SDO_BLOCK_SIZE;
+		data[5] = 0;              /* never switch to a segmented transfer */
+	} else if (t->upload) {
+		header(t, data, 0x40);    /* initiate upload */
+	} else if (t->mode == SDO_EXPEDITED) {
+		if (t->size < 1 || t->size > 4) {
+			finish(t, -5);
+			return -5;
+		}
+		header(t, data, 0x23 | ((4 - t->size) << 2)); /* expedited, size indicated */
+		memcpy(&data[4], t->data, t->size);
+	} else {
+		/* Size indicated, and for a block download, CRC supported. */
+		header(t, data, t->mode == SDO_BLOCK ? 0xc6 : 0x21);
+		setDataInt(data, (int)t->size);
+	}
+
+	if (sendSdo(t->can, data) < 0) {
+		finish(t, -1);
+		return -1;
+	}
+	return 0;
+}
+
+static void handleDownload(TSdoTransfer *t, const unsigned char *data)
+{
+	unsigned char end[8] = { 0 };
+	unsigned short crc;
+	int ack;
+
+	switch (t->state) {
+	case STATE_INITIATE:
+		if (t->mode == SDO_BLOCK && (data[0] & 0xe3) == 0xa0) {
+			t->crc = (data[0] >> 2) & 0x01;
+			t->blksize = data[4];
+			if (t->blksize < 1 || t->blksize > SDO_BLOCK_SIZE) {
+				fail(t, -6, SDO_ABORT_COMMAND);
+				return;
+			}
+			t->state = STATE_BLOCK;
+			if (sendBlock(t) < 0) {
+				fail(t, -1, SDO_ABORT_TIMEOUT);
+			}
+		} else if (t->mode != SDO_BLOCK && data[0] == 0x60) {
+			if (t->mode == SDO_EXPEDITED) {
+				t->done = t->size;
+				finish(t, 0);
+				return;
+			}
+			t->state = STATE_SEGMENT;
+			if (sendSegment(t) < 0) {
+				fail(t, -1, SDO_ABORT_TIMEOUT);
+			}
+		} else {
+			fail(t, -6, SDO_ABORT_COMMAND);
+		}
+		return;
+	case STATE_SEGMENT:
+		if ((data[0] & 0xe0) != 0x20 || ((data[0] >> 4) & 0x01) != t->toggle) {
+			fail(t, -6, SDO_ABORT_TOGGLE);
+			return;
+		}
+		t->done += t->seqno;
+		if (t->done == t->size) {
+			finish(t, 0);
+			return;
+		}
+		t->toggle ^= 1;
+		if (sendSegment(t) < 0) {
+			fail(t, -1, SDO_ABORT_TIMEOUT);
+		}
+		return;
+	case STATE_BLOCK:
+		ack = data[1];
+		if (data[0] != 0xa2 || ack > t->seqno || data[2] < 1 || data[2] > SDO_BLOCK_SIZE) {
+			fail(t, -6, data[0] != 0xa2 ? SDO_ABORT_COMMAND : SDO_ABORT_SEQUENCE);
+			return;
+		}
+
+		t->done = t->blockstart + ack * 7 < t->size ? t->blockstart + ack * 7 : t->size;
+		t->blksize = data[2];
+		if (t->last && ack == t->seqno) {
+			/* The number of bytes of the last segment that were no data. */
+			end[0] = 0xc1 | ((t->size ? (7 - t->size % 7) % 7 : 7) << 2);
+			if (t->crc) {
+				crc = sdoCrc(0, t->data, t->size);
+				end[1] = crc & 0xff;
+				end[2] = crc >> 8;
+			}
+			t->state = STATE_BLOCK_END;
+			if (sendSdo(t->can, end) < 0) {
+				fail(t, -1, SDO_ABORT_TIMEOUT);
+			}
+			return;
+		}
+
+		/* The node asks again for the segments after the last one it confirmed. */
+		t->blockstart = t->done;
+		if (sendBlock(t) < 0) {
+			fail(t, -1, SDO_ABORT_TIMEOUT);
+		}
+		return;
+	case STATE_BLOCK_END:
+		if (data[0] != 0xa1) {
+			fail(t, -6, SDO_ABORT_COMMAND);
+			return;
+		}
+		finish(t, 0);
+		return;
+	}
+}
+
+/* Copies the data of a received segment, counting the bytes that do not fit as well. */
+static void store(TSdoTransfer *t, const unsigned char *data, int n)
+{
+	if (t->done < t->size) {
+		memcpy(t->data + t->done, data, t->size - t->done < (unsigned int)n ? t->size - t->done : (unsigned int)n);
+	}
+	t->done += n;
+}
+
+static void handleUpload(TSdoTransfer *t, const unsigned char *data)
+{
+	unsigned char req[8] = { 0 };
+	unsigned short crc;
+	int n;
+
+	switch (t->state) {
+	case STATE_INITIATE:
+		if (t->mode == SDO_BLOCK && (data[0] & 0xe1) == 0xc0) {
+			t->crc = (data[0] >> 2) & 0x01;
+			t->total = (data[0] & 0x02) ? (unsigned int)intFromData(data) : 0;
+			t->blksize = SDO_BLOCK_SIZE;
+			req[0] = 0xa3;        /* start the upload */
+		} else if (t->mode != SDO_BLOCK && (data[0] & 0xe0) == 0x40) {
+			if (data[0] & 0x02) {
+				/* Expedited, without the size indicated all four bytes are data. */
+				n = (data[0] & 0x01) ? 4 - ((data[0] >> 2) & 0x03) : 4;
+				store(t, &data[4], n);
+				t->total = n;
+				finish(t, t->done > t->size ? -7 : 0);
+				return;
+			}
+			t->total = (data[0] & 0x01) ? (unsigned int)intFromData(data) : 0;
+			req[0] = 0x60;        /* upload the first segment */
+		} else {
+			fail(t, -6, SDO_ABORT_COMMAND);
+			return;
+		}
+
+		if (t->total > t->size) {
+			fail(t, -7, SDO_ABORT_MEMORY);
+			return;
+		}
+		t->state = t->mode == SDO_BLOCK ? STATE_BLOCK : STATE_SEGMENT;
+		break;
+	case STATE_SEGMENT:
+		if ((data[0] & 0xe0) != 0x00 || ((data[0] >> 4) & 0x01) != t->toggle) {
+			fail(t, -6, SDO_ABORT_TOGGLE);
+			return;
+		}
+		store(t, &data[1], 7 - ((data[0] >> 1) & 0x07));
+		if (t->done > t->size) {
+			fail(t, -7, SDO_ABORT_MEMORY);
+			return;
+		}
+		if (data[0] & 0x01) {
+			finish(t, 0);
+			return;
+		}
+		t->toggle ^= 1;
+		req[0] = 0x60 | (t->toggle << 4);
+		break;
+	case STATE_BLOCK:
+		/* Segments out of sequence are dropped, the node repeats them after the ack. */
+		if ((data[0] & 0x7f) == t->seqno + 1) {
+			store(t, &data[1], 7);
+			t->seqno++;
+			t->last = (data[0] & 0x80) != 0;
+		}
+		if ((data[0] & 0x7f) != t->blksize && !(data[0] & 0x80)) {
+			return;
+		}
+		req[0] = 0xa2;
+		req[1] = t->seqno;
+		req[2] = t->blksize;
+		t->seqno = 0;
+		if (t->last) {
+			t->state = STATE_BLOCK_END;
+		}
+		break;
+	case STATE_BLOCK_END:
+		if ((data[0] & 0xe3) != 0xc1) {
+			fail(t, -6, SDO_ABORT_COMMAND);
+			return;
+		}
+
+		/* The last segment was stored whole, without the bytes that were no data. */
+		t->done -= (data[0] >> 2) & 0x07;
+		if (t->done > t->size) {
+			fail(t, -7, SDO_ABORT_MEMORY);
+			return;
+		}
+		crc = data[1] | (data[2] << 8);
+		if (t->crc && crc != sdoCrc(0, t->data, t->done)) {
+			fail(t, -6, SDO_ABORT_CRC);
+			return;
+		}
+		req[0] = 0xa1;            /* end, not confirmed by the node */
+		if (sendSdo(t->can, req) < 0) {
+			finish(t, -1);
+			return;
+		}
+		finish(t, 0);
+		return;
+	}
+
+	if (sendSdo(t->can, req) < 0) {
+		fail(t, -1, SDO_ABORT_TIMEOUT);
+	}
+}
+
+static void handle(TSdoTransfer *t, const unsigned char *data)
+{
+	/* Segment numbers start at 1, so this is never a block segment. */
+	if (data[0] == 0x80) {
+		t->abort = (unsigned int)intFromData(data);
+		t->can->sdoabort = t->abort;
+		finish(t, -3);
+		return;
+	}
+
+	if (t->state == STATE_INITIATE &&
+	    (data[1] != (t->index & 0xff) || data[2] != (t->index >> 8) || data[3] != t->subindex)) {
+		fail(t, -6, SDO_ABORT_COMMAND);
+		return;
+	}
+
+	if (t->upload) {
+		handleUpload(t, data);
+	} else {
+		handleDownload(t, data);
+	}
+}
+
+void sdoInitDownload(TSdoTransfer *t, TCan *can, unsigned short index, unsigned char subindex,
+		     const void *data, unsigned int size, int mode)
+{
+	memset(t, 0, sizeof(*t));
+	t->can = can;
+	t->mode = mode;
+	t->index = index;
+	t->subindex = subindex;
+	t->data = (unsigned char *)data;
+	t->size = size;
+}
+
+void sdoInitUpload(TSdoTransfer *t, TCan *can, unsigned short index, unsigned char subindex,
+		   void *buffer, unsigned int size, int mode)
+{
+	sdoInitDownload(t, can, index, subindex, buffer, size, mode);
+	t->upload = 1;
+}
+
+int sdoRun(TSdoTransfer *t, int count)
+{
+	struct can_frame frame;
+	int active = 0;
+	int rval = 0;
+	int status;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (start(&t[i]) == 0) {
+			active++;
+		}
+	}
+
+	while (active > 0) {
+		for (i = 0; i < count; i++) {
+			if (t[i].state == STATE_DONE) {
+				continue;
+			}
+
+			/*
+			 * Whatever the node has already sent is handled before moving on: once
+			 * the first response arrived, the rest is only polled for.
+			 */
+			status = receiveCob(t[i].can, COBID_SDO_TX(t[i].can->id), &frame);
+			for (;;) {
+				if (status < 0) {
+					fail(&t[i], status, SDO_ABORT_TIMEOUT);
+					break;
+				}
+				handle(&t[i], frame.data);
+				if (t[i].state == STATE_DONE) {
+					break;
+				}
+				status = receiveCobUntil(t[i].can, COBID_SDO_TX(t[i].can->id), &frame,
+							 timeNow());
+				if (status == CAN_TIMEOUT) {
+					break;
+				}
+			}
+
+			if (t[i].state == STATE_DONE) {
+				active--;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (t[i].status < 0 && rval == 0) {
+			rval = t[i].status;
+		}
+	}
+	return rval;
+}
+
+int sdoDownloadData(TCan *can, unsigned short index, unsigned char subindex,
+		    const void *data, unsigned int size, int mode)
+{
+	TSdoTransfer t;
+
+	sdoInitDownload(&t, can, index, subindex, data, size, mode);
+	return sdoRun(&t, 1);
+}
+
+int sdoUploadData(TCan *can, unsigned short index, unsigned char subindex,
+		  void *buffer, unsigned int size, unsigned int *received, int mode)
+{
+	TSdoTransfer t;
+	int rval;
+
+	sdoInitUpload(&t, can, index, subindex, buffer, size, mode);
+	if ((rval = sdoRun(&t, 1)) == 0 && received) {
+		*received = t.done;
+	}
+	return rval;
+}
+
+unsigned short sdoCrc(unsigned short crc, const unsigned char *data, unsigned int size)
+{
+	unsigned int i;
+	int bit;
+
+	for (i = 0; i < size; i++) {
+		crc ^= (unsigned short)data[i] << 8;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+void printSdoStats(TCan *can, FILE *out)
+{
+	double seconds = can->sdotime / 1e9;
+
+	fprintf(out, "SDO: %lu transfers, %lu failed, %llu bytes in %.3f s (%.1f kB/s)\n",
+		can->sdotransfers, can->sdofailures, can->sdobytes, seconds,
+		seconds > 0 ? can->sdobytes / seconds / 1000 : 0.0);
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_SDO_H
+#define ELMO_SDO_H
+
+#include "can.h"
+
+/** Segments per block the client asks for in block transfers, 1-127 */
+#define SDO_BLOCK_SIZE 127
+
+/** Abort codes sent by the client (CiA 301) */
+#define SDO_ABORT_TOGGLE 0x05030000   /** toggle bit not alternated */
+#define SDO_ABORT_TIMEOUT 0x05040000  /** SDO protocol timed out */
+#define SDO_ABORT_COMMAND 0x05040001  /** command specifier not valid or unknown */
+#define SDO_ABORT_SEQUENCE 0x05040003 /** invalid sequence number (block mode) */
+#define SDO_ABORT_CRC 0x05040004      /** CRC error (block mode) */
+#define SDO_ABORT_MEMORY 0x05040005   /** out of memory */
+
+/**
+ * Protocol of an SDO transfer.
+ */
+enum SdoMode
+{
+	SDO_EXPEDITED = 0, /** one request, at most four bytes (uploads switch to segmented if larger) */
+	SDO_SEGMENTED = 1, /** seven bytes per request and response */
+	SDO_BLOCK = 2      /** up to SDO_BLOCK_SIZE segments per confirmation */
+};
+
+/**
+ * An SDO transfer of any size. Transfers to different nodes can be in flight at the
+ * same time with sdoRun(), at most one per node (a node has one SDO channel).
+ */
+typedef struct {
+	TCan *can;                /** the node */
+	int upload;               /** nonzero to read the object, zero to write it */
+	int mode;                 /** enum SdoMode */
+	unsigned short index;     /** index of the object */
+	unsigned char subindex;   /** subindex of the object */
+	unsigned char *data;      /** the data to download, or the buffer of the upload */
+	unsigned int size;        /** bytes to download, or the size of the upload buffer */
+	unsigned int done;        /** bytes transferred */
+	unsigned int total;       /** size of the object announced by the node, 0 if not */
+	int state;                /** protocol state */
+	int toggle;               /** toggle bit of the next segment */
+	int blksize;              /** segments per block */
+	int seqno;                /** last segment sent or received in order in the block */
+	unsigned int blockstart;  /** byte offset of the current block */
+	int crc;                  /** nonzero if both ends check the block CRC */
+	int last;                 /** nonzero once the last segment was sent or received */
+	int status;               /** 0 on success, <0 when failed (see sdoRun()) */
+	unsigned int abort;       /** abort code of a failed transfer, 0 if none */
+	long long start;          /** timeNow() when the transfer started */
+	long long end;            /** timeNow() when it finished */
+} TSdoTransfer;
+
+/**
+ * Writes an object dictionary entry of at most four bytes (expedited SDO download).
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param value The value to be written.
+ * @param size The size of the object in bytes: 1, 2 or 4.
+ * @return 0 on success, -3 if the drive aborted the transfer (the code is in
+ *         can->sdoabort), CAN_TIMEOUT if the drive did not respond in time, <0 otherwise.
+ */
+int sdoDownload(TCan *can, unsigned short index, unsigned char subindex,
+		unsigned int value, int size);
+
+/**
+ * Reads an object dictionary entry of at most four bytes (expedited SDO upload).
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param value The pointer where the value is stored.
+ * @return 0 on success, -3 if the drive aborted the transfer (the code is in
+ *         can->sdoabort), -4 if the object is too large to be read expedited,
+ *         CAN_TIMEOUT if the drive did not respond in time, <0 otherwise.
+ */
+int sdoUpload(TCan *can, unsigned short index, unsigned char subindex, unsigned int *value);
+
+/**
+ * Prepares the download of an object of any size. Nothing is sent until sdoRun().
+ *
+ * @param t The transfer.
+ * @param can The TCan pointer of the node.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param data The data, valid until the transfer finishes.
+ * @param size The size of the data in bytes, at most 4 for SDO_EXPEDITED.
+ * @param mode The enum SdoMode.
+ */
+void sdoInitDownload(TSdoTransfer *t, TCan *can, unsigned short index, unsigned char subindex,
+		     const void *data, unsigned int size, int mode);
+
+/**
+ * Prepares the upload of an object of any size. Nothing is sent until sdoRun().
+ *
+ * @param t The transfer.
+ * @param can The TCan pointer of the node.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param buffer The buffer the object is written to.
+ * @param size The size of the buffer in bytes.
+ * @param mode The enum SdoMode.
+ */
+void sdoInitUpload(TSdoTransfer *t, TCan *can, unsigned short index, unsigned char subindex,
+		   void *buffer, unsigned int size, int mode);
+
+/**
+ * Runs transfers to different nodes until all of them finish. All the transfers are
+ * started at once and each is advanced as soon as its node responds, so the round trips
+ * of the nodes overlap. The segments of a block are sent with one system call.
+ *
+ * The status of each transfer is 0 on success, -1 on send errors, CAN_TIMEOUT if the
+ * node stopped responding, -3 if the node aborted (the code is in abort and in
+ * can->sdoabort), -5 on bad arguments, -6 on protocol errors and -7 if an upload does
+ * not fit in its buffer. The client aborts the transfer on the node in the last three
+ * cases.
+ *
+ * @param t The transfers.
+ * @param count The number of transfers.
+ * @return 0 if all the transfers succeeded, the first failure otherwise.
+ */
+int sdoRun(TSdoTransfer *t, int count);
+
+/**
+ * Writes an object of any size and waits for the transfer to finish.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param data The data.
+ * @param size The size of the data in bytes.
+ * @param mode The enum SdoMode.
+ * @return 0 on success, <0 otherwise (see sdoRun()).
+ */
+int sdoDownloadData(TCan *can, unsigned short index, unsigned char subindex,
+		    const void *data, unsigned int size, int mode);
+
+/**
+ * Reads an object of any size and waits for the transfer to finish.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param index The index of the object.
+ * @param subindex The subindex of the object.
+ * @param buffer The buffer the object is written to.
+ * @param size The size of the buffer in bytes.
+ * @param received The pointer where the size of the object is stored, or NULL.
+ * @param mode The enum SdoMode.
+ * @return 0 on success, <0 otherwise (see sdoRun()).
+ */
+int sdoUploadData(TCan *can, unsigned short index, unsigned char subindex,
+		  void *buffer, unsigned int size, unsigned int *received, int mode);
+
+/**
+ * Computes the CRC of block transfers (CRC-16-CCITT, polynomial 0x1021).
+ *
+ * @param crc The CRC of the preceding data, 0 to start.
+ * @param data The data.
+ * @param size The size of the data in bytes.
+ * @return The CRC.
+ */
+unsigned short sdoCrc(unsigned short crc, const unsigned char *data, unsigned int size);
+
+/**
+ * Prints the SDO transfer counters and the throughput of a node.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param out The stream.
+ */
+void printSdoStats(TCan *can, FILE *out);
+
+#endif /* ELMO_SDO_H */
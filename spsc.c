@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+int initSpscRing(TSpscRing *ring, unsigned int size, unsigned int elemsize)
+{
+	if (!size || (size & (size - 1)) || !elemsize) {
+		return -1;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	if (!(ring->buffer = (unsigned char *)calloc(size, elemsize))) {
+		return -2;
+	}
+	ring->size = size;
+	ring->elemsize = elemsize;
+	return 0;
+}
+
+void freeSpscRing(TSpscRing *ring)
+{
+	free(ring->buffer);
+	ring->buffer = NULL;
+}
+
+int spscPush(TSpscRing *ring, const void *elem)
+{
+	unsigned int tail = ring->tail;
+
+	if (tail - ring->headcache == ring->size) {
+		ring->headcache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - ring->headcache == ring->size) {
+			return -1;
+		}
+	}
+
+	memcpy(ring->buffer + (size_t)(tail & (ring->size - 1)) * ring->elemsize, elem, ring->elemsize);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *spscFront(TSpscRing *ring)
+{
+	unsigned int head = ring->head;
+
+	if (head == ring->tailcache) {
+		ring->tailcache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head == ring->tailcache) {
+			return NULL;
+		}
+	}
+	return ring->buffer + (size_t)(head & (ring->size - 1)) * ring->elemsize;
+}
+
+void spscDrop(TSpscRing *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+int spscPop(TSpscRing *ring, void *elem)
+{
+	void *front;
+
+	if (!(front = spscFront(ring))) {
+		return -1;
+	}
+	memcpy(elem, front, ring->elemsize);
+	spscDrop(ring);
+	return 0;
+}
+
+unsigned int spscSpace(const TSpscRing *ring)
+{
+	return ring->size - (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) -
+			     __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_SPSC_H
+#define ELMO_SPSC_H
+
+/** Size of a cache line, the producer and the consumer indexes are kept apart by it */
+#define SPSC_CACHE_LINE 64
+
+/**
+ * A lock-free ring of fixed size elements between exactly one producer thread and one
+ * consumer thread. Each index is written by one side only and published with a release
+ * store; each side also keeps a cached copy of the other index, so that it touches the
+ * cache line of the other side only when the ring looks full or empty.
+ */
+typedef struct {
+	unsigned char *buffer;    /** the elements */
+	unsigned int size;        /** number of elements, a power of two */
+	unsigned int elemsize;    /** size of an element in bytes */
+	unsigned int head __attribute__((aligned(SPSC_CACHE_LINE))); /** next element to pop, written by the consumer */
+	unsigned int tailcache;   /** the consumer's copy of tail */
+	unsigned int tail __attribute__((aligned(SPSC_CACHE_LINE))); /** next free slot, written by the producer */
+	unsigned int headcache;   /** the producer's copy of head */
+} TSpscRing;
+
+/**
+ * Initializes a ring. The only allocation of the ring is done here.
+ *
+ * @param ring The ring.
+ * @param size The number of elements, a power of two.
+ * @param elemsize The size of an element in bytes.
+ * @return 0 on success, <0 otherwise.
+ */
+int initSpscRing(TSpscRing *ring, unsigned int size, unsigned int elemsize);
+
+/**
+ * Frees the elements of a ring.
+ *
+ * @param ring The ring.
+ */
+void freeSpscRing(TSpscRing *ring);
+
+/**
+ * Copies an element to the ring. Producer only.
+ *
+ * @param ring The ring.
+ * @param elem The element.
+ * @return 0 on success, -1 if the ring is full.
+ */
+int spscPush(TSpscRing *ring, const void *elem);
+
+/**
+ * Copies the oldest element out of the ring. Consumer only.
+ *
+ * @param ring The ring.
+ * @param elem The pointer where the element is stored.
+ * @return 0 on success, -1 if the ring is empty.
+ */
+int spscPop(TSpscRing *ring, void *elem);
+
+/**
+ * Returns the oldest element in place, without removing it. Consumer only.
+ *
+ * @param ring The ring.
+ * @return The element, NULL if the ring is empty.
+ */
+void *spscFront(TSpscRing *ring);
+
+/**
+ * Removes the element returned by spscFront(). Consumer only.
+ *
+ * @param ring The ring.
+ */
+void spscDrop(TSpscRing *ring);
+
+/**
+ * Returns the number of free slots. Exact for the producer; for the consumer the ring
+ * can only have more room than returned.
+ *
+ * @param ring The ring.
+ * @return The number of free slots.
+ */
+unsigned int spscSpace(const TSpscRing *ring);
+
+#endif /* ELMO_SPSC_H */
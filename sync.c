@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* CPU_SET */
+
+#include <sched.h>
+#include <errno.h>
+
+#include "realtime.h"
+#include "sync.h"
+
+void initSync(TSync *sync, TCan *can, int frequency)
+{
+	memset(sync, 0, sizeof(*sync));
+	sync->can = can;
+	sync->period = 1000000000L / frequency;
+	sync->cpu = -1;
+	/* Armed here, by the thread starting the producer: a stopSync() before runSync() holds. */
+	__atomic_store_n(&sync->running, 1, __ATOMIC_RELEASE);
+}
+
+static int setupThread(TSync *sync)
+{
+	struct sched_param param;
+	cpu_set_t set;
+
+	if (sync->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(sync->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			reportError("sched_setaffinity");
+			return -1;
+		}
+	}
+
+	if (sync->priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = sync->priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			reportError("sched_setscheduler");
+			return -2;
+		}
+	}
+
+	if (realtimeEnabled()) {
+		prefaultStack();
+	}
+	return 0;
+}
+
+static void addTime(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+static long long toNs(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void addJitter(TSync *sync, long ns)
+{
+	long us = ns / 1000;
+	int bin = 0;
+
+	while (us > 0 && bin < SYNC_JITTER_BINS - 1) {
+		us >>= 1;
+		bin++;
+	}
+
+	sync->jitter[bin]++;
+	sync->jittersum += ns;
+	if (ns > sync->jittermax) {
+		sync->jittermax = ns;
+	}
+}
+
+int runSync(TSync *sync, unsigned long cycles)
+{
+	unsigned char data[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	struct can_frame frame;
+	struct timespec deadline;
+	unsigned long missed;
+	long long late;
+	int rval;
+
+	if ((rval = setupThread(sync)) < 0) {
+		return rval;
+	}
+
+	createFrame(&frame, COBID_SYNC, 0, data);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	addTime(&deadline, sync->period);
+
+	while (__atomic_load_n(&sync->running, __ATOMIC_ACQUIRE) &&
+	       (!cycles || sync->cycles < cycles)) {
+		while ((rval = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR) {
+		}
+		if (rval) {
+			return -3;
+		}
+
+		addJitter(sync, timeNow() - toNs(&deadline));
+
+		if (sync->before) {
+			sync->before(sync, sync->cycles, sync->arg);
+		}
+
+		if (sendFrame(sync->can, &frame) < 0) {
+			return -4;
+		}
+
+		if (sync->after) {
+			sync->after(sync, sync->cycles, sync->arg);
+		}
+
+		sync->cycles++;
+		addTime(&deadline, sync->period);
+
+		/* Skip the deadlines already missed instead of bursting to catch up. */
+		late = timeNow() - toNs(&deadline);
+		if (late > 0) {
+			missed = late / sync->period + 1;
+			sync->overruns++;
+			sync->overrun[missed < SYNC_OVERRUN_BINS ? missed - 1 : SYNC_OVERRUN_BINS - 1]++;
+			addTime(&deadline, missed * sync->period);
+		}
+	}
+
+	return 0;
+}
+
+void stopSync(TSync *sync)
+{
+	__atomic_store_n(&sync->running, 0, __ATOMIC_RELEASE);
+}
+
+void printSyncStats(TSync *sync, FILE *f)
+{
+	int i;
+
+	fprintf(f, "cycles %lu period %ld ns overruns %lu\n", sync->cycles, sync->period,
+		sync->overruns);
+	fprintf(f, "jitter avg %lld ns max %ld ns\n",
+		sync->cycles ? sync->jittersum / (long long)sync->cycles : 0, sync->jittermax);
+
+	for (i = 0; i < SYNC_JITTER_BINS; i++) {
+		if (sync->jitter[i]) {
+			fprintf(f, "jitter < %ld us: %lu\n", 1L << i, sync->jitter[i]);
+		}
+	}
+
+	for (i = 0; i < SYNC_OVERRUN_BINS; i++) {
+		if (sync->overrun[i]) {
+			fprintf(f, "overrun %s%d cycles: %lu\n", i == SYNC_OVERRUN_BINS - 1 ? ">= " : "",
+				i + 1, sync->overrun[i]);
+		}
+	}
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_SYNC_H
+#define ELMO_SYNC_H
+
+#include "can.h"
+
+/** Number of jitter histogram bins: <1 us, then [2^(n-1), 2^n) us */
+#define SYNC_JITTER_BINS 24
+
+/** Number of overrun histogram bins: cycles missed 1, 2, ... and the last for more */
+#define SYNC_OVERRUN_BINS 16
+
+struct TSync;
+
+/**
+ * Cycle hook of the SYNC producer.
+ */
+typedef void (*TSyncHook)(struct TSync *sync, unsigned long cycle, void *arg);
+
+/**
+ * SYNC producer and control cycle scheduler. Wakes up at absolute deadlines of the
+ * monotonic clock, so the period does not drift with the time spent in the hooks.
+ */
+typedef struct TSync {
+	TCan *can;                /** the TCan the SYNC frames are sent with */
+	long period;              /** cycle period in nanoseconds */
+	int priority;             /** SCHED_FIFO priority of the cycle thread, 0 to keep the policy */
+	int cpu;                  /** CPU the cycle thread is pinned to, -1 not to pin */
+	TSyncHook before;         /** called before the SYNC is sent: stage the setpoints */
+	TSyncHook after;          /** called after the SYNC is sent: collect the replies */
+	void *arg;                /** argument of the hooks */
+	int running;              /** set by initSync(), cleared by stopSync() */
+	unsigned long cycles;     /** cycles run */
+	unsigned long overruns;   /** cycles that ended after the next deadline */
+	long jittermax;           /** worst wake-up latency in nanoseconds */
+	long long jittersum;      /** sum of the wake-up latencies, for the average */
+	unsigned long jitter[SYNC_JITTER_BINS];   /** wake-up latency histogram */
+	unsigned long overrun[SYNC_OVERRUN_BINS]; /** histogram of cycles missed per overrun */
+} TSync;
+
+/**
+ * Initializes a SYNC producer. Must be called by the thread starting the producer, before
+ * the thread running runSync() is created.
+ *
+ * @param sync The SYNC producer.
+ * @param can The TCan pointer the SYNC frames are sent with (any node of the bus).
+ * @param frequency The cycle frequency in Hz (e.g. 1000-4000).
+ */
+void initSync(TSync *sync, TCan *can, int frequency);
+
+/**
+ * Runs the cycle in the calling thread. The thread is given the SCHED_FIFO priority and
+ * pinned to the CPU of the producer first, if set.
+ *
+ * @param sync The SYNC producer.
+ * @param cycles The number of cycles to run, 0 to run until stopSync().
+ * @return 0 on success, <0 otherwise.
+ */
+int runSync(TSync *sync, unsigned long cycles);
+
+/**
+ * Makes runSync() return after the current cycle, or at once if it has not started yet.
+ * Can be called from the hooks or from another thread. The producer must be initialized
+ * again to be run after this.
+ *
+ * @param sync The SYNC producer.
+ */
+void stopSync(TSync *sync);
+
+/**
+ * Prints the jitter and overrun statistics.
+ *
+ * @param sync The SYNC producer.
+ * @param f The stream to print to.
+ */
+void printSyncStats(TSync *sync, FILE *f);
+
+#endif /* ELMO_SYNC_H */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "telemetry.h"
+#include "sdo.h"
+
+/*
+ * Maps two objects to a TPDO of the drive (CiA 301: disable, set type, map, enable).
+ */
+static int mapPDO(TCan *can, int pdo, canid_t cobid, int transmission, int eventtime,
+		  unsigned int object1, unsigned int object2)
+{
+	unsigned short comm = 0x1800 + pdo;  /* communication parameters */
+	unsigned short map = 0x1a00 + pdo;   /* mapping parameters */
+
+	if (sdoDownload(can, comm, 1, 0x80000000 | cobid, 4) < 0 ||
+	    sdoDownload(can, comm, 2, transmission, 1) < 0) {
+		return -1;
+	}
+
+	if (transmission == TELEMETRY_EVENT && sdoDownload(can, comm, 5, eventtime, 2) < 0) {
+		return -1;
+	}
+
+	if (sdoDownload(can, map, 0, 0, 1) < 0 ||
+	    sdoDownload(can, map, 1, object1, 4) < 0 ||
+	    sdoDownload(can, map, 2, object2, 4) < 0 ||
+	    sdoDownload(can, map, 0, 2, 1) < 0) {
+		return -2;
+	}
+
+	return sdoDownload(can, comm, 1, cobid, 4) < 0 ? -3 : 0;
+}
+
+int configureTelemetry(TCan *can, int transmission, int eventtime)
+{
+	/* Objects are index << 16 | subindex << 8 | bits. */
+	if (mapPDO(can, 2, COBID_RPDO3(can->id), transmission, eventtime,
+		   0x60640020,    /* position actual value */
+		   0x606c0020) < 0) { /* velocity actual value */
+		return -1;
+	}
+
+	if (mapPDO(can, 3, COBID_RPDO4(can->id), transmission, eventtime,
+		   0x60780010,    /* current actual value */
+		   0x60410010) < 0) { /* status word */
+		return -2;
+	}
+
+	return 0;
+}
+
+int disableTelemetry(TCan *can)
+{
+	if (sdoDownload(can, 0x1802, 1, 0x80000000 | COBID_RPDO3(can->id), 4) < 0 ||
+	    sdoDownload(can, 0x1803, 1, 0x80000000 | COBID_RPDO4(can->id), 4) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int intFromBytes(unsigned char *data)
+{
+	return (int)(data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int)data[3] << 24));
+}
+
+static void positionHandler(TCan *can, struct can_frame *frame, void *arg)
+{
+	TTelemetry *tm = (TTelemetry *)arg;
+
+	(void)can;
+	tm->partial.position = intFromBytes(&frame->data[0]);
+	tm->partial.velocity = intFromBytes(&frame->data[4]);
+}
+
+/*
+ * The current and status PDO has the higher COB-ID, so the drive sends it after the
+ * position PDO of the same cycle: it completes the sample.
+ */
+static void currentHandler(TCan *can, struct can_frame *frame, void *arg)
+{
+	TTelemetry *tm = (TTelemetry *)arg;
+
+	tm->partial.current = (short)(frame->data[0] | (frame->data[1] << 8));
+	tm->partial.status = frame->data[2] | (frame->data[3] << 8);
+	tm->partial.time = timeNow();
+	tm->samples++;
+
+	if (tm->tail - tm->head < TELEMETRY_QUEUE_SIZE) {
+		tm->queue[tm->tail % TELEMETRY_QUEUE_SIZE] = tm->partial;
+		tm->tail++;
+	} else {
+		tm->dropped++;
+	}
+
+	if (tm->callback) {
+		tm->callback(can, &tm->partial, tm->arg);
+	}
+}
+
+int subscribeTelemetry(TCan *can, TTelemetry *tm, TTelemetryCallback callback, void *arg)
+{
+	memset(tm, 0, sizeof(*tm));
+	tm->callback = callback;
+	tm->arg = arg;
+
+	if (addHandler(can, COBID_RPDO3(can->id), positionHandler, tm) < 0 ||
+	    addHandler(can, COBID_RPDO4(can->id), currentHandler, tm) < 0) {
+		unsubscribeTelemetry(can);
+		return -1;
+	}
+	return 0;
+}
+
+void unsubscribeTelemetry(TCan *can)
+{
+	removeHandler(can, COBID_RPDO3(can->id));
+	removeHandler(can, COBID_RPDO4(can->id));
+}
+
+int readTelemetry(TCan *can, TTelemetry *tm, TTelemetrySample *sample)
+{
+	int rval;
+
+	while (tm->head == tm->tail) {
+		if ((rval = processFrame(can)) < 0) {
+			return rval;
+		}
+	}
+
+	*sample = tm->queue[tm->head % TELEMETRY_QUEUE_SIZE];
+	tm->head++;
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_TELEMETRY_H
+#define ELMO_TELEMETRY_H
+
+#include "can.h"
+
+/** PDO transmission type: sent periodically by the event timer of the drive */
+#define TELEMETRY_EVENT 254
+
+/** Number of samples in the telemetry queue, must be a power of two */
+#define TELEMETRY_QUEUE_SIZE 64
+
+/**
+ * One telemetry sample of a drive.
+ */
+typedef struct {
+	long long time;           /** receive time of the sample (timeNow()) */
+	int position;             /** position actual value (0x6064) */
+	int velocity;             /** velocity actual value (0x606C) */
+	short current;            /** current actual value in per mille of rated current (0x6078) */
+	unsigned short status;    /** status word (0x6041) */
+} TTelemetrySample;
+
+/**
+ * Telemetry callback. Called for every complete sample from the function that received
+ * it.
+ */
+typedef void (*TTelemetryCallback)(TCan *can, const TTelemetrySample *sample, void *arg);
+
+/**
+ * Telemetry subscription of a drive. The samples are put in a queue and passed to the
+ * callback, if any.
+ */
+typedef struct {
+	TTelemetrySample partial; /** sample being assembled from the two PDOs */
+	TTelemetrySample queue[TELEMETRY_QUEUE_SIZE]; /** received samples */
+	unsigned int head;        /** index of the next sample to be read */
+	unsigned int tail;        /** index of the next free slot */
+	unsigned long samples;    /** samples received */
+	unsigned long dropped;    /** samples dropped because the queue was full */
+	TTelemetryCallback callback; /** callback or NULL */
+	void *arg;                /** argument of the callback */
+} TTelemetry;
+
+/**
+ * Maps position and velocity to TPDO3 and current and status word to TPDO4 of the drive
+ * over SDO. The drive then sends them without requests: two frames per sample instead of
+ * the four of a PX and IQ query.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param transmission 1-240 to send after every nth SYNC (see the SYNC producer), or
+ *                     TELEMETRY_EVENT to send by the event timer of the drive.
+ * @param eventtime The event timer period in milliseconds with TELEMETRY_EVENT.
+ * @return 0 on success, <0 otherwise.
+ */
+int configureTelemetry(TCan *can, int transmission, int eventtime);
+
+/**
+ * Disables the telemetry PDOs of the drive.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 otherwise.
+ */
+int disableTelemetry(TCan *can);
+
+/**
+ * Starts delivering the telemetry of the drive to the given subscription. The samples
+ * are received by whatever function reads frames of the TCan, or by readTelemetry().
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param tm The subscription. Must stay valid until unsubscribeTelemetry().
+ * @param callback The callback or NULL.
+ * @param arg The argument of the callback.
+ * @return 0 on success, <0 otherwise.
+ */
+int subscribeTelemetry(TCan *can, TTelemetry *tm, TTelemetryCallback callback, void *arg);
+
+/**
+ * Stops delivering the telemetry of the drive.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void unsubscribeTelemetry(TCan *can);
+
+/**
+ * Returns the oldest queued sample, receiving frames until there is one.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param tm The subscription.
+ * @param sample The pointer where the sample is stored.
+ * @return 0 on success, <0 otherwise.
+ */
+int readTelemetry(TCan *can, TTelemetry *tm, TTelemetrySample *sample);
+
+#endif /* ELMO_TELEMETRY_H */
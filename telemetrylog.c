@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "telemetrylog.h"
+
+int createTelemetryLog(TTelemetryLog *log, const char *path, unsigned int capacity)
+{
+	return createRing(&log->ring, path, LOG_MAGIC, LOG_VERSION, sizeof(TLogRecord), capacity);
+}
+
+int openTelemetryLog(TTelemetryLog *log, const char *path)
+{
+	return openRing(&log->ring, path, LOG_MAGIC, LOG_VERSION, sizeof(TLogRecord));
+}
+
+int closeTelemetryLog(TTelemetryLog *log)
+{
+	return closeRing(&log->ring);
+}
+
+void logRecord(TTelemetryLog *log, const TLogRecord *record)
+{
+	unsigned long long index = ringClaim(&log->ring, 1);
+	TLogRecord *slot = (TLogRecord *)ringBegin(&log->ring, index);
+
+	if (!slot) {
+		return;
+	}
+	slot->time = record->time;
+	slot->node = record->node;
+	slot->status = record->status;
+	slot->position = record->position;
+	slot->velocity = record->velocity;
+	slot->current = record->current;
+	ringCommit(slot, index);
+}
+
+void logTelemetry(TCan *can, const TTelemetrySample *sample, void *arg)
+{
+	TLogRecord record;
+
+	record.time = sample->time;
+	record.node = (unsigned short)can->id;
+	record.status = sample->status;
+	record.position = sample->position;
+	record.velocity = sample->velocity;
+	record.current = sample->current;
+	logRecord((TTelemetryLog *)arg, &record);
+}
+
+unsigned long long logHead(const TTelemetryLog *log)
+{
+	return ringHead(&log->ring);
+}
+
+unsigned long long logTail(const TTelemetryLog *log)
+{
+	return ringTail(&log->ring);
+}
+
+int readLog(TTelemetryLog *log, unsigned long long *cursor, TLogRecord *record, int max)
+{
+	return readRing(&log->ring, cursor, record, max);
+}
+
+unsigned long long seekLog(TTelemetryLog *log, long long time)
+{
+	return seekRing(&log->ring, time);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_TELEMETRY_LOG_H
+#define ELMO_TELEMETRY_LOG_H
+
+#include <stddef.h>
+
+#include "recordring.h"
+#include "telemetry.h"
+
+/** Magic and version at the start of a telemetry log file */
+#define LOG_MAGIC "ELMOLOG"
+#define LOG_VERSION 1
+
+/**
+ * One record of the telemetry log. It starts with the fields of a TRingRecord.
+ */
+typedef struct {
+	unsigned long long seq;   /** sequence number of the slot */
+	long long time;           /** timeNow() of the sample */
+	unsigned short node;      /** node id of the drive */
+	unsigned short status;    /** status word, or 0 if not known */
+	int position;             /** position in counts */
+	int velocity;             /** velocity in counts/s */
+	float current;            /** current: A from IQ, per mille of rated current from PDOs */
+} TLogRecord;
+
+/**
+ * A telemetry log: a TRecordRing of TLogRecords, so writing a record can be done from the
+ * control thread and the log can be read by other processes at the same time.
+ */
+typedef struct {
+	TRecordRing ring;         /** the ring; ring.lost counts the records a reader skipped */
+} TTelemetryLog;
+
+/**
+ * Creates a telemetry log file and maps it for writing. The pages are faulted in now so
+ * that writing never faults.
+ *
+ * @param log The log.
+ * @param path The path of the file, replaced if it exists.
+ * @param capacity The number of records kept, a power of two.
+ * @return 0 on success, <0 otherwise.
+ */
+int createTelemetryLog(TTelemetryLog *log, const char *path, unsigned int capacity);
+
+/**
+ * Maps a telemetry log file for reading. It can be written by another process at the
+ * same time.
+ *
+ * @param log The log.
+ * @param path The path of the file.
+ * @return 0 on success, -1 if the file cannot be mapped, -2 if it is not a valid log.
+ */
+int openTelemetryLog(TTelemetryLog *log, const char *path);
+
+/**
+ * Unmaps and closes a telemetry log.
+ *
+ * @param log The log.
+ * @return 0 on success, <0 otherwise.
+ */
+int closeTelemetryLog(TTelemetryLog *log);
+
+/**
+ * Appends a record. Lock-free, safe to call from several threads.
+ *
+ * @param log A log created by createTelemetryLog().
+ * @param record The record, its seq is ignored.
+ */
+void logRecord(TTelemetryLog *log, const TLogRecord *record);
+
+/**
+ * Appends a telemetry sample. Has the signature of a TTelemetryCallback, so it can be
+ * passed to subscribeTelemetry() with the log as the argument.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param sample The sample.
+ * @param arg The TTelemetryLog.
+ */
+void logTelemetry(TCan *can, const TTelemetrySample *sample, void *arg);
+
+/**
+ * Returns the index of the next record to be written.
+ *
+ * @param log The log.
+ * @return The index.
+ */
+unsigned long long logHead(const TTelemetryLog *log);
+
+/**
+ * Returns the index of the oldest record still in the log.
+ *
+ * @param log The log.
+ * @return The index.
+ */
+unsigned long long logTail(const TTelemetryLog *log);
+
+/**
+ * Copies the records from the cursor on, at most max, and advances the cursor past them.
+ * Records overwritten before they were read are skipped and counted in lost. Stops at a
+ * record still being written.
+ *
+ * @param log The log.
+ * @param cursor The index of the next record to read, logTail() to read from the oldest,
+ *               logHead() to wait for new ones.
+ * @param record The array the records are copied to.
+ * @param max The size of the array.
+ * @return The number of records copied.
+ */
+int readLog(TTelemetryLog *log, unsigned long long *cursor, TLogRecord *record, int max);
+
+/**
+ * Finds the first record at or after a time by a binary search over the records in the
+ * log. With several writers the records are in time order only approximately.
+ *
+ * @param log The log.
+ * @param time The time in timeNow() time.
+ * @return The index of the record, logHead() if all the records are older.
+ */
+unsigned long long seekLog(TTelemetryLog *log, long long time);
+
+#endif /* ELMO_TELEMETRY_LOG_H */
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <signal.h>
+
+#include "telemetrylog.h"
+
+/**
+ * Records read at a time.
+ */
+#define TLOG_BATCH 256
+
+/**
+ * Time between the polls of a followed log, in microseconds.
+ */
+#define TLOG_POLL 10000
+
+static volatile int running = 1;
+
+static void interrupt(int signal)
+{
+	(void)signal;
+	running = 0;
+}
+
+/*
+ * Prints the records from the cursor until the end index (or the head of the log), one
+ * per line, the time in milliseconds since the log was created.
+ */
+static void printRecords(TTelemetryLog *log, unsigned long long *cursor, unsigned long long end)
+{
+	TLogRecord record[TLOG_BATCH];
+	int count, i;
+
+	while (*cursor < end && (count = readLog(log, cursor, record, end - *cursor < TLOG_BATCH ?
+						 (int)(end - *cursor) : TLOG_BATCH)) > 0) {
+		for (i = 0; i < count; i++) {
+			printf("%.3f\t%u\t%d\t%d\t%g\t0x%04x\n",
+			       (record[i].time - log->ring.header->epoch) / 1e6, record[i].node,
+			       record[i].position, record[i].velocity, record[i].current,
+			       record[i].status);
+		}
+	}
+}
+
+/**
+ * Reads a telemetry log written by another process, such as main.
+ *
+ * Usage:
+ *   tlog file
+ *     Prints all the records in the log.
+ *   tlog file tail
+ *     Prints the new records as they are written, until interrupted.
+ *   tlog file range from to
+ *     Prints the records from one time up to another, in milliseconds since the log
+ *     was created.
+ *
+ * Columns: time in ms, node, position, velocity, current and status word.
+ */
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 2 ? argv[2] : "dump";
+	struct timespec wait = { 0, TLOG_POLL * 1000L };
+	TTelemetryLog log;
+	unsigned long long cursor, end;
+	long long epoch;
+
+	if (argc < 2 || openTelemetryLog(&log, argv[1]) < 0) {
+		printf("Could not open the telemetry log %s\n", argc < 2 ? "" : argv[1]);
+		return EXIT_FAILURE;
+	}
+	epoch = log.ring.header->epoch;
+
+	if (!strcmp(mode, "tail")) {
+		signal(SIGINT, interrupt);
+		cursor = logHead(&log);
+		while (running) {
+			printRecords(&log, &cursor, (unsigned long long)-1);
+			fflush(stdout);
+			nanosleep(&wait, NULL);
+		}
+	} else if (!strcmp(mode, "range") && argc > 4) {
+		cursor = seekLog(&log, epoch + (long long)(atof(argv[3]) * 1e6));
+		end = seekLog(&log, epoch + (long long)(atof(argv[4]) * 1e6));
+		printRecords(&log, &cursor, end);
+	} else if (!strcmp(mode, "dump")) {
+		cursor = logTail(&log);
+		printRecords(&log, &cursor, logHead(&log));
+	} else {
+		printf("Unknown mode %s\n", mode);
+		closeTelemetryLog(&log);
+		return EXIT_FAILURE;
+	}
+
+	if (log.ring.lost) {
+		fprintf(stderr, "%llu records overwritten before they were read\n", log.ring.lost);
+	}
+	closeTelemetryLog(&log);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "trace.h"
+
+int enableTrace(TCan *can)
+{
+	if (can->trace) {
+		return 0;
+	}
+
+	can->trace = (TTrace *)malloc(sizeof(TTrace));
+	if (!can->trace) {
+		return -1;
+	}
+
+	memset(can->trace, 0, sizeof(*can->trace));
+	return 0;
+}
+
+void disableTrace(TCan *can)
+{
+	free(can->trace);
+	can->trace = NULL;
+}
+
+void resetTrace(TCan *can)
+{
+	if (can->trace) {
+		memset(can->trace, 0, sizeof(*can->trace));
+	}
+}
+
+static TTraceEntry *findEntry(TTrace *trace, const unsigned char *data)
+{
+	TTraceEntry *entry;
+	int i;
+
+	for (i = 0; i < trace->count; i++) {
+		if (trace->entry[i].mnemonic[0] == data[0] && trace->entry[i].mnemonic[1] == data[1]) {
+			return &trace->entry[i];
+		}
+	}
+
+	if (trace->count == TRACE_MAX_COMMANDS) {
+		return NULL;
+	}
+
+	entry = &trace->entry[trace->count++];
+	entry->mnemonic[0] = data[0];
+	entry->mnemonic[1] = data[1];
+	return entry;
+}
+
+void traceRequest(TCan *can, TElmoRequest *req, long long replied)
+{
+	TTraceEntry *entry = findEntry(can->trace, req->data);
+
+	if (!entry) {
+		can->trace->untraced++;
+		return;
+	}
+
+	histogramAdd(&entry->rtt, (long)((replied - req->sent) / 1000));
+	if (req->txstamp && req->rxstamp) {
+		histogramAdd(&entry->wire, (long)((req->rxstamp - req->txstamp) / 1000));
+	}
+}
+
+void printTrace(TCan *can, FILE *out)
+{
+	TTraceEntry *entry;
+	char name[16];
+	int i;
+
+	if (!can->trace) {
+		return;
+	}
+
+	fprintf(out, "node %u round trips in us\n", can->id);
+	fprintf(out, "%-8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+		"command", "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < can->trace->count; i++) {
+		entry = &can->trace->entry[i];
+		snprintf(name, sizeof(name), "%c%c rtt", entry->mnemonic[0], entry->mnemonic[1]);
+		printHistogram(&entry->rtt, name, out);
+		if (entry->wire.count) {
+			snprintf(name, sizeof(name), "%c%c wire", entry->mnemonic[0], entry->mnemonic[1]);
+			printHistogram(&entry->wire, name, out);
+		}
+	}
+	if (can->trace->untraced) {
+		fprintf(out, "%lu replies of untraced commands\n", can->trace->untraced);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_TRACE_H
+#define ELMO_TRACE_H
+
+#include "elmoasync.h"
+#include "histogram.h"
+
+/** Number of different commands traced per node */
+#define TRACE_MAX_COMMANDS 16
+
+/**
+ * Round-trip times of one binary interpreter command, in microseconds.
+ */
+typedef struct {
+	unsigned char mnemonic[2]; /** the command, e.g. "PX" */
+	THistogram rtt;           /** from sendRequest() until the reply was received */
+	THistogram wire;          /** from the command on the bus until the reply on the bus */
+} TTraceEntry;
+
+/**
+ * Round-trip times of the commands of a node. rtt includes the whole stack, wire only the
+ * bus and the drive, so their difference is the time spent in the host. wire needs the
+ * kernel timestamps of setTimestamping().
+ */
+typedef struct TTrace {
+	TTraceEntry entry[TRACE_MAX_COMMANDS]; /** the commands in the order first seen */
+	int count;                /** number of commands */
+	unsigned long untraced;   /** replies of commands beyond TRACE_MAX_COMMANDS */
+} TTrace;
+
+/**
+ * Starts recording the round-trip time of every request of the node.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @return 0 on success, <0 otherwise.
+ */
+int enableTrace(TCan *can);
+
+/**
+ * Stops recording and frees the histograms.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void disableTrace(TCan *can);
+
+/**
+ * Clears the histograms.
+ *
+ * @param can The TCan pointer of the motor controller.
+ */
+void resetTrace(TCan *can);
+
+/**
+ * Records a completed request. Called when the reply is received.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param req The completed request.
+ * @param replied timeNow() when the reply was received.
+ */
+void traceRequest(TCan *can, TElmoRequest *req, long long replied);
+
+/**
+ * Writes the histograms of all the commands, one line per command and measurement. Can
+ * be called at any time.
+ *
+ * @param can The TCan pointer of the motor controller.
+ * @param out The stream.
+ */
+void printTrace(TCan *can, FILE *out);
+
+#endif /* ELMO_TRACE_H */
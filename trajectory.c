@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "trajectory.h"
+#include "elmo.h"
+#include "elmocmd.h"
+#include "sdo.h"
+
+void initTrajectory(TTrajectory *traj, TCan *can, enum TrajectoryMode mode, int period)
+{
+	memset(traj, 0, sizeof(*traj));
+	traj->can = can;
+	traj->mode = mode;
+	traj->period = period;
+	traj->capacity = TRAJECTORY_DRIVE_BUFFER;
+	traj->lowwater = TRAJECTORY_DRIVE_BUFFER / 2;
+	traj->checkperiod = TRAJECTORY_CHECK_PERIOD;
+}
+
+int configureTrajectory(TTrajectory *traj)
+{
+	TCan *can = traj->can;
+	unsigned int object = traj->mode == TRAJECTORY_PVT ? 0x20010040 : 0x20020020;
+
+	if (sdoDownload(can, 0x1402, 1, 0x80000000 | COBID_TPDO3(can->id), 4) < 0 ||
+	    sdoDownload(can, 0x1402, 2, 255, 1) < 0 ||   /* asynchronous: act on arrival */
+	    sdoDownload(can, 0x1602, 0, 0, 1) < 0 ||
+	    sdoDownload(can, 0x1602, 1, object, 4) < 0 ||
+	    sdoDownload(can, 0x1602, 0, 1, 1) < 0 ||
+	    sdoDownload(can, 0x1402, 1, COBID_TPDO3(can->id), 4) < 0) {
+		return -1;
+	}
+
+	if (setUnitMode(can, MODE_POS) < 0) {
+		return -2;
+	}
+
+	if (traj->mode == TRAJECTORY_PT) {
+		/* time between PT points */
+		if (elmoSetInt(can, ELMO_CMD(MP4), traj->period) < 0) {
+			return -3;
+		}
+	}
+
+	return 0;
+}
+
+int pushTrajectory(TTrajectory *traj, const TTrajectoryPoint *point, int count)
+{
+	int i;
+
+	for (i = 0; i < count && traj->tail - traj->head < TRAJECTORY_RING_SIZE; i++) {
+		traj->ring[traj->tail % TRAJECTORY_RING_SIZE] = point[i];
+		traj->tail++;
+	}
+	return i;
+}
+
+void finishTrajectory(TTrajectory *traj)
+{
+	traj->finished = 1;
+}
+
+static long long duration(TTrajectory *traj, unsigned int index)
+{
+	int ms = traj->mode == TRAJECTORY_PVT ? traj->ring[index % TRAJECTORY_RING_SIZE].time
+		: traj->period;
+	return ms * 1000000LL;
+}
+
+/*
+ * Advances head over the points whose segments have ended by now. The moment the fill
+ * drops below the low water mark is remembered for the refill latency.
+ */
+static void consume(TTrajectory *traj, long long now)
+{
+	while (traj->head != traj->sent &&
+	       traj->start + traj->consumed + duration(traj, traj->head) <= now) {
+		traj->consumed += duration(traj, traj->head);
+		traj->head++;
+		if (!traj->low && (int)(traj->sent - traj->head) < traj->lowwater) {
+			traj->low = traj->start + traj->consumed;
+		}
+	}
+}
+
+/*
+ * Sends points to the drive until its buffer is full or the ring is empty, in one system
+ * call. TRAJECTORY_SLACK points are left free for an estimate running ahead of the drive.
+ */
+static int refill(TTrajectory *traj)
+{
+	TCan *can = traj->can;
+	TTrajectoryPoint *point;
+	struct can_frame frame;
+	unsigned char data[8];
+	int rval;
+
+	beginBatch(can);
+	while (traj->sent != traj->tail &&
+	       (int)(traj->sent - traj->head) < traj->capacity - TRAJECTORY_SLACK) {
+		point = &traj->ring[traj->sent % TRAJECTORY_RING_SIZE];
+		data[0] = point->position & 0xff;
+		data[1] = (point->position >> 8) & 0xff;
+		data[2] = (point->position >> 16) & 0xff;
+		data[3] = (point->position >> 24) & 0xff;
+		data[4] = point->velocity & 0xff;
+		data[5] = (point->velocity >> 8) & 0xff;
+		data[6] = (point->velocity >> 16) & 0xff;
+		data[7] = point->time;
+
+		createFrame(&frame, COBID_TPDO3(can->id), traj->mode == TRAJECTORY_PVT ? 8 : 4, data);
+		if ((rval = sendFrame(can, &frame)) < 0) {
+			flushBatch(can);
+			return rval;
+		}
+		traj->sent++;
+	}
+	return flushBatch(can);
+}
+
+/* Forgets the buffer status queries still in flight. */
+static void stopChecking(TTrajectory *traj)
+{
+	if (traj->checking) {
+		cancelRequest(traj->can, &traj->check[0]);
+		cancelRequest(traj->can, &traj->check[1]);
+		traj->checking = 0;
+	}
+}
+
+/*
+ * Corrects the estimate from the read pointer of the drive. The points are written to its
+ * table cyclically from index 1, so the pointer tells the points consumed only modulo the
+ * capacity: of the counts it allows, the one nearest to the estimate is taken. A drive at
+ * rest has consumed all the points it had when the queries were sent.
+ */
+static int correct(TTrajectory *traj, int pointer, int status)
+{
+	int capacity = traj->capacity;
+	int delta = ((pointer - 1 - (int)(traj->head % capacity)) % capacity + capacity) % capacity;
+	unsigned int head;
+
+	if (delta > capacity / 2) {
+		delta -= capacity;
+	}
+	head = traj->head + delta;
+	if (status != MOTION_IN_PROGRESS && head % capacity == traj->checksent % capacity) {
+		head = traj->checksent;
+	}
+
+	/* The drive holds at most capacity of the points sent, and they are still in the ring. */
+	if ((int)(head - traj->sent) > 0) {
+		head = traj->sent;
+	}
+	if ((int)(traj->sent - head) > capacity) {
+		head = traj->sent - capacity;
+	}
+	if (traj->tail - head > TRAJECTORY_RING_SIZE) {
+		head = traj->tail - TRAJECTORY_RING_SIZE;
+	}
+
+	if (head != traj->head) {
+		traj->corrections++;
+		traj->head = head;
+		/* The point in progress began no later than the queries were sent. */
+		traj->start = traj->check[0].sent;
+		traj->consumed = 0;
+	}
+
+	if (status != MOTION_IN_PROGRESS && !(traj->finished && head == traj->tail)) {
+		traj->start = 0;
+		if (head == traj->checksent) {
+			traj->underflows++;
+			return TRAJECTORY_UNDERFLOW;
+		}
+		return TRAJECTORY_STOPPED;
+	}
+	return 0;
+}
+
+/*
+ * Queries the read pointer and the motion status of the drive every checkperiod, and
+ * corrects the estimate when both replies are in. The replies already received are taken
+ * without waiting; queries not answered within the receive timeout are given up.
+ */
+static int checkDrive(TTrajectory *traj, long long now)
+{
+	TCan *can = traj->can;
+	TElmoRequest *check = traj->check;
+
+	if (!traj->checking) {
+		if (!traj->checkperiod || now - traj->checked < traj->checkperiod * 1000000LL) {
+			return 0;
+		}
+		/* The status first: a drive at rest by then has its final pointer. */
+		if (elmoSendGet(can, ELMO_CMD(MS), &check[0]) < 0) {
+			return 0; /* tried again next time */
+		}
+		if (elmoSendGet(can, traj->mode == TRAJECTORY_PVT ? ELMO_CMD(PV) : ELMO_CMD(PT),
+				&check[1]) < 0) {
+			cancelRequest(can, &check[0]);
+			return 0;
+		}
+		traj->checking = 1;
+		traj->checked = now;
+		traj->checksent = traj->sent;
+		return 0;
+	}
+
+	while ((!check[0].done || !check[1].done) && receiveReplyUntil(can, now) == 0) {
+	}
+	if (!check[0].done || !check[1].done) {
+		if (can->rxtimeout && now - traj->checked > can->rxtimeout * 1000LL) {
+			stopChecking(traj);
+		}
+		return 0;
+	}
+
+	traj->checking = 0;
+	if (check[0].status < 0 || check[1].status < 0) {
+		return check[0].status < 0 ? check[0].status : check[1].status;
+	}
+	return correct(traj, requestInt(&check[1]), requestInt(&check[0]));
+}
+
+int startTrajectory(TTrajectory *traj)
+{
+	if (traj->tail == traj->head) {
+		return -1;
+	}
+
+	if (refill(traj) < 0) {
+		return -2;
+	}
+
+	if (startMotor(traj->can) < 0 ||
+	    elmoSetInt(traj->can, traj->mode == TRAJECTORY_PVT ? ELMO_CMD(PV) : ELMO_CMD(PT), 1) < 0 ||
+	    beginMotion(traj->can) < 0) {
+		return -3;
+	}
+
+	traj->start = timeNow();
+	traj->consumed = 0;
+	traj->low = 0;
+	traj->starved = 0;
+	traj->checked = traj->start;
+	return 0;
+}
+
+int serviceTrajectory(TTrajectory *traj)
+{
+	long long now = timeNow();
+	int rval;
+
+	if (!traj->start) {
+		return 0;
+	}
+
+	consume(traj, now);
+
+	if ((rval = checkDrive(traj, now)) < 0) {
+		stopChecking(traj);
+		return rval;
+	}
+
+	if (traj->head == traj->sent) {
+		if (traj->finished && traj->sent == traj->tail) {
+			stopChecking(traj);
+			return 1;
+		}
+		if (!traj->starved) {
+			traj->underruns++;
+			traj->starved = 1;
+		}
+	} else {
+		traj->starved = 0;
+	}
+
+	if ((int)(traj->sent - traj->head) < traj->lowwater && traj->sent != traj->tail) {
+		if ((rval = refill(traj)) < 0) {
+			return rval;
+		}
+		addLatency(&traj->latency, traj->low ? (now - traj->low) / 1000 : 0);
+		traj->refills++;
+		traj->low = 0;
+
+		/* A starved drive restarts its clock when the new points arrive. */
+		if (traj->starved) {
+			traj->start = now;
+			traj->consumed = 0;
+			traj->starved = 0;
+		}
+	}
+
+	return 0;
+}
+
+int trajectoryFill(TTrajectory *traj)
+{
+	if (traj->start) {
+		consume(traj, timeNow());
+	}
+	return traj->sent - traj->head;
+}
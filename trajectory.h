@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_TRAJECTORY_H
+#define ELMO_TRAJECTORY_H
+
+#include "can.h"
+#include "elmoasync.h"
+
+/** Number of points in the host side ring buffer, must be a power of two */
+#define TRAJECTORY_RING_SIZE 1024
+
+/** Default number of points the drive can buffer */
+#define TRAJECTORY_DRIVE_BUFFER 64
+
+/** Points of the drive buffer never filled, the error allowed to the estimate */
+#define TRAJECTORY_SLACK 2
+
+/** Default time between reads of the buffer status of the drive, in milliseconds */
+#define TRAJECTORY_CHECK_PERIOD 20
+
+/** Returned by serviceTrajectory() when the drive ran out of points before the end */
+#define TRAJECTORY_UNDERFLOW (-8)
+
+/** Returned by serviceTrajectory() when the drive stopped with points left */
+#define TRAJECTORY_STOPPED (-9)
+
+/** Motion status (MS) of a drive executing a motion */
+#define MOTION_IN_PROGRESS 2
+
+/**
+ * Interpolation mode of the drive.
+ */
+enum TrajectoryMode
+{
+	TRAJECTORY_PVT, /** position, velocity and time of every point (object 0x2001) */
+	TRAJECTORY_PT   /** position of every point, fixed time between points (object 0x2002) */
+};
+
+/**
+ * One point of a trajectory.
+ */
+typedef struct {
+	int position;             /** position at the end of the segment */
+	int velocity;             /** velocity at the end of the segment, 24 bits (PVT only) */
+	unsigned char time;       /** duration of the segment in milliseconds (PVT only) */
+} TTrajectoryPoint;
+
+/**
+ * Trajectory streaming engine. The points are queued in a host side ring and written to
+ * the drive buffer ahead of its consumption. The fill of the drive buffer is estimated
+ * from the durations of the points sent since the motion began, and every checkperiod
+ * the estimate is corrected from the drive: the read pointer of its table (PV or PT, the
+ * index of the point in progress) and its motion status (MS) are queried without waiting,
+ * and the replies are taken by later serviceTrajectory() calls. This keeps the estimate
+ * in step with a drive whose clock drifts from the host's.
+ *
+ * A drive that stopped before the end of the trajectory is reported by
+ * serviceTrajectory(): TRAJECTORY_UNDERFLOW if its buffer ran out, counted in underflows,
+ * TRAJECTORY_STOPPED if it stopped with points left (a fault, see startMonitor()).
+ * underruns counts the times the estimate alone ran out of points.
+ */
+typedef struct {
+	TCan *can;                /** the motor controller */
+	enum TrajectoryMode mode; /** interpolation mode */
+	int period;               /** time between points in milliseconds (PT only) */
+	int capacity;             /** points the drive can buffer, the size of its table */
+	int lowwater;             /** refill when fewer points than this are buffered */
+	TTrajectoryPoint ring[TRAJECTORY_RING_SIZE]; /** queued points */
+	unsigned int head;        /** oldest point not yet consumed by the drive */
+	unsigned int sent;        /** next point to be sent to the drive */
+	unsigned int tail;        /** next free slot */
+	int finished;             /** nonzero when no more points will be pushed */
+	long long start;          /** time the motion began, 0 if not started */
+	long long consumed;       /** time from start to the end of point head - 1 in nanoseconds */
+	long long low;            /** time the buffer was noticed to be low, 0 if not low */
+	int starved;              /** nonzero while the drive has no points */
+	unsigned long underruns;  /** times the estimate ran out of points before the end */
+	unsigned long refills;    /** refills sent */
+	TCanLatency latency;      /** latency from the buffer getting low until it was refilled */
+	int checkperiod;          /** time between reads of the drive buffer in ms, 0 for none */
+	TElmoRequest check[2];    /** the motion status and read pointer queries */
+	int checking;             /** nonzero while the queries are in flight */
+	long long checked;        /** timeNow() when the queries were last sent */
+	unsigned int checksent;   /** sent when the queries were sent */
+	unsigned long corrections; /** times the estimate disagreed with the drive */
+	unsigned long underflows; /** times the drive ran out of points before the end */
+} TTrajectory;
+
+/**
+ * Initializes a trajectory streaming engine.
+ *
+ * @param traj The engine.
+ * @param can The TCan pointer of the motor controller.
+ * @param mode The interpolation mode.
+ * @param period The time between points in milliseconds (TRAJECTORY_PT only).
+ */
+void initTrajectory(TTrajectory *traj, TCan *can, enum TrajectoryMode mode, int period);
+
+/**
+ * Maps the trajectory points to the TPDO3 of the host (RPDO3 of the drive) over SDO and
+ * sets the drive in position mode.
+ *
+ * @param traj The engine.
+ * @return 0 on success, <0 otherwise.
+ */
+int configureTrajectory(TTrajectory *traj);
+
+/**
+ * Queues points to the host side ring.
+ *
+ * @param traj The engine.
+ * @param point The points.
+ * @param count The number of points.
+ * @return The number of points queued, less than count if the ring is full.
+ */
+int pushTrajectory(TTrajectory *traj, const TTrajectoryPoint *point, int count);
+
+/**
+ * Marks the end of the trajectory: running out of points after this is not an underrun.
+ *
+ * @param traj The engine.
+ */
+void finishTrajectory(TTrajectory *traj);
+
+/**
+ * Fills the drive buffer and begins the motion.
+ *
+ * @param traj The engine.
+ * @return 0 on success, <0 otherwise.
+ */
+int startTrajectory(TTrajectory *traj);
+
+/**
+ * Updates the estimate of the drive buffer, corrects it from the drive every checkperiod
+ * and refills the buffer when it gets low. Must be called more often than the buffer
+ * drains, e.g. from a SYNC producer hook, by the thread receiving the replies of the node.
+ *
+ * @param traj The engine.
+ * @return 1 when the whole trajectory has been consumed, 0 otherwise, TRAJECTORY_UNDERFLOW
+ *         or TRAJECTORY_STOPPED if the drive stopped before the end, <0 on other errors.
+ */
+int serviceTrajectory(TTrajectory *traj);
+
+/**
+ * Returns the estimated number of points in the drive buffer.
+ *
+ * @param traj The engine.
+ * @return The number of points.
+ */
+int trajectoryFill(TTrajectory *traj);
+
+#endif /* ELMO_TRAJECTORY_H */
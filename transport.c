@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "realtime.h"
+#include "transport.h"
+
+void setTransport(TCan *can, const TCanTransport *transport)
+{
+	can->transport = transport;
+}
+
+/*
+ * SocketCAN
+ */
+
+static int openSocket(TCan *can)
+{
+	if ((can->socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+		reportError("socket error");
+		return -1;
+	}
+
+	can->addr.can_family = AF_CAN;
+	strcpy(can->ifr.ifr_name, can->iface);
+
+	if (ioctl(can->socket, SIOCGIFINDEX, &can->ifr) < 0) {
+		reportError("SIOCGIFINDEX error");
+		return -2;
+	}
+
+	can->addr.can_ifindex = can->ifr.ifr_ifindex;
+
+	/* Filters are set before bind so that no foreign frames are ever queued. */
+	if (setDefaultFilters(can) < 0) {
+		return -4;
+	}
+
+	if (can->timestamping && setTimestampOptions(can->socket, can->iface, can->timestamping) < 0) {
+		return -5;
+	}
+
+	if (bind(can->socket, (struct sockaddr *)&can->addr, sizeof(can->addr)) < 0) {
+		reportError("bind error");
+		return -3;
+	}
+	return 0;
+}
+
+static int closeSocket(TCan *can)
+{
+	int rval = close(can->socket);
+	can->socket = -1;
+	return rval;
+}
+
+static int sendRaw(TCan *can, struct can_frame *frame, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (write(can->socket, &frame[i], sizeof(*frame)) != sizeof(*frame)) {
+			reportError("write");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int receiveRaw(TCan *can, struct can_frame *frame, long long *stamp, int count,
+		      long long deadline)
+{
+	int rval;
+
+	(void)count;
+	if ((rval = waitReadable(can->socket, deadline)) < 0) {
+		return rval;
+	}
+	return readFramesStamped(can->socket, frame, stamp, 1);
+}
+
+/* A single frame goes out with write(), a syscall as cheap as sendmmsg() of one. */
+static int sendBatch(TCan *can, struct can_frame *frame, int count)
+{
+	if (count == 1) {
+		return sendRaw(can, frame, 1);
+	}
+	return writeFrames(can->socket, frame, count) < 0 ? -1 : 0;
+}
+
+static int receiveBatch(TCan *can, struct can_frame *frame, long long *stamp, int count,
+			long long deadline)
+{
+	int rval;
+
+	if ((rval = waitReadable(can->socket, deadline)) < 0) {
+		return rval;
+	}
+	return readFramesStamped(can->socket, frame, stamp, count);
+}
+
+static int socketOption(TCan *can, int level, int name, const void *value, socklen_t size)
+{
+	return setsockopt(can->socket, level, name, value, size);
+}
+
+const TCanTransport canRawTransport = {
+	"raw", openSocket, closeSocket, sendRaw, receiveRaw, socketOption
+};
+
+const TCanTransport canBatchTransport = {
+	"batch", openSocket, closeSocket, sendBatch, receiveBatch, socketOption
+};
+
+/*
+ * Loopback
+ */
+
+static TCanLink *createLink(int ends)
+{
+	TCanLink *link;
+	int i;
+
+	if (!(link = (TCanLink *)calloc(ends, sizeof(TCanLink)))) {
+		return NULL;
+	}
+
+	for (i = 0; i < ends; i++) {
+		if (initSpscRing(&link[i].rx, CAN_LOOPBACK_SIZE, sizeof(struct can_frame)) < 0) {
+			while (i-- > 0) {
+				freeSpscRing(&link[i].rx);
+			}
+			free(link);
+			return NULL;
+		}
+	}
+	link->refs = ends;
+	return link;
+}
+
+int loopbackConnect(TCan *a, TCan *b)
+{
+	TCanLink *link;
+
+	if (!(link = createLink(2))) {
+		return -1;
+	}
+
+	link[0].peer = &link[1];
+	link[1].peer = &link[0];
+	a->link = &link[0];
+	b->link = &link[1];
+	a->transport = &canLoopbackTransport;
+	b->transport = &canLoopbackTransport;
+	return 0;
+}
+
+TCanLink *loopbackAttach(TCan *can, TCanLinkHandler deliver, long long (*poll)(void *arg),
+			 void *arg)
+{
+	TCanLink *link;
+
+	if (!(link = createLink(1))) {
+		return NULL;
+	}
+
+	link->deliver = deliver;
+	link->poll = poll;
+	link->arg = arg;
+	can->link = link;
+	can->transport = &canLoopbackTransport;
+	return link;
+}
+
+int loopbackPush(TCanLink *link, const struct can_frame *frame, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (spscPush(&link->rx, &frame[i]) < 0) {
+			link->dropped += count - i;
+			break;
+		}
+	}
+
+	/* Pairs with the store of sleeping in sleepLink(): one of us sees the other. */
+	if (i > 0) {
+		__atomic_add_fetch(&link->pushes, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&link->sleeping, __ATOMIC_SEQ_CST)) {
+			syscall(SYS_futex, &link->pushes, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		}
+	}
+	return i;
+}
+
+/* The kernel filters have no equivalent: the TCan gets everything sent to it. */
+static int openLoopback(TCan *can)
+{
+	if (!can->link) {
+		return -1;
+	}
+
+	can->filter[0].can_id = 0;
+	can->filter[0].can_mask = 0;
+	can->filters = 1;
+	return 0;
+}
+
+/* The first end of the allocation frees the link when both ends are closed. */
+static int closeLoopback(TCan *can)
+{
+	TCanLink *link = can->link;
+	TCanLink *first = link->peer && link->peer < link ? link->peer : link;
+	int ends = link->peer ? 2 : 1;
+	int i;
+
+	can->link = NULL;
+	if (__atomic_sub_fetch(&first->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (i = 0; i < ends; i++) {
+			freeSpscRing(&first[i].rx);
+		}
+		free(first);
+	}
+	return 0;
+}
+
+static int sendLoopback(TCan *can, struct can_frame *frame, int count)
+{
+	TCanLink *link = can->link;
+
+	if (!link->peer) {
+		link->deliver(link->arg, frame, count);
+	} else if (loopbackPush(link->peer, frame, count) < count) {
+		errno = ENOBUFS;
+		reportError("loopback");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sleeps until a push after the one numbered pushes, or until the timeNow() time until
+ * (0 for no limit). The count is read before the ring was found empty, so a frame pushed
+ * since then changed it and the futex returns at once.
+ */
+static void sleepLink(TCanLink *link, unsigned int pushes, long long until)
+{
+	struct timespec timeout;
+	long long remaining = 0;
+
+	if (until && (remaining = until - timeNow()) <= 0) {
+		return;
+	}
+	timeout.tv_sec = remaining / 1000000000LL;
+	timeout.tv_nsec = remaining % 1000000000LL;
+
+	__atomic_store_n(&link->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (syscall(SYS_futex, &link->pushes, FUTEX_WAIT_PRIVATE, pushes,
+		    until ? &timeout : NULL, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+		reportError("futex");
+	}
+	__atomic_store_n(&link->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/* Spins for a while, as the reply is usually close, then sleeps until a frame is pushed. */
+static int receiveLoopback(TCan *can, struct can_frame *frame, long long *stamp, int count,
+			   long long deadline)
+{
+	TCanLink *link = can->link;
+	unsigned int pushes;
+	long long until;
+	int spins = 0;
+	int n = 0;
+
+	for (;;) {
+		pushes = __atomic_load_n(&link->pushes, __ATOMIC_SEQ_CST);
+		while (n < count && spscPop(&link->rx, &frame[n]) == 0) {
+			stamp[n++] = 0;
+		}
+		if (n > 0) {
+			return n;
+		}
+
+		if (deadline && timeNow() >= deadline) {
+			return CAN_TIMEOUT;
+		}
+		until = link->poll ? link->poll(link->arg) : 0;
+		if (++spins <= CAN_LOOPBACK_SPIN) {
+			continue;
+		}
+
+		/* Up to the deadline, or until poll wants to be called again. */
+		if (!until || (deadline && deadline < until)) {
+			until = deadline;
+		}
+		sleepLink(link, pushes, until);
+	}
+}
+
+static int loopbackOption(TCan *can, int level, int name, const void *value, socklen_t size)
+{
+	(void)can;
+	(void)level;
+	(void)name;
+	(void)value;
+	(void)size;
+	return 0;
+}
+
+const TCanTransport canLoopbackTransport = {
+	"loopback", openLoopback, closeLoopback, sendLoopback, receiveLoopback, loopbackOption
+};
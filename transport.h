@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2009 Miika-Petteri Matikainen, Tuomas Miettinen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ELMO_TRANSPORT_H
+#define ELMO_TRANSPORT_H
+
+#include "can.h"
+#include "spsc.h"
+
+/** Frames in each direction of a loopback link, a power of two */
+#define CAN_LOOPBACK_SIZE 1024
+
+/** Polls of an empty loopback link before the waiting thread sleeps until a frame is pushed */
+#define CAN_LOOPBACK_SPIN 1000
+
+/**
+ * The frame I/O of a TCan. can.c does all its sending and receiving through the
+ * transport of the TCan, set before TCanOpen(). A TCan on a TCanBus uses the socket of
+ * the bus instead.
+ */
+typedef struct TCanTransport {
+	const char *name;         /** name of the backend */
+
+	/**
+	 * Opens the link of the TCan: the socket with the default filters for SocketCAN.
+	 * @return 0 on success, <0 otherwise.
+	 */
+	int (*open)(TCan *can);
+
+	/**
+	 * Closes the link of the TCan.
+	 * @return 0 on success, <0 otherwise.
+	 */
+	int (*close)(TCan *can);
+
+	/**
+	 * Sends the frames in order.
+	 * @return 0 on success, <0 otherwise.
+	 */
+	int (*send)(TCan *can, struct can_frame *frame, int count);
+
+	/**
+	 * Waits until the deadline (timeNow() time, 0 waits forever) for at least one frame,
+	 * then takes up to count frames and their timestamps (0 if unknown).
+	 * @return The number of frames, CAN_TIMEOUT if the deadline passed, <0 otherwise.
+	 */
+	int (*receive)(TCan *can, struct can_frame *frame, long long *stamp, int count,
+		       long long deadline);
+
+	/**
+	 * Sets a socket option, like setsockopt(). Backends without kernel filtering accept
+	 * and ignore the options.
+	 * @return 0 on success, <0 otherwise.
+	 */
+	int (*option)(TCan *can, int level, int name, const void *value, socklen_t size);
+} TCanTransport;
+
+/** SocketCAN raw socket, one system call per frame */
+extern const TCanTransport canRawTransport;
+
+/** SocketCAN raw socket, sendmmsg() and recvmmsg() of up to CAN_BATCH frames; the default */
+extern const TCanTransport canBatchTransport;
+
+/** In-process loopback without system calls, see loopbackConnect() and loopbackAttach() */
+extern const TCanTransport canLoopbackTransport;
+
+/**
+ * Executes the frames sent to a loopback end that has a handler instead of a peer.
+ */
+typedef void (*TCanLinkHandler)(void *arg, const struct can_frame *frame, int count);
+
+/**
+ * One end of an in-process loopback link. The frames sent to the end are queued in a
+ * lock-free ring: by the TCan at the other end, or by the handler serving this end.
+ */
+typedef struct TCanLink {
+	TSpscRing rx;             /** frames sent to this end */
+	struct TCanLink *peer;    /** the other end, NULL if a handler serves this end */
+	TCanLinkHandler deliver;  /** executes the frames this end sends when there is no peer */
+	long long (*poll)(void *arg); /** called while this end waits, returns when to call it next */
+	void *arg;                /** argument of deliver and poll */
+	int refs;                 /** ends still open, in the first end of a pair */
+	unsigned int pushes;      /** futex word, incremented by every loopbackPush() */
+	int sleeping;             /** nonzero while the receiving thread waits on pushes */
+	unsigned long dropped;    /** frames dropped because rx was full */
+} TCanLink;
+
+/**
+ * Sets the transport of a TCan. Must be called before TCanOpen().
+ *
+ * @param can The TCan pointer.
+ * @param transport The transport.
+ */
+void setTransport(TCan *can, const TCanTransport *transport);
+
+/**
+ * Connects two TCans with an in-process loopback link: the frames each sends are
+ * received by the other, without kernel filters. Each TCan can be used from its own
+ * thread. The TCans are then opened with TCanOpen() as usual.
+ *
+ * @param a The TCan pointer of one end.
+ * @param b The TCan pointer of the other end.
+ * @return 0 on success, <0 otherwise.
+ */
+int loopbackConnect(TCan *a, TCan *b);
+
+/**
+ * Connects a TCan to a handler with an in-process loopback link. The handler executes
+ * the frames the TCan sends in the sending thread and answers with loopbackPush(); poll
+ * is called while the TCan waits for frames and returns the timeNow() time it must be
+ * called again by, 0 if only a push can bring a frame. The TCan is then opened with
+ * TCanOpen().
+ *
+ * @param can The TCan pointer.
+ * @param deliver The handler of the frames sent.
+ * @param poll The function called while waiting, or NULL.
+ * @param arg The argument of deliver and poll.
+ * @return The link of the TCan, NULL on errors.
+ */
+TCanLink *loopbackAttach(TCan *can, TCanLinkHandler deliver, long long (*poll)(void *arg),
+			 void *arg);
+
+/**
+ * Queues frames to a loopback end and wakes up its receiving thread if it sleeps. Frames
+ * that do not fit are dropped and counted.
+ *
+ * @param link The end.
+ * @param frame The frames.
+ * @param count The number of frames.
+ * @return The number of frames queued.
+ */
+int loopbackPush(TCanLink *link, const struct can_frame *frame, int count);
+
+#endif /* ELMO_TRANSPORT_H */